@@ -34,5 +34,22 @@ void  as_reset_timer();
 void as_read_from_dev(const phemap_id_t id, uint8_t *const buff, uint32_t *const nBytes);
 void  as_rng_init() ;
 uint32_t as_rng_gen();
+/**
+ * @brief Position of the AS in the chain of the device, saved in the snapshots of the AS.
+ */
+uint32_t as_chain_cursor(const phemap_id_t id);
+/**
+ * @brief Move the chain of the device to cursor, called when a snapshot is restored.
+ */
+void as_set_chain_cursor(const phemap_id_t id, const uint32_t cursor);
+/**
+ * @brief Copy up to n links of the chain of the device that follow the current one, without consuming them.
+ * @return uint32_t Links copied, 0 if the chain can't be read ahead.
+ */
+uint32_t as_peek_links(const phemap_id_t id, puf_resp_t* const links, const uint32_t n);
+/**
+ * @brief Consume the next n links of the chain of the device.
+ */
+void as_skip_links(const phemap_id_t id, const uint32_t n);
 #endif
 
@@ -0,0 +1,261 @@
+/*
+    Group-Key-Phemap - Copyright (C) 2023-2024 Antonio Emmanuele
+
+    This file is part of Group-Key-Phemap.
+
+    Group-Key-Phemap is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Group-Key-Phemap is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "gk_as_admit.h"
+#include <assert.h>
+#include <new>
+#include <string.h>
+
+#define ADMIT_TOKEN     1000    /*!< A rekey in thousandths of token*/
+
+static void admit_push(gk_as_admit_t* const adm, const uint16_t slot, const uint32_t since_ms, const uint8_t* const pkt)
+{
+    uint16_t e = (uint16_t)((adm->head + adm->count) % adm->cap);
+    adm->ring[e].slot       = slot;
+    adm->ring[e].since_ms   = since_ms;
+    memcpy(adm->ring[e].pkt,pkt,GK_AS_ADMIT_PKT);
+    adm->where[slot] = e;
+    adm->count++;
+}
+
+static gk_as_admit_entry_t* admit_pop(gk_as_admit_t* const adm)
+{
+    gk_as_admit_entry_t* e = &adm->ring[adm->head];
+    adm->where[e->slot] = GK_AS_NO_SLOT;
+    adm->head = (uint16_t)((adm->head + 1) % adm->cap);
+    adm->count--;
+    return e;
+}
+
+static void admit_gauge(gk_as_admit_t* const adm)
+{
+    adm->stats.depth = adm->count;
+    if(adm->count > adm->stats.depth_peak)
+        adm->stats.depth_peak = adm->count;
+}
+
+static void admit_latency(gk_as_admit_t* const adm, const uint32_t since_ms, const uint32_t now_ms)
+{
+    uint32_t wait = now_ms - since_ms;
+    uint32_t k = 0;
+    while(k < GK_AS_ADMIT_HIST - 1 && wait >= (1u << k))
+        k++;
+    adm->stats.latency_hist[k]++;
+    adm->stats.latency_sum_ms += wait;
+    if(wait > adm->stats.latency_max_ms)
+        adm->stats.latency_max_ms = wait;
+}
+
+/**
+ * @brief Drop the waiting joins of the devices the install is sending a START_PK to, the others keep their order.
+ */
+static void admit_absorb_pending(gk_as_admit_t* const adm)
+{
+    uint16_t n = adm->count;
+    uint16_t kept = 0;
+    for(uint16_t i = 0; i < n; i++)
+    {
+        gk_as_admit_entry_t e = adm->ring[(adm->head + i) % adm->cap];
+        adm->where[e.slot] = GK_AS_NO_SLOT;
+        if(adm->as->pending_conf[e.slot] == 1)
+        {
+            adm->stats.absorbed++;
+            continue;
+        }
+        uint16_t to = (uint16_t)((adm->head + kept) % adm->cap);
+        adm->ring[to]       = e;
+        adm->where[e.slot]  = to;
+        kept++;
+    }
+    adm->count = kept;
+}
+
+gk_as_admit_t* gk_as_admit_open(AuthServer* const as, const uint32_t max_latency_ms, const uint32_t rate)
+{
+    assert(NULL != as);
+    gk_as_admit_t* adm = new (std::nothrow) gk_as_admit_t();
+    if(adm == NULL)
+        return NULL;
+    adm->as             = as;
+    adm->cap            = as->max_auth_devs;
+    adm->ring           = new (std::nothrow) gk_as_admit_entry_t[adm->cap];
+    adm->where          = new (std::nothrow) uint16_t[adm->cap];
+    adm->max_latency_ms = max_latency_ms;
+    adm->rate           = rate;
+    if(adm->ring == NULL || adm->where == NULL)
+    {
+        gk_as_admit_close(adm);
+        return NULL;
+    }
+    for(uint16_t i = 0; i < adm->cap; i++)
+        adm->where[i] = GK_AS_NO_SLOT;
+    return adm;
+}
+
+void gk_as_admit_close(gk_as_admit_t* const adm)
+{
+    if(adm == NULL)
+        return;
+    delete[] adm->ring;
+    delete[] adm->where;
+    delete adm;
+}
+
+uint8_t gk_as_admit_offer(gk_as_admit_t* const adm, const uint8_t* const pkt, const uint8_t len, const uint32_t now_ms)
+{
+    assert(NULL != adm);
+    assert(NULL != pkt);
+    adm->stats.offered++;
+    uint16_t slot = (len >= GK_AS_ADMIT_PKT && pkt[0] == START_SESS) ? gk_as_get_slot(adm->as,U8_TO_PHEMAP_ID_BE(&pkt[1])) : GK_AS_NO_SLOT;
+    if(slot == GK_AS_NO_SLOT)
+    {
+        adm->stats.rejected++;
+        return 0;
+    }
+    //  Its START_PK is on the way, gk_as_retx_poll sends it again if lost
+    if(adm->as->pending_conf[slot] == 1)
+    {
+        adm->stats.absorbed++;
+        return 0;
+    }
+    //  The device tried again, only its last link can still be ahead of the AS: gk_as_add_batch matches it
+    //  within GK_AS_LINK_WINDOW links, read with as_peek_links or pulled into the link cache
+    if(adm->where[slot] != GK_AS_NO_SLOT)
+    {
+        memcpy(adm->ring[adm->where[slot]].pkt,pkt,GK_AS_ADMIT_PKT);
+        adm->stats.merged++;
+        return 1;
+    }
+    admit_push(adm,slot,now_ms,pkt);
+    admit_gauge(adm);
+    return 1;
+}
+
+phemap_ret_t gk_as_admit_automa(gk_as_admit_t* const adm, uint8_t* const pkt, const uint8_t len, const uint32_t now_ms)
+{
+    assert(NULL != adm);
+    assert(NULL != pkt);
+    if(len > 0 && pkt[0] == START_SESS)
+    {
+        gk_as_admit_offer(adm,pkt,len,now_ms);
+        return CONN_WAIT;
+    }
+    return gk_as_automa(adm->as,pkt,len);
+}
+
+uint16_t gk_as_admit_poll(gk_as_admit_t* const adm, const uint32_t now_ms)
+{
+    assert(NULL != adm);
+    AuthServer* const as = adm->as;
+    //  Refill the bucket
+    if(adm->clock_set == 0)
+    {
+        adm->clock_set      = 1;
+        adm->tokens_milli   = GK_AS_ADMIT_BURST*ADMIT_TOKEN;
+    }
+    else if(adm->rate > 0)
+    {
+        uint64_t tokens = adm->tokens_milli + (uint64_t)(now_ms - adm->last_ms)*adm->rate;
+        adm->tokens_milli = (tokens > GK_AS_ADMIT_BURST*ADMIT_TOKEN) ? GK_AS_ADMIT_BURST*ADMIT_TOKEN : (uint32_t)tokens;
+    }
+    adm->last_ms = now_ms;
+    while(adm->count > 0 && now_ms - adm->ring[adm->head].since_ms >= GK_AS_ADMIT_EXPIRE_MS)
+    {
+        admit_pop(adm);
+        adm->stats.expired++;
+    }
+    admit_gauge(adm);
+    //  A rekey is being confirmed, or its mexs haven't been sent yet
+    if(adm->count == 0 || as->as_state == GK_AS_WAIT_FOR_START_CONF || as->broadcast_is_present == 1 || as->unicast_tsmt_count > 0)
+        return 0;
+    //  The install covers everybody, no reason to wait for more joins
+    if(as->as_state != GK_AS_WAIT_FOR_START_REQ && adm->count < GK_AS_ADMIT_BATCH && now_ms - adm->ring[adm->head].since_ms < adm->max_latency_ms)
+        return 0;
+    if(adm->rate > 0 && adm->tokens_milli < ADMIT_TOKEN)
+    {
+        adm->stats.throttled++;
+        return 0;
+    }
+    uint16_t admitted = 0;
+    if(as->as_state == GK_AS_WAIT_FOR_START_REQ)
+    {
+        gk_as_admit_entry_t* e = admit_pop(adm);
+        if(gk_as_start_session_cb(as,e->pkt,GK_AS_ADMIT_PKT) == OK)
+        {
+            admit_latency(adm,e->since_ms,now_ms);
+            admitted = 1;
+            admit_absorb_pending(adm);
+        }
+        else
+            adm->stats.refused++;
+    }
+    else
+    {
+        const uint8_t*          pkts[GK_AS_ADMIT_BATCH];
+        uint8_t                 lens[GK_AS_ADMIT_BATCH];
+        uint16_t                slots[GK_AS_ADMIT_BATCH];
+        gk_as_admit_entry_t*    taken[GK_AS_ADMIT_BATCH];
+        uint16_t                n = 0;
+        //  The entries popped stay in the ring until the next offer
+        while(n < GK_AS_ADMIT_BATCH && adm->count > 0)
+        {
+            taken[n]    = admit_pop(adm);
+            pkts[n]     = taken[n]->pkt;
+            lens[n]     = GK_AS_ADMIT_PKT;
+            n++;
+        }
+        uint8_t ok = (gk_as_add_batch(as,pkts,lens,n,slots) == OK) ? 1 : 0;
+        for(uint16_t i = 0; i < n; i++)
+        {
+            //  Nothing was pending before the batch
+            if(ok == 1 && as->pending_conf[taken[i]->slot] == 1)
+            {
+                admit_latency(adm,taken[i]->since_ms,now_ms);
+                admitted++;
+            }
+            else
+                adm->stats.refused++;
+        }
+    }
+    admit_gauge(adm);
+    if(admitted == 0)
+        return 0;
+    adm->stats.admitted += admitted;
+    adm->stats.rekeys++;
+    if(adm->rate > 0)
+        adm->tokens_milli -= ADMIT_TOKEN;
+    return admitted;
+}
+
+uint32_t gk_as_admit_latency_ms(const gk_as_admit_t* const adm, const double q)
+{
+    assert(NULL != adm);
+    uint64_t total = 0;
+    for(uint32_t k = 0; k < GK_AS_ADMIT_HIST; k++)
+        total += adm->stats.latency_hist[k];
+    if(total == 0)
+        return 0;
+    uint64_t seen = 0;
+    for(uint32_t k = 0; k < GK_AS_ADMIT_HIST - 1; k++)
+    {
+        seen += adm->stats.latency_hist[k];
+        if((double)seen >= q*(double)total)
+            return ((1u << k) < adm->stats.latency_max_ms) ? (1u << k) : adm->stats.latency_max_ms;
+    }
+    return adm->stats.latency_max_ms;
+}
@@ -0,0 +1,144 @@
+/*
+    Group-Key-Phemap - Copyright (C) 2023-2024 Antonio Emmanuele
+
+    This file is part of Group-Key-Phemap.
+
+    Group-Key-Phemap is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Group-Key-Phemap is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file    gk_as_admit.h
+ * @brief   Admission stage in front of an AS: join storms become a steady rate of batched rekeys.
+ * @details The START_SESS mexs go to a queue instead of gk_as_add_cb, which costs a rekey for each join and 
+ *          reinits the AS if a join arrives while another one is still being confirmed. The queue keeps one
+ *          entry for each device, the last START_SESS received, and drops the joins of devices the AS is
+ *          already sending a START_PK to. gk_as_admit_poll releases the waiting joins as a single rekey,
+ *          with gk_as_add_batch, when the AS is not confirming a rekey and one of these holds:
+ *              - GK_AS_ADMIT_BATCH joins are waiting;
+ *              - the oldest join waited max_latency_ms.
+ *          A token bucket refilled at rate rekeys per second, up to GK_AS_ADMIT_BURST, bounds the rekey rate.
+ *          An AS without a key runs the install of the whole group on the first join instead.
+ *          Everything is driven by the AS thread, the stats included.
+ */
+#ifndef GK_AS_ADMIT_H
+#define GK_AS_ADMIT_H
+#include "gk_phemap_as.h"
+#ifndef GK_AS_ADMIT_BATCH
+#define GK_AS_ADMIT_BATCH       64      /*!< Joins released with a single rekey at most*/
+#endif
+#ifndef GK_AS_ADMIT_BURST
+#define GK_AS_ADMIT_BURST       4       /*!< Rekeys released back to back after an idle period*/
+#endif
+#ifndef GK_AS_ADMIT_EXPIRE_MS
+#define GK_AS_ADMIT_EXPIRE_MS   30000   /*!< Joins waiting longer are dropped, the device sends a new START_SESS*/
+#endif
+#ifndef GK_AS_ADMIT_HIST
+#define GK_AS_ADMIT_HIST        16      /*!< Buckets of the latency histogram*/
+#endif
+#define GK_AS_ADMIT_PKT         (1 + sizeof(phemap_id_t) + sizeof(puf_resp_t))  /*!< START_SESS|DEV_ID|LINK*/
+
+/**
+ * @typedef A join waiting in the queue
+ */
+typedef struct{
+    uint16_t    slot;                       /*!< Slot of the device in the AS.*/
+    uint32_t    since_ms;                   /*!< Arrival of its first START_SESS, the latency starts here.*/
+    uint8_t     pkt[GK_AS_ADMIT_PKT];       /*!< Its last START_SESS.*/
+}gk_as_admit_entry_t;
+
+/**
+ * @typedef Counters and gauges of the admission stage
+ * @details Bucket k of latency_hist counts the joins released after less than 2^k ms, the last bucket all the
+ *          longer ones.
+ */
+typedef struct{
+    uint32_t    depth;                          /*!< Joins waiting.*/
+    uint32_t    depth_peak;                     /*!< Highest depth.*/
+    uint64_t    offered;                        /*!< START_SESS received.*/
+    uint64_t    merged;                         /*!< START_SESS of a device already waiting, replacing its mex.*/
+    uint64_t    absorbed;                       /*!< START_SESS of a device already getting a START_PK.*/
+    uint64_t    rejected;                       /*!< Malformed or from an unknown device.*/
+    uint64_t    expired;                        /*!< Dropped after GK_AS_ADMIT_EXPIRE_MS.*/
+    uint64_t    admitted;                       /*!< Joins released to the AS.*/
+    uint64_t    refused;                        /*!< Joins released but not authenticated by the AS.*/
+    uint64_t    rekeys;                         /*!< Batches and installs started.*/
+    uint64_t    throttled;                      /*!< Polls with joins to release and no token.*/
+    uint64_t    latency_sum_ms;                 /*!< Sum of the waits of the released joins.*/
+    uint32_t    latency_max_ms;                 /*!< Longest wait.*/
+    uint64_t    latency_hist[GK_AS_ADMIT_HIST]; /*!< Waits of the released joins by power of 2.*/
+}gk_as_admit_stats_t;
+
+/**
+ * @typedef Admission stage of one AS
+ */
+typedef struct{
+    AuthServer*             as;                 /*!< The AS behind the stage.*/
+    gk_as_admit_entry_t*    ring;               /*!< Waiting joins, oldest first, one for each slot of the AS.*/
+    uint16_t*               where;              /*!< Entry of each slot in ring, GK_AS_NO_SLOT if not waiting.*/
+    uint16_t                cap;                /*!< Entries of ring, the slots of the AS.*/
+    uint16_t                head;               /*!< Oldest join.*/
+    uint16_t                count;              /*!< Waiting joins.*/
+    uint32_t                max_latency_ms;     /*!< Time a join waits at most for others to batch with.*/
+    uint32_t                rate;               /*!< Rekeys per second, 0 for no limit.*/
+    uint32_t                tokens_milli;       /*!< Rekeys that can start now, in thousandths.*/
+    uint32_t                last_ms;            /*!< Time of the last refill.*/
+    uint8_t                 clock_set;          /*!< 1 once last_ms is valid.*/
+    gk_as_admit_stats_t     stats;              /*!< Counters, read by the AS thread.*/
+}gk_as_admit_t;
+
+/**
+ * @brief Create the admission stage of an AS bound and registered.
+ * @param as The AS
+ * @param max_latency_ms Time the oldest join waits at most for others before its batch is released
+ * @param rate Rekeys per second, 0 for no limit
+ * @return gk_as_admit_t* NULL if out of memory
+ */
+gk_as_admit_t* gk_as_admit_open(AuthServer* const as, const uint32_t max_latency_ms, const uint32_t rate);
+
+/**
+ * @brief Free the stage, the waiting joins are lost.
+ */
+void gk_as_admit_close(gk_as_admit_t* const adm);
+
+/**
+ * @brief Queue a START_SESS, to be called instead of gk_as_add_cb.
+ * @param adm The stage
+ * @param pkt The START_SESS
+ * @param len Size of the pkt
+ * @param now_ms Monotonic time in ms
+ * @return uint8_t 1 if the join waits in the queue, 0 if it has been dropped, see the stats
+ */
+uint8_t gk_as_admit_offer(gk_as_admit_t* const adm, const uint8_t* const pkt, const uint8_t len, const uint32_t now_ms);
+
+/**
+ * @brief gk_as_automa with the START_SESS going to gk_as_admit_offer.
+ * @return phemap_ret_t What gk_as_automa returns, CONN_WAIT for a START_SESS
+ */
+phemap_ret_t gk_as_admit_automa(gk_as_admit_t* const adm, uint8_t* const pkt, const uint8_t len, const uint32_t now_ms);
+
+/**
+ * @brief Release the joins that are due as a single rekey, to be called periodically and after each pkt by the
+ *        AS thread once the mexs of the AS have been sent.
+ * @param adm The stage
+ * @param now_ms Monotonic time in ms
+ * @return uint16_t Joins released, the AS has mexs to send if not 0
+ */
+uint16_t gk_as_admit_poll(gk_as_admit_t* const adm, const uint32_t now_ms);
+
+/**
+ * @brief Wait under which a fraction q of the released joins fell, from the histogram.
+ * @return uint32_t Upper bound of the bucket in ms capped at the max seen, 0 if no join was released
+ */
+uint32_t gk_as_admit_latency_ms(const gk_as_admit_t* const adm, const double q);
+#endif
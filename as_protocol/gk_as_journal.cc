@@ -0,0 +1,326 @@
+/*
+    Group-Key-Phemap - Copyright (C) 2023-2024 Antonio Emmanuele
+
+    This file is part of Group-Key-Phemap.
+
+    Group-Key-Phemap is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Group-Key-Phemap is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file gk_as_journal.cc
+ * @brief Write-ahead journal of the AS with group commit
+ */
+#include "gk_as_journal.h"
+#include "../common/phemap_snapshot.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <new>
+
+//  OP|AS_ID|SEQ
+#define JREC_COMMON_SIZE    (1 + sizeof(phemap_id_t) + sizeof(uint32_t))
+//  NUM_PART|PENDING|STATE|INSTALLED|NONCE|PK|ST|EPOCH|SLOT|ID|SR_KEY|FLAGS|CURSOR|RESYNC_ANCHOR|RESYNC_LINKS|MEMBER_LINKS
+#define JREC_SLOT_SIZE      (JREC_COMMON_SIZE + 3*sizeof(uint16_t) + sizeof(phemap_id_t) + 2 + 4*sizeof(private_key_t) + 1 + 3*sizeof(uint32_t) + 2)
+#define JREC_MEMBER         0x01
+#define JREC_PENDING        0x02
+
+/**
+ * @brief Length of the valid prefix of a journal image, 0 if the header is wrong.
+ */
+static uint32_t journal_valid_len(const uint8_t* const buff, const uint32_t size)
+{
+    if(size < GK_JOURNAL_HDR_SIZE || U8_TO_PUF_BE(buff) != GK_JOURNAL_MAGIC || U8_TO_PHEMAP_ID_BE(&buff[4]) != GK_JOURNAL_VERSION)
+        return 0;
+    uint32_t off = GK_JOURNAL_HDR_SIZE;
+    while(size - off >= GK_JOURNAL_REC_HDR_SIZE)
+    {
+        uint32_t len = U8_TO_PUF_BE(&buff[off]);
+        if(len < JREC_COMMON_SIZE || len > size - off - GK_JOURNAL_REC_HDR_SIZE ||
+            phemap_crc32(0,&buff[off + GK_JOURNAL_REC_HDR_SIZE],len) != U8_TO_PUF_BE(&buff[off + 4]))
+            break;
+        off += GK_JOURNAL_REC_HDR_SIZE + len;
+    }
+    return off;
+}
+
+static uint8_t journal_write_all(const int fd, const uint8_t* const buff, const size_t size)
+{
+    size_t done = 0;
+    while(done < size)
+    {
+        ssize_t ret = write(fd,buff + done,size - done);
+        if(ret <= 0)
+            return 0;
+        done += (size_t)ret;
+    }
+    return 1;
+}
+
+gk_journal_t* gk_journal_open(const char* const path)
+{
+    int fd = open(path,O_RDWR | O_CREAT | O_APPEND,0600);
+    if(fd < 0)
+        return NULL;
+    uint32_t size = 0;
+    uint8_t* image = phemap_snap_read_file(path,&size);
+    if(image == NULL)
+    {
+        //  A new journal
+        uint8_t hdr[GK_JOURNAL_HDR_SIZE];
+        uint32_t magic = GK_JOURNAL_MAGIC;
+        PUF_TO_U8_BE(magic,hdr);
+        PHEMAP_ID_TO_U8_BE(GK_JOURNAL_VERSION,&hdr[4]);
+        if(ftruncate(fd,0) != 0 || journal_write_all(fd,hdr,sizeof(hdr)) == 0 || fsync(fd) != 0)
+        {
+            close(fd);
+            return NULL;
+        }
+    }
+    else
+    {
+        //  Cut the record torn by a crash, appends restart from the last good one
+        uint32_t valid = journal_valid_len(image,size);
+        free(image);
+        if(valid == 0 || (valid < size && (ftruncate(fd,valid) != 0 || fsync(fd) != 0)))
+        {
+            close(fd);
+            return NULL;
+        }
+    }
+    gk_journal_t* j = new (std::nothrow) gk_journal_t();
+    if(j == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+    j->fd = fd;
+    return j;
+}
+
+void gk_journal_close(gk_journal_t* const j)
+{
+    if(j == NULL)
+        return;
+    gk_journal_commit(j);
+    close(j->fd);
+    delete j;
+}
+
+void gk_as_journal_attach(AuthServer* const as, gk_journal_t* const j)
+{
+    assert(NULL != as);
+    as->journal = j;
+}
+
+void as_journal_op(AuthServer* const as, const uint8_t op, const uint16_t slot, const uint8_t member_links)
+{
+    as->journal_seq++;
+    gk_journal_t* const j = as->journal;
+    if(j == NULL)
+        return;
+    uint32_t len = (op == GK_AS_OP_START) ? JREC_COMMON_SIZE + gk_as_snapshot_size(as) - PHEMAP_SNAP_HDR_SIZE : JREC_SLOT_SIZE;
+    std::lock_guard<std::mutex> lock(j->lock);
+    size_t start = j->pending.size();
+    j->pending.resize(start + GK_JOURNAL_REC_HDR_SIZE + len);
+    uint8_t* const rec = &j->pending[start + GK_JOURNAL_REC_HDR_SIZE];
+    uint8_t* p = rec;
+    *p++ = op;
+    PHEMAP_ID_TO_U8_BE(as->as_id,p);            p += 2;
+    PUF_TO_U8_BE(as->journal_seq,p);            p += 4;
+    if(op == GK_AS_OP_START)
+    {
+        //  Every slot changed, the record is the whole AS
+        p += gk_as_snapshot_payload(as,p);
+    }
+    else
+    {
+        PHEMAP_ID_TO_U8_BE(as->num_part,p);         p += 2;
+        PHEMAP_ID_TO_U8_BE(as->pending_count,p);    p += 2;
+        *p++ = (uint8_t)as->as_state;
+        *p++ = as->pk_installed;
+        PUF_TO_U8_BE(as->session_nonce,p);          p += 4;
+        PUF_TO_U8_BE(as->private_key,p);            p += 4;
+        PUF_TO_U8_BE(as->secret_token,p);           p += 4;
+        PUF_TO_U8_BE(as->epoch,p);                  p += 4;
+        PHEMAP_ID_TO_U8_BE(slot,p);                 p += 2;
+        uint8_t valid = (slot < as->num_auth_devs) ? 1 : 0;
+        //  The slot values are absolute, the links of the other members relative to their cursor
+        PHEMAP_ID_TO_U8_BE((valid ? as->auth_devs[slot] : 0),p);   p += 2;
+        PUF_TO_U8_BE((valid ? as->sr_key[slot] : 0),p);             p += 4;
+        *p++ = valid ? ((as->group_members[slot] ? JREC_MEMBER : 0) | (as->pending_conf[slot] ? JREC_PENDING : 0)) : 0;
+        uint32_t cursor = valid ? gk_as_slot_cursor(as,slot) : 0;
+        PUF_TO_U8_BE(cursor,p);                     p += 4;
+        PUF_TO_U8_BE((valid ? as->resync_anchor[slot] : 0),p);     p += 4;
+        *p++ = valid ? as->resync_links[slot] : 0;
+        *p++ = member_links;
+    }
+    PUF_TO_U8_BE(len,&j->pending[start]);
+    uint32_t crc = phemap_crc32(0,rec,len);
+    PUF_TO_U8_BE(crc,&j->pending[start + 4]);
+    j->appended++;
+}
+
+uint8_t gk_journal_commit(gk_journal_t* const j)
+{
+    assert(NULL != j);
+    std::unique_lock<std::mutex> lock(j->lock);
+    const uint64_t target = j->appended;
+    while(j->durable < target && j->failed == 0)
+    {
+        //  Somebody is already writing, its sync may cover these records too
+        if(j->flushing == 1)
+        {
+            j->synced.wait(lock);
+            continue;
+        }
+        //  Become the leader for everything appended so far
+        j->flushing = 1;
+        j->flushing_buff.swap(j->pending);
+        const uint64_t upto = j->appended;
+        lock.unlock();
+        uint8_t ok = journal_write_all(j->fd,j->flushing_buff.data(),j->flushing_buff.size());
+        ok = (ok == 1 && fdatasync(j->fd) == 0) ? 1 : 0;
+        lock.lock();
+        j->flushing_buff.clear();
+        j->flushing = 0;
+        j->syncs++;
+        if(ok == 1)
+            j->durable = upto;
+        else
+            j->failed = 1;
+        j->synced.notify_all();
+    }
+    return j->failed == 0 ? 1 : 0;
+}
+
+uint8_t gk_journal_reset(gk_journal_t* const j)
+{
+    assert(NULL != j);
+    if(gk_journal_commit(j) == 0)
+        return 0;
+    std::unique_lock<std::mutex> lock(j->lock);
+    //  A leader writes outside the lock, its records would be cut. The ones still pending are written after the header
+    while(j->flushing == 1)
+        j->synced.wait(lock);
+    if(j->failed == 1)
+        return 0;
+    if(ftruncate(j->fd,GK_JOURNAL_HDR_SIZE) != 0 || fsync(j->fd) != 0)
+    {
+        j->failed = 1;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Apply a record made of the AS scalars and one slot.
+ */
+static uint8_t journal_apply_slot(AuthServer* const as, const uint8_t op, const uint8_t* p)
+{
+    uint16_t num_part   = U8_TO_PHEMAP_ID_BE(p);    p += 2;
+    uint16_t pending    = U8_TO_PHEMAP_ID_BE(p);    p += 2;
+    uint8_t  state      = *p++;
+    uint8_t  installed  = *p++;
+    private_key_t nonce = U8_TO_PUF_BE(p);          p += 4;
+    private_key_t pk    = U8_TO_PUF_BE(p);          p += 4;
+    private_key_t st    = U8_TO_PUF_BE(p);          p += 4;
+    uint32_t epoch      = U8_TO_PUF_BE(p);          p += 4;
+    uint16_t slot       = U8_TO_PHEMAP_ID_BE(p);    p += 2;
+    phemap_id_t id      = U8_TO_PHEMAP_ID_BE(p);    p += 2;
+    private_key_t sr    = U8_TO_PUF_BE(p);          p += 4;
+    uint8_t  flags      = *p++;
+    uint32_t cursor     = U8_TO_PUF_BE(p);          p += 4;
+    uint32_t anchor     = U8_TO_PUF_BE(p);          p += 4;
+    uint8_t  anchor_links = *p++;
+    uint8_t  links      = *p;
+    if(op == GK_AS_OP_REGISTER)
+    {
+        //  Slots are given in order, a hole means the journal doesn't belong to this AS
+        if(slot != as->num_auth_devs || slot == as->max_auth_devs)
+            return 0;
+        as->auth_devs[slot] = id;
+        as->num_auth_devs++;
+    }
+    else if(slot != GK_AS_NO_SLOT && (slot >= as->num_auth_devs || as->auth_devs[slot] != id))
+        return 0;
+    //  An update opened the next epoch, the history is rebuilt from the key and the token it replaced
+    if(epoch == as->epoch + 1)
+        gk_as_epoch_advance(as,as->private_key ^ pk,as->secret_token,links);
+    as->epoch           = epoch;
+    as->num_part        = num_part;
+    as->pending_count   = pending;
+    as->as_state        = (Gk_AS_State)state;
+    as->pk_installed    = installed;
+    as->session_nonce   = nonce;
+    as->private_key     = pk;
+    as->secret_token    = st;
+    if(slot == GK_AS_NO_SLOT)
+        return 1;
+    as->sr_key[slot]        = sr;
+    as->group_members[slot] = (flags & JREC_MEMBER) ? 1 : 0;
+    as->pending_conf[slot]  = (flags & JREC_PENDING) ? 1 : 0;
+    as->resync_anchor[slot] = anchor;
+    as->resync_links[slot]  = anchor_links;
+    as_set_chain_cursor(id,cursor);
+    for(uint16_t i = 0; links > 0 && i < as->num_auth_devs; i++)
+        if(i != slot && as->group_members[i] == 1)
+            as_set_chain_cursor(as->auth_devs[i],as_chain_cursor(as->auth_devs[i]) + links);
+    return 1;
+}
+
+int32_t gk_as_journal_replay(AuthServer* const as, const char* const path)
+{
+    assert(NULL != as);
+    uint32_t size = 0;
+    uint8_t* image = phemap_snap_read_file(path,&size);
+    if(image == NULL)
+        return -1;
+    uint32_t valid = journal_valid_len(image,size);
+    if(valid == 0)
+    {
+        free(image);
+        return -1;
+    }
+    //  The records move the chain cursors, links pulled ahead would no longer follow them
+    gk_as_drop_precomputed(as);
+    int32_t applied = 0;
+    uint32_t off = GK_JOURNAL_HDR_SIZE;
+    while(off < valid && applied >= 0)
+    {
+        uint32_t len = U8_TO_PUF_BE(&image[off]);
+        const uint8_t* rec = &image[off + GK_JOURNAL_REC_HDR_SIZE];
+        off += GK_JOURNAL_REC_HDR_SIZE + len;
+        uint8_t op = rec[0];
+        uint32_t seq = U8_TO_PUF_BE(&rec[1 + sizeof(phemap_id_t)]);
+        //  Other ASes sharing the journal and records already in the snapshot
+        if(U8_TO_PHEMAP_ID_BE(&rec[1]) != as->as_id || seq <= as->journal_seq)
+            continue;
+        uint8_t ok;
+        if(op == GK_AS_OP_START)
+            ok = (gk_as_restore_payload(as,rec + JREC_COMMON_SIZE,len - JREC_COMMON_SIZE) == len - JREC_COMMON_SIZE) ? 1 : 0;
+        else
+            ok = (op <= GK_AS_OP_LINK && len == JREC_SLOT_SIZE) ? journal_apply_slot(as,op,rec + JREC_COMMON_SIZE) : 0;
+        if(ok == 0)
+        {
+            applied = -1;
+            break;
+        }
+        as->journal_seq = seq;
+        applied++;
+    }
+    free(image);
+    return applied;
+}
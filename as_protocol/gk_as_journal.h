@@ -0,0 +1,97 @@
+/*
+    Group-Key-Phemap - Copyright (C) 2023-2024 Antonio Emmanuele
+
+    This file is part of Group-Key-Phemap.
+
+    Group-Key-Phemap is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Group-Key-Phemap is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file    gk_as_journal.h
+ * @brief   Write-ahead journal of the AS state changes with group commit.
+ * @details Linking gk_as_journal.cc replaces the weak as_journal_op: each state change of an AS attached to a
+ *          journal appends a record to the journal buffer. gk_journal_commit makes the records durable and
+ *          must be called before the mexs of the AS are sent, concurrent callers share one fdatasync.
+ *          After a crash the AS is restored from its last snapshot and gk_as_journal_replay applies the
+ *          records written after it.
+ *          File: MAGIC(4)|VERSION(2) then LEN(4)|CRC32(4)|BODY records, BODY is OP|AS_ID|SEQ|...
+ */
+#ifndef GK_AS_JOURNAL_H
+#define GK_AS_JOURNAL_H
+#include "gk_phemap_as.h"
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+#define GK_JOURNAL_MAGIC        0x474B4A52u     /*!< "GKJR"*/
+#define GK_JOURNAL_VERSION      2
+#define GK_JOURNAL_HDR_SIZE     6
+#define GK_JOURNAL_REC_HDR_SIZE 8
+
+/**
+ * @typedef Journal shared by one or more AS, e.g. all the LVs of a gateway
+ */
+typedef struct gk_journal_s{
+    int                     fd;                 /*!< Journal file, opened in append mode.*/
+    std::mutex              lock;               /*!< Protects everything below.*/
+    std::condition_variable synced;             /*!< Signalled when a flush completes.*/
+    std::vector<uint8_t>    pending;            /*!< Records appended and not yet written.*/
+    std::vector<uint8_t>    flushing_buff;      /*!< Records being written by the flush leader.*/
+    uint64_t                appended;           /*!< Records appended since the open.*/
+    uint64_t                durable;            /*!< Records on disk since the open.*/
+    uint8_t                 flushing;           /*!< 1 while a caller of gk_journal_commit writes for everyone.*/
+    uint8_t                 failed;             /*!< 1 after a write or sync error, the journal must be reopened.*/
+    uint64_t                syncs;              /*!< fdatasync calls, records/syncs is the group commit factor.*/
+}gk_journal_t;
+
+/**
+ * @brief Open or create a journal, a torn record at the end of the file is cut away.
+ * @return gk_journal_t* NULL if the file can't be opened or isn't a journal.
+ */
+gk_journal_t* gk_journal_open(const char* const path);
+
+/**
+ * @brief Commit what is pending and close the journal.
+ */
+void gk_journal_close(gk_journal_t* const j);
+
+/**
+ * @brief Journal the state changes of the AS from now on, attach after restoring it.
+ */
+void gk_as_journal_attach(AuthServer* const as, gk_journal_t* const j);
+
+/**
+ * @brief Make every record appended so far durable.
+ * @details The first caller writes and syncs the records of everybody, the others wait for it, so a burst
+ *          of operations from many threads costs a single fdatasync.
+ * @return uint8_t 1 on success, 0 if the journal failed.
+ */
+uint8_t gk_journal_commit(gk_journal_t* const j);
+
+/**
+ * @brief Empty the journal, to be called once every AS writing to it has been saved with gk_as_save.
+ * @details The file is cut under the lock with no write in flight; records appended meanwhile stay pending
+ *          and the next commit writes them after the header.
+ * @return uint8_t 1 on success.
+ */
+uint8_t gk_journal_reset(gk_journal_t* const j);
+
+/**
+ * @brief Apply the records of the AS newer than its journal_seq, i.e. the ones after its snapshot.
+ * 
+ * @param as Pointer to the AS struct, restored from the snapshot or just bound with its as_id set
+ * @param path Journal file
+ * @return int32_t Records applied, -1 if the journal can't be read or a record doesn't fit the AS
+ */
+int32_t gk_as_journal_replay(AuthServer* const as, const char* const path);
+#endif
@@ -0,0 +1,232 @@
+/*
+    Group-Key-Phemap - Copyright (C) 2023-2024 Antonio Emmanuele
+
+    This file is part of Group-Key-Phemap.
+
+    Group-Key-Phemap is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Group-Key-Phemap is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file gk_as_rekey.cc
+ * @brief Completion of the rekeys of the AS
+ */
+#include "gk_as_rekey.h"
+#include <assert.h>
+#include <chrono>
+#include <new>
+#include <string.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
+
+/**
+ * @brief Publish the rekey in progress, then wake the waiters, the eventfd and the callback.
+ */
+static void rekey_complete(gk_as_rekeys_t* const r, const phemap_ret_t result)
+{
+    r->cur.result   = result;
+    r->cur.done     = 1;
+    r->open         = 0;
+    {
+        std::lock_guard<std::mutex> lock(r->lock);
+        r->ring[r->cur.seq % GK_AS_REKEY_DEPTH] = r->cur;
+    }
+    r->completed.notify_all();
+    if(r->event_fd >= 0)
+    {
+        uint64_t one = 1;
+        ssize_t written = write(r->event_fd,&one,sizeof(one));
+        (void)written;
+    }
+    if(r->cb != NULL)
+        r->cb(&r->cur,r->user);
+}
+
+/**
+ * @brief Start a rekey, one still in progress lost its AS state and is closed with REINIT.
+ */
+static void rekey_begin(gk_as_rekeys_t* const r, const AuthServer* const as, const uint8_t op, const uint16_t slot)
+{
+    if(r->open == 1)
+        rekey_complete(r,REINIT);
+    r->seq++;
+    memset(&r->cur,0,sizeof(r->cur));
+    r->cur.seq      = r->seq;
+    r->cur.op       = op;
+    r->cur.dev      = (slot != GK_AS_NO_SLOT) ? as->auth_devs[slot] : 0;
+    r->cur.epoch    = as->epoch;
+    r->cur.waiting  = as->pending_count;
+    r->cur.result   = CONN_WAIT;
+    r->open         = 1;
+    r->armed        = 0;
+    std::lock_guard<std::mutex> lock(r->lock);
+    r->ring[r->seq % GK_AS_REKEY_DEPTH] = r->cur;
+}
+
+/**
+ * @brief Complete the rekey in progress if nobody is pending anymore.
+ */
+static void rekey_check(gk_as_rekeys_t* const r, const AuthServer* const as)
+{
+    if(as->pending_count > 0)
+        return;
+    //  Every device gone, e.g. all evicted, means there is no group left to hold the key
+    if(as->as_state != GK_AS_WAIT_FOR_UPDATES)
+        rekey_complete(r,REINIT);
+    else
+        rekey_complete(r,(r->cur.op == GK_AS_OP_START) ? INSTALL_OK : UPDATE_OK);
+}
+
+gk_as_rekeys_t* gk_as_rekeys_open(const gk_as_rekey_cb_t cb, void* const user)
+{
+    gk_as_rekeys_t* r = new (std::nothrow) gk_as_rekeys_t();
+    if(r == NULL)
+        return NULL;
+    r->cb       = cb;
+    r->user     = user;
+#if defined(__linux__)
+    r->event_fd = eventfd(0,EFD_NONBLOCK | EFD_CLOEXEC);
+#else
+    r->event_fd = -1;
+#endif
+    return r;
+}
+
+void gk_as_rekeys_close(gk_as_rekeys_t* const r)
+{
+    if(r == NULL)
+        return;
+    if(r->event_fd >= 0)
+        close(r->event_fd);
+    delete r;
+}
+
+void gk_as_rekeys_attach(AuthServer* const as, gk_as_rekeys_t* const r)
+{
+    assert(NULL != as);
+    as->rekeys = r;
+    if(r != NULL)
+        r->evicted_seen = as->retx_evicted;
+}
+
+uint32_t gk_as_rekey_last(const gk_as_rekeys_t* const r)
+{
+    assert(NULL != r);
+    return r->seq;
+}
+
+void as_rekey_note(AuthServer* const as, const uint8_t op, const uint16_t slot)
+{
+    gk_as_rekeys_t* const r = as->rekeys;
+    if(r == NULL)
+        return;
+    switch(op)
+    {
+        case GK_AS_OP_ADD:
+            //  gk_as_add_batch notes each device of its single rekey, the epoch tells them apart
+            if(r->open == 1 && r->cur.op == GK_AS_OP_ADD && r->cur.epoch == as->epoch)
+            {
+                r->cur.dev      = 0;
+                r->cur.waiting  = as->pending_count;
+                std::lock_guard<std::mutex> lock(r->lock);
+                r->ring[r->seq % GK_AS_REKEY_DEPTH] = r->cur;
+                break;
+            }
+            rekey_begin(r,as,op,slot);
+        break;
+        case GK_AS_OP_START:
+            rekey_begin(r,as,op,slot);
+        break;
+        case GK_AS_OP_CONF:
+            if(r->open == 1)
+            {
+                r->cur.confirmed++;
+                rekey_check(r,as);
+            }
+        break;
+        case GK_AS_OP_REMOVE:
+            //  gk_as_retx_poll evicts through the path of a leave, its counter tells them apart
+            if(as->retx_evicted != r->evicted_seen && r->open == 1)
+            {
+                r->evicted_seen = as->retx_evicted;
+                r->cur.evicted++;
+                r->cur.epoch    = as->epoch;
+                rekey_check(r,as);
+            }
+            else
+            {
+                r->evicted_seen = as->retx_evicted;
+                rekey_begin(r,as,op,slot);
+                rekey_complete(r,UPDATE_OK);
+            }
+        break;
+        case GK_AS_OP_REINIT:
+            if(r->open == 1)
+                rekey_complete(r,REINIT);
+        break;
+        default:
+        break;
+    }
+}
+
+void gk_as_rekeys_poll(gk_as_rekeys_t* const r, const uint32_t now_ms)
+{
+    assert(NULL != r);
+    if(r->open == 0)
+        return;
+    //  The deadline starts at the first poll, as the retransmissions do
+    if(r->armed == 0)
+    {
+        r->armed        = 1;
+        r->deadline_ms  = now_ms + GK_AS_REKEY_TIMEOUT_MS;
+    }
+    else if((int32_t)(now_ms - r->deadline_ms) >= 0)
+        rekey_complete(r,CONN_WAIT);
+}
+
+/**
+ * @brief Result of seq in the ring, the lock is held.
+ */
+static phemap_ret_t rekey_lookup(const gk_as_rekeys_t* const r, const uint32_t seq, gk_as_rekey_t* const out)
+{
+    const gk_as_rekey_t* const e = &r->ring[seq % GK_AS_REKEY_DEPTH];
+    if(seq == 0 || e->seq != seq)
+        return AUTH_FAILED;
+    if(e->done == 0)
+        return CONN_WAIT;
+    *out = *e;
+    return OK;
+}
+
+phemap_ret_t gk_as_rekey_result(gk_as_rekeys_t* const r, const uint32_t seq, gk_as_rekey_t* const out)
+{
+    assert(NULL != r);
+    assert(NULL != out);
+    std::lock_guard<std::mutex> lock(r->lock);
+    return rekey_lookup(r,seq,out);
+}
+
+phemap_ret_t gk_as_rekey_wait(gk_as_rekeys_t* const r, const uint32_t seq, const uint32_t timeout_ms, gk_as_rekey_t* const out)
+{
+    assert(NULL != r);
+    assert(NULL != out);
+    std::unique_lock<std::mutex> lock(r->lock);
+    phemap_ret_t ret = rekey_lookup(r,seq,out);
+    r->completed.wait_for(lock,std::chrono::milliseconds(timeout_ms),[&]{
+        ret = rekey_lookup(r,seq,out);
+        return ret != CONN_WAIT;
+    });
+    return ret;
+}
@@ -0,0 +1,128 @@
+/*
+    Group-Key-Phemap - Copyright (C) 2023-2024 Antonio Emmanuele
+
+    This file is part of Group-Key-Phemap.
+
+    Group-Key-Phemap is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Group-Key-Phemap is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file    gk_as_rekey.h
+ * @brief   Handles completing when a rekey of the AS is confirmed, with a callback, an eventfd or a wait.
+ * @details Linking gk_as_rekey.cc replaces the weak as_rekey_note. An AS attached to a tracker gives each 
+ *          install (GK_AS_OP_START), join (GK_AS_OP_ADD) and leave (GK_AS_OP_REMOVE) a sequence number, its
+ *          handle, readable with gk_as_rekey_last right after the call or the pkt that started it.
+ *          A rekey completes when its last confirmation arrives or the devices still pending are evicted by 
+ *          gk_as_retx_poll, when the AS reinits through gk_as_automa, or when gk_as_rekeys_poll times it out.
+ *          A leave has no confirmation and completes as soon as its updates are queued.
+ *          The AS thread drives the tracker, any thread can wait for a handle or poll the eventfd.
+ */
+#ifndef GK_AS_REKEY_H
+#define GK_AS_REKEY_H
+#include "gk_phemap_as.h"
+#include <condition_variable>
+#include <mutex>
+#ifndef GK_AS_REKEY_DEPTH
+#define GK_AS_REKEY_DEPTH       16      /*!< Last rekeys whose result can be read*/
+#endif
+#ifndef GK_AS_REKEY_TIMEOUT_MS
+#define GK_AS_REKEY_TIMEOUT_MS  5000    /*!< Time from the first gk_as_rekeys_poll after which a rekey times out*/
+#endif
+
+/**
+ * @typedef A rekey and its result
+ */
+typedef struct{
+    uint32_t        seq;            /*!< Handle of the rekey, from 1*/
+    uint8_t         op;             /*!< GK_AS_OP_START, GK_AS_OP_ADD or GK_AS_OP_REMOVE*/
+    phemap_id_t     dev;            /*!< Device joining or leaving, 0 for an install or gk_as_add_batch*/
+    uint32_t        epoch;          /*!< Epoch opened by the rekey*/
+    uint16_t        waiting;        /*!< Confirmations expected when it started*/
+    uint16_t        confirmed;      /*!< Confirmations received*/
+    uint16_t        evicted;        /*!< Pending devices evicted by gk_as_retx_poll*/
+    phemap_ret_t    result;         /*!< INSTALL_OK or UPDATE_OK, REINIT if the AS reinit or lost the group, CONN_WAIT on timeout*/
+    uint8_t         done;           /*!< 1 once completed*/
+}gk_as_rekey_t;
+
+/**
+ * @brief Called by the AS thread when a rekey completes, it must not call the AS.
+ */
+typedef void (*gk_as_rekey_cb_t)(const gk_as_rekey_t* const rekey, void* const user);
+
+/**
+ * @typedef Rekeys of one AS
+ */
+typedef struct gk_as_rekeys_s{
+    std::mutex              lock;                       /*!< Protects ring.*/
+    std::condition_variable completed;                  /*!< Signalled when a rekey completes.*/
+    gk_as_rekey_t           ring[GK_AS_REKEY_DEPTH];    /*!< Last rekeys, seq at seq % GK_AS_REKEY_DEPTH.*/
+    uint32_t                seq;                        /*!< Handle of the last rekey started.*/
+    gk_as_rekey_t           cur;                        /*!< Rekey in progress, only the AS thread touches it.*/
+    uint8_t                 open;                       /*!< 1 while cur is in progress.*/
+    uint8_t                 armed;                      /*!< 1 once gk_as_rekeys_poll set the deadline of cur.*/
+    uint32_t                deadline_ms;                /*!< Time cur times out.*/
+    uint32_t                evicted_seen;               /*!< retx_evicted of the AS at the last note, tells an eviction from a leave.*/
+    gk_as_rekey_cb_t        cb;                         /*!< Completion callback, NULL if none.*/
+    void*                   user;                       /*!< Argument of cb.*/
+    int                     event_fd;                   /*!< eventfd incremented at each completion, -1 if not available.*/
+}gk_as_rekeys_t;
+
+/**
+ * @brief Create a tracker.
+ * @param cb Completion callback, NULL if none
+ * @param user Argument of cb
+ * @return gk_as_rekeys_t* NULL if out of memory
+ */
+gk_as_rekeys_t* gk_as_rekeys_open(const gk_as_rekey_cb_t cb, void* const user);
+
+/**
+ * @brief Detach the tracker from the AS first. Waiters must be gone.
+ */
+void gk_as_rekeys_close(gk_as_rekeys_t* const r);
+
+/**
+ * @brief Track the rekeys of the AS from now on, a tracker serves a single AS.
+ */
+void gk_as_rekeys_attach(AuthServer* const as, gk_as_rekeys_t* const r);
+
+/**
+ * @brief Handle of the last rekey started, to be read by the AS thread.
+ * @return uint32_t 0 if none
+ */
+uint32_t gk_as_rekey_last(const gk_as_rekeys_t* const r);
+
+/**
+ * @brief Time out the rekey in progress, to be called periodically by the AS thread with a monotonic time in ms.
+ */
+void gk_as_rekeys_poll(gk_as_rekeys_t* const r, const uint32_t now_ms);
+
+/**
+ * @brief Result of a rekey, without waiting.
+ * @param r The tracker
+ * @param seq Handle of the rekey
+ * @param out Filled when the rekey completed
+ * @return phemap_ret_t OK if completed, CONN_WAIT if in progress, AUTH_FAILED if unknown or no longer in the ring
+ */
+phemap_ret_t gk_as_rekey_result(gk_as_rekeys_t* const r, const uint32_t seq, gk_as_rekey_t* const out);
+
+/**
+ * @brief Wait for a rekey to complete.
+ * @param r The tracker
+ * @param seq Handle of the rekey
+ * @param timeout_ms Max wait
+ * @param out Filled when the rekey completed
+ * @return phemap_ret_t As gk_as_rekey_result, CONN_WAIT if the wait timed out
+ */
+phemap_ret_t gk_as_rekey_wait(gk_as_rekeys_t* const r, const uint32_t seq, const uint32_t timeout_ms, gk_as_rekey_t* const out);
+#endif
@@ -0,0 +1,35 @@
+/*
+    Group-Key-Phemap - Copyright (C) 2023-2024 Antonio Emmanuele
+
+    This file is part of Group-Key-Phemap.
+
+    Group-Key-Phemap is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Group-Key-Phemap is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file gk_as_rng.cc
+ * @brief Linking it replaces the weak as_rng_init and as_rng_gen with the CSPRNG of common/phemap_rng.cc
+ */
+#include "gk_phemap_as.h"
+#include "../common/phemap_rng.h"
+
+void as_rng_init()
+{
+    phemap_rng_init();
+}
+
+uint32_t as_rng_gen()
+{
+    return phemap_rng_u32();
+}
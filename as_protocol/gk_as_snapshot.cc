@@ -0,0 +1,194 @@
+/*
+    Group-Key-Phemap - Copyright (C) 2023-2024 Antonio Emmanuele
+
+    This file is part of Group-Key-Phemap.
+
+    Group-Key-Phemap is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Group-Key-Phemap is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file gk_as_snapshot.cc
+ * @brief Snapshot and warm restart of the AS, kept apart from the protocol so targets without a file system don't link it
+ */
+#include "gk_phemap_as.h"
+#include "../common/phemap_snapshot.h"
+#include "stdlib.h"
+#include "string.h"
+#include "assert.h"
+
+#define AS_SNAP_MEMBER      0x01    /*!< Slot flag, the device is part of the group*/
+#define AS_SNAP_PENDING     0x02    /*!< Slot flag, the device hasn't confirmed yet*/
+
+uint32_t gk_as_snapshot_size(const AuthServer* const as)
+{
+    assert(NULL != as);
+    return PHEMAP_SNAP_HDR_SIZE + GK_AS_SNAP_FIXED_SIZE + (uint32_t)as->num_auth_devs*GK_AS_SNAP_SLOT_SIZE;
+}
+
+uint32_t gk_as_snapshot_payload(const AuthServer* const as, uint8_t* const out)
+{
+    assert(NULL != as);
+    assert(NULL != out);
+    uint8_t* p = out;
+    //  AS_ID|NUM_AUTH|NUM_PART|PENDING|STATE|INSTALLED|NONCE|PK|ST|JOURNAL_SEQ|EPOCH|HISTORY_COUNT|HISTORY
+    PHEMAP_ID_TO_U8_BE(as->as_id,p);            p += 2;
+    PHEMAP_ID_TO_U8_BE(as->num_auth_devs,p);    p += 2;
+    PHEMAP_ID_TO_U8_BE(as->num_part,p);         p += 2;
+    PHEMAP_ID_TO_U8_BE(as->pending_count,p);    p += 2;
+    *p++ = (uint8_t)as->as_state;
+    *p++ = as->pk_installed;
+    PUF_TO_U8_BE(as->session_nonce,p);          p += 4;
+    PUF_TO_U8_BE(as->private_key,p);            p += 4;
+    PUF_TO_U8_BE(as->secret_token,p);           p += 4;
+    PUF_TO_U8_BE(as->journal_seq,p);            p += 4;
+    PUF_TO_U8_BE(as->epoch,p);                  p += 4;
+    *p++ = as->history_count;
+    //  The whole ring KEY_DELTA|PREV_TOKEN|MEMBER_LINKS, in place
+    for(uint8_t i = 0; i < GK_AS_EPOCH_HISTORY; i++)
+    {
+        PUF_TO_U8_BE(as->history[i].key_delta,p);   p += 4;
+        PUF_TO_U8_BE(as->history[i].prev_token,p);  p += 4;
+        *p++ = as->history[i].member_links;
+    }
+    //  Then for each slot ID|SR_KEY|FLAGS|CURSOR|RESYNC_ANCHOR|RESYNC_LINKS
+    for(uint16_t slot = 0; slot < as->num_auth_devs; slot++)
+    {
+        PHEMAP_ID_TO_U8_BE(as->auth_devs[slot],p);  p += 2;
+        PUF_TO_U8_BE(as->sr_key[slot],p);           p += 4;
+        *p++ = (as->group_members[slot] ? AS_SNAP_MEMBER : 0) | (as->pending_conf[slot] ? AS_SNAP_PENDING : 0);
+        uint32_t cursor = gk_as_slot_cursor(as,slot);
+        PUF_TO_U8_BE(cursor,p);                     p += 4;
+        PUF_TO_U8_BE(as->resync_anchor[slot],p);    p += 4;
+        *p++ = as->resync_links[slot];
+    }
+    return (uint32_t)(p - out);
+}
+
+uint32_t gk_as_restore_payload(AuthServer* const as, const uint8_t* const in, const uint32_t size)
+{
+    assert(NULL != as);
+    assert(NULL != in);
+    if(size < GK_AS_SNAP_FIXED_SIZE)
+        return 0;
+    const uint8_t* p = in;
+    phemap_id_t as_id       = U8_TO_PHEMAP_ID_BE(p);    p += 2;
+    uint16_t    num_auth    = U8_TO_PHEMAP_ID_BE(p);    p += 2;
+    uint16_t    num_part    = U8_TO_PHEMAP_ID_BE(p);    p += 2;
+    uint16_t    pending     = U8_TO_PHEMAP_ID_BE(p);    p += 2;
+    uint8_t     state       = *p++;
+    uint8_t     installed   = *p++;
+    uint32_t    used        = GK_AS_SNAP_FIXED_SIZE + (uint32_t)num_auth*GK_AS_SNAP_SLOT_SIZE;
+    if(num_auth > as->max_auth_devs || size < used || state > GK_AS_WAIT_FOR_UPDATES ||
+        p[3*sizeof(private_key_t) + 2*sizeof(uint32_t)] > GK_AS_EPOCH_HISTORY)
+        return 0;
+    //  The counters must match the slot flags, otherwise the AS would wait forever
+    const uint8_t* slots = p + 3*sizeof(private_key_t) + sizeof(uint32_t) + GK_AS_SNAP_EPOCH_SIZE;
+    uint16_t members = 0, pendings = 0;
+    for(uint16_t slot = 0; slot < num_auth; slot++)
+    {
+        uint8_t flags = slots[slot*GK_AS_SNAP_SLOT_SIZE + sizeof(phemap_id_t) + sizeof(private_key_t)];
+        members     += (flags & AS_SNAP_MEMBER) ? 1 : 0;
+        pendings    += (flags & AS_SNAP_PENDING) ? 1 : 0;
+    }
+    if(members != num_part || pendings != pending)
+        return 0;
+    //  Valid, from here on the AS is overwritten, sr_key is the start of the bound storage. What configures
+    //  the AS and its counters are not in the snapshot, they are kept
+    const AuthServer kept = *as;
+    gk_as_bind(as,as->sr_key,as->max_auth_devs);
+    as->journal         = kept.journal;
+    as->rekeys          = kept.rekeys;
+    as->stats           = kept.stats;
+    as->dup_policy      = kept.dup_policy;
+    as->chain_rewind    = kept.chain_rewind;
+    as->dup_absorbed    = kept.dup_absorbed;
+    as->auth_links_lost = kept.auth_links_lost;
+    as->retx_sent       = kept.retx_sent;
+    as->retx_evicted    = kept.retx_evicted;
+    as->as_id           = as_id;
+    as->num_auth_devs   = num_auth;
+    as->num_part        = num_part;
+    as->pending_count   = pending;
+    as->as_state        = (Gk_AS_State)state;
+    as->pk_installed    = installed;
+    as->session_nonce   = U8_TO_PUF_BE(p);  p += 4;
+    as->private_key     = U8_TO_PUF_BE(p);  p += 4;
+    as->secret_token    = U8_TO_PUF_BE(p);  p += 4;
+    as->journal_seq     = U8_TO_PUF_BE(p);  p += 4;
+    as->epoch           = U8_TO_PUF_BE(p);  p += 4;
+    as->history_count   = *p++;
+    for(uint8_t i = 0; i < GK_AS_EPOCH_HISTORY; i++)
+    {
+        as->history[i].key_delta    = U8_TO_PUF_BE(p);  p += 4;
+        as->history[i].prev_token   = U8_TO_PUF_BE(p);  p += 4;
+        as->history[i].member_links = *p++;
+    }
+    for(uint16_t slot = 0; slot < num_auth; slot++)
+    {
+        as->auth_devs[slot]     = U8_TO_PHEMAP_ID_BE(p);    p += 2;
+        as->sr_key[slot]        = U8_TO_PUF_BE(p);          p += 4;
+        as->group_members[slot] = (*p & AS_SNAP_MEMBER) ? 1 : 0;
+        as->pending_conf[slot]  = (*p & AS_SNAP_PENDING) ? 1 : 0;
+        p++;
+        as_set_chain_cursor(as->auth_devs[slot],U8_TO_PUF_BE(p));
+        p += 4;
+        as->resync_anchor[slot] = U8_TO_PUF_BE(p);          p += 4;
+        as->resync_links[slot]  = *p++;
+    }
+    return used;
+}
+
+uint32_t gk_as_snapshot(const AuthServer* const as, uint8_t* const buff, const uint32_t cap)
+{
+    assert(NULL != as);
+    assert(NULL != buff);
+    if(cap < gk_as_snapshot_size(as))
+        return 0;
+    uint32_t payload_len = gk_as_snapshot_payload(as,&buff[PHEMAP_SNAP_HDR_SIZE]);
+    phemap_snap_seal(buff,PHEMAP_SNAP_AS,payload_len);
+    return PHEMAP_SNAP_HDR_SIZE + payload_len;
+}
+
+phemap_ret_t gk_as_restore(AuthServer* const as, const uint8_t* const snap, const uint32_t size)
+{
+    assert(NULL != as);
+    uint32_t payload_len = phemap_snap_open(snap,size,PHEMAP_SNAP_AS);
+    if(payload_len == 0 || gk_as_restore_payload(as,&snap[PHEMAP_SNAP_HDR_SIZE],payload_len) != payload_len)
+        return REINIT;
+    return OK;
+}
+
+uint8_t gk_as_save(const AuthServer* const as, const char* const path)
+{
+    assert(NULL != as);
+    uint32_t size = gk_as_snapshot_size(as);
+    uint8_t* buff = (uint8_t*)malloc(size);
+    if(buff == NULL)
+        return 0;
+    uint8_t to_ret = phemap_snap_write_file(path,buff,gk_as_snapshot(as,buff,size));
+    free(buff);
+    return to_ret;
+}
+
+phemap_ret_t gk_as_load(AuthServer* const as, const char* const path)
+{
+    assert(NULL != as);
+    uint32_t size = 0;
+    uint8_t* buff = phemap_snap_read_file(path,&size);
+    if(buff == NULL)
+        return REINIT;
+    phemap_ret_t to_ret = gk_as_restore(as,buff,size);
+    free(buff);
+    return to_ret;
+}
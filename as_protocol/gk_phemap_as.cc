@@ -27,7 +27,6 @@
 #include "stdio.h"
 #include "string.h"
 #include "assert.h"
-#include "math.h"
 
 /**
  * @brief Calculate the sign using sign_key of the buff of size buff_size
@@ -38,42 +37,476 @@
  * @return private_key_t    Calculated sign.   
  */
 static private_key_t keyed_sign(const uint8_t *const buff, const uint32_t buff_size, const private_key_t sign_key );
+/**
+ * @brief Body of gk_as_start_session_cb, checks and authenticates the START_SESS.
+ */
+static phemap_ret_t as_start_session_req(AuthServer* const as,uint8_t * rcvd_start,uint8_t pkt_len);
 
 /**
- * @brief Check if a mex requestor is in the list of phemap ids
+ * @brief Take a device out of the group: the key is updated without its part and sent to every other member
+ *        with a linked UPDATE_KEY. Body of gk_as_remove_cb, also used to evict stragglers.
  * 
- * @param req_id Id of the requestor
  * @param as Pointer to the AS struct 
- * @return uint8_t 1 if the requestor is in the list, else 0
+ * @param slot Slot of the device, not pending
  */
-static inline uint8_t as_check_requestor(const phemap_id_t req_id,AuthServer* const as)
+static void as_remove_members(AuthServer* const as, const uint16_t slot);
+
+/**
+ * @brief Notify a state change to the journal and to the rekey handles
+ * 
+ * @param as Pointer to the AS struct 
+ * @param op gk_as_op_t
+ * @param slot Slot of the device, GK_AS_NO_SLOT if none
+ * @param member_links Links of the chain used for each other member of the group
+ */
+static inline void as_state_changed(AuthServer* const as, const uint8_t op, const uint16_t slot, const uint8_t member_links)
 {
-    assert(NULL != as);
-    for(uint32_t i = 0;i < as->num_auth_devs; i++)
-        if(as->auth_devs[i] == req_id)
-            return 1;
+    as_journal_op(as,op,slot,member_links);
+    as_rekey_note(as,op,slot);
+}
+
+/**
+ * @brief Queue the slot for transmission of the mex already in its buffer
+ * 
+ * @param as Pointer to the AS struct 
+ * @param slot Slot of the receiver
+ */
+static inline void as_queue_slot(AuthServer* const as, const uint16_t slot);
+
+/**
+ * @brief Save the mex for a device in its slot and queue the slot for transmission
+ * 
+ * @param as Pointer to the AS struct 
+ * @param slot Slot of the receiver
+ * @param mex Mex of GK_AS_MEX_SIZE bytes 
+ */
+static inline void as_queue_slot(AuthServer* const as, const uint16_t slot)
+{
+    //  The queue can't overflow unless the sender never drains it, in that case 
+    //  the newest mex is anyway kept into the slot buffer.
+    if(as->unicast_tsmt_count < as->max_auth_devs)
+    {
+        as->unicast_tsmt_queue[as->unicast_tsmt_count] = slot;
+        as->unicast_tsmt_count++;
+    }
+}
+
+static inline void as_queue_unicast(AuthServer* const as, const uint16_t slot, const uint8_t* const mex)
+{
+    //  Instead of calling a snd function, write the data into the receiver slot
+    memcpy(as->unicast_tsmt_buff[slot],mex,GK_AS_MEX_SIZE);
+    as_queue_slot(as,slot);
+}
+
+/**
+ * @brief Write a key mex TYPE|AS_ID|ENC_KEY|ENC_ST|EPOCH|ARG|SIGN
+ * 
+ * @param as Pointer to the AS struct 
+ * @param type START_PK, UPDATE_KEY, RESYNC_DELTA or RESUME_PK
+ * @param enc_key Encrypted key or key update
+ * @param enc_st Encrypted secret token
+ * @param arg Type dependent argument
+ * @param sign_key Key of the sign
+ * @param mex Buffer of GK_AS_MEX_SIZE bytes
+ */
+static inline void as_forge_key_mex(const AuthServer* const as, const phemap_mex_t type, const private_key_t enc_key, const puf_resp_t enc_st,
+                                    const uint8_t arg, const private_key_t sign_key, uint8_t* const mex)
+{
+    mex[0] = type;
+    PHEMAP_ID_TO_U8_BE(as->as_id,&mex[1]);
+    PUF_TO_U8_BE(enc_key,&mex[1+sizeof(phemap_id_t)]);
+    PUF_TO_U8_BE(enc_st,&mex[1+sizeof(phemap_id_t)+sizeof(private_key_t)]);
+    PUF_TO_U8_BE(as->epoch,&mex[PHEMAP_KEY_MEX_EPOCH]);
+    mex[PHEMAP_KEY_MEX_ARG] = arg;
+    private_key_t sign = keyed_sign(mex,PHEMAP_KEY_MEX_SIGNED,sign_key);
+    PUF_TO_U8_BE(sign,&mex[PHEMAP_KEY_MEX_SIGNED]);
+}
+
+/**
+ * @brief Secret token of an epoch still in the history, it signs the mexs a device sends from that epoch
+ * 
+ * @param as Pointer to the AS struct 
+ * @param epoch Epoch of the device
+ * @param token Filled with the token of the epoch
+ * @return uint8_t 0 if every epoch after it is no longer in the history
+ */
+static inline uint8_t as_epoch_token(const AuthServer* const as, const uint32_t epoch, puf_resp_t* const token)
+{
+    if(epoch > as->epoch || as->epoch - epoch > as->history_count)
+        return 0;
+    *token = (epoch == as->epoch) ? as->secret_token : as->history[(epoch + 1) % GK_AS_EPOCH_HISTORY].prev_token;
+    return 1;
+}
+
+/**
+ * @brief Next link of the chain of a slot, from its cache if gk_as_precompute already pulled it
+ * 
+ * @param as Pointer to the AS struct 
+ * @param slot Slot of the device
+ * @return puf_resp_t The link
+ */
+static inline puf_resp_t as_next_link(AuthServer* const as, const uint16_t slot)
+{
+#if GK_AS_LINK_CACHE > 0
+    uint8_t n = as->link_cached[slot];
+    if(n > 0)
+    {
+        puf_resp_t* const cache = &as->link_cache[(uint32_t)slot * GK_AS_LINK_CACHE];
+        puf_resp_t link = cache[0];
+        for(uint8_t i = 1; i < n; i++)
+            cache[i - 1] = cache[i];
+        as->link_cached[slot] = (uint8_t)(n - 1);
+        return link;
+    }
+#endif
+    return as_get_next_link(as->auth_devs[slot]);
+}
+
+/**
+ * @brief Skip links of the chain of a slot, the cached ones first
+ * 
+ * @param as Pointer to the AS struct 
+ * @param slot Slot of the device
+ * @param n Links to skip
+ */
+static inline void as_skip_slot_links(AuthServer* const as, const uint16_t slot, uint32_t n)
+{
+#if GK_AS_LINK_CACHE > 0
+    while(n > 0 && as->link_cached[slot] > 0)
+    {
+        as_next_link(as,slot);
+        n--;
+    }
+#endif
+    if(n > 0)
+        as_skip_links(as->auth_devs[slot],n);
+}
+
+/**
+ * @brief Random value for a membership change, generated ahead by gk_as_precompute if possible
+ * 
+ * @param as Pointer to the AS struct 
+ * @return uint32_t The value
+ */
+static inline uint32_t as_next_random(AuthServer* const as)
+{
+    if(as->rng_ready > 0)
+        return as->rng_pool[--as->rng_ready];
+    return as_rng_gen();
+}
+
+/**
+ * @brief Position of a link in a window of links, branchless: every link of the window is compared
+ * 
+ * @param window Links following the expected one
+ * @param n Links in the window, up to 32
+ * @param link Link rcvd
+ * @return uint32_t 1 + index of the first match, 0 if the link is not in the window
+ */
+static inline uint32_t as_link_window_match(const puf_resp_t* const window, const uint32_t n, const puf_resp_t link)
+{
+    uint32_t hits = 0;
+    for(uint32_t i = 0; i < n; i++)
+        hits |= (uint32_t)(window[i] == link) << i;
+    return (hits == 0) ? 0 : (uint32_t)__builtin_ctz(hits) + 1;
+}
+
+/**
+ * @brief 1 if the mex of a device is one of the last it sent, the compares are branchless as in as_link_window_match
+ * 
+ * @param as Pointer to the AS struct 
+ * @param slot Slot of the device
+ * @param type Type of the mex
+ * @param link Link carried by the mex
+ * @return uint8_t 1 if it was already authenticated
+ */
+static inline uint8_t as_dup_seen(const AuthServer* const as, const uint16_t slot, const uint8_t type, const puf_resp_t link)
+{
+    uint32_t hits = 0;
+#if GK_AS_DUP_DEPTH > 0
+    const puf_resp_t*   links = &as->dup_links[(uint32_t)slot * GK_AS_DUP_DEPTH];
+    const uint8_t*      types = &as->dup_types[(uint32_t)slot * GK_AS_DUP_DEPTH];
+    for(uint32_t i = 0; i < GK_AS_DUP_DEPTH; i++)
+        hits |= (uint32_t)(links[i] == link) & (uint32_t)(types[i] == (uint8_t)(type + 1));
+#else
+    (void)as;
+    (void)slot;
+    (void)type;
+    (void)link;
+#endif
+    return (uint8_t)hits;
+}
+
+/**
+ * @brief Remember a mex authenticated for a device, a link is used once so the same type and link again is a duplicate
+ * 
+ * @param as Pointer to the AS struct 
+ * @param slot Slot of the device
+ * @param type Type of the mex
+ * @param link Link carried by the mex
+ */
+static inline void as_dup_record(AuthServer* const as, const uint16_t slot, const uint8_t type, const puf_resp_t link)
+{
+#if GK_AS_DUP_DEPTH > 0
+    uint32_t entry = (uint32_t)slot * GK_AS_DUP_DEPTH + as->dup_head[slot];
+    as->dup_links[entry]    = link;
+    as->dup_types[entry]    = (uint8_t)(type + 1);
+    as->dup_head[slot]      = (uint8_t)((as->dup_head[slot] + 1) % GK_AS_DUP_DEPTH);
+#else
+    (void)as;
+    (void)slot;
+    (void)type;
+    (void)link;
+#endif
+}
+
+/**
+ * @brief Copy the next links of the chain of a slot without consuming them
+ * @details The cached links come first, then the ones read with as_peek_links. If the chain can't be read 
+ *          ahead the links are pulled into the cache instead, where they wait to be used.
+ * 
+ * @param as Pointer to the AS struct 
+ * @param slot Slot of the device
+ * @param links Filled with the links in chain order
+ * @param want Links wanted
+ * @return uint32_t Links copied, 0 only without a cache and without as_peek_links
+ */
+static uint32_t as_peek_slot_links(AuthServer* const as, const uint16_t slot, puf_resp_t* const links, const uint32_t want)
+{
+    uint32_t n = 0;
+#if GK_AS_LINK_CACHE > 0
+    puf_resp_t* const cache = &as->link_cache[(uint32_t)slot * GK_AS_LINK_CACHE];
+    for(; n < as->link_cached[slot] && n < want; n++)
+        links[n] = cache[n];
+#endif
+    if(n == want)
+        return n;
+    uint32_t peeked = as_peek_links(as->auth_devs[slot],&links[n],want - n);
+#if GK_AS_LINK_CACHE > 0
+    while(peeked == 0 && n < want && as->link_cached[slot] < GK_AS_LINK_CACHE)
+    {
+        links[n] = as_get_next_link(as->auth_devs[slot]);
+        cache[as->link_cached[slot]] = links[n];
+        as->link_cached[slot]++;
+        n++;
+    }
+#endif
+    return n + peeked;
+}
+
+/**
+ * @brief Authenticate a device by the next link of its chain, no link is consumed unless it matches
+ * @details A lost mex leaves the device some links ahead of the AS. When the expected link doesn't match, 
+ *          the next GK_AS_LINK_WINDOW links are compared too and on a match the chain of the AS moves past it.
+ *          The links are read with as_peek_slot_links, so a forged or stale mex doesn't move the chain. Only
+ *          without a cache and without as_peek_links a failed check uses a link, counted in auth_links_lost.
+ *          The authenticated mex is remembered by the duplicate filter.
+ * 
+ * @param as Pointer to the AS struct 
+ * @param slot Slot of the device
+ * @param type Type of the mex carrying the link
+ * @param rcvd_link Link rcvd
+ * @return uint8_t Links of the chain consumed, the matching one included, 0 if the device is not authenticated
+ */
+static uint8_t as_auth_link(AuthServer* const as, const uint16_t slot, const uint8_t type, const puf_resp_t rcvd_link)
+{
+    phemap_id_t req_id  = as->auth_devs[slot];
+    //  The expected link, then the window after it
+    puf_resp_t  window[GK_AS_LINK_WINDOW + 1];
+    uint32_t    used    = 0;
+    if(as_peek_slot_links(as,slot,window,1) == 0)
+    {
+        window[0]   = as_get_next_link(req_id);
+        used        = 1;
+    }
+    uint32_t    pos     = (window[0] == rcvd_link) ? 1 : 0;
+#if GK_AS_LINK_WINDOW > 0
+    if(pos == 0 && used == 0)
+    {
+        uint32_t n = as_peek_slot_links(as,slot,window,GK_AS_LINK_WINDOW + 1);
+        pos = as_link_window_match(&window[1],n - 1,rcvd_link);
+        if(pos != 0)
+        {
+#if AS_PC_DBG
+            printf("[AS-GK] Chain of %u moved ahead by %u links \n",req_id,pos);
+#endif
+            PHEMAP_TRACE_EV(PHEMAP_EV_AS_LINK_SKIPPED,as->as_id,req_id,pos,type);
+            pos++;
+        }
+    }
+#endif
+    if(pos != 0)
+    {
+        as_skip_slot_links(as,slot,pos - used);
+        as_dup_record(as,slot,type,rcvd_link);
+        return (uint8_t)pos;
+    }
+#if AS_PC_DBG
+    printf("[AS-GK] Authentication of %u failed, needs resync, expected %x rcvd %x \n",req_id,window[0],rcvd_link);
+#endif
+    PHEMAP_TRACE_EV(PHEMAP_EV_AS_AUTH_FAILED,as->as_id,req_id,window[0],rcvd_link);
+    if(used == 1)
+    {
+        //  The chain of the AS is now one link ahead of the device
+        as->auth_links_lost++;
+        PHEMAP_TRACE_EV(PHEMAP_EV_AS_LINK_LOST,as->as_id,req_id,type,0);
+        as_state_changed(as,GK_AS_OP_LINK,slot,0);
+    }
     return 0;
 }
 
+/**
+ * @brief Duplicate filter run before the callbacks, only the mexs authenticated by a link are filtered
+ * @details A RESYNC_REQ or a RESUME_SESS only when it carries a link, the first one of a resync or of a resume
+ *          is a legitimate retry.
+ * 
+ * @param as Pointer to the AS struct 
+ * @param pkt Rcvd pkt
+ * @param pkt_len Size of the rcvd pkt
+ * @return uint8_t 1 if the pkt is a duplicate and has been absorbed
+ */
+static uint8_t as_dup_absorbed(AuthServer* const as, const uint8_t* const pkt, const uint8_t pkt_len)
+{
+#if GK_AS_DUP_DEPTH > 0
+    if(as->dup_policy == GK_AS_DUP_OFF || pkt_len < 1 + sizeof(phemap_id_t) + sizeof(puf_resp_t))
+        return 0;
+    uint32_t link_at = 1 + sizeof(phemap_id_t);
+    if(pkt[0] == RESYNC_REQ)
+    {
+        if(pkt_len < PHEMAP_RESYNC_REQ_SIZE || pkt[PHEMAP_RESYNC_REQ_LINKED] != 1)
+            return 0;
+        link_at = PHEMAP_RESYNC_REQ_LINK;
+    }
+    else if(pkt[0] == RESUME_SESS)
+    {
+        if(pkt_len < PHEMAP_RESUME_SESS_SIZE || pkt[PHEMAP_RESUME_SESS_LINKED] != 1)
+            return 0;
+        link_at = PHEMAP_RESUME_SESS_LINK;
+    }
+    else if(pkt[0] != START_SESS && pkt[0] != PK_CONF && pkt[0] != END_SESS && pkt[0] != UPDATE_CONF)
+        return 0;
+    phemap_id_t req_id  = U8_TO_PHEMAP_ID_BE(&pkt[1]);
+    uint16_t    slot    = gk_as_get_slot(as,req_id);
+    if(slot == GK_AS_NO_SLOT || as_dup_seen(as,slot,pkt[0],U8_TO_PUF_BE(&pkt[link_at])) == 0)
+        return 0;
+    //  The answer is sent again only if nothing replaced it in the slot and it isn't still queued
+    uint8_t answer = (pkt[0] == START_SESS) ? (uint8_t)START_PK : (pkt[0] == RESYNC_REQ) ? (uint8_t)RESYNC_DELTA :
+                     (pkt[0] == RESUME_SESS) ? (uint8_t)RESUME_PK : 0xFF;
+    uint8_t reemit = (as->dup_policy == GK_AS_DUP_REEMIT && as->unicast_tsmt_buff[slot][0] == answer);
+    for(uint32_t i = 0; reemit == 1 && i < as->unicast_tsmt_count; i++)
+        if(as->unicast_tsmt_queue[i] == slot)
+            reemit = 0;
+    if(reemit == 1)
+        as_queue_slot(as,slot);
+    as->dup_absorbed++;
+#if AS_PC_DBG
+    printf("[AS-GK] Duplicate %u from %u absorbed, reemitted %u \n",pkt[0],req_id,reemit);
+#endif
+    PHEMAP_TRACE_EV(PHEMAP_EV_AS_DUPLICATE,as->as_id,pkt[0],req_id,reemit);
+    return 1;
+#else
+    (void)as;
+    (void)pkt;
+    (void)pkt_len;
+    return 0;
+#endif
+}
+
+void gk_as_bind(AuthServer* const as, void* const storage, const uint16_t max_auth_devs)
+{
+    assert(NULL != as);
+    assert(NULL != storage);
+    uint8_t* mem = (uint8_t*)storage;
+    memset(as,0,sizeof(AuthServer));
+    memset(mem,0,GK_AS_STORAGE_SIZE(max_auth_devs));
+    as->max_auth_devs       = max_auth_devs;
+    as->dup_policy          = GK_AS_DUP_DEFAULT;
+    as->chain_rewind        = GK_AS_CHAIN_REWIND;
+    //  Carve the arrays by decreasing alignment
+    as->sr_key              = (private_key_t*)mem;
+    mem                     += max_auth_devs * sizeof(private_key_t);
+    as->resync_anchor       = (uint32_t*)mem;
+    mem                     += max_auth_devs * sizeof(uint32_t);
+    as->retx_deadline       = (uint32_t*)mem;
+    mem                     += max_auth_devs * sizeof(uint32_t);
+    as->dup_links           = (puf_resp_t*)mem;
+    mem                     += max_auth_devs * GK_AS_DUP_DEPTH * sizeof(puf_resp_t);
+    as->link_cache          = (puf_resp_t*)mem;
+    mem                     += max_auth_devs * GK_AS_LINK_CACHE * sizeof(puf_resp_t);
+    as->auth_devs           = (phemap_id_t*)mem;
+    mem                     += max_auth_devs * sizeof(phemap_id_t);
+    as->unicast_tsmt_queue  = (uint16_t*)mem;
+    mem                     += max_auth_devs * sizeof(uint16_t);
+    as->unicast_tsmt_buff   = (uint8_t (*)[GK_AS_MEX_SIZE])mem;
+    mem                     += max_auth_devs * GK_AS_MEX_SIZE;
+    as->pending_conf        = mem;
+    mem                     += max_auth_devs;
+    as->group_members       = mem;
+    mem                     += max_auth_devs;
+    as->resync_links        = mem;
+    mem                     += max_auth_devs;
+    as->retx_tries          = mem;
+    mem                     += max_auth_devs;
+    as->link_cached         = mem;
+    mem                     += (GK_AS_LINK_CACHE > 0) ? max_auth_devs : 0;
+    as->dup_types           = mem;
+    mem                     += max_auth_devs * GK_AS_DUP_DEPTH;
+    as->dup_head            = mem;
+    as->as_state            = GK_AS_WAIT_FOR_START_REQ;
+}
+
+phemap_ret_t gk_as_register_dev(AuthServer* const as, const phemap_id_t id)
+{
+    assert(NULL != as);
+    if(as->num_auth_devs == as->max_auth_devs || gk_as_get_slot(as,id) != GK_AS_NO_SLOT)
+        return ENROLL_FAILED;
+    as->auth_devs[as->num_auth_devs] = id;
+    as->num_auth_devs++;
+    as_state_changed(as,GK_AS_OP_REGISTER,as->num_auth_devs - 1,0);
+    return OK;
+}
+
+uint16_t gk_as_get_slot(const AuthServer* const as, const phemap_id_t id)
+{
+    assert(NULL != as);
+    for(uint16_t i = 0;i < as->num_auth_devs; i++)
+        if(as->auth_devs[i] == id)
+            return i;
+    return GK_AS_NO_SLOT;
+}
+
 phemap_ret_t gk_as_start_session_cb( AuthServer* const as,uint8_t * rcvd_start,uint8_t pkt_len)
 {
     assert(NULL != as);
     assert(NULL != rcvd_start);
+    PHEMAP_CAPTURE_ENTER(PHEMAP_CAP_AS_START,as->as_id,rcvd_start,pkt_len);
+    phemap_ret_t to_ret = as_start_session_req(as,rcvd_start,pkt_len);
+    PHEMAP_STATS_RECORD(as->stats,rcvd_start,pkt_len,to_ret,as->pending_count,as->num_part,
+                        as->unicast_tsmt_count + as->broadcast_is_present);
+    PHEMAP_CAPTURE_EXIT();
+    return to_ret;
+}
+
+static phemap_ret_t as_start_session_req(AuthServer* const as,uint8_t * rcvd_start,uint8_t pkt_len)
+{
     if(rcvd_start[0] != START_SESS || pkt_len < 1 + sizeof(phemap_id_t) + sizeof(puf_resp_t))
     {
 #if AS_PC_DBG
         printf("[AS-GK] Malformed start, needs resync rcvd_start %d len %d \n",rcvd_start[0],pkt_len);
 #endif
+        PHEMAP_TRACE_EV(PHEMAP_EV_AS_MALFORMED,as->as_id,rcvd_start[0],pkt_len,0);
         as->as_state = GK_AS_WAIT_FOR_START_REQ;
         return REINIT;
     }
     phemap_id_t req_id = U8_TO_PHEMAP_ID_BE(&rcvd_start[1]);
+    uint16_t    slot   = gk_as_get_slot(as,req_id);
     // Check for the requestor id
-    if( !as_check_requestor(req_id,as))
+    if( slot == GK_AS_NO_SLOT)
     {
 #if AS_PC_DBG
         printf("[AS-GK] Req %u  not authenticated \n",req_id);
 #endif
+        PHEMAP_TRACE_EV(PHEMAP_EV_AS_UNKNOWN_DEV,as->as_id,START_SESS,req_id,0);
         as->as_state = GK_AS_WAIT_FOR_START_REQ;
         return REINIT;
     }
@@ -82,13 +515,8 @@ phemap_ret_t gk_as_start_session_cb( AuthServer* const as,uint8_t * rcvd_start,u
         printf("[AS-GK] Starting sess for  %d \n",req_id);
 #endif
     // Authenticate the device
-    puf_resp_t link_req  = as_get_next_link(req_id); //ai-1
-    puf_resp_t rcvd_link = U8_TO_PUF_BE(&rcvd_start[1+sizeof(phemap_id_t)]); 
-    if(link_req != rcvd_link) //  Auth the requestor
+    if(as_auth_link(as,slot,START_SESS,U8_TO_PUF_BE(&rcvd_start[1+sizeof(phemap_id_t)])) == 0) //ai-1
     {
-#if AS_PC_DBG
-        printf("[AS-GK] Authentication failed, needs resync, expected %x rcvd %x   \n",link_req,rcvd_link);
-#endif
         as->as_state = GK_AS_WAIT_FOR_START_REQ;
         return REINIT;
     }
@@ -102,59 +530,48 @@ phemap_ret_t gk_as_start_session( AuthServer* const as)
     puf_resp_t      auth[as->num_auth_devs]; 
     puf_resp_t      sr_noise[as->num_auth_devs]; 
     private_key_t   partial_key;
-    uint8_t m_to_send[1+sizeof(phemap_id_t)+sizeof(puf_resp_t)+2*sizeof(private_key_t)];
+    uint8_t m_to_send[GK_AS_MEX_SIZE];
     uint16_t i;
-    //  Initialize the mex common part 
-    m_to_send[0] = START_PK;
-    PHEMAP_ID_TO_U8_BE(as->as_id,&m_to_send[1]);
     as->private_key = 0;
     //  Initialize the key parts
     for( i=0;i<as->num_auth_devs;i++)
     {
         //  ai-> NOISE ADDED TO THE KEY
         //  The secret token noise is the same of the key noise !!
-        sr_noise[i]     = as_get_next_link(as->auth_devs[i]);          
+        sr_noise[i]     = as_next_link(as,i);          
         //  ai+1 -> PART OF THE KEY 
-        as->sr_key[i]   = as_get_next_link(as->auth_devs[i]);          
+        as->sr_key[i]   = as_next_link(as,i);          
         //  ai+3 -> Authentication link
-        auth[i] = as_get_next_link(as->auth_devs[i]);          
+        auth[i] = as_next_link(as,i);          
         //  Compose the pk        
         as->private_key ^= as->sr_key[i];
     }
     //  Generate and add the nonce for back and for
     //  security.
-    as->session_nonce   =   as_rng_gen();
+    as->session_nonce   =   as_next_random(as);
     as->private_key     ^=  as->session_nonce;
     //  Add the secret token 
-    as->secret_token = as_rng_gen();
+    as->secret_token = as_next_random(as);
+    //  A new key, nothing before it can be resynced
+    as->epoch++;
+    as->history_count = 0;
     //  Generte and send the pkts for devices 
     for( i = 0; i < as->num_auth_devs; i++)
     {
         //  Generate the key for device i
         //  key=xor(keyj, j!=i) 
         partial_key= sr_noise[i] ^ as->private_key ^ as->sr_key[i];
-        // append the key part
-        PUF_TO_U8_BE(partial_key,&m_to_send[1+sizeof(phemap_id_t)]); 
-        // Append the secret token with its noise 
-        PUF_TO_U8_BE((sr_noise[i]^as->secret_token),&m_to_send[1+sizeof(phemap_id_t)+sizeof(puf_resp_t)]); 
-        // Now sign the mex
-        partial_key = keyed_sign(m_to_send,1+sizeof(phemap_id_t)+2*sizeof(puf_resp_t),auth[i]);
-        // Append the sign
-        PUF_TO_U8_BE(partial_key,&m_to_send[1+sizeof(phemap_id_t)+2*sizeof(puf_resp_t)]);
+        //  The key part and the secret token with the same noise, signed with the authentication link
+        as_forge_key_mex(as,START_PK,partial_key,sr_noise[i]^as->secret_token,0,auth[i],m_to_send);
         // **** Old deprecated
         //  as->as_write_to_device(as->as_id,as->auth_devs[i],m_to_send,1+sizeof(phemap_id_t)+2*sizeof(puf_resp_t)+sizeof(private_key_t));
-        //  Instead of calling a snd function, write the data into a buffer and write
-        //  Copy the buffer into the slot for the specific receiver
-        //  Should always be 15 bytes
-        memcpy(&as->unicast_tsmt_buff[as->auth_devs[i]],m_to_send,15); 
-        //  Assign the first receiver id that must receive the pkt
-        as->unicast_tsmt_queue[i]=as->auth_devs[i];
-        //  Increase the count of messages into the tsmt queue.
-        as->unicast_tsmt_count++;
-        as->pending_conf[as->auth_devs[i]] = 1;   // set pending state
+        as_queue_unicast(as,i,m_to_send);
+        as->pending_conf[i] = 1;   // set pending state
+        as->retx_tries[i]   = 0;
     }
     as->pending_count = as->num_auth_devs;
     as->as_state = GK_AS_WAIT_FOR_START_CONF;
+    as_state_changed(as,GK_AS_OP_START,GK_AS_NO_SLOT,0);
     as_start_timer();
     return OK;
 }
@@ -170,17 +587,20 @@ phemap_ret_t gk_as_conf_cb( AuthServer* const as,uint8_t * rcvd_conf,const uint8
 #if AS_PC_DBG
         printf("[AS-GK] Confirmation failed, need reinitialization \n ");
 #endif
+        PHEMAP_TRACE_EV(PHEMAP_EV_AS_MALFORMED,as->as_id,rcvd_conf[0],pkt_len,0);
         as->as_state = GK_AS_WAIT_FOR_START_REQ;
         return REINIT;
     }
     
     // Check if the requestor is in the list of auth devs
     phemap_id_t req_id = U8_TO_PHEMAP_ID_BE(&rcvd_conf[1]);
-    if( !as_check_requestor(req_id,as))
+    uint16_t    slot   = gk_as_get_slot(as,req_id);
+    if( slot == GK_AS_NO_SLOT)
     {
 #if AS_PC_DBG
         printf("100-GK] Req %u  not authenticated, could not confirm \n",req_id);
 #endif
+        PHEMAP_TRACE_EV(PHEMAP_EV_AS_UNKNOWN_DEV,as->as_id,rcvd_conf[0],req_id,0);
         as->as_state = GK_AS_WAIT_FOR_START_REQ;
         return REINIT;
     }
@@ -189,31 +609,28 @@ phemap_ret_t gk_as_conf_cb( AuthServer* const as,uint8_t * rcvd_conf,const uint8
         printf("[AS-GK %lu] Start confirming for  %u \n",as->as_id,req_id);
 #endif
 
-    //  Authenticate the requestor
-    puf_resp_t link_req     =   as_get_next_link(req_id);
-    puf_resp_t rcvd_link    =   U8_TO_PUF_BE(&rcvd_conf[1+sizeof(phemap_id_t)]);
-    if(link_req != rcvd_link)
+    //  Nothing to confirm, e.g. the late PK_CONF of an evicted device or the PK_CONF a member sends again for a
+    //  retransmitted START_PK, whatever dup_policy is. No link is checked, the chain stays where the device is
+    if(as->pending_conf[slot] == 0)
     {
-#if AS_PC_DBG
-        printf("[AS-GK] Authentication failed during confirmation, needs resync\n");
-#endif
-        as->as_state = GK_AS_WAIT_FOR_START_REQ;
-        return REINIT;
+        PHEMAP_TRACE_EV(PHEMAP_EV_AS_CONF_NOT_PENDING,as->as_id,rcvd_conf[0],req_id,0);
+        return CONN_WAIT;
     }
-    if(as->pending_conf[req_id] == 0)
+    //  Authenticate the requestor
+    if(as_auth_link(as,slot,rcvd_conf[0],U8_TO_PUF_BE(&rcvd_conf[1+sizeof(phemap_id_t)])) == 0)
     {
-        printf("ERRORE ERRORE ERRORE \n");
+        as->as_state = GK_AS_WAIT_FOR_START_REQ;
         return REINIT;
-        //assert(1==0);
     }
     //  set the state as no more pending
-    as->pending_conf[req_id] = 0;
+    as->pending_conf[slot] = 0;
+    as->retx_tries[slot]   = 0;
     as->pending_count--;
     //  If a new key has been installed add the device to the members of the group.
     if(rcvd_conf[0] ==  PK_CONF)
     {
         as->num_part++;
-        as->group_members[req_id] = 1;
+        as->group_members[slot] = 1;
     }
     //  If there are no more pending devs and the num parts
     //  is greater than 0 
@@ -226,18 +643,21 @@ phemap_ret_t gk_as_conf_cb( AuthServer* const as,uint8_t * rcvd_conf,const uint8
         {
             //printf("[AS %u], key installed \n",as->as_id);
             as->pk_installed = 1;
+            as_state_changed(as,GK_AS_OP_CONF,slot,0);
             return INSTALL_OK;
         }
-        else
-            return UPDATE_OK;
+        as_state_changed(as,GK_AS_OP_CONF,slot,0);
+        return UPDATE_OK;
     }
     //  No more devices, reset the state 
     else if(as->pending_count == 0 && as->num_part == 0)
     {
         //printf("[AS %u], update completed \n",as->as_id);
         as->as_state = GK_AS_WAIT_FOR_START_REQ;
+        as_state_changed(as,GK_AS_OP_CONF,slot,0);
         return UPDATE_OK;
     }
+    as_state_changed(as,GK_AS_OP_CONF,slot,0);
     return OK;
 }
 
@@ -256,16 +676,19 @@ phemap_ret_t  gk_as_remove_cb(AuthServer* const as,uint8_t * rcvd_pkt,const uint
 #if AS_PC_DBG
         printf("[AS-GK] Confirmation failed, need reinitialization \n ");
 #endif
+        PHEMAP_TRACE_EV(PHEMAP_EV_AS_MALFORMED,as->as_id,rcvd_pkt[0],pkt_len,0);
         as->as_state = GK_AS_WAIT_FOR_START_REQ;
         return REINIT;
     }
 
     //Check it the requestor is in the list of auth devs
     phemap_id_t req_id = U8_TO_PHEMAP_ID_BE(&rcvd_pkt[1]);
-    if(!as_check_requestor(req_id,as)){
+    uint16_t    slot   = gk_as_get_slot(as,req_id);
+    if(slot == GK_AS_NO_SLOT){
 #if AS_PC_DBG
         printf("[AS-GK] Req %u  not authenticated, could not remove \n",req_id);
 #endif
+        PHEMAP_TRACE_EV(PHEMAP_EV_AS_UNKNOWN_DEV,as->as_id,END_SESS,req_id,0);
         as->as_state = GK_AS_WAIT_FOR_START_REQ;
         return REINIT;
     }
@@ -275,68 +698,74 @@ phemap_ret_t  gk_as_remove_cb(AuthServer* const as,uint8_t * rcvd_pkt,const uint
 #endif
 
     // Authenticate the requestor
-    puf_resp_t link_req     = as_get_next_link(req_id);
-    puf_resp_t rcvd_link    = U8_TO_PUF_BE(&rcvd_pkt[1+sizeof(phemap_id_t)]);
-    if(link_req != rcvd_link)
+    if(as_auth_link(as,slot,END_SESS,U8_TO_PUF_BE(&rcvd_pkt[1+sizeof(phemap_id_t)])) == 0)
     {
-#if AS_PC_DBG
-        printf("[AS-GK] Authentication failed during elimination, needs resync\n");
-#endif
         as->as_state = GK_AS_WAIT_FOR_START_REQ;
         return REINIT;
     }
 
-    // Send remove updates
-    uint8_t m_to_send[1 + sizeof(phemap_id_t)+ 3*sizeof(puf_resp_t)];
-    puf_resp_t temp_noise,mex_helper;
-    uint16_t idx = 0;
-    //  Generate the pkt type and add the puf
-    m_to_send[0] = UPDATE_KEY;
-    PHEMAP_ID_TO_U8_BE(as->as_id,&m_to_send[1]);
     //  Initialize the list of pending devices for the communication
     as->pending_count = 0;
-    //  Save the old nonce for updates
+    as_remove_members(as,slot);
+    //  Else do nothing since we're already in WAIT_FOR_UPDATES
+    return OK;
+}
+
+static inline uint8_t as_is_leaving(const AuthServer* const as, const uint16_t idx, const uint16_t slot)
+{
+    return (slot == GK_AS_NO_SLOT) ? (as->retx_tries[idx] > GK_AS_RETX_MAX) : (idx == slot);
+}
+
+/**
+ * @brief Remove from the group a device or the devices given up by gk_as_retx_poll with a single update
+ * 
+ * @param as Pointer to the AS struct 
+ * @param slot Slot of the device leaving, GK_AS_NO_SLOT for every slot with retx_tries > GK_AS_RETX_MAX
+ */
+static void as_remove_members(AuthServer* const as, const uint16_t slot)
+{
+    // Send remove updates
+    uint8_t m_to_send[GK_AS_MEX_SIZE];
+    puf_resp_t temp_noise;
+    uint16_t idx = 0;
+    //  Save the old nonce and token for updates
     private_key_t old_nonce = as->session_nonce;
+    puf_resp_t old_secret_token = as->secret_token;
     //  Generate nonce and tokens
-    as->session_nonce       =   as_rng_gen();
-    as->secret_token        =   as_rng_gen();
-    //  The update is composed by the leaving node puf used in the key
-    puf_resp_t update_key   =   (as->sr_key[req_id]^old_nonce^as->session_nonce); 
+    as->session_nonce       =   as_next_random(as);
+    as->secret_token        =   as_next_random(as);
+    //  The update is composed by the leaving nodes puf used in the key, as_add_slots the other way round
+    puf_resp_t update_key   =   old_nonce^as->session_nonce;
+    for(idx = 0; idx < as->num_auth_devs; idx++)
+    {
+        if(as_is_leaving(as,idx,slot) == 0)
+            continue;
+        update_key ^= as->sr_key[idx];
+        //  Remove the requestor from the group, an evicted device may have never confirmed
+        if(as->group_members[idx] == 1)
+        {
+            as->group_members[idx] =   0;
+            as->num_part--;
+        }
+    }
     //  update the private key saved into the AS 
     as->private_key         =   (as->private_key ^ update_key);  
-    //  Remove the requestor from the group
-    as->group_members[req_id]   =   0;
-    //  Decrease the number of group part
-    as->num_part--;
+    //  Every other member uses a link for the encryption and one for the sign
+    gk_as_epoch_advance(as,update_key,old_secret_token,2);
     //  For each auth devs
     for(idx=0;idx<as->num_auth_devs;idx++)
     {
-        //  If idx is not the leaving dev and is a member of the group
-        if(as->auth_devs[idx] != req_id && as->group_members[as->auth_devs[idx]] == 1)
+        //  The leaving devs are no longer members
+        if(as->group_members[idx] == 1)
         {
             //  Get the next link for the device, this link
             //  will be used for encrypting the update mex 
-            temp_noise =    as_get_next_link(as->auth_devs[idx]);            
-            //  Append first the Enc ST USING THE SAME NOISE OF THE KEY
-            mex_helper =    mex_helper ^ as->secret_token;
-            PUF_TO_U8_BE(mex_helper,&m_to_send[1+sizeof(phemap_id_t)+sizeof(puf_resp_t)]);    
-            //  Encrypt the update using the next puf link
-            mex_helper  =   temp_noise ^ update_key;                     
-            //  append the key update
-            PUF_TO_U8_BE(mex_helper,&m_to_send[1 + sizeof(phemap_id_t)]);  
-            //  Calculate the pkt sign
-            mex_helper = keyed_sign(   m_to_send, 
-                                1+sizeof(phemap_id_t)+2*sizeof(puf_resp_t),
-                                as_get_next_link(as->auth_devs[idx])
-                            );
-            //  Append the sign
-            PUF_TO_U8_BE(mex_helper,&m_to_send[1+sizeof(phemap_id_t)+2*sizeof(puf_resp_t)]);
+            temp_noise =    as_next_link(as,idx);            
+            //  The update and the ST USING THE SAME NOISE, signed with the link after it
+            as_forge_key_mex(as,UPDATE_KEY,temp_noise^update_key,temp_noise^as->secret_token,PHEMAP_UPDATE_LINKED,
+                            as_next_link(as,idx),m_to_send);
             // Protocol  send updates
-            //  This should be idx to write to the correct recvr slot
-            memcpy(&as->unicast_tsmt_buff[as->auth_devs[idx]],m_to_send,15);   
-            //  This should be unicast_tsmt_count because acts as a queue
-            as->unicast_tsmt_queue[as->unicast_tsmt_count]=as->auth_devs[idx]; 
-            as->unicast_tsmt_count++;
+            as_queue_unicast(as,idx,m_to_send);
         }
     }
     //  If there are no more nodes reset the state 
@@ -350,11 +779,93 @@ phemap_ret_t  gk_as_remove_cb(AuthServer* const as,uint8_t * rcvd_pkt,const uint
 #if AS_PC_DBG
     printf("[AS-GK] Ending revoke procedure \n");
 #endif
-    //  Else do nothing since we're already in WAIT_FOR_UPDATES
-    return OK;
+    //  Every other member used a link for the encryption and one for the sign, the first record carries them
+    uint8_t member_links = 2;
+    for(idx = 0; idx < as->num_auth_devs; idx++)
+    {
+        if(as_is_leaving(as,idx,slot) == 0)
+            continue;
+        //  Each eviction is counted before it is notified, gk_as_rekey tells it from a leave
+        if(slot == GK_AS_NO_SLOT)
+        {
+            as->retx_tries[idx] = 0;
+            as->retx_evicted++;
+        }
+        as_state_changed(as,GK_AS_OP_REMOVE,idx,member_links);
+        member_links = 0;
+    }
 }
 
-phemap_ret_t  gk_as_add_cb(AuthServer* const as,const uint8_t * const rcvd_pkt,const uint8_t pkt_len)
+phemap_ret_t gk_as_retx_poll(AuthServer* const as, const uint32_t now_ms)
+{
+    assert(NULL != as);
+    if(as->as_state != GK_AS_WAIT_FOR_START_CONF)
+        return OK;
+    uint16_t given_up = 0;
+    for(uint16_t slot = 0; slot < as->num_auth_devs; slot++)
+    {
+        if(as->pending_conf[slot] == 0)
+            continue;
+        //  The deadline starts at the first poll, the AS has no clock of its own
+        if(as->retx_tries[slot] == 0)
+        {
+            as->retx_tries[slot]    = 1;
+            as->retx_deadline[slot] = now_ms + GK_AS_RETX_BASE_MS;
+        }
+        else if(as->retx_tries[slot] > GK_AS_RETX_MAX)
+            given_up++;
+        else if((int32_t)(now_ms - as->retx_deadline[slot]) >= 0)
+        {
+            //  Only the START_PK is sent again, anything else means the slot buffer was reused
+            if(as->unicast_tsmt_buff[slot][0] == START_PK)
+            {
+                as_queue_slot(as,slot);
+                as->retx_sent++;
+            }
+            as->retx_deadline[slot] = now_ms + ((uint32_t)GK_AS_RETX_BASE_MS << as->retx_tries[slot]);
+            as->retx_tries[slot]++;
+        }
+    }
+    //  Evicting while some device may still confirm would leave it with the key before the eviction
+    if(given_up == 0 || given_up != as->pending_count)
+        return OK;
+    //  All at once with a single update, none of them is pending any more and a late PK_CONF is dropped by 
+    //  gk_as_conf_cb. retx_tries stays above GK_AS_RETX_MAX to mark them until they are removed
+    uint16_t members    = 0;
+    uint16_t left       = given_up;
+    for(uint16_t slot = 0; slot < as->num_auth_devs; slot++)
+    {
+        if(as->pending_conf[slot] == 0)
+            continue;
+        PHEMAP_TRACE_EV(PHEMAP_EV_AS_EVICTED,as->as_id,as->auth_devs[slot],GK_AS_RETX_MAX,--left);
+        as->pending_conf[slot]  = 0;
+        members                 += as->group_members[slot];
+    }
+#if AS_PC_DBG
+    printf("[AS-GK] Evicting %u given up devices \n",given_up);
+#endif
+    as->pending_count = 0;
+    //  Their going away completes the install or the join as in gk_as_conf_cb, the state is set before the 
+    //  evictions are journaled
+    phemap_ret_t to_ret = OK;
+    if(as->num_part > members)
+    {
+        as->as_state    = GK_AS_WAIT_FOR_UPDATES;
+        to_ret          = (as->pk_installed == 0) ? INSTALL_OK : UPDATE_OK;
+        as->pk_installed = 1;
+        as_reset_timer();
+    }
+    //  They may know the key if only their PK_CONF got lost, so the key is updated as for an END_SESS
+    as_remove_members(as,GK_AS_NO_SLOT);
+    return to_ret;
+}
+
+/**
+ * @brief Check and authenticate a START_SESS, nothing is changed if it fails but auth_links_lost, see as_auth_link.
+ *
+ * @return uint16_t Slot of the device, GK_AS_NO_SLOT if the mex is malformed, unknown or not authenticated
+ */
+static uint16_t as_join_slot(AuthServer* const as, const uint8_t* const rcvd_pkt, const uint8_t pkt_len)
 {
     //  Check pkt type and size 
     if(rcvd_pkt[0] != START_SESS  || pkt_len < 1 + sizeof(puf_resp_t) + sizeof(phemap_id_t))
@@ -362,18 +873,19 @@ phemap_ret_t  gk_as_add_cb(AuthServer* const as,const uint8_t * const rcvd_pkt,c
 #if AS_PC_DBG
         printf("[AS-GK] Confirmation failed, need reinitialization \n ");
 #endif
-        as->as_state = GK_AS_WAIT_FOR_START_REQ;
-        return REINIT;
+        PHEMAP_TRACE_EV(PHEMAP_EV_AS_MALFORMED,as->as_id,rcvd_pkt[0],pkt_len,0);
+        return GK_AS_NO_SLOT;
     }
 
     //  Check if the req is in the list of auth devs
     phemap_id_t req_id = U8_TO_PHEMAP_ID_BE(&rcvd_pkt[1]);
-    if(!as_check_requestor(req_id,as)){
+    uint16_t    slot   = gk_as_get_slot(as,req_id);
+    if(slot == GK_AS_NO_SLOT){
 #if AS_PC_DBG
         printf("[AS-GK] Req %u  not authenticated, could not add \n",req_id);
 #endif
-        as->as_state = GK_AS_WAIT_FOR_START_REQ;  
-        return REINIT;
+        PHEMAP_TRACE_EV(PHEMAP_EV_AS_UNKNOWN_DEV,as->as_id,START_SESS,req_id,0);
+        return GK_AS_NO_SLOT;
     }
 
 #if AS_PC_DBG
@@ -381,100 +893,371 @@ phemap_ret_t  gk_as_add_cb(AuthServer* const as,const uint8_t * const rcvd_pkt,c
         printf("[AS-GK] Start adding for  %u \n",req_id);
 #endif
     //  Authenticate the req
-    puf_resp_t link_req     =   as_get_next_link(req_id);
-    puf_resp_t rcvd_link    =   U8_TO_PUF_BE(&rcvd_pkt[1+sizeof(phemap_id_t)]);
-    if(link_req !=  rcvd_link)
+    if(as_auth_link(as,slot,START_SESS,U8_TO_PUF_BE(&rcvd_pkt[1+sizeof(phemap_id_t)])) == 0)
+        return GK_AS_NO_SLOT;
+    return slot;
+}
+
+/**
+ * @brief One rekey adding the devices of slots: a single UPDATE_KEY for the members and a START_PK for each device.
+ * @details The key part of each device is added to the key, so its three links are pulled before the key is 
+ *          known; the noise and the HMAC key wait in the slot buffer, which the START_PK then overwrites.
+ * 
+ * @param as Pointer to the AS struct 
+ * @param slots Slots of the joining devices, all different and not pending. A member joining again, e.g. after 
+ *              losing its key and ticket, leaves the group in the same rekey: its old key part is taken out.
+ * @param n Number of slots, at least 1
+ */
+static void as_add_slots(AuthServer* const as, const uint16_t* const slots, const uint16_t n)
+{
+    //  The key update always consists in the difference of session secrets plus the added secret keys.
+    private_key_t key_update = 0;
+    for(uint16_t i = 0; i < n; i++)
     {
-#if AS_PC_DBG
-        printf("[AS-GK] Authentication failed during Adding, needs resync\n");
-#endif
-        as->as_state    =   GK_AS_WAIT_FOR_START_REQ;
-        return REINIT;
+        uint16_t slot = slots[i];
+        //  A member joining again leaves first, as in as_remove_members, so gk_as_conf_cb counts it once
+        if(as->group_members[slot] == 1)
+        {
+            key_update ^= as->sr_key[slot];
+            as->group_members[slot] = 0;
+            as->num_part--;
+        }
+        //  Save the noise added to the dev key.
+        private_key_t sr_noise  =   as_next_link(as,slot);    
+        //  Save its key part.
+        as->sr_key[slot]        =   as_next_link(as,slot);  
+        //  Save the key used for HMAC
+        private_key_t hmac_key  =   as_next_link(as,slot);
+        PUF_TO_U8_BE(sr_noise,&as->unicast_tsmt_buff[slot][0]);
+        PUF_TO_U8_BE(hmac_key,&as->unicast_tsmt_buff[slot][sizeof(puf_resp_t)]);
+        key_update ^= as->sr_key[slot];
     }
-
-    uint8_t m_to_send[1+sizeof(phemap_id_t)+2*sizeof(puf_resp_t)+sizeof(private_key_t)];
-    //  Save the noise added to the dev key.
-    private_key_t sr_noise  =   as_get_next_link(req_id);    
-    //  Save its key part.
-    as->sr_key[req_id]      =   as_get_next_link(req_id);  
-    //  Save the key used for HMAC
-    private_key_t hmac_key  =   as_get_next_link(req_id);
+    uint8_t m_to_send[GK_AS_MEX_SIZE];
     //  Save the old session nonce              
     private_key_t old_session_nonce = as->session_nonce ;
     //  Generate the new nonce 
-    as->session_nonce       =   as_rng_gen();                     
-    //  The key update always consists in the difference of session secrets plus the added secret key.
-    private_key_t key_update = as->session_nonce ^ old_session_nonce^ as->sr_key[req_id];
+    as->session_nonce       =   as_next_random(as);                     
+    key_update ^= as->session_nonce ^ old_session_nonce;
     //  Save the old key locally.
     private_key_t old_key    = as->private_key;
     //  Update the PK locally
     as->private_key ^= key_update;
-    puf_resp_t mex_helper;
     // Generate the new secret token   
     private_key_t old_secret_token=as->secret_token;  
-    as->secret_token=as_rng_gen();
-    //  Send add updates
-    //  Initialize the mex common parts
-    uint16_t idx    =   0;
-    m_to_send[0]    =   UPDATE_KEY;
-    PHEMAP_ID_TO_U8_BE(as->as_id,&m_to_send[1]);
-    //  encryption of the new key with the old key
-    mex_helper =   old_key ^ as->private_key;
-    //  Append the enc pk 
-    PUF_TO_U8_BE(mex_helper,&m_to_send[1+sizeof(phemap_id_t)]); 
-    //  Encrypt the new session nonce
-    mex_helper =   old_key ^ as->secret_token;
-    //  Append the enc s.t.
-    PUF_TO_U8_BE(mex_helper,&m_to_send[1+sizeof(phemap_id_t)+sizeof(private_key_t)]); 
-    //  Generate the keyed sign
-    mex_helper =   keyed_sign(m_to_send,1+sizeof(phemap_id_t)+2*sizeof(puf_resp_t),old_secret_token);
-    //  Append the keyed sign.
-    PUF_TO_U8_BE(mex_helper,&m_to_send[1+sizeof(phemap_id_t)+2*sizeof(private_key_t)]);
+    as->secret_token=as_next_random(as);
+    //  The members decode the broadcast with the old key, no link is used
+    gk_as_epoch_advance(as,old_key ^ as->private_key,old_secret_token,0);
+    //  Send add updates: the new key and the new token encrypted with the old key, signed with the old token
+    as_forge_key_mex(as,UPDATE_KEY,old_key^as->private_key,old_key^as->secret_token,PHEMAP_UPDATE_GROUP,old_secret_token,m_to_send);
     //  BROADCAST *****
-    memcpy(as->broadcast_tsmt_buff,m_to_send,15);
+    memcpy(as->broadcast_tsmt_buff,m_to_send,GK_AS_MEX_SIZE);
     as->broadcast_is_present=1;
-    //  Ultimate the update by adding the node
-    mex_helper = (as->private_key ^as->sr_key[req_id] ^ sr_noise); 
-    //  Construct the pkt for the requestor
-    m_to_send[0] = START_PK;
-    PHEMAP_ID_TO_U8_BE(as->as_id,&m_to_send[1]);
-    //  Append the key
-    PUF_TO_U8_BE(mex_helper,&m_to_send[1+sizeof(phemap_id_t)]); 
-    //  Append the st with the SAME NOISE USED FOR THE KEY 
-    mex_helper = as->secret_token ^ sr_noise;
-    // Append the requestor id with ai+2
-    PUF_TO_U8_BE(mex_helper,&m_to_send[1+sizeof(phemap_id_t)+sizeof(puf_resp_t)]); 
-    // Append to the hash 
-    mex_helper = keyed_sign(m_to_send,1+sizeof(phemap_id_t)+2*sizeof(puf_resp_t),hmac_key); 
-    PUF_TO_U8_BE(mex_helper,&m_to_send[1+sizeof(phemap_id_t)+2*sizeof(puf_resp_t)]);
-    // Protocol send
-    //as->as_write_to_device(as->as_id,req_id,m_to_send,1+sizeof(phemap_id_t)+sizeof(private_key_t)+2*sizeof(puf_resp_t));
-    //  Instead of calling a snd function, write the data into a buffer and write
-    //  Copy the buffer into the slot for the specific receiver
-    //  Should always be 15 bytes
-    memcpy(&as->unicast_tsmt_buff[req_id],m_to_send,15); 
-    //  Assign the first receiver id that must receive the pkt
-    as->unicast_tsmt_queue[req_id]=1;
-    //  Increase the count of messages into the tsmt queue.
-    as->unicast_tsmt_count++;
-    //  Should increase the pending count in add cb..
-    as->pending_conf[req_id] = 1;
-    as->pending_count++;
-    as->as_state = GK_AS_WAIT_FOR_START_CONF; // Start confirmation for the adding member
+    for(uint16_t i = 0; i < n; i++)
+    {
+        uint16_t slot = slots[i];
+        private_key_t sr_noise  = U8_TO_PUF_BE(&as->unicast_tsmt_buff[slot][0]);
+        private_key_t hmac_key  = U8_TO_PUF_BE(&as->unicast_tsmt_buff[slot][sizeof(puf_resp_t)]);
+        //  Ultimate the update by adding the node, the key and the st with the SAME NOISE
+        as_forge_key_mex(as,START_PK,as->private_key^as->sr_key[slot]^sr_noise,as->secret_token^sr_noise,0,hmac_key,m_to_send);
+        // Protocol send
+        //as->as_write_to_device(as->as_id,req_id,m_to_send,1+sizeof(phemap_id_t)+sizeof(private_key_t)+2*sizeof(puf_resp_t));
+        as_queue_unicast(as,slot,m_to_send);
+        //  Should increase the pending count in add cb..
+        as->pending_conf[slot] = 1;
+        as->retx_tries[slot]   = 0;
+        as->pending_count++;
+    }
+    as->as_state = GK_AS_WAIT_FOR_START_CONF; // Start confirmation for the adding members
+    for(uint16_t i = 0; i < n; i++)
+        as_state_changed(as,GK_AS_OP_ADD,slots[i],0);
+}
+
+phemap_ret_t  gk_as_add_cb(AuthServer* const as,const uint8_t * const rcvd_pkt,const uint8_t pkt_len)
+{
+    uint16_t slot = as_join_slot(as,rcvd_pkt,pkt_len);
+    if(slot == GK_AS_NO_SLOT)
+    {
+        as->as_state = GK_AS_WAIT_FOR_START_REQ;
+        return REINIT;
+    }
+    as_add_slots(as,&slot,1);
     return OK;
 }
 
+phemap_ret_t gk_as_add_batch(AuthServer* const as, const uint8_t* const* const pkts, const uint8_t* const lens, const uint16_t n, uint16_t* const slots)
+{
+    assert(NULL != as);
+    assert(NULL != pkts);
+    assert(NULL != lens);
+    assert(NULL != slots);
+    if(as->as_state != GK_AS_WAIT_FOR_UPDATES)
+        return CONN_WAIT;
+    uint16_t added = 0;
+    for(uint16_t i = 0; i < n; i++)
+    {
+        //  A repeated join, or one of a device already pending, is left out before its link is checked
+        uint16_t slot = (lens[i] >= 1 + sizeof(phemap_id_t)) ? gk_as_get_slot(as,U8_TO_PHEMAP_ID_BE(&pkts[i][1])) : GK_AS_NO_SLOT;
+        if(slot != GK_AS_NO_SLOT)
+        {
+            uint16_t k = 0;
+            while(k < added && slots[k] != slot)
+                k++;
+            if(k < added || as->pending_conf[slot] == 1)
+                continue;
+        }
+        //  A bad join is left out instead of reinitializing the whole group
+        slot = as_join_slot(as,pkts[i],lens[i]);
+        if(slot != GK_AS_NO_SLOT)
+            slots[added++] = slot;
+    }
+    if(added == 0)
+        return AUTH_FAILED;
+    as_add_slots(as,slots,added);
+    return OK;
+}
+
+phemap_ret_t  gk_as_resync_cb(AuthServer* const as,const uint8_t * const rcvd_pkt,const uint8_t pkt_len)
+{
+    assert(NULL != as);
+    assert(NULL != rcvd_pkt);
+    //  A bad request is dropped, the rest of the group is not affected by it
+    if(rcvd_pkt[0] != RESYNC_REQ || pkt_len < PHEMAP_RESYNC_REQ_SIZE)
+    {
+        PHEMAP_TRACE_EV(PHEMAP_EV_AS_MALFORMED,as->as_id,rcvd_pkt[0],pkt_len,0);
+        return AUTH_FAILED;
+    }
+    phemap_id_t req_id  = U8_TO_PHEMAP_ID_BE(&rcvd_pkt[1]);
+    uint16_t    slot    = gk_as_get_slot(as,req_id);
+    if(slot == GK_AS_NO_SLOT || as->group_members[slot] == 0 || as->pending_conf[slot] == 1)
+    {
+#if AS_PC_DBG
+        printf("[AS-GK] Resync req from %u not a member \n",req_id);
+#endif
+        PHEMAP_TRACE_EV(PHEMAP_EV_AS_UNKNOWN_DEV,as->as_id,RESYNC_REQ,req_id,0);
+        return AUTH_FAILED;
+    }
+    //  Every epoch after the one of the device must still be in the history
+    uint32_t    from = U8_TO_PUF_BE(&rcvd_pkt[1+sizeof(phemap_id_t)]);
+    puf_resp_t  from_token;
+    if(as_epoch_token(as,from,&from_token) == 0)
+    {
+#if AS_PC_DBG
+        printf("[AS-GK] Resync of %u from epoch %u refused, epoch %u \n",req_id,from,as->epoch);
+#endif
+        PHEMAP_TRACE_EV(PHEMAP_EV_AS_RESYNC_REFUSED,as->as_id,req_id,from,as->epoch);
+        return CONN_WAIT;
+    }
+    //  The request is signed with the key part of the device and the secret token of its epoch
+    puf_resp_t calc_sign    = keyed_sign(rcvd_pkt,PHEMAP_RESYNC_REQ_SIGNED,as->sr_key[slot] ^ from_token);
+    puf_resp_t rcvd_sign    = U8_TO_PUF_BE(&rcvd_pkt[PHEMAP_RESYNC_REQ_SIGNED]);
+    if(calc_sign != rcvd_sign)
+    {
+        PHEMAP_TRACE_EV(PHEMAP_EV_AS_AUTH_FAILED,as->as_id,req_id,calc_sign,rcvd_sign);
+        return AUTH_FAILED;
+    }
+    //  Sum the updates missed by the device and the links they used. A device still before the epoch of the 
+    //  last RESYNC_DELTA never applied it, its links are counted from the epoch it asked from
+    private_key_t   key_delta   = 0;
+    uint32_t        skip        = 0;
+    uint32_t        since       = from;
+    if(from < as->resync_anchor[slot])
+    {
+        skip    = as->resync_links[slot];
+        since   = as->resync_anchor[slot];
+    }
+    for(uint32_t e = from + 1; e <= as->epoch; e++)
+        key_delta   ^=  as->history[e % GK_AS_EPOCH_HISTORY].key_delta;
+    for(uint32_t e = since + 1; e <= as->epoch; e++)
+        skip        +=  as->history[e % GK_AS_EPOCH_HISTORY].member_links;
+    if(skip > 0xFF - GK_AS_LINK_WINDOW - 3)
+    {
+        PHEMAP_TRACE_EV(PHEMAP_EV_AS_RESYNC_REFUSED,as->as_id,req_id,from,as->epoch);
+        return CONN_WAIT;
+    }
+    //  No link is used until the device proves where its chain is: a request without a link, or with one
+    //  that doesn't match, is told how many links to skip and nothing else, a replayed one too
+    uint8_t     used    = 0;
+    uint8_t     m_to_send[GK_AS_MEX_SIZE];
+    if(from != as->epoch && rcvd_pkt[PHEMAP_RESYNC_REQ_LINKED] == 1)
+        used = as_auth_link(as,slot,RESYNC_REQ,U8_TO_PUF_BE(&rcvd_pkt[PHEMAP_RESYNC_REQ_LINK]));
+    if(used == 0)
+    {
+        as_forge_key_mex(as,RESYNC_SKIP,0,0,(uint8_t)skip,as->sr_key[slot] ^ from_token ^ rcvd_sign,m_to_send);
+        as_queue_unicast(as,slot,m_to_send);
+#if AS_PC_DBG
+        printf("[AS-GK] Resync of %u from epoch %u to %u, skip %u first \n",req_id,from,as->epoch,skip);
+#endif
+        return CONN_WAIT;
+    }
+    //  Same encryption of a linked update, ARG tells the device which request it answers
+    puf_resp_t  noise   = as_next_link(as,slot);
+    as_forge_key_mex(as,RESYNC_DELTA,noise^key_delta,noise^as->secret_token,rcvd_pkt[PHEMAP_RESYNC_REQ_SIGNED - 1],
+                        as_next_link(as,slot),m_to_send);
+    as_queue_unicast(as,slot,m_to_send);
+    //  Where the chain of the device is if this RESYNC_DELTA gets lost, from the epoch it asked from
+    as->resync_anchor[slot] = as->epoch;
+    as->resync_links[slot]  = (uint8_t)(skip + used + 2);
+#if AS_PC_DBG
+    printf("[AS-GK] Resync of %u from epoch %u to %u, skip %u \n",req_id,from,as->epoch,skip);
+#endif
+    as_state_changed(as,GK_AS_OP_RESYNC,slot,0);
+    return OK;
+}
+
+phemap_ret_t  gk_as_resume_cb(AuthServer* const as,const uint8_t * const rcvd_pkt,const uint8_t pkt_len)
+{
+    assert(NULL != as);
+    assert(NULL != rcvd_pkt);
+    if(rcvd_pkt[0] != RESUME_SESS || pkt_len < PHEMAP_RESUME_SESS_SIZE)
+    {
+        PHEMAP_TRACE_EV(PHEMAP_EV_AS_MALFORMED,as->as_id,rcvd_pkt[0],pkt_len,0);
+        return AUTH_FAILED;
+    }
+    //  Only a device that never left can resume, a removed one no longer knows the key
+    phemap_id_t req_id  = U8_TO_PHEMAP_ID_BE(&rcvd_pkt[1]);
+    uint16_t    slot    = gk_as_get_slot(as,req_id);
+    if(slot == GK_AS_NO_SLOT || as->group_members[slot] == 0 || as->pending_conf[slot] == 1)
+    {
+#if AS_PC_DBG
+        printf("[AS-GK] Resume req from %u not a member \n",req_id);
+#endif
+        PHEMAP_TRACE_EV(PHEMAP_EV_AS_UNKNOWN_DEV,as->as_id,RESUME_SESS,req_id,0);
+        return AUTH_FAILED;
+    }
+    uint32_t    from    = U8_TO_PUF_BE(&rcvd_pkt[1+sizeof(phemap_id_t)]);
+    uint32_t    cursor  = U8_TO_PUF_BE(&rcvd_pkt[PHEMAP_RESUME_SESS_CURSOR]);
+    puf_resp_t  from_token;
+    if(as_epoch_token(as,from,&from_token) == 0)
+    {
+        PHEMAP_TRACE_EV(PHEMAP_EV_AS_TICKET_REFUSED,as->as_id,req_id,from,cursor);
+        return CONN_WAIT;
+    }
+    //  Same sign of a RESYNC_REQ, the cursor is covered too
+    puf_resp_t calc_sign    = keyed_sign(rcvd_pkt,PHEMAP_RESUME_SESS_SIGNED,as->sr_key[slot] ^ from_token);
+    puf_resp_t rcvd_sign    = U8_TO_PUF_BE(&rcvd_pkt[PHEMAP_RESUME_SESS_SIGNED]);
+    if(calc_sign != rcvd_sign)
+    {
+        PHEMAP_TRACE_EV(PHEMAP_EV_AS_AUTH_FAILED,as->as_id,req_id,calc_sign,rcvd_sign);
+        return AUTH_FAILED;
+    }
+    //  Links between the ticket and the AS, a device ahead is found by as_auth_link within the window
+    uint32_t at     = gk_as_slot_cursor(as,slot);
+    uint32_t skip   = (cursor > at) ? 0 : at - cursor;
+    if(skip > 0xFF - GK_AS_LINK_WINDOW - 3)
+    {
+        PHEMAP_TRACE_EV(PHEMAP_EV_AS_TICKET_REFUSED,as->as_id,req_id,from,cursor);
+        return CONN_WAIT;
+    }
+    //  As in a resync the ticket alone uses no link, a replayed RESUME_SESS only gets a RESYNC_SKIP
+    uint8_t     m_to_send[GK_AS_MEX_SIZE];
+    if(rcvd_pkt[PHEMAP_RESUME_SESS_LINKED] != 1 || as_auth_link(as,slot,RESUME_SESS,U8_TO_PUF_BE(&rcvd_pkt[PHEMAP_RESUME_SESS_LINK])) == 0)
+    {
+        as_forge_key_mex(as,RESYNC_SKIP,0,0,(uint8_t)skip,as->sr_key[slot] ^ from_token ^ rcvd_sign,m_to_send);
+        as_queue_unicast(as,slot,m_to_send);
+        return CONN_WAIT;
+    }
+    //  The whole key, not a delta, the device lost it
+    puf_resp_t  noise   = as_next_link(as,slot);
+    as_forge_key_mex(as,RESUME_PK,noise^as->private_key,noise^as->secret_token,rcvd_pkt[PHEMAP_RESUME_SESS_SIGNED - 1],
+                        as_next_link(as,slot),m_to_send);
+    as_queue_unicast(as,slot,m_to_send);
+    //  The device is back in step with the AS at the current epoch
+    as->resync_anchor[slot] = as->epoch;
+    as->resync_links[slot]  = 0;
+#if AS_PC_DBG
+    printf("[AS-GK] Resume of %u from epoch %u cursor %u, skip %u \n",req_id,from,cursor,skip);
+#endif
+    as_state_changed(as,GK_AS_OP_RESUME,slot,0);
+    return OK;
+}
+
+uint32_t gk_as_precompute(AuthServer* const as, const uint32_t budget)
+{
+    assert(NULL != as);
+    while(as->rng_ready < GK_AS_RNG_AHEAD)
+        as->rng_pool[as->rng_ready++] = as_rng_gen();
+    uint32_t pulled = 0;
+#if GK_AS_LINK_CACHE > 0
+    //  A cache that can't be rewound would be lost by a journal replay
+    if(as->chain_rewind == 0)
+        return 0;
+    if(as->precompute_next >= as->num_auth_devs)
+        as->precompute_next = 0;
+    //  Round robin, a small budget still reaches every slot over the calls
+    for(uint16_t visited = 0; visited < as->num_auth_devs && pulled < budget; visited++)
+    {
+        uint16_t slot = as->precompute_next;
+        as->precompute_next = (uint16_t)((slot + 1 < as->num_auth_devs) ? slot + 1 : 0);
+        puf_resp_t* const cache = &as->link_cache[(uint32_t)slot * GK_AS_LINK_CACHE];
+        while(as->link_cached[slot] < GK_AS_LINK_CACHE && pulled < budget)
+        {
+            cache[as->link_cached[slot]] = as_get_next_link(as->auth_devs[slot]);
+            as->link_cached[slot]++;
+            pulled++;
+        }
+    }
+#else
+    (void)budget;
+#endif
+    return pulled;
+}
+
+uint32_t gk_as_slot_cursor(const AuthServer* const as, const uint16_t slot)
+{
+    assert(NULL != as);
+#if GK_AS_LINK_CACHE > 0
+    uint32_t cursor = as_chain_cursor(as->auth_devs[slot]);
+    return (cursor > as->link_cached[slot]) ? cursor - as->link_cached[slot] : 0;
+#else
+    return as_chain_cursor(as->auth_devs[slot]);
+#endif
+}
+
+void gk_as_drop_precomputed(AuthServer* const as)
+{
+    assert(NULL != as);
+#if GK_AS_LINK_CACHE > 0
+    if(as->chain_rewind == 0)
+        return;
+    for(uint16_t slot = 0; slot < as->num_auth_devs; slot++)
+    {
+        if(as->link_cached[slot] == 0)
+            continue;
+        as_set_chain_cursor(as->auth_devs[slot],gk_as_slot_cursor(as,slot));
+        as->link_cached[slot] = 0;
+    }
+#else
+    (void)as;
+#endif
+}
+
+void gk_as_epoch_advance(AuthServer* const as, const private_key_t key_delta, const puf_resp_t prev_token, const uint8_t member_links)
+{
+    assert(NULL != as);
+    as->epoch++;
+    gk_as_epoch_t* const h  = &as->history[as->epoch % GK_AS_EPOCH_HISTORY];
+    h->key_delta            = key_delta;
+    h->prev_token           = prev_token;
+    h->member_links         = member_links;
+    if(as->history_count < GK_AS_EPOCH_HISTORY)
+        as->history_count++;
+}
+
 phemap_ret_t gk_as_automa(AuthServer*const pAS,uint8_t *pPkt, const uint8_t pktLen)
 {
     //  Check the ptrs
     assert(NULL != pAS);
     assert(NULL != pPkt);
+    PHEMAP_CAPTURE_ENTER(PHEMAP_CAP_AS,pAS->as_id,pPkt,pktLen);
     //  Initialize the return value 
     phemap_ret_t toRet = OK;
     //if(pAS->as_id == 0 )
     //printf("[%u] AS rcvd type %u , sender %lu \n ",pAS->as_id, pPkt[0],U8_TO_PHEMAP_ID_BE(&pPkt[1]));
+    //  A mex repeated by the link layer would fail its link check and reinit the AS
+    if(pktLen > 0 && as_dup_absorbed(pAS,pPkt,pktLen) == 1)
+        toRet = CONN_WAIT;
     //  If the pkt size is correct
-    if(pktLen > 0)
+    else if(pktLen > 0)
     {
         //  Switch based on the state
         switch(pAS->as_state){
@@ -485,12 +1268,18 @@ phemap_ret_t gk_as_automa(AuthServer*const pAS,uint8_t *pPkt, const uint8_t pktL
                 {    
                     toRet = gk_as_conf_cb(pAS,pPkt,pktLen);
                 }
+                //  A member lagging behind doesn't wait for the join to complete
+                else if(pPkt[0] == RESYNC_REQ)
+                    toRet = gk_as_resync_cb(pAS,pPkt,pktLen);
+                else if(pPkt[0] == RESUME_SESS)
+                    toRet = gk_as_resume_cb(pAS,pPkt,pktLen);
                 //  Any other mex means an incorrect state, supposing there is no buffering system in the simulation
                 else
                 {
 #if AS_PC_DBG
                 printf("[GK-AS ] NEEDS REINIT, unexpected message in Conf Resp %u \n ",pPkt[0]);
 #endif
+                    PHEMAP_TRACE_EV(PHEMAP_EV_AS_UNEXPECTED_MEX,pAS->as_id,pAS->as_state,pPkt[0],0);
                     // In this case we can check the state of the as and maybe reinit only the original caller
                     toRet           = REINIT; 
                     pAS->as_state   = GK_AS_WAIT_FOR_START_REQ;
@@ -504,9 +1293,19 @@ phemap_ret_t gk_as_automa(AuthServer*const pAS,uint8_t *pPkt, const uint8_t pktL
                 //  An authenticated device wants to join the group
                 else if(pPkt[0] == START_SESS)  
                     toRet = gk_as_add_cb(pAS,pPkt,pktLen);
+                //  A member missed some updates
+                else if(pPkt[0] == RESYNC_REQ)
+                    toRet = gk_as_resync_cb(pAS,pPkt,pktLen);
+                //  A member that lost its key comes back with its ticket
+                else if(pPkt[0] == RESUME_SESS)
+                    toRet = gk_as_resume_cb(pAS,pPkt,pktLen);
+                //  The late PK_CONF of a device evicted with the last pending ones
+                else if(pPkt[0] == PK_CONF)
+                    toRet = gk_as_conf_cb(pAS,pPkt,pktLen);
                 else
                 { 
                     //  An unexpected mex has been received
+                    PHEMAP_TRACE_EV(PHEMAP_EV_AS_UNEXPECTED_MEX,pAS->as_id,pAS->as_state,pPkt[0],0);
                     toRet           = REINIT;
                     pAS->as_state   = GK_AS_WAIT_FOR_START_REQ;
                 }
@@ -515,22 +1314,28 @@ phemap_ret_t gk_as_automa(AuthServer*const pAS,uint8_t *pPkt, const uint8_t pktL
                 //  The state is not coherent with a state where 
                 //  the AS can rcv pkts 
                 toRet = REINIT; 
-                printf("[GK-AS] AS CORRUPTED STATE %u \n ",pAS->as_state);
+                PHEMAP_TRACE_EV(PHEMAP_EV_AS_CORRUPTED_STATE,pAS->as_id,pAS->as_state,0,0);
                 pAS->as_state = GK_AS_WAIT_FOR_START_REQ;
             break;
         }
     }
     //  If there was a problem change the state 
     if(toRet == REINIT)
+    {
         pAS->as_state = GK_AS_WAIT_FOR_START_REQ;
+        as_state_changed(pAS,GK_AS_OP_REINIT,GK_AS_NO_SLOT,0);
+    }
 #if AS_PC_DBG
     printf("[AS-GK] Returning ... %u \n", toRet);
 #endif
+    PHEMAP_STATS_RECORD(pAS->stats,pPkt,pktLen,toRet,pAS->pending_count,pAS->num_part,
+                        pAS->unicast_tsmt_count + pAS->broadcast_is_present);
+    PHEMAP_CAPTURE_EXIT();
     return toRet;
 }
 
 // get the next chain link
-puf_resp_t as_get_next_link (const phemap_id_t req_id)
+puf_resp_t __attribute__((weak)) as_get_next_link (const phemap_id_t req_id)
 {
     (void)req_id;
     return 0xef0000ac;
@@ -561,20 +1366,48 @@ uint32_t __attribute__((weak)) as_rng_gen()
     return 0x00cafe00;
 }
 
-static private_key_t keyed_sign(const uint8_t *const buff, const uint32_t buff_size, const private_key_t sign_key )
+uint32_t __attribute__((weak)) as_chain_cursor(const phemap_id_t id)
 {
+    (void)id;
+    return 0;
+}
 
-    uint32_t new_buff_size = ceil(buff_size/sizeof(private_key_t));
-    uint32_t idx;
-    private_key_t helper,sign = 0;
-    
-    for(idx = 0;idx < new_buff_size - 1; idx++)
-    {
-        helper  =   U8_TO_PUF_BE(&buff[idx*sizeof(private_key_t)]);
-        sign    ^=  (helper^sign_key);
-    }
-    // append the last one
-    helper  =   (U8_TO_PUF_BE(&buff[(new_buff_size-1)*sizeof(private_key_t)])<<8*(new_buff_size-buff_size));
-    sign    ^=  (helper^sign_key);
-    return sign;
+void __attribute__((weak)) as_set_chain_cursor(const phemap_id_t id, const uint32_t cursor)
+{
+    (void)id;
+    (void)cursor;
+}
+
+uint32_t __attribute__((weak)) as_peek_links(const phemap_id_t id, puf_resp_t* const links, const uint32_t n)
+{
+    (void)id;
+    (void)links;
+    (void)n;
+    return 0;
+}
+
+void __attribute__((weak)) as_skip_links(const phemap_id_t id, const uint32_t n)
+{
+    for(uint32_t i = 0; i < n; i++)
+        as_get_next_link(id);
+}
+
+void __attribute__((weak)) as_journal_op(AuthServer* const as, const uint8_t op, const uint16_t slot, const uint8_t member_links)
+{
+    (void)op;
+    (void)slot;
+    (void)member_links;
+    as->journal_seq++;
+}
+
+void __attribute__((weak)) as_rekey_note(AuthServer* const as, const uint8_t op, const uint16_t slot)
+{
+    (void)as;
+    (void)op;
+    (void)slot;
+}
+
+static private_key_t keyed_sign(const uint8_t *const buff, const uint32_t buff_size, const private_key_t sign_key )
+{
+    return phemap_keyed_sign(buff,buff_size,sign_key);
 }
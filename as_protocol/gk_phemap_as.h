@@ -28,9 +28,72 @@
 #define GK_PHEMAP_AS_H
 
 #include "as_common.h"
+#include "../common/phemap_stats.h"
+#include "../common/phemap_trace.h"
+#include "../common/phemap_capture.h"
 #define AS_PC_DBG       0
 #define MEX_ENQUEUE     1
-#define MAX_NUM_AUTH    3000
+#ifndef MAX_NUM_AUTH
+#define MAX_NUM_AUTH    3000    /*!< Device capacity of the default sized AS */
+#endif
+#ifndef GK_AS_EPOCH_HISTORY
+#define GK_AS_EPOCH_HISTORY 8   /*!< Epochs a lagging device can be behind and still catch up with a RESYNC_REQ */
+#endif
+#ifndef GK_AS_LINK_WINDOW
+#define GK_AS_LINK_WINDOW   8   /*!< Links the AS looks ahead when a device link doesn't match, 0 disables it */
+#endif
+#if GK_AS_LINK_WINDOW > 32
+#error "GK_AS_LINK_WINDOW can't exceed 32"
+#endif
+#ifndef GK_AS_DUP_DEPTH
+#define GK_AS_DUP_DEPTH     4   /*!< Mexs of each device remembered to recognize their duplicates, 0 removes the filter */
+#endif
+#if GK_AS_DUP_DEPTH > 255
+#error "GK_AS_DUP_DEPTH can't exceed 255"
+#endif
+/*
+ *  A duplicate is recognized by its link, the filter needs a chain whose links don't repeat: with the 
+ *  constant link of the weak as_get_next_link every mex would be dropped as a duplicate of the previous one.
+ *  Set it to GK_AS_DUP_ABSORB when the chain hooks are provided.
+ */
+#ifndef GK_AS_DUP_DEFAULT
+#define GK_AS_DUP_DEFAULT   GK_AS_DUP_OFF   /*!< dup_policy after gk_as_bind*/
+#endif
+#ifndef GK_AS_RETX_BASE_MS
+#define GK_AS_RETX_BASE_MS  250 /*!< First wait for the confirmation of a pending device, doubled at each retransmission */
+#endif
+#ifndef GK_AS_RETX_MAX
+#define GK_AS_RETX_MAX      4   /*!< Retransmissions to a pending device before it is evicted */
+#endif
+#ifndef GK_AS_LINK_CACHE
+#define GK_AS_LINK_CACHE    4   /*!< Links of each device pulled ahead by gk_as_precompute, 0 disables the cache */
+#endif
+#ifndef GK_AS_CHAIN_REWIND
+#define GK_AS_CHAIN_REWIND  0   /*!< chain_rewind after gk_as_bind, 1 only if as_chain_cursor and as_set_chain_cursor are linked */
+#endif
+#if GK_AS_LINK_CACHE > 255
+#error "GK_AS_LINK_CACHE can't exceed 255"
+#endif
+#define GK_AS_RNG_AHEAD     2   /*!< Random values of a membership change, its nonce and its secret token */
+#define GK_AS_MEX_SIZE  PHEMAP_KEY_MEX_SIZE
+#define GK_AS_NO_SLOT   0xFFFF  /*!< Returned when a phemap id has no slot in the AS */
+
+/**
+ * @brief Bytes of the duplicate filter of a device: links and types of its last mexs and the ring head.
+ */
+#define GK_AS_DUP_SLOT_SIZE     ((GK_AS_DUP_DEPTH > 0) ? GK_AS_DUP_DEPTH * (sizeof(puf_resp_t) + 1) + 1 : 0)
+/**
+ * @brief Bytes of the link cache of a device: the links and their count.
+ */
+#define GK_AS_CACHE_SLOT_SIZE   ((GK_AS_LINK_CACHE > 0) ? GK_AS_LINK_CACHE * sizeof(puf_resp_t) + 1 : 0)
+/**
+ * @brief Bytes of storage needed by an AS managing up to n devices.
+ * @details Per device: key part, resync anchor, retransmission deadline, id, queue entry, last mex, pending and 
+ *          member flags, resync links, retransmission count, duplicate filter, link cache. The storage must be 
+ *          aligned as a private_key_t, its size is rounded to keep that alignment.
+ */
+#define GK_AS_STORAGE_SIZE(n)   (((uint32_t)(n) * (sizeof(private_key_t) + 2*sizeof(uint32_t) + 2*sizeof(phemap_id_t) + GK_AS_MEX_SIZE + 4 \
+                                                   + GK_AS_DUP_SLOT_SIZE + GK_AS_CACHE_SLOT_SIZE) + 3) & ~3u)
 /**
  * @typedef State of the GK AS
  * 
@@ -41,34 +104,126 @@ typedef enum{
     GK_AS_WAIT_FOR_UPDATES,     /*!<In this state the as waits for end session and updates */
 }Gk_AS_State;
 
+/**
+ * @typedef What the AS does with a mex already authenticated, e.g. repeated by the link layer
+ */
+typedef enum{
+    GK_AS_DUP_OFF,          /*!< No filter, the duplicate goes to the callback: a conf is dropped, anything else fails its link check*/
+    GK_AS_DUP_ABSORB,       /*!< The duplicate is counted and dropped, the AS returns CONN_WAIT*/
+    GK_AS_DUP_REEMIT,       /*!< As GK_AS_DUP_ABSORB, a repeated START_SESS also queues again its START_PK*/
+}gk_as_dup_policy_t;
+
+/**
+ * @typedef What changed from the previous epoch to this one, kept to bring lagging devices up to date
+ */
+typedef struct{
+    private_key_t   key_delta;      /*!< Xor of the key of the previous epoch and of the key of this one*/
+    puf_resp_t      prev_token;     /*!< Secret token of the previous epoch, signs the RESYNC_REQ sent from there*/
+    uint8_t         member_links;   /*!< Links of the chain used for each member by the update*/
+}gk_as_epoch_t;
+
 /**
  * @brief Handler function for the authentication server
+ * @details Each authenticated device owns a slot, i.e. its index in auth_devs, and every per device
+ *          array is indexed by slot. The arrays live in a storage bound with gk_as_bind, so the 
+ *          AS costs only what its device capacity requires.
  */
 typedef struct{
     phemap_id_t     as_id;                          /*!< Id of the Authentication Server*/
-    phemap_id_t     auth_devs[MAX_NUM_AUTH];        /*!< List of synched devices according to phemap protocol*/
+    uint16_t        max_auth_devs;                  /*!< Number of device slots of the bound storage*/
+    phemap_id_t*    auth_devs;                      /*!< List of synched devices according to phemap protocol, the index is the slot*/
     uint16_t        num_auth_devs;                  /*!< Number of actually authenticated devices*/
     uint16_t        num_part;                       /*!< Number of nodes actually in the group*/  
-    uint8_t         pending_conf[MAX_NUM_AUTH];     /*!< Bitmap of pending confirmation, if pending_conf[i]==1 means that node with id i hasn't send its own id.*/
+    uint8_t*        pending_conf;                   /*!< Bitmap of pending confirmation, if pending_conf[slot]==1 the node hasn't send its confirmation yet.*/
     uint16_t        pending_count;                  /*!< Count of pending devices i.e. if its value is 4 it means 4 nodes hasn't send a confirmation yet*/
-    private_key_t   sr_key[MAX_NUM_AUTH];           /*!< Part of keys of each node kept for updates */
+    private_key_t*  sr_key;                         /*!< Part of keys of each node kept for updates */
     Gk_AS_State     as_state;                       /*!< Current state of the AS */
     private_key_t   session_nonce;                  /*!< In order to provide backward and forward security each pk has a nonce added*/
     uint8_t         pk_installed;                       /*!< Flag used to check if the private key is installed.*/              
     private_key_t   private_key;                    /*!< Actual private key.*/
     puf_resp_t      secret_token;                   /*!< Secret token of the intra group. */
-    phemap_id_t     group_members[MAX_NUM_AUTH];    /*!< Bitmap for nodes that are part of the intra group key.*/
-    uint8_t         unicast_tsmt_buff[MAX_NUM_AUTH][15];
-    phemap_id_t     unicast_tsmt_queue[MAX_NUM_AUTH];
-    uint32_t        unicast_tsmt_count;
-    uint8_t         broadcast_tsmt_buff[MAX_NUM_AUTH];
+    uint8_t*        group_members;                  /*!< Bitmap for nodes that are part of the intra group key.*/
+    uint32_t        epoch;                          /*!< Epoch of the intra key, increased by each install and update*/
+    gk_as_epoch_t   history[GK_AS_EPOCH_HISTORY];   /*!< Last epochs, the one of epoch e at e % GK_AS_EPOCH_HISTORY*/
+    uint8_t         history_count;                  /*!< Epochs in history, the install clears it*/
+    uint32_t*       resync_anchor;                  /*!< Epoch of the AS when the last RESYNC_DELTA of each slot was sent*/
+    uint8_t*        resync_links;                   /*!< Links from the position of the device at its epoch to after that RESYNC_DELTA*/
+    puf_resp_t*     dup_links;                      /*!< Links of the last GK_AS_DUP_DEPTH mexs authenticated for each slot, at slot*GK_AS_DUP_DEPTH*/
+    uint8_t*        dup_types;                      /*!< Type + 1 of each of those mexs, 0 if the entry is empty*/
+    uint8_t*        dup_head;                       /*!< Entry of each slot overwritten next*/
+    uint8_t         dup_policy;                     /*!< gk_as_dup_policy_t, GK_AS_DUP_DEFAULT after gk_as_bind*/
+    uint32_t        dup_absorbed;                   /*!< Duplicates dropped by the filter*/
+    uint32_t        auth_links_lost;                /*!< Links used by failed link checks, possible only without link cache and as_peek_links*/
+    uint32_t*       retx_deadline;                  /*!< Time in ms when the mex of each pending slot is sent again*/
+    uint8_t*        retx_tries;                     /*!< 0 if the slot is not waited for yet, then 1 + retransmissions so far*/
+    uint32_t        retx_sent;                      /*!< Mexs sent again to pending devices*/
+    uint32_t        retx_evicted;                   /*!< Pending devices evicted after GK_AS_RETX_MAX retransmissions*/
+    puf_resp_t*     link_cache;                     /*!< Links pulled ahead from the chain of each slot in chain order, at slot*GK_AS_LINK_CACHE*/
+    uint8_t*        link_cached;                    /*!< Links in the cache of each slot*/
+    uint16_t        precompute_next;                /*!< Slot gk_as_precompute tops up first*/
+    uint8_t         chain_rewind;                   /*!< 1 if the chain cursors can be read and set, links are pulled ahead only then*/
+    uint32_t        rng_pool[GK_AS_RNG_AHEAD];      /*!< Random values generated ahead for the next membership change*/
+    uint8_t         rng_ready;                      /*!< Values in rng_pool*/
+    uint8_t         (*unicast_tsmt_buff)[GK_AS_MEX_SIZE];   /*!< Last mex built for each slot*/
+    uint16_t*       unicast_tsmt_queue;             /*!< Slots having a mex to send, in emission order*/
+    uint32_t        unicast_tsmt_count;             /*!< Number of entries in the unicast queue, reset by the sender once drained*/
+    uint8_t         broadcast_tsmt_buff[GK_AS_MEX_SIZE];
     uint8_t         broadcast_is_present;
+    struct gk_journal_s* journal;                   /*!< Write-ahead journal of the AS, NULL if not journaled, see gk_as_journal.h*/
+    uint32_t        journal_seq;                    /*!< Sequence of the last operation notified with as_journal_op*/
+    struct gk_as_rekeys_s* rekeys;                  /*!< Completion of the rekeys, NULL if not tracked, see gk_as_rekey.h*/
+    phemap_stats_slot_t* stats;                     /*!< Counters published by the AS, NULL if not published, see phemap_stats.h*/
     /*void (*as_write_to_device)( const phemap_id_t,  
                                 const phemap_id_t,
                                 const uint8_t* const,
                                 const uint32_t);*/
 }AuthServer;
 
+/**
+ * @brief Reset the AS and bind the storage for its per device arrays.
+ * 
+ * @param as Pointer to the AS struct 
+ * @param storage Zeroed or not, at least GK_AS_STORAGE_SIZE(max_auth_devs) bytes aligned as a private_key_t
+ * @param max_auth_devs Device capacity
+ */
+void gk_as_bind(AuthServer* const as, void* const storage, const uint16_t max_auth_devs);
+/**
+ * @brief Add a device to the list of the authenticated ones, giving it the next free slot.
+ * 
+ * @param as Pointer to the AS struct 
+ * @param id Phemap id of the device
+ * @return phemap_ret_t OK, ENROLL_FAILED if the AS is full or the device is already present
+ */
+phemap_ret_t gk_as_register_dev(AuthServer* const as, const phemap_id_t id);
+/**
+ * @brief Get the slot of an authenticated device.
+ * 
+ * @param as Pointer to the AS struct 
+ * @param id Phemap id of the device
+ * @return uint16_t Slot of the device, GK_AS_NO_SLOT if the device is not authenticated
+ */
+uint16_t gk_as_get_slot(const AuthServer* const as, const phemap_id_t id);
+
+#ifdef __cplusplus
+/**
+ * @brief AS whose per device storage is sized at compile time. 
+ * @details get() exposes the plain AuthServer used by the gk_as_* functions.
+ * @tparam NDev Device capacity
+ */
+template<uint16_t NDev>
+class GkAuthServer{
+public:
+    GkAuthServer()                                  { gk_as_bind(&as,storage,NDev); }
+    GkAuthServer(const GkAuthServer&)               = delete;
+    GkAuthServer& operator=(const GkAuthServer&)    = delete;
+    AuthServer*         get()                       { return &as; }
+    const AuthServer*   get() const                 { return &as; }
+private:
+    AuthServer  as;
+    alignas(private_key_t) uint8_t storage[GK_AS_STORAGE_SIZE(NDev)];
+};
+#endif
+
 /**
  * @brief Callback called when a START_SESS_ mex is received from a device
  * @details In order to install a PK a device sends a START_SESS mex and the AS , waiting for a Start Req, sends 
@@ -102,7 +257,8 @@ phemap_ret_t gk_as_start_session( AuthServer* const as);
  * @details When the AS is performing an operation it keeps track of the pending ID waiting for their confirmation
  *          messages in order to consider the operation concluded. 
  *          There are two types of confirmation: PK_CONF which is the confirmation that the pk was installed and the 
- *          UPDATE_CONF which is the confirmation that the PK was installed
+ *          UPDATE_CONF which is the confirmation that the PK was installed. A confirmation of a device that is not
+ *          pending, e.g. sent again for a retransmitted START_PK, is dropped with CONN_WAIT.
  * @param as Pointer to the AS DS  
  * @param rcvd_conf pkt received
  * @param pkt_len   Size of the received packet
@@ -117,13 +273,139 @@ phemap_ret_t gk_as_conf_cb( AuthServer* const as,uint8_t * rcvd_conf,const uint8
  * @return phemap_ret_t  Operation status 
  */
 phemap_ret_t  gk_as_add_cb(AuthServer* const as,const uint8_t * const rcvd_pkt,const uint8_t pkt_len);
+/**
+ * @brief Add several devices with a single rekey, e.g. the joins collected by gk_as_admit.
+ * @details Each START_SESS is checked as by gk_as_add_cb, but a malformed, unknown, unauthenticated or repeated
+ *          one, or one of a device already pending, is skipped instead of reinitializing the AS; a failed link
+ *          check doesn't move the chain of the device, see auth_links_lost. The members get one UPDATE_KEY and
+ *          each device added its START_PK, the AS then waits for all the PK_CONF. A device still member joins
+ *          again: its old key part leaves the key in the same rekey.
+ * @param as Pointer to the AS DS
+ * @param pkts START_SESS mexs
+ * @param lens Size of each mex
+ * @param n Number of mexs
+ * @param slots Array of n entries, filled with the slots of the devices added
+ * @return phemap_ret_t OK if at least a device was added, AUTH_FAILED if none, CONN_WAIT if the AS isn't in 
+ *         GK_AS_WAIT_FOR_UPDATES. The group changes only when OK is returned.
+ */
+phemap_ret_t gk_as_add_batch(AuthServer* const as, const uint8_t* const* const pkts, const uint8_t* const lens, const uint16_t n, uint16_t* const slots);
 phemap_ret_t  gk_as_remove_cb(AuthServer* const as,uint8_t * rcvd_pkt,const uint8_t pkt_len);
+/**
+ * @brief CB called when a member that missed some updates sends a RESYNC_REQ 
+ * @details Two steps, neither uses a link of the device until it proves where its chain is. A request without
+ *          a link, or whose link doesn't match, is answered with a RESYNC_SKIP telling how many links the missed
+ *          updates used. The device skips them and sends its next link, checked with as_auth_link: the
+ *          updates from its epoch to the current one are then xored from the history and sent in a single
+ *          RESYNC_DELTA, encrypted and signed with the next two links. A replayed request only gets another
+ *          RESYNC_SKIP. The rest of the group is not involved.
+ * @param as Pointer to the AS DS
+ * @param rcvd_pkt pkt received
+ * @param pkt_len   Size of the received packet
+ * @return phemap_ret_t OK if a RESYNC_DELTA was sent, AUTH_FAILED if the request is not valid, CONN_WAIT if a 
+ *         RESYNC_SKIP was sent or the epoch is no longer in the history and the device has to start a new session
+ */
+phemap_ret_t  gk_as_resync_cb(AuthServer* const as,const uint8_t * const rcvd_pkt,const uint8_t pkt_len);
+/**
+ * @brief CB called when a member that lost its key sends a RESUME_SESS built from its ticket
+ * @details The ticket binds the request to an epoch still in the history and to the position of the device in
+ *          its chain. The two steps of gk_as_resync_cb: a request without a link, or whose link doesn't match,
+ *          gets a RESYNC_SKIP with the links the device is behind gk_as_slot_cursor. Once the next link of the
+ *          device is found the current key is sent in a RESUME_PK encrypted and signed with the two links after
+ *          it, the group key is not rotated since the device never left. A device removed in the meantime has 
+ *          to start a new session.
+ * @param as Pointer to the AS DS
+ * @param rcvd_pkt pkt received
+ * @param pkt_len   Size of the received packet
+ * @return phemap_ret_t OK if a RESUME_PK was sent, AUTH_FAILED if the request is not valid, CONN_WAIT if a 
+ *         RESYNC_SKIP was sent or the ticket is too old
+ */
+phemap_ret_t  gk_as_resume_cb(AuthServer* const as,const uint8_t * const rcvd_pkt,const uint8_t pkt_len);
+/**
+ * @brief Retransmission engine of the pending devices, to be called periodically with a monotonic time in ms
+ * @details A pending device is waited for GK_AS_RETX_BASE_MS from the first poll, then its START_PK, still in its slot
+ *          buffer, is queued again with an exponential backoff. After GK_AS_RETX_MAX retransmissions it is given up;
+ *          once every pending device is given up they are all evicted in that call with a single update, as if 
+ *          they had sent END_SESS together. Pair it with GK_AS_DUP_ABSORB, a 
+ *          retransmission crossing a late PK_CONF makes the device repeat it.
+ * @param as Pointer to the AS DS
+ * @param now_ms Current time
+ * @return phemap_ret_t OK, INSTALL_OK or UPDATE_OK when an eviction completes the pending install or join, 
+ *         as gk_as_conf_cb would do
+ */
+phemap_ret_t gk_as_retx_poll(AuthServer* const as, const uint32_t now_ms);
+/**
+ * @brief Idle time precomputation of the material of the next membership change
+ * @details Generates the nonce and the secret token of the next join or leave and tops up the link cache of 
+ *          the devices, round robin from where the previous call stopped. A join or a leave then takes its 
+ *          links and random values from there instead of waiting for the chain and the rng. Call it from the
+ *          thread owning the AS when it has no pkt to process. Links are pulled only if chain_rewind is 1,
+ *          without the cursor hooks gk_as_drop_precomputed couldn't give them back to the chain.
+ * @param as Pointer to the AS DS
+ * @param budget Max links pulled from the chains by this call
+ * @return uint32_t Links pulled, 0 once every cache is full
+ */
+uint32_t gk_as_precompute(AuthServer* const as, const uint32_t budget);
+/**
+ * @brief Position of the AS in the chain of a slot, the links in its cache are not used yet.
+ * @details Snapshots, journal records and RESUME_SESS use it instead of as_chain_cursor.
+ * @param as Pointer to the AS DS
+ * @param slot Slot of the device
+ * @return uint32_t as_chain_cursor of the device minus the cached links, 0 if the chain is behind the cache
+ */
+uint32_t gk_as_slot_cursor(const AuthServer* const as, const uint16_t slot);
+/**
+ * @brief Empty the link caches moving each chain cursor back with as_set_chain_cursor.
+ * @details Without chain_rewind the caches are kept, their links are still the next ones of each chain.
+ * @param as Pointer to the AS DS
+ */
+void gk_as_drop_precomputed(AuthServer* const as);
 /**
  * @brief Get the next link of the chain for the specific phemap id 
+ * @details Weak, the stock one returns a constant link, the platform replaces it with the chain of the device.
  * @param id id for which we want to retrieve the key 
  * @return puf_resp_t Operation status
  */
 puf_resp_t as_get_next_link(const phemap_id_t  id);
+/**
+ * @typedef State changing operations notified with as_journal_op
+ */
+typedef enum{
+    GK_AS_OP_REGISTER,  /*!< A device got a slot*/
+    GK_AS_OP_START,     /*!< The intra key has been generated for every device*/
+    GK_AS_OP_ADD,       /*!< A device joined, it still has to confirm*/
+    GK_AS_OP_REMOVE,    /*!< A device left, each other member used member_links links*/
+    GK_AS_OP_CONF,      /*!< A device confirmed its key*/
+    GK_AS_OP_REINIT,    /*!< The AS went back to GK_AS_WAIT_FOR_START_REQ*/
+    GK_AS_OP_RESYNC,    /*!< A lagging device got a RESYNC_DELTA*/
+    GK_AS_OP_RESUME,    /*!< A member resumed its session with a ticket*/
+    GK_AS_OP_LINK,      /*!< A failed link check used a link of the device, see auth_links_lost*/
+}gk_as_op_t;
+/**
+ * @brief Called after each state change of the AS, before its mexs are sent.
+ * @details The default does nothing, gk_as_journal.cc turns it into a write-ahead journal record.
+ * @param as Pointer to the AS struct 
+ * @param op gk_as_op_t
+ * @param slot Slot of the device, GK_AS_NO_SLOT if none
+ * @param member_links Links of the chain used for each other member of the group
+ */
+void as_journal_op(AuthServer* const as, const uint8_t op, const uint16_t slot, const uint8_t member_links);
+/**
+ * @brief Called after as_journal_op with the same operation.
+ * @details The default does nothing, gk_as_rekey.cc turns it into the completion of the rekey handles.
+ * @param as Pointer to the AS struct 
+ * @param op gk_as_op_t
+ * @param slot Slot of the device, GK_AS_NO_SLOT if none
+ */
+void as_rekey_note(AuthServer* const as, const uint8_t op, const uint16_t slot);
+/**
+ * @brief Open the next epoch of the intra key and keep in the history how it differs from the previous one.
+ * @details Called by the install and by the updates, and by gk_as_journal_replay to rebuild the history.
+ * @param as Pointer to the AS struct 
+ * @param key_delta Xor of the old and of the new key
+ * @param prev_token Secret token of the previous epoch
+ * @param member_links Links of the chain the update used for each member
+ */
+void gk_as_epoch_advance(AuthServer* const as, const private_key_t key_delta, const puf_resp_t prev_token, const uint8_t member_links);
 /**
  * @brief Returns true if there is still at least a device that hasn't send yet a conf mex 
  * @details This function is important because it can be used to check if the group is in the middle
@@ -142,4 +424,52 @@ uint8_t gk_as_is_still_pending(const AuthServer*as);
  * @return phemap_ret_t  Operation status 
  */
 phemap_ret_t gk_as_automa(AuthServer*const pAS,uint8_t *pPkt, const uint8_t pktLen);
+
+/*  Snapshots, implemented in gk_as_snapshot.cc with common/phemap_snapshot.cc */
+#define GK_AS_SNAP_EPOCH_SIZE   (sizeof(uint32_t) + 1 + GK_AS_EPOCH_HISTORY*(2*sizeof(private_key_t) + 1))
+#define GK_AS_SNAP_FIXED_SIZE   (4*sizeof(uint16_t) + 2 + 3*sizeof(private_key_t) + sizeof(uint32_t) + GK_AS_SNAP_EPOCH_SIZE)
+#define GK_AS_SNAP_SLOT_SIZE    (sizeof(phemap_id_t) + sizeof(private_key_t) + 1 + 2*sizeof(uint32_t) + 1)
+/**
+ * @brief Bytes of the snapshot of the AS, header included.
+ */
+uint32_t gk_as_snapshot_size(const AuthServer* const as);
+/**
+ * @brief Write the snapshot of the keys, of the group and of the chain cursors of each slot.
+ * @details The mexs not yet sent are not part of the snapshot.
+ * @param as Pointer to the AS struct 
+ * @param buff Destination buffer
+ * @param cap Bytes of buff
+ * @return uint32_t Bytes written, 0 if buff is too small
+ */
+uint32_t gk_as_snapshot(const AuthServer* const as, uint8_t* const buff, const uint32_t cap);
+/**
+ * @brief Restore a snapshot into an AS already bound, the chain cursors are set with as_set_chain_cursor.
+ * @details The journal, rekeys, stats, dup_policy and the counters of the filter and of the retransmissions
+ *          are not in the snapshot and keep their values.
+ * @param as Pointer to the AS struct 
+ * @param snap The snapshot
+ * @param size Bytes of snap
+ * @return phemap_ret_t OK, REINIT if the snapshot is invalid or the AS too small, in that case the AS is untouched
+ */
+phemap_ret_t gk_as_restore(AuthServer* const as, const uint8_t* const snap, const uint32_t size);
+/**
+ * @brief Save the snapshot of the AS replacing path atomically.
+ * @return uint8_t 1 on success
+ */
+uint8_t gk_as_save(const AuthServer* const as, const char* const path);
+/**
+ * @brief Restore the AS from the snapshot saved at path.
+ * @return phemap_ret_t OK, REINIT if the file is missing or invalid
+ */
+phemap_ret_t gk_as_load(AuthServer* const as, const char* const path);
+/**
+ * @brief Payload of the AS snapshot, used also by the snapshot of the LV.
+ * @return uint32_t Bytes written, GK_AS_SNAP_FIXED_SIZE + num_auth_devs*GK_AS_SNAP_SLOT_SIZE
+ */
+uint32_t gk_as_snapshot_payload(const AuthServer* const as, uint8_t* const out);
+/**
+ * @brief Restore the payload written by gk_as_snapshot_payload.
+ * @return uint32_t Bytes consumed, 0 if the payload is invalid or the AS too small
+ */
+uint32_t gk_as_restore_payload(AuthServer* const as, const uint8_t* const in, const uint32_t size);
 #endif
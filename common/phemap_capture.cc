@@ -0,0 +1,132 @@
+/*
+    Group-Key-Phemap - Copyright (C) 2023-2024 Antonio Emmanuele
+
+    This file is part of Group-Key-Phemap.
+
+    Group-Key-Phemap is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Group-Key-Phemap is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "phemap_capture.h"
+#include <mutex>
+#include <string.h>
+#include <time.h>
+
+static std::mutex   capture_lock;       //  Serializes the records of the threads running automas
+static FILE*        capture_file    = NULL;
+static uint64_t     capture_last_us = 0;
+static uint64_t     capture_records = 0;
+
+static uint64_t capture_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000u + (uint64_t)ts.tv_nsec/1000u;
+}
+
+static void capture_pkt(const uint8_t point, const phemap_id_t self, const uint8_t* const pkt, const uint32_t len)
+{
+    uint8_t rec[PHEMAP_TRACE_REC_SIZE];
+    uint8_t rec_len = (len > PHEMAP_TRACE_MAX_PKT) ? PHEMAP_TRACE_MAX_PKT : (uint8_t)len;
+    std::lock_guard<std::mutex> lock(capture_lock);
+    if(capture_file == NULL)
+        return;
+    //  The time is taken under the lock so the deltas never go backwards
+    uint64_t now    = capture_now_us();
+    uint64_t delta  = (capture_records == 0) ? 0 : now - capture_last_us;
+    uint32_t dt     = (delta > 0xFFFFFFFFu) ? 0xFFFFFFFFu : (uint32_t)delta;
+    capture_last_us = now;
+    PUF_TO_U8_BE(dt,rec);
+    rec[4] = point;
+    PHEMAP_ID_TO_U8_BE(self,&rec[5]);
+    rec[7] = rec_len;
+    fwrite(rec,1,sizeof(rec),capture_file);
+    fwrite(pkt,1,rec_len,capture_file);
+    capture_records++;
+}
+
+uint8_t phemap_capture_open(const char* const path)
+{
+    std::lock_guard<std::mutex> lock(capture_lock);
+    if(capture_file != NULL)
+        return 0;
+    capture_file = fopen(path,"wb");
+    if(capture_file == NULL)
+        return 0;
+    uint8_t hdr[PHEMAP_TRACE_HDR_SIZE];
+    uint32_t magic = PHEMAP_TRACE_MAGIC;
+    PUF_TO_U8_BE(magic,hdr);
+    PHEMAP_ID_TO_U8_BE(PHEMAP_TRACE_VERSION,&hdr[4]);
+    fwrite(hdr,1,sizeof(hdr),capture_file);
+    capture_records = 0;
+#if PHEMAP_CAPTURE
+    phemap_capture_hook().store(capture_pkt,std::memory_order_release);
+#endif
+    return 1;
+}
+
+void phemap_capture_close(void)
+{
+#if PHEMAP_CAPTURE
+    //  A thread that loaded the hook before finds the file closed under the lock
+    phemap_capture_hook().store(NULL,std::memory_order_release);
+#endif
+    std::lock_guard<std::mutex> lock(capture_lock);
+    if(capture_file != NULL)
+        fclose(capture_file);
+    capture_file = NULL;
+}
+
+uint64_t phemap_capture_count(void)
+{
+    std::lock_guard<std::mutex> lock(capture_lock);
+    return capture_records;
+}
+
+uint8_t phemap_trace_open(phemap_trace_reader_t* const reader, const char* const path)
+{
+    uint8_t hdr[PHEMAP_TRACE_HDR_SIZE];
+    memset(reader,0,sizeof(phemap_trace_reader_t));
+    reader->file = fopen(path,"rb");
+    if(reader->file == NULL)
+        return 0;
+    if(fread(hdr,1,sizeof(hdr),reader->file) != sizeof(hdr) ||
+        U8_TO_PUF_BE(hdr) != PHEMAP_TRACE_MAGIC || U8_TO_PHEMAP_ID_BE(&hdr[4]) != PHEMAP_TRACE_VERSION)
+    {
+        phemap_trace_close(reader);
+        return 0;
+    }
+    return 1;
+}
+
+uint8_t phemap_trace_next(phemap_trace_reader_t* const reader, phemap_trace_rec_t* const rec)
+{
+    uint8_t hdr[PHEMAP_TRACE_REC_SIZE];
+    if(reader->file == NULL || fread(hdr,1,sizeof(hdr),reader->file) != sizeof(hdr))
+        return 0;
+    reader->ts_us   += U8_TO_PUF_BE(hdr);
+    rec->ts_us      = reader->ts_us;
+    rec->point      = hdr[4];
+    rec->self       = U8_TO_PHEMAP_ID_BE(&hdr[5]);
+    rec->len        = hdr[7];
+    if(fread(rec->pkt,1,rec->len,reader->file) != rec->len)
+        return 0;
+    rec->peer       = (rec->len >= 1 + sizeof(phemap_id_t)) ? U8_TO_PHEMAP_ID_BE(&rec->pkt[1]) : 0;
+    return 1;
+}
+
+void phemap_trace_close(phemap_trace_reader_t* const reader)
+{
+    if(reader->file != NULL)
+        fclose(reader->file);
+    reader->file = NULL;
+}
@@ -0,0 +1,110 @@
+/*
+    Group-Key-Phemap - Copyright (C) 2023-2024 Antonio Emmanuele
+
+    This file is part of Group-Key-Phemap.
+
+    Group-Key-Phemap is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Group-Key-Phemap is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file    phemap_capture.h
+ * @brief   Binary trace of the pkts received by the automas and its reader.
+ * @details phemap_capture_open installs the phemap_capture_hook, from then on each pkt passed to gk_as_automa,
+ *          gk_as_start_session_cb, gk_dev_automa or lv_automa is appended to the trace. The pkts an LV
+ *          passes to its own AS and device roles are not captured again.
+ *          File: MAGIC(4)|VERSION(2) then DT_US(4)|POINT(1)|SELF(2)|LEN(1)|PKT records, DT_US is the time
+ *          since the previous record and the peer is the sender id of the pkt.
+ */
+#ifndef PHEMAP_CAPTURE_H
+#define PHEMAP_CAPTURE_H
+#include "../phemap_common.h"
+#include <stdio.h>
+#define PHEMAP_TRACE_MAGIC      0x474B5452u     /*!< "GKTR"*/
+#define PHEMAP_TRACE_VERSION    1
+#define PHEMAP_TRACE_HDR_SIZE   6
+#define PHEMAP_TRACE_REC_SIZE   8               /*!< Record bytes before the pkt*/
+#define PHEMAP_TRACE_MAX_PKT    255
+
+#if PHEMAP_CAPTURE
+#include <atomic>
+/**
+ * @brief Hook installed by phemap_capture_open, 0 when not capturing.
+ */
+inline std::atomic<phemap_capture_fn_t>& phemap_capture_hook()  { static std::atomic<phemap_capture_fn_t> fn(nullptr); return fn; }
+/**
+ * @brief Automas nested on this thread, only the outermost pkt is captured.
+ */
+inline uint8_t& phemap_capture_depth()                          { static thread_local uint8_t depth = 0; return depth; }
+//  The hook is loaded once, phemap_capture_close may clear it meanwhile
+#define PHEMAP_CAPTURE_ENTER(point,self,pkt,len) do{                                                \
+    phemap_capture_fn_t capture_fn_ = phemap_capture_hook().load(std::memory_order_acquire);        \
+    if(phemap_capture_depth()++ == 0 && capture_fn_ != 0)                                           \
+        capture_fn_(point,self,pkt,len);                                                            \
+}while(0)
+#define PHEMAP_CAPTURE_EXIT()   do{ phemap_capture_depth()--; }while(0)
+#else
+#define PHEMAP_CAPTURE_ENTER(point,self,pkt,len)
+#define PHEMAP_CAPTURE_EXIT()
+#endif
+
+/**
+ * @typedef A decoded trace record
+ */
+typedef struct{
+    uint64_t        ts_us;                          /*!< Microseconds since the first record.*/
+    uint8_t         point;                          /*!< phemap_cap_point_t.*/
+    phemap_id_t     self;                           /*!< Id of the receiving role.*/
+    phemap_id_t     peer;                           /*!< Sender id carried by the pkt, 0 if the pkt is too short.*/
+    uint8_t         len;                            /*!< Bytes of pkt.*/
+    uint8_t         pkt[PHEMAP_TRACE_MAX_PKT];      /*!< The pkt as received.*/
+}phemap_trace_rec_t;
+
+/**
+ * @typedef Sequential reader of a trace
+ */
+typedef struct{
+    FILE*           file;                           /*!< The trace.*/
+    uint64_t        ts_us;                          /*!< Time of the last record read.*/
+}phemap_trace_reader_t;
+
+/**
+ * @brief Start capturing into path, replacing it.
+ * @return uint8_t 1 on success.
+ */
+uint8_t phemap_capture_open(const char* const path);
+
+/**
+ * @brief Stop capturing and flush the trace.
+ */
+void phemap_capture_close(void);
+
+/**
+ * @brief Pkts captured since phemap_capture_open.
+ */
+uint64_t phemap_capture_count(void);
+
+/**
+ * @brief Open a trace for reading.
+ * @return uint8_t 1 on success, 0 if the file is missing or isn't a trace.
+ */
+uint8_t phemap_trace_open(phemap_trace_reader_t* const reader, const char* const path);
+
+/**
+ * @brief Read the next record.
+ * @return uint8_t 1 if rec is valid, 0 at the end of the trace or on a truncated record.
+ */
+uint8_t phemap_trace_next(phemap_trace_reader_t* const reader, phemap_trace_rec_t* const rec);
+
+void phemap_trace_close(phemap_trace_reader_t* const reader);
+#endif
@@ -0,0 +1,234 @@
+/*
+    Group-Key-Phemap - Copyright (C) 2023-2024 Antonio Emmanuele
+
+    This file is part of Group-Key-Phemap.
+
+    Group-Key-Phemap is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Group-Key-Phemap is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file    phemap_rng.cc
+ * @brief   Per thread ChaCha20 CSPRNG with fast key erasure
+ */
+#include "phemap_rng.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#define RNG_SEEDED_OS       1
+#define RNG_SEEDED_FIXED    2
+#define RNG_KEY_WORDS       8
+
+/**
+ * @brief A word of PHEMAP_RNG_LANES blocks, lane l belongs to block l.
+ */
+typedef uint32_t rng_vec_t __attribute__((vector_size(sizeof(uint32_t)*PHEMAP_RNG_LANES)));
+
+/**
+ * @typedef Generator of a thread
+ */
+typedef struct{
+    uint32_t    key[RNG_KEY_WORDS];         /*!< ChaCha20 key of the next refill*/
+    uint32_t    buff[PHEMAP_RNG_WORDS];     /*!< Keystream of the last refill, a word is wiped once returned*/
+    uint32_t    avail;                      /*!< Words of buff not returned yet, the last ones*/
+    uint32_t    refills;                    /*!< Refills since the last OS seed*/
+    uint8_t     seeded;                     /*!< 0, RNG_SEEDED_OS or RNG_SEEDED_FIXED*/
+}rng_state_t;
+
+static thread_local rng_state_t rng_tls;
+
+#define RNG_ROTL(v,n)       (((v) << (n)) | ((v) >> (32 - (n))))
+#define RNG_QR(a,b,c,d)     a += b; d ^= a; d = RNG_ROTL(d,16);     \
+                            c += d; b ^= c; b = RNG_ROTL(b,12);     \
+                            a += b; d ^= a; d = RNG_ROTL(d,8);      \
+                            c += d; b ^= c; b = RNG_ROTL(b,7);
+
+/**
+ * @brief PHEMAP_RNG_LANES ChaCha20 blocks of key, counters 0 to PHEMAP_RNG_LANES - 1 and nonce 0.
+ * @details The blocks are computed together, one lane each, the key is used for a single refill.
+ * @param key 8 words
+ * @param out PHEMAP_RNG_WORDS words, block after block
+ */
+static void rng_blocks(const uint32_t* const key, uint32_t* const out)
+{
+    static const uint32_t sigma[4] = {0x61707865u,0x3320646eu,0x79622d32u,0x6b206574u};
+    rng_vec_t s[16], x[16];
+    for(uint32_t l = 0; l < PHEMAP_RNG_LANES; l++)
+    {
+        for(uint32_t i = 0; i < 4; i++)
+            s[i][l] = sigma[i];
+        for(uint32_t i = 0; i < RNG_KEY_WORDS; i++)
+            s[4 + i][l] = key[i];
+        s[12][l] = l;
+        s[13][l] = 0;
+        s[14][l] = 0;
+        s[15][l] = 0;
+    }
+    for(uint32_t i = 0; i < 16; i++)
+        x[i] = s[i];
+    for(uint32_t round = 0; round < 10; round++)
+    {
+        RNG_QR(x[0],x[4],x[8], x[12]);
+        RNG_QR(x[1],x[5],x[9], x[13]);
+        RNG_QR(x[2],x[6],x[10],x[14]);
+        RNG_QR(x[3],x[7],x[11],x[15]);
+        RNG_QR(x[0],x[5],x[10],x[15]);
+        RNG_QR(x[1],x[6],x[11],x[12]);
+        RNG_QR(x[2],x[7],x[8], x[13]);
+        RNG_QR(x[3],x[4],x[9], x[14]);
+    }
+    for(uint32_t i = 0; i < 16; i++)
+        x[i] += s[i];
+    for(uint32_t l = 0; l < PHEMAP_RNG_LANES; l++)
+        for(uint32_t i = 0; i < 16; i++)
+            out[l*16 + i] = x[i][l];
+}
+
+/**
+ * @brief Read size bytes of entropy from getrandom, or from /dev/urandom without it.
+ * @return uint8_t 1 if buff has been filled
+ */
+static uint8_t rng_os_entropy(uint8_t* const buff, const uint32_t size)
+{
+    uint32_t got = 0;
+#if defined(SYS_getrandom)
+    while(got < size)
+    {
+        long r = syscall(SYS_getrandom,buff + got,(size_t)(size - got),0);
+        if(r > 0)
+            got += (uint32_t)r;
+        else if(r < 0 && errno == EINTR)
+            continue;
+        else
+            break;
+    }
+#endif
+    if(got < size)
+    {
+        int fd = open("/dev/urandom",O_RDONLY | O_CLOEXEC);
+        while(fd >= 0 && got < size)
+        {
+            ssize_t r = read(fd,buff + got,size - got);
+            if(r > 0)
+                got += (uint32_t)r;
+            else if(r < 0 && errno == EINTR)
+                continue;
+            else
+                break;
+        }
+        if(fd >= 0)
+            close(fd);
+    }
+    return (got == size) ? 1 : 0;
+}
+
+/**
+ * @brief In the child only the forking thread is left, its generator must not repeat the parent.
+ */
+static void rng_atfork_child(void)
+{
+    rng_tls.seeded  = 0;
+    rng_tls.avail   = 0;
+}
+
+/**
+ * @brief Mix fresh OS entropy into the key of a thread.
+ * @return uint8_t 1 on success, the key is untouched otherwise
+ */
+static uint8_t rng_reseed(rng_state_t* const s)
+{
+    static const int atfork = pthread_atfork(NULL,NULL,rng_atfork_child);
+    (void)atfork;
+    uint32_t fresh[RNG_KEY_WORDS];
+    if(rng_os_entropy((uint8_t*)fresh,sizeof(fresh)) == 0)
+        return 0;
+    //  Xored, a reseed never makes the key weaker than it was
+    for(uint32_t i = 0; i < RNG_KEY_WORDS; i++)
+    {
+        s->key[i] ^= fresh[i];
+        fresh[i] = 0;
+    }
+    s->seeded   = RNG_SEEDED_OS;
+    s->refills  = 0;
+    return 1;
+}
+
+/**
+ * @brief Generate the next PHEMAP_RNG_LANES blocks, the first 8 words replace the key.
+ */
+static void rng_refill(rng_state_t* const s)
+{
+    if(s->seeded == 0 || (PHEMAP_RNG_RESEED > 0 && s->seeded == RNG_SEEDED_OS && s->refills >= PHEMAP_RNG_RESEED))
+    {
+        //  Nonces and tokens from a known key would be worse than no key at all
+        if(rng_reseed(s) == 0)
+            abort();
+    }
+    rng_blocks(s->key,s->buff);
+    memcpy(s->key,s->buff,sizeof(s->key));
+    memset(s->buff,0,sizeof(s->key));
+    s->avail = PHEMAP_RNG_WORDS - RNG_KEY_WORDS;
+    s->refills++;
+}
+
+uint8_t phemap_rng_init(void)
+{
+    rng_state_t* const s = &rng_tls;
+    if(rng_reseed(s) == 0)
+        return 0;
+    //  The words left were generated by the previous key
+    memset(s->buff,0,sizeof(s->buff));
+    s->avail = 0;
+    return 1;
+}
+
+void phemap_rng_seed(const uint8_t* const seed)
+{
+    rng_state_t* const s = &rng_tls;
+    //  Little endian words, as the ChaCha20 key bytes
+    for(uint32_t i = 0; i < RNG_KEY_WORDS; i++)
+        s->key[i] = (uint32_t)seed[4*i] | (uint32_t)seed[4*i + 1] << 8 | (uint32_t)seed[4*i + 2] << 16 | (uint32_t)seed[4*i + 3] << 24;
+    memset(s->buff,0,sizeof(s->buff));
+    s->avail    = 0;
+    s->refills  = 0;
+    s->seeded   = RNG_SEEDED_FIXED;
+}
+
+uint32_t phemap_rng_u32(void)
+{
+    rng_state_t* const s = &rng_tls;
+    if(s->avail == 0)
+        rng_refill(s);
+    uint32_t* const word = &s->buff[PHEMAP_RNG_WORDS - s->avail];
+    uint32_t value = *word;
+    *word = 0;
+    s->avail--;
+    return value;
+}
+
+void phemap_rng_fill(void* const out, const uint32_t size)
+{
+    uint8_t* p = (uint8_t*)out;
+    for(uint32_t done = 0; done < size; done += sizeof(uint32_t))
+    {
+        uint32_t value = phemap_rng_u32();
+        memcpy(&p[done],&value,(size - done < sizeof(uint32_t)) ? size - done : sizeof(uint32_t));
+    }
+}
@@ -0,0 +1,66 @@
+/*
+    Group-Key-Phemap - Copyright (C) 2023-2024 Antonio Emmanuele
+
+    This file is part of Group-Key-Phemap.
+
+    Group-Key-Phemap is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Group-Key-Phemap is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file    phemap_rng.h
+ * @brief   ChaCha20 CSPRNG for the nonces and the secret tokens, one generator for each thread.
+ * @details Each thread owns a ChaCha20 key seeded from getrandom (/dev/urandom as fallback) on its first call
+ *          and a buffer of PHEMAP_RNG_LANES keystream blocks, generated together with the GCC vector extension
+ *          (SSE2/NEON with 4 lanes, AVX2 with 8). The first 8 words of each refill become the next key and
+ *          are wiped, so a state leaked later doesn't reveal the values already returned. A call only takes
+ *          a word from the buffer of the calling thread: no lock, no syscall, safe from any worker.
+ *          A forked child reseeds from the OS.
+ */
+#ifndef PHEMAP_RNG_H
+#define PHEMAP_RNG_H
+#include "../phemap_common.h"
+#ifndef PHEMAP_RNG_LANES
+#define PHEMAP_RNG_LANES    4       /*!< ChaCha20 blocks generated together by a refill, 4 or 8*/
+#endif
+#if PHEMAP_RNG_LANES != 4 && PHEMAP_RNG_LANES != 8
+#error "PHEMAP_RNG_LANES must be 4 or 8"
+#endif
+#ifndef PHEMAP_RNG_RESEED
+#define PHEMAP_RNG_RESEED   65536   /*!< Refills after which fresh OS entropy is mixed into the key, 0 never*/
+#endif
+#define PHEMAP_RNG_WORDS    (16*PHEMAP_RNG_LANES)   /*!< Words of a refill, the first 8 are the next key*/
+
+/**
+ * @brief Seed the generator of the calling thread from the OS now instead of on its first call.
+ * @return uint8_t 1 on success, 0 if the OS gave no entropy
+ */
+uint8_t phemap_rng_init(void);
+/**
+ * @brief Seed the generator of the calling thread with a fixed key, for reproducible simulations only.
+ * @details The OS reseed is disabled for the thread until phemap_rng_init.
+ * @param seed 32 bytes
+ */
+void phemap_rng_seed(const uint8_t* const seed);
+/**
+ * @brief Next random word of the calling thread.
+ * @details Aborts if the generator can't be seeded, a predictable key would be worse.
+ */
+uint32_t phemap_rng_u32(void);
+/**
+ * @brief Fill a buffer with random bytes.
+ * @param out Destination
+ * @param size Bytes of out
+ */
+void phemap_rng_fill(void* const out, const uint32_t size);
+#endif
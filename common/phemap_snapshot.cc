@@ -0,0 +1,138 @@
+/*
+    Group-Key-Phemap - Copyright (C) 2023-2024 Antonio Emmanuele
+
+    This file is part of Group-Key-Phemap.
+
+    Group-Key-Phemap is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Group-Key-Phemap is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "phemap_snapshot.h"
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+uint32_t phemap_crc32(uint32_t crc, const uint8_t* const buff, const uint32_t size)
+{
+    //  Reflected polynomial, a nibble at a time
+    static const uint32_t nibble_tab[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+    };
+    crc = ~crc;
+    for(uint32_t i = 0; i < size; i++)
+    {
+        crc ^= buff[i];
+        crc = (crc >> 4) ^ nibble_tab[crc & 0x0F];
+        crc = (crc >> 4) ^ nibble_tab[crc & 0x0F];
+    }
+    return ~crc;
+}
+
+void phemap_snap_seal(uint8_t* const snap, const phemap_snap_kind_t kind, const uint32_t payload_len)
+{
+    uint32_t magic = PHEMAP_SNAP_MAGIC;
+    PUF_TO_U8_BE(magic,&snap[0]);
+    PHEMAP_ID_TO_U8_BE(PHEMAP_SNAP_VERSION,&snap[4]);
+    PHEMAP_ID_TO_U8_BE(kind,&snap[6]);
+    PUF_TO_U8_BE(payload_len,&snap[8]);
+    uint32_t crc = phemap_crc32(0,&snap[PHEMAP_SNAP_HDR_SIZE],payload_len);
+    PUF_TO_U8_BE(crc,&snap[12]);
+}
+
+uint32_t phemap_snap_open(const uint8_t* const snap, const uint32_t size, const phemap_snap_kind_t kind)
+{
+    if(snap == NULL || size < PHEMAP_SNAP_HDR_SIZE)
+        return 0;
+    uint32_t payload_len = U8_TO_PUF_BE(&snap[8]);
+    if( U8_TO_PUF_BE(&snap[0]) != PHEMAP_SNAP_MAGIC || U8_TO_PHEMAP_ID_BE(&snap[4]) != PHEMAP_SNAP_VERSION ||
+        U8_TO_PHEMAP_ID_BE(&snap[6]) != kind || payload_len > size - PHEMAP_SNAP_HDR_SIZE)
+        return 0;
+    if(phemap_crc32(0,&snap[PHEMAP_SNAP_HDR_SIZE],payload_len) != U8_TO_PUF_BE(&snap[12]))
+        return 0;
+    return payload_len;
+}
+
+uint8_t phemap_snap_write_file(const char* const path, const uint8_t* const buff, const uint32_t size)
+{
+    char tmp_path[4096];
+    if(snprintf(tmp_path,sizeof(tmp_path),"%s.tmp",path) >= (int)sizeof(tmp_path))
+        return 0;
+    int fd = open(tmp_path,O_WRONLY | O_CREAT | O_TRUNC,0600);
+    if(fd < 0)
+        return 0;
+    uint32_t written = 0;
+    while(written < size)
+    {
+        ssize_t ret = write(fd,buff + written,size - written);
+        if(ret <= 0)
+            break;
+        written += (uint32_t)ret;
+    }
+    //  The data must be on disk before the rename makes it visible
+    if(written != size || fsync(fd) != 0)
+    {
+        close(fd);
+        unlink(tmp_path);
+        return 0;
+    }
+    close(fd);
+    if(rename(tmp_path,path) != 0)
+    {
+        unlink(tmp_path);
+        return 0;
+    }
+    //  And the rename itself must survive a crash
+    char dir_path[4096];
+    snprintf(dir_path,sizeof(dir_path),"%s",path);
+    int dir_fd = open(dirname(dir_path),O_RDONLY | O_DIRECTORY);
+    if(dir_fd >= 0)
+    {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+    return 1;
+}
+
+uint8_t* phemap_snap_read_file(const char* const path, uint32_t* const size)
+{
+    int fd = open(path,O_RDONLY);
+    if(fd < 0)
+        return NULL;
+    struct stat st;
+    if(fstat(fd,&st) != 0 || st.st_size <= 0 || st.st_size > 0x7FFFFFFF)
+    {
+        close(fd);
+        return NULL;
+    }
+    uint8_t* buff = (uint8_t*)malloc((size_t)st.st_size);
+    uint32_t got = 0;
+    while(buff != NULL && got < (uint32_t)st.st_size)
+    {
+        ssize_t ret = read(fd,buff + got,(uint32_t)st.st_size - got);
+        if(ret <= 0)
+            break;
+        got += (uint32_t)ret;
+    }
+    close(fd);
+    if(buff == NULL || got != (uint32_t)st.st_size)
+    {
+        free(buff);
+        return NULL;
+    }
+    *size = got;
+    return buff;
+}
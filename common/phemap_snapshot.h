@@ -0,0 +1,76 @@
+/*
+    Group-Key-Phemap - Copyright (C) 2023-2024 Antonio Emmanuele
+
+    This file is part of Group-Key-Phemap.
+
+    Group-Key-Phemap is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Group-Key-Phemap is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file    phemap_snapshot.h
+ * @brief   Container format and atomic file I/O for the snapshots of the AS and LV state.
+ * @details A snapshot is a header followed by the payload of a role, all the fields are big endian as
+ *          the protocol mexs:
+ *          MAGIC(4)|VERSION(2)|KIND(2)|PAYLOAD_LEN(4)|CRC32 of the payload(4)|PAYLOAD
+ */
+#ifndef PHEMAP_SNAPSHOT_H
+#define PHEMAP_SNAPSHOT_H
+#include "../phemap_common.h"
+#define PHEMAP_SNAP_MAGIC       0x474B534Eu     /*!< "GKSN"*/
+#define PHEMAP_SNAP_VERSION     4               /*!< Bumped on any change of a payload layout*/
+#define PHEMAP_SNAP_HDR_SIZE    16
+
+/**
+ * @typedef Role whose state is carried by a snapshot
+ */
+typedef enum{
+    PHEMAP_SNAP_AS = 1,     /*!< AuthServer*/
+    PHEMAP_SNAP_LV = 2,     /*!< local_verifier_t*/
+}phemap_snap_kind_t;
+
+/**
+ * @brief Standard CRC-32 (IEEE 802.3), crc is 0 for the first chunk.
+ */
+uint32_t phemap_crc32(uint32_t crc, const uint8_t* const buff, const uint32_t size);
+
+/**
+ * @brief Write the header in front of a payload already stored at snap + PHEMAP_SNAP_HDR_SIZE.
+ */
+void phemap_snap_seal(uint8_t* const snap, const phemap_snap_kind_t kind, const uint32_t payload_len);
+
+/**
+ * @brief Check the header and the crc of a snapshot.
+ * 
+ * @param snap          The snapshot.
+ * @param size          Bytes of snap.
+ * @param kind          Expected role.
+ * @return uint32_t     Length of the payload, 0 if the snapshot is invalid, truncated or of another version.
+ */
+uint32_t phemap_snap_open(const uint8_t* const snap, const uint32_t size, const phemap_snap_kind_t kind);
+
+/**
+ * @brief Replace path with buff atomically: temporary file, fsync, rename and fsync of the directory.
+ * @return uint8_t 1 on success, on failure the old file is untouched.
+ */
+uint8_t phemap_snap_write_file(const char* const path, const uint8_t* const buff, const uint32_t size);
+
+/**
+ * @brief Read a whole snapshot file.
+ * 
+ * @param path          File to read.
+ * @param size          Set to the bytes read.
+ * @return uint8_t*     Buffer allocated with malloc, to be freed by the caller, NULL on failure.
+ */
+uint8_t* phemap_snap_read_file(const char* const path, uint32_t* const size);
+#endif
@@ -0,0 +1,113 @@
+/*
+    Group-Key-Phemap - Copyright (C) 2023-2024 Antonio Emmanuele
+
+    This file is part of Group-Key-Phemap.
+
+    Group-Key-Phemap is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Group-Key-Phemap is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "phemap_stats.h"
+#include <fcntl.h>
+#include <new>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static uint32_t stats_seg_size(const uint16_t max_slots)
+{
+    return PHEMAP_STATS_HDR_SIZE + (uint32_t)max_slots*sizeof(phemap_stats_slot_t);
+}
+
+phemap_stats_seg_t* phemap_stats_create(const char* const name, const uint16_t max_slots)
+{
+    uint32_t size = stats_seg_size(max_slots);
+    //  A stale segment of a previous run is replaced, the readers still attached keep the old one
+    shm_unlink(name);
+    int fd = shm_open(name,O_CREAT|O_EXCL|O_RDWR,0644);
+    if(fd < 0)
+        return NULL;
+    if(ftruncate(fd,size) != 0)
+    {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    void* map = mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+    close(fd);
+    if(map == MAP_FAILED)
+    {
+        shm_unlink(name);
+        return NULL;
+    }
+    phemap_stats_seg_t* seg = new (map) phemap_stats_seg_t();
+    phemap_stats_slot_t* slots = phemap_stats_slots(seg);
+    for(uint16_t k = 0; k < max_slots; k++)
+        new (&slots[k]) phemap_stats_slot_t();
+    seg->version    = PHEMAP_STATS_VERSION;
+    seg->max_slots  = max_slots;
+    seg->size       = size;
+    //  The magic goes last, a reader attaching meanwhile sees an invalid segment
+    std::atomic_thread_fence(std::memory_order_release);
+    seg->magic      = PHEMAP_STATS_MAGIC;
+    return seg;
+}
+
+const phemap_stats_seg_t* phemap_stats_attach(const char* const name)
+{
+    struct stat st;
+    int fd = shm_open(name,O_RDONLY,0);
+    if(fd < 0)
+        return NULL;
+    if(fstat(fd,&st) != 0 || (size_t)st.st_size < sizeof(phemap_stats_seg_t))
+    {
+        close(fd);
+        return NULL;
+    }
+    void* map = mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return NULL;
+    const phemap_stats_seg_t* seg = (const phemap_stats_seg_t*)map;
+    if(seg->magic != PHEMAP_STATS_MAGIC || seg->version != PHEMAP_STATS_VERSION ||
+        seg->size != (uint32_t)st.st_size || stats_seg_size(seg->max_slots) != seg->size)
+    {
+        munmap(map,st.st_size);
+        return NULL;
+    }
+    return seg;
+}
+
+phemap_stats_slot_t* phemap_stats_claim(phemap_stats_seg_t* const seg, const uint8_t role, const phemap_id_t id)
+{
+    uint32_t idx = seg->num_slots.fetch_add(1,std::memory_order_relaxed);
+    if(idx >= seg->max_slots)
+        return NULL;
+    phemap_stats_slot_t* slot = &phemap_stats_slots(seg)[idx];
+    slot->role  = role;
+    slot->id    = id;
+    slot->pid   = (uint32_t)getpid();
+    slot->ready.store(1,std::memory_order_release);
+    return slot;
+}
+
+void phemap_stats_detach(const phemap_stats_seg_t* const seg)
+{
+    if(seg != NULL)
+        munmap((void*)seg,seg->size);
+}
+
+void phemap_stats_unlink(const char* const name)
+{
+    shm_unlink(name);
+}
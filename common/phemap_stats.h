@@ -0,0 +1,149 @@
+/*
+    Group-Key-Phemap - Copyright (C) 2023-2024 Antonio Emmanuele
+
+    This file is part of Group-Key-Phemap.
+
+    Group-Key-Phemap is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Group-Key-Phemap is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file    phemap_stats.h
+ * @brief   Counters of the roles published in a shared memory segment.
+ * @details Each role having a slot (as->stats, dev->stats, lv->stats) counts the pkts it receives by type, the
+ *          values returned by its automa and a few gauges. A role is run by one thread at a time, so the
+ *          counters are single writer: they are bumped with relaxed loads and stores, no lock and no syscall.
+ *          Readers attach the segment read only, tools/phemap_stats.cc prints it live.
+ */
+#ifndef PHEMAP_STATS_H
+#define PHEMAP_STATS_H
+#include "../phemap_common.h"
+#ifndef PHEMAP_STATS
+#define PHEMAP_STATS    1   /*!< Counters on the automas, a role publishes them only if it has a slot*/
+#endif
+#define PHEMAP_STATS_MAGIC      0x474B5354u     /*!< "GKST"*/
+#define PHEMAP_STATS_VERSION    2
+#define PHEMAP_STATS_MEX_TYPES  32              /*!< Pkt counters, the last one counts the unknown types*/
+#define PHEMAP_STATS_RET_CODES  32              /*!< Return counters, the last one counts the unknown codes*/
+#define PHEMAP_STATS_LINE       64              /*!< Cache line, each slot starts on its own*/
+#define PHEMAP_STATS_HDR_SIZE   PHEMAP_STATS_LINE   /*!< Bytes before the first slot*/
+
+/**
+ * @typedef Role owning a slot
+ */
+typedef enum{
+    PHEMAP_STATS_AS,
+    PHEMAP_STATS_DEV,
+    PHEMAP_STATS_LV,
+}phemap_stats_role_t;
+
+#if PHEMAP_STATS
+#include <atomic>
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "the stats counters must be lock free");
+
+/**
+ * @typedef Counters of a role
+ * @details Gauges, refreshed after each pkt:
+ *          AS  pending confirmations, members, mexs queued for the sender.
+ *          DEV 1 while the key isn't installed, 0, mexs in the outbox.
+ *          LV  LVs the inter key install waits for, members of the subgroup, mexs queued for devs, LVs and
+ *              the AS role sender.
+ */
+typedef struct alignas(PHEMAP_STATS_LINE){
+    std::atomic<uint8_t>    ready;                              /*!< 1 once role and id are valid.*/
+    uint8_t                 role;                               /*!< phemap_stats_role_t.*/
+    phemap_id_t             id;                                 /*!< Id of the role.*/
+    uint32_t                pid;                                /*!< Process publishing the slot.*/
+    std::atomic<uint64_t>   pkts[PHEMAP_STATS_MEX_TYPES];       /*!< Pkts received, by phemap_mex_t.*/
+    std::atomic<uint64_t>   rets[PHEMAP_STATS_RET_CODES];       /*!< Automa return values, by phemap_ret_t.*/
+    std::atomic<uint32_t>   pending;                            /*!< Pending gauge.*/
+    std::atomic<uint32_t>   group_size;                         /*!< Group size gauge.*/
+    std::atomic<uint32_t>   tsmt_depth;                         /*!< Transmit queue gauge.*/
+}phemap_stats_slot_t;
+static_assert(sizeof(phemap_stats_slot_t) % PHEMAP_STATS_LINE == 0, "two roles must not share a cache line");
+
+/**
+ * @typedef Header of the segment, followed by max_slots slots
+ */
+typedef struct{
+    uint32_t                magic;                              /*!< PHEMAP_STATS_MAGIC.*/
+    uint16_t                version;                            /*!< PHEMAP_STATS_VERSION.*/
+    uint16_t                max_slots;                          /*!< Slots of the segment.*/
+    std::atomic<uint32_t>   num_slots;                          /*!< Slots claimed, may exceed max_slots.*/
+    uint32_t                size;                               /*!< Bytes of the segment.*/
+}phemap_stats_seg_t;
+static_assert(sizeof(phemap_stats_seg_t) <= PHEMAP_STATS_HDR_SIZE, "the stats header must fit PHEMAP_STATS_HDR_SIZE");
+
+static inline void phemap_stats_bump(std::atomic<uint64_t>& counter)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + 1,std::memory_order_relaxed);
+}
+
+/**
+ * @brief Count a pkt, the value returned for it and refresh the gauges, slot may be NULL.
+ */
+#define PHEMAP_STATS_RECORD(slot,pkt,len,ret,pend,group,depth) do{                                        \
+    phemap_stats_slot_t* const stats_slot_ = (slot);                                                        \
+    if(stats_slot_ != 0)                                                                                    \
+    {                                                                                                       \
+        if((len) > 0)                                                                                       \
+            phemap_stats_bump(stats_slot_->pkts[(pkt)[0] < PHEMAP_STATS_MEX_TYPES - 1 ?                     \
+                                                (pkt)[0] : PHEMAP_STATS_MEX_TYPES - 1]);                    \
+        phemap_stats_bump(stats_slot_->rets[(uint32_t)(ret) < PHEMAP_STATS_RET_CODES - 1 ?                  \
+                                            (uint32_t)(ret) : PHEMAP_STATS_RET_CODES - 1]);                 \
+        stats_slot_->pending.store((uint32_t)(pend),std::memory_order_relaxed);                             \
+        stats_slot_->group_size.store((uint32_t)(group),std::memory_order_relaxed);                         \
+        stats_slot_->tsmt_depth.store((uint32_t)(depth),std::memory_order_relaxed);                         \
+    }                                                                                                       \
+}while(0)
+
+/**
+ * @brief Slots of a segment.
+ */
+static inline phemap_stats_slot_t* phemap_stats_slots(const phemap_stats_seg_t* const seg)
+{
+    return (phemap_stats_slot_t*)((uint8_t*)seg + PHEMAP_STATS_HDR_SIZE);
+}
+
+/**
+ * @brief Create, or replace, the segment name with room for max_slots roles.
+ * @return phemap_stats_seg_t* The segment mapped read write, NULL on failure.
+ */
+phemap_stats_seg_t* phemap_stats_create(const char* const name, const uint16_t max_slots);
+
+/**
+ * @brief Map an existing segment read only.
+ * @return phemap_stats_seg_t* NULL if missing or not a stats segment.
+ */
+const phemap_stats_seg_t* phemap_stats_attach(const char* const name);
+
+/**
+ * @brief Claim a slot for a role, then assign it to the stats field of the role.
+ * @return phemap_stats_slot_t* NULL if the segment is full.
+ */
+phemap_stats_slot_t* phemap_stats_claim(phemap_stats_seg_t* const seg, const uint8_t role, const phemap_id_t id);
+
+/**
+ * @brief Unmap a segment, the roles must not use its slots anymore.
+ */
+void phemap_stats_detach(const phemap_stats_seg_t* const seg);
+
+/**
+ * @brief Remove the segment name, the mappings stay valid.
+ */
+void phemap_stats_unlink(const char* const name);
+#else
+typedef struct phemap_stats_slot_s phemap_stats_slot_t;
+#define PHEMAP_STATS_RECORD(slot,pkt,len,ret,pend,group,depth)
+#endif
+#endif
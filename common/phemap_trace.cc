@@ -0,0 +1,77 @@
+/*
+    Group-Key-Phemap - Copyright (C) 2023-2024 Antonio Emmanuele
+
+    This file is part of Group-Key-Phemap.
+
+    Group-Key-Phemap is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Group-Key-Phemap is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "phemap_trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#if PHEMAP_TRACE
+uint32_t phemap_trace_dump(const char* const path)
+{
+    uint8_t hdr[PHEMAP_TRACE_DUMP_RING_SIZE];
+    uint32_t written = 0;
+    uint8_t (*rec)[PHEMAP_TRACE_DUMP_EV_SIZE] = (uint8_t (*)[PHEMAP_TRACE_DUMP_EV_SIZE])malloc(PHEMAP_TRACE_DEPTH*PHEMAP_TRACE_DUMP_EV_SIZE);
+    FILE* file = (rec != NULL) ? fopen(path,"wb") : NULL;
+    if(file == NULL)
+    {
+        free(rec);
+        return 0;
+    }
+    uint32_t magic = PHEMAP_TRACE_DUMP_MAGIC;
+    PUF_TO_U8_BE(magic,hdr);
+    PHEMAP_ID_TO_U8_BE(PHEMAP_TRACE_DUMP_VERSION,&hdr[4]);
+    fwrite(hdr,1,PHEMAP_TRACE_DUMP_HDR_SIZE,file);
+    for(phemap_trace_ring_t* ring = phemap_trace_rings().load(std::memory_order_acquire); ring != NULL; ring = ring->next)
+    {
+        uint64_t head   = ring->head.load(std::memory_order_acquire);
+        uint64_t first  = (head > PHEMAP_TRACE_DEPTH) ? head - PHEMAP_TRACE_DEPTH : 0;
+        for(uint64_t idx = first; idx < head; idx++)
+        {
+            const phemap_trace_ent_t* ent = &ring->ent[idx & (PHEMAP_TRACE_DEPTH - 1)];
+            uint8_t* p = rec[idx - first];
+            uint64_t ts = ent->ts_ns.load(std::memory_order_relaxed);
+            uint64_t w  = ent->head.load(std::memory_order_relaxed);
+            uint64_t a  = ent->args.load(std::memory_order_relaxed);
+            uint32_t part;
+            part = (uint32_t)(ts >> 32);    PUF_TO_U8_BE(part,p);
+            part = (uint32_t)ts;            PUF_TO_U8_BE(part,p + 4);
+            part = (uint32_t)(w >> 32);     PUF_TO_U8_BE(part,p + 8);
+            part = (uint32_t)w;             PUF_TO_U8_BE(part,p + 12);
+            part = (uint32_t)(a >> 32);     PUF_TO_U8_BE(part,p + 16);
+            part = (uint32_t)a;             PUF_TO_U8_BE(part,p + 20);
+        }
+        //  The thread kept running, the oldest copied events may have been overwritten meanwhile
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t now = ring->head.load(std::memory_order_relaxed);
+        uint64_t valid = (now >= PHEMAP_TRACE_DEPTH && now - PHEMAP_TRACE_DEPTH + 1 > first) ? now - PHEMAP_TRACE_DEPTH + 1 : first;
+        uint32_t count = (valid < head) ? (uint32_t)(head - valid) : 0;
+        uint32_t part;
+        PUF_TO_U8_BE(ring->thread,hdr);
+        part = (uint32_t)(head >> 32);  PUF_TO_U8_BE(part,hdr + 4);
+        part = (uint32_t)head;          PUF_TO_U8_BE(part,hdr + 8);
+        PUF_TO_U8_BE(count,hdr + 12);
+        fwrite(hdr,1,PHEMAP_TRACE_DUMP_RING_SIZE,file);
+        fwrite(rec[valid - first],PHEMAP_TRACE_DUMP_EV_SIZE,count,file);
+        written += count;
+    }
+    free(rec);
+    if(fclose(file) != 0)
+        return 0;
+    return written;
+}
+#endif
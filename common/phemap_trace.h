@@ -0,0 +1,156 @@
+/*
+    Group-Key-Phemap - Copyright (C) 2023-2024 Antonio Emmanuele
+
+    This file is part of Group-Key-Phemap.
+
+    Group-Key-Phemap is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Group-Key-Phemap is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file    phemap_trace.h
+ * @brief   Binary trace of the protocol events, kept in a ring for each thread.
+ * @details An event is an id fixed at compile time, the id of the role and three arguments. Emitting it
+ *          only stores three words in the ring of the calling thread, with relaxed atomics: no lock, no
+ *          syscall, no formatting. phemap_trace_dump (phemap_trace.cc) copies the rings to a file at any
+ *          time, tools/phemap_trace_dec.cc formats it offline. A ring keeps the last PHEMAP_TRACE_DEPTH
+ *          events of its thread, rings outlive their thread so they can still be dumped.
+ */
+#ifndef PHEMAP_TRACE_H
+#define PHEMAP_TRACE_H
+#include "../phemap_common.h"
+#ifndef PHEMAP_TRACE
+#define PHEMAP_TRACE    1   /*!< Events recorded in the per thread rings*/
+#endif
+#ifndef PHEMAP_TRACE_DEPTH
+#define PHEMAP_TRACE_DEPTH  1024    /*!< Events kept for each thread, a power of 2*/
+#endif
+#define PHEMAP_TRACE_DUMP_MAGIC     0x474B4556u     /*!< "GKEV"*/
+#define PHEMAP_TRACE_DUMP_VERSION   1
+#define PHEMAP_TRACE_DUMP_HDR_SIZE  6               /*!< MAGIC(4)|VERSION(2)*/
+#define PHEMAP_TRACE_DUMP_RING_SIZE 16              /*!< THREAD(4)|HEAD(8)|COUNT(4)*/
+#define PHEMAP_TRACE_DUMP_EV_SIZE   24              /*!< TS_NS(8)|EVENT(2)|SELF(2)|ARG0(4)|ARG1(4)|ARG2(4)*/
+
+/**
+ * @brief The events and their format, the arguments are self then ARG0..ARG2.
+ * @details Append new events at the end, the ids are stored in the dumps.
+ */
+#define PHEMAP_TRACE_EVENTS(X)                                                                              \
+    X(PHEMAP_EV_AS_MALFORMED,           "AS %u: malformed pkt type %u len %u")                              \
+    X(PHEMAP_EV_AS_UNKNOWN_DEV,         "AS %u: pkt type %u from not authenticated %u")                     \
+    X(PHEMAP_EV_AS_AUTH_FAILED,         "AS %u: auth of %u failed, expected link %#x rcvd %#x")             \
+    X(PHEMAP_EV_AS_CONF_NOT_PENDING,    "AS %u: confirmation type %u from %u not pending")                  \
+    X(PHEMAP_EV_AS_UNEXPECTED_MEX,      "AS %u: unexpected mex in state %u type %u")                        \
+    X(PHEMAP_EV_AS_CORRUPTED_STATE,     "AS %u: corrupted state %u")                                        \
+    X(PHEMAP_EV_DEV_MALFORMED,          "DEV %u: malformed pkt type %u len %u")                             \
+    X(PHEMAP_EV_DEV_AUTH_FAILED,        "DEV %u: auth of type %u failed, rcvd %#x expected %#x")            \
+    X(PHEMAP_EV_DEV_WRONG_AS,           "DEV %u: update from %u, not from its AS")                          \
+    X(PHEMAP_EV_DEV_UNEXPECTED_MEX,     "DEV %u: unexpected mex in state %u type %u")                       \
+    X(PHEMAP_EV_DEV_WEAK_TIMER,         "DEV %u: weak dev_start_timer called")                              \
+    X(PHEMAP_EV_LV_PARSE_ERROR,         "LV %u: parse error type %u size %u")                               \
+    X(PHEMAP_EV_LV_PART_AUTH_FAILED,    "LV %u: inter key mex of %u failed auth")                           \
+    X(PHEMAP_EV_LV_UNEXPECTED_MEX,      "LV %u: unexpected mex type %u from LV %u")                         \
+    X(PHEMAP_EV_LV_UNKNOWN_SENDER,      "LV %u: dropped type %u from unknown sender %u")                    \
+    X(PHEMAP_EV_LV_UNEXPECTED_COMBINED, "LV %u: unexpected combined key from %u")                       \
+    X(PHEMAP_EV_AS_RESYNC_REFUSED,      "AS %u: resync of %u from epoch %u refused, AS epoch %u")           \
+    X(PHEMAP_EV_DEV_EPOCH_GAP,          "DEV %u: update to epoch %u at epoch %u, resync requested")          \
+    X(PHEMAP_EV_AS_TICKET_REFUSED,      "AS %u: ticket of %u at epoch %u cursor %u refused")                \
+    X(PHEMAP_EV_AS_LINK_SKIPPED,        "AS %u: chain of %u moved ahead by %u links to match type %u")      \
+    X(PHEMAP_EV_AS_DUPLICATE,           "AS %u: duplicate type %u from %u absorbed, reemitted %u")          \
+    X(PHEMAP_EV_AS_EVICTED,             "AS %u: pending %u evicted after %u retransmissions, %u left")      \
+    X(PHEMAP_EV_AS_LINK_LOST,           "AS %u: failed check of %u type %u used a link, the AS is one link ahead") \
+    X(PHEMAP_EV_LV_PART_OUT_OF_ORDER,   "LV %u: inter key mex of %u at epoch %u dropped, expected epoch %u")
+
+#define PHEMAP_TRACE_EV_ID(id,fmt)  id,
+/**
+ * @typedef Ids of the events
+ */
+typedef enum{
+    PHEMAP_TRACE_EVENTS(PHEMAP_TRACE_EV_ID)
+    PHEMAP_EV_NUM,
+}phemap_trace_ev_t;
+#undef PHEMAP_TRACE_EV_ID
+
+#if PHEMAP_TRACE
+#include <atomic>
+#include <chrono>
+#include <new>
+static_assert((PHEMAP_TRACE_DEPTH & (PHEMAP_TRACE_DEPTH - 1)) == 0, "PHEMAP_TRACE_DEPTH must be a power of 2");
+
+/**
+ * @typedef An event, packed in words written atomically so the dump can read them while the thread runs
+ */
+typedef struct{
+    std::atomic<uint64_t>   ts_ns;      /*!< Monotonic time.*/
+    std::atomic<uint64_t>   head;       /*!< EVENT(16)|SELF(16)|ARG0(32).*/
+    std::atomic<uint64_t>   args;       /*!< ARG1(32)|ARG2(32).*/
+}phemap_trace_ent_t;
+
+/**
+ * @typedef Ring of a thread, written by its thread only
+ */
+typedef struct phemap_trace_ring_s{
+    std::atomic<uint64_t>       head;                       /*!< Events emitted, the next one goes to head % DEPTH.*/
+    uint32_t                    thread;                     /*!< Index of the thread, in ring creation order.*/
+    struct phemap_trace_ring_s* next;                       /*!< Next ring of the list.*/
+    phemap_trace_ent_t          ent[PHEMAP_TRACE_DEPTH];    /*!< The last events.*/
+}phemap_trace_ring_t;
+
+/**
+ * @brief List of the rings of all the threads, newest first.
+ */
+inline std::atomic<phemap_trace_ring_t*>& phemap_trace_rings()  { static std::atomic<phemap_trace_ring_t*> rings(nullptr); return rings; }
+
+inline phemap_trace_ring_t* phemap_trace_ring_new()
+{
+    static std::atomic<uint32_t> threads(0);
+    phemap_trace_ring_t* ring = new (std::nothrow) phemap_trace_ring_t();
+    if(ring == nullptr)
+        return nullptr;
+    ring->thread = threads.fetch_add(1,std::memory_order_relaxed);
+    ring->next = phemap_trace_rings().load(std::memory_order_relaxed);
+    while(!phemap_trace_rings().compare_exchange_weak(ring->next,ring,std::memory_order_release,std::memory_order_relaxed))
+        ;
+    return ring;
+}
+
+/**
+ * @brief Ring of the calling thread, allocated by its first event.
+ */
+inline phemap_trace_ring_t* phemap_trace_ring()   { static thread_local phemap_trace_ring_t* ring = phemap_trace_ring_new(); return ring; }
+
+inline void phemap_trace_emit(const uint16_t event, const phemap_id_t self, const uint32_t a0, const uint32_t a1, const uint32_t a2)
+{
+    phemap_trace_ring_t* const ring = phemap_trace_ring();
+    if(ring == nullptr)
+        return;
+    uint64_t idx = ring->head.load(std::memory_order_relaxed);
+    phemap_trace_ent_t* const ent = &ring->ent[idx & (PHEMAP_TRACE_DEPTH - 1)];
+    ent->ts_ns.store((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now().time_since_epoch()).count(),std::memory_order_relaxed);
+    ent->head.store(((uint64_t)event << 48) | ((uint64_t)self << 32) | a0,std::memory_order_relaxed);
+    ent->args.store(((uint64_t)a1 << 32) | a2,std::memory_order_relaxed);
+    ring->head.store(idx + 1,std::memory_order_release);
+}
+
+#define PHEMAP_TRACE_EV(event,self,a0,a1,a2)    phemap_trace_emit((uint16_t)(event),(phemap_id_t)(self),(uint32_t)(a0),(uint32_t)(a1),(uint32_t)(a2))
+
+/**
+ * @brief Write the rings of all the threads to path, it can be called while the threads run.
+ * @return uint32_t Events written, 0 if the file can't be written.
+ */
+uint32_t phemap_trace_dump(const char* const path);
+#else
+#define PHEMAP_TRACE_EV(event,self,a0,a1,a2)
+#endif
+#endif
@@ -26,4 +26,12 @@ void  dev_reset_timer(const phemap_id_t id);
 void  read_data_from_as(const phemap_id_t id , uint8_t *const buff , uint32_t*const  size);
 void  dev_rng_init();
 uint32_t dev_rng_gen();
+/**
+ * @brief Position of the device in its own chain, saved in the resumption ticket.
+ */
+uint32_t dev_chain_cursor();
+/**
+ * @brief Move the chain of the device to cursor, called when a session is resumed from a ticket.
+ */
+void dev_set_chain_cursor(const uint32_t cursor);
 #endif
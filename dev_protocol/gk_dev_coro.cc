@@ -0,0 +1,400 @@
+/*
+    Group-Key-Phemap - Copyright (C) 2023-2024 Antonio Emmanuele
+
+    This file is part of Group-Key-Phemap.
+
+    Group-Key-Phemap is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Group-Key-Phemap is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "gk_dev_coro.h"
+#include <algorithm>
+#include "string.h"
+#if DEV_USE_ASSERT
+#include "assert.h"
+#define DEV_ASSERT(x)   assert(x)
+#else
+#define DEV_ASSERT(x)   ((void)0)
+#endif
+
+static thread_local gk_dev_co_session_t* dev_co_current = NULL;
+
+/**
+ * @brief Marks the session calling the device functions for gk_dev_co_current, never held across a co_await.
+ */
+struct dev_co_scope{
+    explicit dev_co_scope(gk_dev_co_session_t* const s)     { dev_co_current = s; }
+    ~dev_co_scope()                                         { dev_co_current = NULL; }
+};
+
+/**
+ * @brief Coroutine wrapping a spawned flow, linked in the scheduler until it completes and then freed.
+ */
+struct dev_co_root_t{
+    struct promise_type{
+        gk_dev_co_sched_t*  sched;
+        promise_type*       prev;
+        promise_type*       next;
+        promise_type(gk_dev_co_sched_t* const s, GkDevTask<void>&) : sched(s), prev(NULL), next((promise_type*)s->roots)
+        {
+            if(next != NULL)
+                next->prev = this;
+            sched->roots = this;
+            sched->live++;
+        }
+        ~promise_type()
+        {
+            if(prev != NULL)
+                prev->next = next;
+            else
+                sched->roots = next;
+            if(next != NULL)
+                next->prev = prev;
+            sched->live--;
+        }
+        dev_co_root_t           get_return_object()         { return dev_co_root_t{std::coroutine_handle<promise_type>::from_promise(*this)}; }
+        std::suspend_always     initial_suspend() noexcept  { return {}; }
+        std::suspend_never      final_suspend() noexcept    { return {}; }
+        void                    return_void()               { }
+        void                    unhandled_exception()       { std::terminate(); }
+    };
+    std::coroutine_handle<promise_type> h;
+};
+
+static dev_co_root_t dev_co_root(gk_dev_co_sched_t* const sched, GkDevTask<void> flow)
+{
+    (void)sched;
+    co_await flow;
+}
+
+static bool dev_co_timer_after(const gk_dev_co_timer_t& a, const gk_dev_co_timer_t& b)
+{
+    return a.at != b.at ? a.at > b.at : a.seq > b.seq;
+}
+
+static void dev_co_add_timer(gk_dev_co_sched_t* const sched, const uint64_t at, gk_dev_co_session_t* const s, const std::coroutine_handle<> h)
+{
+    sched->timers.push_back(gk_dev_co_timer_t{at,sched->seq++,s,h});
+    std::push_heap(sched->timers.begin(),sched->timers.end(),dev_co_timer_after);
+}
+
+/**
+ * @brief A session keeps at most one timer in the heap, the earliest deadline it had since the timer fired.
+ * @details A wait ended by a pkt leaves its timer in place; when it fires it is moved to the deadline of the
+ *          current wait, if any, so a member processing updates doesn't grow the heap.
+ */
+static void dev_co_arm(gk_dev_co_sched_t* const sched, gk_dev_co_session_t* const s)
+{
+    if(s->deadline == GK_DEV_CO_FOREVER || s->deadline >= s->armed_at)
+        return;
+    s->armed_at = s->deadline;
+    dev_co_add_timer(sched,s->deadline,s,nullptr);
+}
+
+/**
+ * @brief Move the coroutines whose timer expired to the ready queue.
+ */
+static void dev_co_fire(gk_dev_co_sched_t* const sched)
+{
+    while(!sched->timers.empty() && sched->timers.front().at <= sched->now_ms)
+    {
+        std::pop_heap(sched->timers.begin(),sched->timers.end(),dev_co_timer_after);
+        gk_dev_co_timer_t t = sched->timers.back();
+        sched->timers.pop_back();
+        if(t.s == NULL)
+        {
+            sched->ready.push_back(t.h);
+            continue;
+        }
+        gk_dev_co_session_t* s = t.s;
+        //  Replaced by an earlier deadline, or a duplicate of the same one
+        if(t.at != s->armed_at)
+            continue;
+        s->armed_at = GK_DEV_CO_FOREVER;
+        if(!s->waiter)
+            continue;
+        if(s->deadline <= sched->now_ms)
+        {
+            sched->ready.push_back(s->waiter);
+            s->waiter = nullptr;
+            sched->timeouts++;
+        }
+        else
+            dev_co_arm(sched,s);
+    }
+}
+
+void gk_dev_co_sched_init(gk_dev_co_sched_t* const sched, const gk_dev_co_send_t send, void* const user)
+{
+    DEV_ASSERT(NULL != sched);
+    sched->ready.clear();
+    sched->timers.clear();
+    sched->now_ms   = 0;
+    sched->seq      = 0;
+    sched->send     = send;
+    sched->user     = user;
+    sched->roots    = NULL;
+    sched->live     = 0;
+    sched->resumed  = 0;
+    sched->timeouts = 0;
+}
+
+void gk_dev_co_sched_free(gk_dev_co_sched_t* const sched)
+{
+    DEV_ASSERT(NULL != sched);
+    //  Destroying a root destroys the flows it awaits and unlinks it
+    while(sched->roots != NULL)
+        std::coroutine_handle<dev_co_root_t::promise_type>::from_promise(*(dev_co_root_t::promise_type*)sched->roots).destroy();
+    sched->ready.clear();
+    sched->timers.clear();
+}
+
+void gk_dev_co_session_init(gk_dev_co_sched_t* const sched, gk_dev_co_session_t* const s, const phemap_id_t id, const phemap_id_t as_id)
+{
+    DEV_ASSERT(NULL != sched);
+    DEV_ASSERT(NULL != s);
+    memset(&s->dev,0,sizeof(Device));
+    s->dev.id       = id;
+    s->dev.as_id    = as_id;
+    s->dev.dev_state= GK_DEV_WAIT_START_PK;
+    s->sched        = sched;
+    s->user         = NULL;
+    s->waiter       = nullptr;
+    s->deadline     = GK_DEV_CO_FOREVER;
+    s->armed_at     = GK_DEV_CO_FOREVER;
+    s->in_head      = 0;
+    s->in_count     = 0;
+    s->in_dropped   = 0;
+}
+
+void gk_dev_co_spawn(gk_dev_co_sched_t* const sched, GkDevTask<void>&& flow)
+{
+    DEV_ASSERT(NULL != sched);
+    sched->ready.push_back(dev_co_root(sched,std::move(flow)).h);
+}
+
+uint8_t gk_dev_co_deliver(gk_dev_co_session_t* const s, const uint8_t* const pkt, const uint32_t len)
+{
+    DEV_ASSERT(NULL != s);
+    DEV_ASSERT(NULL != pkt);
+    if(len == 0 || len > GK_DEV_CO_MAX_PKT || s->in_count == GK_DEV_CO_INBOX_DEPTH)
+    {
+        s->in_dropped++;
+        return 0;
+    }
+    uint8_t slot = (uint8_t)((s->in_head + s->in_count) % GK_DEV_CO_INBOX_DEPTH);
+    memcpy(s->inbox[slot],pkt,len);
+    s->in_len[slot] = (uint8_t)len;
+    s->in_count++;
+    if(s->waiter)
+    {
+        s->sched->ready.push_back(s->waiter);
+        s->waiter = nullptr;
+    }
+    return 1;
+}
+
+uint32_t gk_dev_co_run(gk_dev_co_sched_t* const sched, const uint64_t now_ms)
+{
+    DEV_ASSERT(NULL != sched);
+    uint32_t resumed = 0;
+    if(now_ms > sched->now_ms)
+        sched->now_ms = now_ms;
+    for(;;)
+    {
+        dev_co_fire(sched);
+        if(sched->ready.empty())
+            break;
+        //  The coroutines resumed queue more at the end
+        for(size_t i = 0; i < sched->ready.size(); i++)
+        {
+            std::coroutine_handle<> h = sched->ready[i];
+            h.resume();
+            resumed++;
+        }
+        sched->ready.clear();
+    }
+    sched->resumed += resumed;
+    return resumed;
+}
+
+uint64_t gk_dev_co_next_timer(const gk_dev_co_sched_t* const sched)
+{
+    DEV_ASSERT(NULL != sched);
+    return sched->timers.empty() ? GK_DEV_CO_FOREVER : sched->timers.front().at;
+}
+
+uint32_t gk_dev_co_run_virtual(gk_dev_co_sched_t* const sched, const uint64_t until_ms)
+{
+    DEV_ASSERT(NULL != sched);
+    gk_dev_co_run(sched,sched->now_ms);
+    while(sched->live > 0)
+    {
+        uint64_t next = gk_dev_co_next_timer(sched);
+        if(next == GK_DEV_CO_FOREVER || next > until_ms)
+            break;
+        gk_dev_co_run(sched,next);
+    }
+    return sched->live;
+}
+
+gk_dev_co_session_t* gk_dev_co_current()
+{
+    return dev_co_current;
+}
+
+void gk_dev_co_flush(gk_dev_co_session_t* const s)
+{
+    DEV_ASSERT(NULL != s);
+    const dev_outbox_entry_t* e;
+    while((e = gk_dev_outbox_peek(&s->dev)) != NULL)
+    {
+        s->sched->send(s,e->mex,e->len,s->sched->user);
+        gk_dev_outbox_pop(&s->dev);
+    }
+}
+
+void gk_dev_co_sleep_t::await_suspend(std::coroutine_handle<> h)
+{
+    dev_co_add_timer(sched,at,NULL,h);
+}
+
+void gk_dev_co_recv_t::await_suspend(std::coroutine_handle<> h)
+{
+    s->waiter   = h;
+    s->deadline = deadline;
+    dev_co_arm(s->sched,s);
+}
+
+uint8_t gk_dev_co_recv_t::await_resume()
+{
+    if(s->in_count == 0)
+        return 0;
+    uint8_t len = s->in_len[s->in_head];
+    memcpy(pkt,s->inbox[s->in_head],len);
+    s->in_head = (uint8_t)((s->in_head + 1) % GK_DEV_CO_INBOX_DEPTH);
+    s->in_count--;
+    return len;
+}
+
+static uint64_t dev_co_deadline(const gk_dev_co_session_t* const s, const uint64_t timeout_ms)
+{
+    uint64_t now = s->sched->now_ms;
+    return (timeout_ms >= GK_DEV_CO_FOREVER - now) ? GK_DEV_CO_FOREVER : now + timeout_ms;
+}
+
+/**
+ * @brief Feed the pkts to the device until it gets its key from a START_PK or a RESUME_PK.
+ */
+static GkDevTask<phemap_ret_t> dev_co_wait_key(gk_dev_co_session_t* const s, const uint64_t deadline)
+{
+    uint8_t pkt[GK_DEV_CO_MAX_PKT];
+    for(;;)
+    {
+        uint8_t len = co_await gk_dev_co_recv(s,pkt,deadline);
+        if(len == 0)
+            co_return CONN_WAIT;
+        phemap_ret_t ret;
+        {
+            dev_co_scope scope(s);
+            ret = gk_dev_automa(&s->dev,pkt,len);
+        }
+        gk_dev_co_flush(s);
+        if(ret == INSTALL_OK)
+            co_return INSTALL_OK;
+        //  Updates of the group seen before the key are not an error, a bad key is
+        if(ret == REINIT && (pkt[0] == START_PK || pkt[0] == RESUME_PK))
+            co_return REINIT;
+    }
+}
+
+/**
+ * @brief Drop what was delivered before the request, it belongs to an older session.
+ */
+static void dev_co_drop_inbox(gk_dev_co_session_t* const s)
+{
+    s->in_head  = 0;
+    s->in_count = 0;
+}
+
+GkDevTask<phemap_ret_t> gk_dev_co_join(gk_dev_co_session_t* const s, const uint64_t timeout_ms)
+{
+    DEV_ASSERT(NULL != s);
+    uint64_t deadline = dev_co_deadline(s,timeout_ms);
+    dev_co_drop_inbox(s);
+    {
+        dev_co_scope scope(s);
+        gk_dev_start_session(&s->dev);
+    }
+    gk_dev_co_flush(s);
+    co_return co_await dev_co_wait_key(s,deadline);
+}
+
+GkDevTask<phemap_ret_t> gk_dev_co_install(gk_dev_co_session_t* const s, const uint64_t timeout_ms)
+{
+    DEV_ASSERT(NULL != s);
+    //  The START_PK may already be in the inbox
+    s->dev.dev_state = GK_DEV_WAIT_START_PK;
+    co_return co_await dev_co_wait_key(s,dev_co_deadline(s,timeout_ms));
+}
+
+GkDevTask<phemap_ret_t> gk_dev_co_resume(gk_dev_co_session_t* const s, const gk_dev_ticket_t* const ticket, const uint64_t timeout_ms)
+{
+    DEV_ASSERT(NULL != s);
+    DEV_ASSERT(NULL != ticket);
+    uint64_t deadline = dev_co_deadline(s,timeout_ms);
+    uint8_t queued;
+    dev_co_drop_inbox(s);
+    {
+        dev_co_scope scope(s);
+        queued = gk_dev_resume_session(&s->dev,ticket);
+    }
+    if(queued == 0)
+        co_return REINIT;
+    gk_dev_co_flush(s);
+    co_return co_await dev_co_wait_key(s,deadline);
+}
+
+GkDevTask<phemap_ret_t> gk_dev_co_update(gk_dev_co_session_t* const s, const uint64_t timeout_ms)
+{
+    DEV_ASSERT(NULL != s);
+    uint64_t deadline = dev_co_deadline(s,timeout_ms);
+    uint32_t epoch = s->dev.epoch;
+    uint8_t pkt[GK_DEV_CO_MAX_PKT];
+    for(;;)
+    {
+        uint8_t len = co_await gk_dev_co_recv(s,pkt,deadline);
+        if(len == 0)
+            co_return CONN_WAIT;
+        phemap_ret_t ret;
+        {
+            dev_co_scope scope(s);
+            ret = gk_dev_automa(&s->dev,pkt,len);
+        }
+        gk_dev_co_flush(s);
+        if(ret == REINIT)
+            co_return REINIT;
+        //  A RESYNC_DELTA moves the epoch too, possibly by more than one
+        if(s->dev.epoch != epoch && s->dev.resync_pending == 0)
+            co_return UPDATE_OK;
+    }
+}
+
+void gk_dev_co_leave(gk_dev_co_session_t* const s)
+{
+    DEV_ASSERT(NULL != s);
+    {
+        dev_co_scope scope(s);
+        gk_dev_end_session(&s->dev);
+    }
+    gk_dev_co_flush(s);
+}
@@ -0,0 +1,286 @@
+/*
+    Group-Key-Phemap - Copyright (C) 2023-2024 Antonio Emmanuele
+
+    This file is part of Group-Key-Phemap.
+
+    Group-Key-Phemap is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Group-Key-Phemap is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file    gk_dev_coro.h
+ * @brief   Coroutine driver for device sessions: co_await a join or an update instead of hand driving the automa.
+ * @details A session owns a Device and a small inbox. Its flows are C++20 coroutines (GkDevTask) suspending
+ *          on the inbox, with a deadline, or on a timer. A scheduler runs them on the calling thread only:
+ *          the network delivers pkts with gk_dev_co_deliver, the mexs of the device outbox go out through the
+ *          send callback, and gk_dev_co_run resumes the sessions that got a pkt or whose timer expired.
+ *          The clock is given by the caller, the wall clock of an epoll loop or a virtual one for simulations
+ *          (gk_dev_co_run_virtual), so a thread can host hundreds of thousands of sessions: a suspended
+ *          session costs its gk_dev_co_session_t and its coroutine frames, and no thread or stack.
+ *          The chain hooks (dev_get_next_puf_resp ...) have no device argument, a platform hosting more
+ *          devices picks the chain with gk_dev_co_current.
+ *          Requires C++20, the rest of the device code still builds as C++11.
+ */
+#ifndef GK_DEV_CORO_H
+#define GK_DEV_CORO_H
+#if __cplusplus < 202002L
+#error "gk_dev_coro.h requires C++20"
+#endif
+#include "gk_phemap_dev.h"
+#include <coroutine>
+#include <exception>
+#include <vector>
+#ifndef GK_DEV_CO_INBOX_DEPTH
+#define GK_DEV_CO_INBOX_DEPTH   4       /*!< Pkts a session holds while it is not waiting for them*/
+#endif
+#define GK_DEV_CO_MAX_PKT       PHEMAP_KEY_MEX_SIZE
+#define GK_DEV_CO_FOREVER       UINT64_MAX
+
+struct gk_dev_co_session_s;
+struct gk_dev_co_sched_s;
+
+/**
+ * @brief Called for each mex the device outbox holds after a step of a flow, it must not resume sessions.
+ */
+typedef void (*gk_dev_co_send_t)(struct gk_dev_co_session_s* const s, const uint8_t* const mex, const uint8_t len, void* const user);
+
+/**
+ * @typedef A device session driven by the scheduler.
+ */
+typedef struct gk_dev_co_session_s{
+    Device                      dev;                                        /*!< The device, only its flows touch it.*/
+    struct gk_dev_co_sched_s*   sched;                                      /*!< Scheduler the session runs on.*/
+    void*                       user;                                       /*!< Free for the application, e.g. its peer.*/
+    std::coroutine_handle<>     waiter;                                     /*!< Flow suspended in gk_dev_co_recv, null if none.*/
+    uint64_t                    deadline;                                   /*!< Deadline of waiter.*/
+    uint64_t                    armed_at;                                   /*!< Time of the timer of the session, GK_DEV_CO_FOREVER if none.*/
+    uint8_t                     in_len[GK_DEV_CO_INBOX_DEPTH];              /*!< Bytes of each pkt of the inbox.*/
+    uint8_t                     inbox[GK_DEV_CO_INBOX_DEPTH][GK_DEV_CO_MAX_PKT];    /*!< Pkts delivered and not yet read.*/
+    uint8_t                     in_head;                                    /*!< Oldest pkt of the inbox.*/
+    uint8_t                     in_count;                                   /*!< Pkts in the inbox.*/
+    uint16_t                    in_dropped;                                 /*!< Pkts lost because the inbox was full or too big.*/
+}gk_dev_co_session_t;
+
+/**
+ * @typedef A timer, on a session deadline or on a gk_dev_co_sleep.
+ */
+typedef struct{
+    uint64_t                    at;                                         /*!< Expiry time.*/
+    uint64_t                    seq;                                        /*!< Order of the timers expiring together.*/
+    gk_dev_co_session_t*        s;                                          /*!< Session whose deadline it is, NULL for a sleep.*/
+    std::coroutine_handle<>     h;                                          /*!< Coroutine sleeping, for a sleep.*/
+}gk_dev_co_timer_t;
+
+/**
+ * @typedef Scheduler of the sessions of a thread.
+ */
+typedef struct gk_dev_co_sched_s{
+    std::vector<std::coroutine_handle<>>    ready;                          /*!< Coroutines to resume.*/
+    std::vector<gk_dev_co_timer_t>          timers;                         /*!< Min heap on at, seq.*/
+    uint64_t                                now_ms;                         /*!< Clock of the last gk_dev_co_run.*/
+    uint64_t                                seq;                            /*!< Timers created.*/
+    gk_dev_co_send_t                        send;                           /*!< Sends the mexs of the devices.*/
+    void*                                   user;                           /*!< Passed to send.*/
+    void*                                   roots;                          /*!< Spawned flows not completed, a list.*/
+    uint32_t                                live;                           /*!< Number of roots.*/
+    uint64_t                                resumed;                        /*!< Coroutines resumed.*/
+    uint64_t                                timeouts;                       /*!< Waits ended by their deadline.*/
+}gk_dev_co_sched_t;
+
+/**
+ * @brief Coroutine returned by the flows, started when awaited (or spawned) and owning its frame.
+ * @tparam T Result of the flow, phemap_ret_t for the flows of this file.
+ */
+template<typename T>
+class GkDevTask;
+
+template<typename T>
+struct gk_dev_co_result{
+    T       value{};
+    void    return_value(const T v)     { value = v; }
+    T       get()                       { return value; }
+};
+
+template<>
+struct gk_dev_co_result<void>{
+    void    return_void()               { }
+    void    get()                       { }
+};
+
+template<typename T>
+class GkDevTask{
+public:
+    struct promise_type : gk_dev_co_result<T>{
+        std::coroutine_handle<>     cont;   /*!< Coroutine awaiting this one.*/
+        GkDevTask                   get_return_object()         { return GkDevTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always         initial_suspend() noexcept  { return {}; }
+        void                        unhandled_exception()       { std::terminate(); }
+        struct final_awaiter{
+            bool                    await_ready() noexcept      { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept
+            {
+                return h.promise().cont ? h.promise().cont : std::noop_coroutine();
+            }
+            void                    await_resume() noexcept     { }
+        };
+        final_awaiter               final_suspend() noexcept    { return {}; }
+    };
+    GkDevTask(GkDevTask&& o) noexcept : h(o.h)                  { o.h = nullptr; }
+    GkDevTask(const GkDevTask&)                                 = delete;
+    GkDevTask& operator=(const GkDevTask&)                      = delete;
+    ~GkDevTask()                                                { if(h) h.destroy(); }
+    bool                    await_ready() const noexcept        { return !h || h.done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) noexcept
+    {
+        h.promise().cont = c;
+        return h;
+    }
+    T                       await_resume()                      { return h.promise().get(); }
+private:
+    explicit GkDevTask(std::coroutine_handle<promise_type> p) : h(p) { }
+    std::coroutine_handle<promise_type> h;
+};
+
+/**
+ * @brief Initialize a scheduler, its clock starts at 0.
+ *
+ * @param sched     The scheduler.
+ * @param send      Called with the mexs of the devices.
+ * @param user      Passed to send.
+ */
+void gk_dev_co_sched_init(gk_dev_co_sched_t* const sched, const gk_dev_co_send_t send, void* const user);
+
+/**
+ * @brief Destroy the flows still suspended, the sessions are not touched.
+ */
+void gk_dev_co_sched_free(gk_dev_co_sched_t* const sched);
+
+/**
+ * @brief Initialize a session of the scheduler, the device has no key.
+ */
+void gk_dev_co_session_init(gk_dev_co_sched_t* const sched, gk_dev_co_session_t* const s, const phemap_id_t id, const phemap_id_t as_id);
+
+/**
+ * @brief Run a flow, it starts at the next gk_dev_co_run and is freed when it completes or with the scheduler.
+ */
+void gk_dev_co_spawn(gk_dev_co_sched_t* const sched, GkDevTask<void>&& flow);
+
+/**
+ * @brief Give a pkt received from the network to a session, the flow waiting for it runs at the next gk_dev_co_run.
+ *
+ * @return uint8_t 1 if queued, 0 if dropped because the inbox is full or the pkt too big.
+ */
+uint8_t gk_dev_co_deliver(gk_dev_co_session_t* const s, const uint8_t* const pkt, const uint32_t len);
+
+/**
+ * @brief Advance the clock to now_ms and resume the flows that are ready or whose timer expired, until none is.
+ *
+ * @return uint32_t Number of coroutines resumed.
+ */
+uint32_t gk_dev_co_run(gk_dev_co_sched_t* const sched, const uint64_t now_ms);
+
+/**
+ * @brief Time of the next timer, GK_DEV_CO_FOREVER if none, e.g. to compute the epoll timeout.
+ */
+uint64_t gk_dev_co_next_timer(const gk_dev_co_sched_t* const sched);
+
+/**
+ * @brief Simulation: run and move the clock straight to the next timer, until no flow is left, no timer is 
+ *        left, or the next timer is after until_ms.
+ *
+ * @return uint32_t Flows still running.
+ */
+uint32_t gk_dev_co_run_virtual(gk_dev_co_sched_t* const sched, const uint64_t until_ms);
+
+/**
+ * @brief Session whose flow is calling the device functions, for the platform hooks; NULL outside the flows.
+ */
+gk_dev_co_session_t* gk_dev_co_current();
+
+/**
+ * @brief Send the mexs in the outbox of the device.
+ */
+void gk_dev_co_flush(gk_dev_co_session_t* const s);
+
+/**
+ * @brief Awaitable resuming after ms milliseconds of the scheduler clock.
+ */
+struct gk_dev_co_sleep_t{
+    gk_dev_co_sched_t*  sched;
+    uint64_t            at;
+    bool                await_ready() const noexcept    { return at <= sched->now_ms; }
+    void                await_suspend(std::coroutine_handle<> h);
+    void                await_resume() const noexcept   { }
+};
+
+inline gk_dev_co_sleep_t gk_dev_co_sleep(gk_dev_co_sched_t* const sched, const uint64_t ms)
+{
+    return gk_dev_co_sleep_t{sched,sched->now_ms + ms};
+}
+
+/**
+ * @brief Awaitable resuming with the next pkt of the session, or with 0 once the clock reaches the deadline.
+ */
+struct gk_dev_co_recv_t{
+    gk_dev_co_session_t*    s;
+    uint8_t*                pkt;        /*!< Buffer of GK_DEV_CO_MAX_PKT bytes.*/
+    uint64_t                deadline;
+    bool                    await_ready() const noexcept    { return s->in_count > 0 || deadline <= s->sched->now_ms; }
+    void                    await_suspend(std::coroutine_handle<> h);
+    uint8_t                 await_resume();
+};
+
+/**
+ * @brief co_await gk_dev_co_recv(s,pkt,deadline) gives the bytes copied in pkt, 0 on timeout.
+ */
+inline gk_dev_co_recv_t gk_dev_co_recv(gk_dev_co_session_t* const s, uint8_t* const pkt, const uint64_t deadline_ms)
+{
+    return gk_dev_co_recv_t{s,pkt,deadline_ms};
+}
+
+/**
+ * @brief Join the group: drop the stale pkts, send START_SESS and wait for the START_PK, whose PK_CONF is sent.
+ *
+ * @param s             The session.
+ * @param timeout_ms    Time to wait for the key.
+ * @return phemap_ret_t INSTALL_OK, REINIT if the START_PK is invalid, CONN_WAIT on timeout.
+ */
+GkDevTask<phemap_ret_t> gk_dev_co_join(gk_dev_co_session_t* const s, const uint64_t timeout_ms);
+
+/**
+ * @brief Wait for the START_PK of an install started by the AS (gk_as_start_session), without sending START_SESS.
+ *
+ * @return phemap_ret_t As gk_dev_co_join.
+ */
+GkDevTask<phemap_ret_t> gk_dev_co_install(gk_dev_co_session_t* const s, const uint64_t timeout_ms);
+
+/**
+ * @brief Resume the session from a ticket, see gk_dev_resume_session.
+ *
+ * @return phemap_ret_t INSTALL_OK, REINIT if the ticket can't be used or the RESUME_PK is invalid, CONN_WAIT on
+ *         timeout, e.g. when the AS doesn't answer since the device was removed.
+ */
+GkDevTask<phemap_ret_t> gk_dev_co_resume(gk_dev_co_session_t* const s, const gk_dev_ticket_t* const ticket, const uint64_t timeout_ms);
+
+/**
+ * @brief Process the pkts of a member until the key moves to a newer epoch, the RESYNC_REQ of a gap included.
+ *
+ * @return phemap_ret_t UPDATE_OK, REINIT if the device lost the key, CONN_WAIT on timeout.
+ */
+GkDevTask<phemap_ret_t> gk_dev_co_update(gk_dev_co_session_t* const s, const uint64_t timeout_ms);
+
+/**
+ * @brief Leave the group, END_SESS is sent at once and nothing is awaited.
+ */
+void gk_dev_co_leave(gk_dev_co_session_t* const s);
+#endif
@@ -24,13 +24,18 @@
  * @date 2023-06-18
  */
 #include "gk_phemap_dev.h"
+#if DEV_USE_STDIO
 #include "stdio.h"
-#include "assert.h"
-#include "math.h"
+#endif
 #include "string.h"
+#if DEV_USE_ASSERT
+#include "assert.h"
+#define DEV_ASSERT(x)   assert(x)
+#else
+#define DEV_ASSERT(x)   ((void)0)
+#endif
 
 static private_key_t dev_keyed_sign(const uint8_t *const buff, const uint32_t buff_size, const private_key_t sign_key );
-phemap_ret_t gk_dev_sup_inst(Device* const dev, const uint8_t* const rcvd_pkt,const uint8_t pkt_len);
 /**
  * @brief Function used to create a mex composed MEX_TYPE|SENDER_ID|CHALLENGE 
  * 
@@ -45,36 +50,73 @@ static inline void forge_simple_mex(const phemap_mex_t mtype,const phemap_id_t i
     dev_get_next_puf_resp_u8(&mex[1+sizeof(phemap_id_t)]); 
 }
 
+/**
+ * @brief Next free outbox slot, the mex is queued by increasing the count once it is forged.
+ * 
+ * @param dev Pointer to the device 
+ * @return dev_outbox_entry_t* The slot, NULL if the outbox is full
+ */
+static dev_outbox_entry_t* dev_outbox_reserve(Device* const dev)
+{
+    if(dev->outbox.count == DEV_OUTBOX_DEPTH)
+    {
+        dev->outbox.dropped++;
+        return NULL;
+    }
+    return &dev->outbox.entries[(dev->outbox.head + dev->outbox.count) % DEV_OUTBOX_DEPTH];
+}
+
+/**
+ * @brief Handle a START_PK rcvd with the key installed, i.e. retransmitted by the AS because the PK_CONF got lost.
+ * 
+ * @param dev Pointer to the device 
+ * @param resp_mex Rcvd pkt
+ * @param resp_len Rcvd pkt size
+ * @return phemap_ret_t CONN_WAIT if it was the START_PK of the installed key, REINIT if it is a new one
+ */
+static phemap_ret_t dev_start_pk_repeated(Device* const dev, const uint8_t* const resp_mex, const uint32_t resp_len);
+
+/**
+ * @brief Forge a simple mex directly into the next free outbox slot.
+ * 
+ * @param dev Pointer to the device 
+ * @param mtype Type of the mex
+ * @return uint8_t 1 if the mex was queued, 0 if the outbox is full
+ */
+static uint8_t dev_send_simple_mex(Device* const dev, const phemap_mex_t mtype)
+{
+    dev_outbox_entry_t* slot = dev_outbox_reserve(dev);
+    if(slot == NULL)
+        return 0;
+    slot->type  = mtype;
+    slot->len   = DEV_SIMPLE_MEX_SIZE;
+    forge_simple_mex(mtype,dev->id,slot->mex);
+    dev->outbox.count++;
+    return 1;
+}
+
 // Start group key installation
 void gk_dev_start_session(Device* const dev )
 {
-    uint8_t start_mex[1+sizeof(puf_resp_t)+sizeof(phemap_id_t)];
-    forge_simple_mex(START_SESS,dev->id,start_mex);
-#if DEV_PC_DBG
-    uint32_t snd=U8_TO_PUF_BE(&start_mex[1+sizeof(phemap_id_t)]);
-    printf ("[DEVICE] Starting communication with puf  %#x \n" ,snd);
-#endif
-
     // Communication protocol send
     //dev->write_data_to_as(dev->id,start_mex,1+sizeof(puf_resp_t)+sizeof(phemap_id_t));
-    memcpy(dev->unicast_tsmt_buff,start_mex,7);
-    dev->unicast_is_present=1;
-    dev->dev_state = GK_DEV_WAIT_START_PK;
+    dev_send_simple_mex(dev,START_SESS);
+#if DEV_PC_DBG
+    printf ("[DEVICE] Starting communication, %u mexs queued \n" ,dev->outbox.count);
+#endif
+    dev->dev_state      = GK_DEV_WAIT_START_PK;
+    dev->resync_pending = 0;
 }
 
 // Leave the group
 void gk_dev_end_session(Device* const dev)
 {
-    uint8_t end_mex[1+sizeof(phemap_id_t)+sizeof(puf_resp_t)];
-    forge_simple_mex(END_SESS,dev->id,end_mex);
-#if DEV_PC_DBG
-    uint32_t snd=U8_TO_PUF_BE(&end_mex[1+sizeof(phemap_id_t)]);
-    printf ("[DEVICE %u ] Ending communication with puf  %#x \n" ,dev->id,snd);
-#endif
     // Communication protocol send
     //dev->write_data_to_as(dev->id,end_mex,1+sizeof(puf_resp_t)+sizeof(phemap_id_t));
-    memcpy(dev->unicast_tsmt_buff,end_mex,7);
-    dev->unicast_is_present=1;
+    dev_send_simple_mex(dev,END_SESS);
+#if DEV_PC_DBG
+    printf ("[DEVICE %u ] Ending communication, %u mexs queued \n" ,dev->id,dev->outbox.count);
+#endif
     dev->dev_state = GK_DEV_WAIT_START_PK;
 }
 
@@ -82,13 +124,14 @@ void gk_dev_end_session(Device* const dev)
 // Cb fun when receiving the response message from the AS
 phemap_ret_t gk_dev_startPK_cb(Device* const dev,const uint8_t * const resp_mex,const uint32_t resp_len)
 {
-    assert( NULL != dev);
-    assert( NULL != resp_mex);
-    if( resp_mex[0] != START_PK || resp_len <  1 + 3*sizeof(puf_resp_t)+sizeof(phemap_id_t))
+    DEV_ASSERT( NULL != dev);
+    DEV_ASSERT( NULL != resp_mex);
+    if( resp_mex[0] != START_PK || resp_len <  PHEMAP_KEY_MEX_SIZE)
     {
 #if DEV_PC_DBG
         printf("[GK-DEVICE] MALFORMED GK AS_RESP-> RESINCRONIZAZION NEEDED");
 #endif
+        PHEMAP_TRACE_EV(PHEMAP_EV_DEV_MALFORMED,dev->id,resp_mex[0],resp_len,0);
         dev->dev_state = GK_DEV_WAIT_START_PK;
         return REINIT;
     }
@@ -101,12 +144,14 @@ phemap_ret_t gk_dev_startPK_cb(Device* const dev,const uint8_t * const resp_mex,
     //  ai+2-> Link used for keying
     puf_resp_t link_keyed           = dev_get_next_puf_resp();          
     // Check the sign 
-    puf_resp_t rcvd_sign = U8_TO_PUF_BE(&resp_mex[1+sizeof(phemap_id_t)+2*sizeof(puf_resp_t)]); 
-    if(rcvd_sign != dev_keyed_sign(resp_mex,1+sizeof(phemap_id_t)+2*sizeof(puf_resp_t),link_keyed)) // Check the signing
+    puf_resp_t rcvd_sign = U8_TO_PUF_BE(&resp_mex[PHEMAP_KEY_MEX_SIGNED]); 
+    puf_resp_t calc_sign = dev_keyed_sign(resp_mex,PHEMAP_KEY_MEX_SIGNED,link_keyed);
+    if(rcvd_sign != calc_sign) // Check the signing
     {
 #if DEV_PC_DBG
-        printf("[GK-DEVICE %u ] AS Authentication failed during response , exp %#x ,calculated %#x \n",dev->id, rcvd_sign,dev_keyed_sign(resp_mex,1+sizeof(phemap_id_t)+2*sizeof(puf_resp_t),link_keyed));
+        printf("[GK-DEVICE %u ] AS Authentication failed during response , exp %#x ,calculated %#x \n",dev->id, rcvd_sign,calc_sign);
 #endif
+        PHEMAP_TRACE_EV(PHEMAP_EV_DEV_AUTH_FAILED,dev->id,START_PK,rcvd_sign,calc_sign);
         dev->dev_state = GK_DEV_WAIT_START_PK;
         return REINIT;
     }
@@ -115,15 +160,20 @@ phemap_ret_t gk_dev_startPK_cb(Device* const dev,const uint8_t * const resp_mex,
     dev->pk = U8_TO_PUF_BE(&resp_mex[1+sizeof(phemap_id_t)])^key_to_add^noise_key_part; 
     //  Get the st and remove its noise
     dev->secret_token = noise_secret_token^(U8_TO_PUF_BE(&resp_mex[1+sizeof(phemap_id_t)+sizeof(puf_resp_t)]));
+    dev->key_part       = key_to_add;
+    dev->epoch          = U8_TO_PUF_BE(&resp_mex[PHEMAP_KEY_MEX_EPOCH]);
+    dev->resync_pending = 0;
+#if DEV_INTER_GROUP
+    //  A new session, the LV could have restarted its epochs too
+    dev->inter_epoch    = 0;
+#endif
 #if DEV_PC_DBG
-        printf("[GK-DEVICE %u] Installed pk %#x secret token %#x \n",dev->id,dev->pk, dev->secret_token);
+        printf("[GK-DEVICE %u] Installed pk %#x secret token %#x epoch %u \n",dev->id,dev->pk, dev->secret_token,dev->epoch);
 #endif
     // Generate response
-    uint8_t resp[1+sizeof(phemap_id_t)+sizeof(puf_resp_t)];
-    forge_simple_mex(PK_CONF,dev->id,resp);
     //dev->write_data_to_as(dev->id,resp,1+sizeof(puf_resp_t)+sizeof(phemap_id_t));
-    memcpy(dev->unicast_tsmt_buff,resp,7);
-    dev->unicast_is_present=1;
+    if(dev_send_simple_mex(dev,PK_CONF) == 1)
+        dev->conf_link = U8_TO_PUF_BE(&dev->outbox.entries[(dev->outbox.head + dev->outbox.count - 1) % DEV_OUTBOX_DEPTH].mex[1+sizeof(phemap_id_t)]);
     dev->dev_state          = GK_DEV_WAIT_FOR_UPDATE;
     dev->is_pk_installed    = 1;
     return INSTALL_OK;
@@ -132,11 +182,12 @@ phemap_ret_t gk_dev_startPK_cb(Device* const dev,const uint8_t * const resp_mex,
 // Callback for updating private key when receiving a mex
 phemap_ret_t gk_dev_update_pk_cb(Device*const dev, const uint8_t * const update_mex,const uint32_t update_len )
 {
-    if(update_mex[0] != UPDATE_KEY || update_len < 1 + 3*sizeof(puf_resp_t) + sizeof(phemap_id_t))
+    if(update_mex[0] != UPDATE_KEY || update_len < PHEMAP_KEY_MEX_SIZE)
     {
 #if DEV_PC_DBG
         printf("[GK-DEVICE] MALFORMED GK AS_UPDATE-> RESINCRONIZAZION NEEDED");
 #endif
+        PHEMAP_TRACE_EV(PHEMAP_EV_DEV_MALFORMED,dev->id,update_mex[0],update_len,0);
         dev->dev_state = GK_DEV_WAIT_START_PK;
         return REINIT;
     }
@@ -146,21 +197,51 @@ phemap_ret_t gk_dev_update_pk_cb(Device*const dev, const uint8_t * const update_
 #if DEV_PC_DBG
         printf("[GK-DEVICE %u ] Received id different from as id, rcvd %u \n ",dev->id,rcvd_id);
 #endif
+        PHEMAP_TRACE_EV(PHEMAP_EV_DEV_WRONG_AS,dev->id,rcvd_id,0,0);
         return CONN_WAIT; // Not loose sync
     }
-    //  bi for key noise, this is the noise that will be removed from the key
-    puf_resp_t key_noise    = dev_get_next_puf_resp(); 
-    //  secret_token noise == key noise
-    puf_resp_t stok_noise   = key_noise;
-    //  bi+1 for MAC 
-    puf_resp_t auth     = dev_get_next_puf_resp();        
-    private_key_t mac   = dev_keyed_sign(update_mex,1+sizeof(phemap_id_t)+2*sizeof(puf_resp_t),auth);
-    private_key_t rcvd_mac = U8_TO_PUF_BE(&update_mex[1+sizeof(phemap_id_t)+2*sizeof(puf_resp_t)]); 
+    uint32_t epoch = U8_TO_PUF_BE(&update_mex[PHEMAP_KEY_MEX_EPOCH]);
+    //  Already applied, or the resync already used links the update would use too, no link is used
+    if(epoch <= dev->epoch || (dev->resync_pending != 0 && dev->resync_done != 0))
+        return CONN_WAIT;
+    //  Some update got lost, its links can't be guessed, ask for the missing ones. Its MAC can't be checked
+    //  either, it is signed with links or a token of the missed epochs: the first RESYNC_REQ costs the AS
+    //  no link and a forged gap is answered with a RESYNC_SKIP at the epoch of the device. One at a time.
+    if(epoch != dev->epoch + 1)
+    {
+        if(dev->resync_pending != 0)
+            return CONN_WAIT;
+#if DEV_PC_DBG
+        printf("[GK-DEVICE %u] Update to epoch %u at epoch %u, resync \n",dev->id,epoch,dev->epoch);
+#endif
+        PHEMAP_TRACE_EV(PHEMAP_EV_DEV_EPOCH_GAP,dev->id,epoch,dev->epoch,0);
+        gk_dev_resync(dev);
+        return CONN_WAIT;
+    }
+    //  A group update is the xor of the old and of the new key, the token is encrypted with the old key and 
+    //  the mex signed with the old token. A linked one uses the next links: bi for key noise, 
+    //  secret_token noise == key noise, bi+1 for MAC
+    puf_resp_t key_noise,stok_noise;
+    private_key_t mac;
+    if(update_mex[PHEMAP_KEY_MEX_ARG] == PHEMAP_UPDATE_GROUP)
+    {
+        key_noise   = 0;
+        stok_noise  = dev->pk;
+        mac         = dev_keyed_sign(update_mex,PHEMAP_KEY_MEX_SIGNED,dev->secret_token);
+    }
+    else
+    {
+        key_noise   = dev_get_next_puf_resp(); 
+        stok_noise  = key_noise;
+        mac         = dev_keyed_sign(update_mex,PHEMAP_KEY_MEX_SIGNED,dev_get_next_puf_resp());
+    }
+    private_key_t rcvd_mac = U8_TO_PUF_BE(&update_mex[PHEMAP_KEY_MEX_SIGNED]); 
     if(mac != rcvd_mac)
     {
 #if DEV_PC_DBG
         printf("[GK-DEVICE] AS Authentication failed during update,  recvd mac %#x exp mac %#x\n",rcvd_mac,mac );
 #endif 
+        PHEMAP_TRACE_EV(PHEMAP_EV_DEV_AUTH_FAILED,dev->id,UPDATE_KEY,rcvd_mac,mac);
         dev->dev_state = GK_DEV_WAIT_START_PK;
         return REINIT;
     }
@@ -168,17 +249,272 @@ phemap_ret_t gk_dev_update_pk_cb(Device*const dev, const uint8_t * const update_
     //  Get the update and the new st removing the noise 
     dev->pk = dev->pk ^ update ^ key_noise;
     dev->secret_token = (U8_TO_PUF_BE(&update_mex[1+sizeof(phemap_id_t)+sizeof(puf_resp_t)])) ^ stok_noise;
+    dev->epoch = epoch;
+    //  Nothing was missed, the RESYNC_SKIP answering the request is dropped
+    dev->resync_pending = 0;
 #if DEV_PC_DBG
-        printf("[GK-DEVICE %u] Update completed, new pk %#x, new sec key %#x \n",dev->id ,dev->pk,dev->secret_token);
+        printf("[GK-DEVICE %u] Update completed, new pk %#x, new sec key %#x epoch %u \n",dev->id ,dev->pk,dev->secret_token,dev->epoch);
 #endif
     dev->dev_state = GK_DEV_WAIT_FOR_UPDATE;
     return OK;
 }
 
+/**
+ * @brief Queue a RESYNC_REQ|DEV_ID|EPOCH|LINKED|LINK|SIGN, or a RESUME_SESS|DEV_ID|EPOCH|CURSOR|LINKED|LINK|SIGN
+ *        while the key is lost. The own key part makes the sign unique to this device.
+ * 
+ * @param dev Pointer to the device manager.
+ * @param linked 1 if the next link of the chain goes in LINK
+ * @return uint8_t 1 if the request was queued, no link is used otherwise
+ */
+static uint8_t dev_send_resync_req(Device* const dev, const uint8_t linked)
+{
+    dev_outbox_entry_t* slot = dev_outbox_reserve(dev);
+    if(slot == NULL)
+        return 0;
+    const uint8_t   resume      = (dev->is_pk_installed == 0) ? 1 : 0;
+    const uint32_t  linked_at   = (resume == 1) ? PHEMAP_RESUME_SESS_LINKED : PHEMAP_RESYNC_REQ_LINKED;
+    slot->type      = (resume == 1) ? RESUME_SESS : RESYNC_REQ;
+    slot->len       = (resume == 1) ? PHEMAP_RESUME_SESS_SIZE : PHEMAP_RESYNC_REQ_SIZE;
+    slot->mex[0]    = slot->type;
+    PHEMAP_ID_TO_U8_BE(dev->id,&slot->mex[1]);
+    PUF_TO_U8_BE(dev->epoch,&slot->mex[1+sizeof(phemap_id_t)]);
+    //  The cursor of the ticket, before the links used by the resume
+    if(resume == 1)
+    {
+        uint32_t cursor = dev_chain_cursor() - dev->resync_done;
+        PUF_TO_U8_BE(cursor,&slot->mex[PHEMAP_RESUME_SESS_CURSOR]);
+    }
+    puf_resp_t link = 0;
+    if(linked == 1)
+    {
+        link = dev_get_next_puf_resp();
+        dev->resync_done++;
+        dev->resync_tag = (uint8_t)link;
+    }
+    slot->mex[linked_at] = linked;
+    PUF_TO_U8_BE(link,&slot->mex[linked_at + 1]);
+    dev->resync_sign = dev_keyed_sign(slot->mex,linked_at + 1 + sizeof(puf_resp_t),dev->key_part^dev->secret_token);
+    PUF_TO_U8_BE(dev->resync_sign,&slot->mex[linked_at + 1 + sizeof(puf_resp_t)]);
+    dev->outbox.count++;
+    return 1;
+}
+
+uint8_t gk_dev_resync(Device* const dev)
+{
+    DEV_ASSERT(NULL != dev);
+    if(dev->is_pk_installed == 0 || dev->dev_state != GK_DEV_WAIT_FOR_UPDATE)
+        return 0;
+    //  A retry keeps counting the links already used, the AS counts them too
+    if(dev->resync_pending == 0)
+        dev->resync_done = 0;
+    if(dev_send_resync_req(dev,0) == 0)
+        return 0;
+    dev->resync_pending = 1;
+    return 1;
+}
+
+phemap_ret_t gk_dev_resync_skip_cb(Device* const dev, const uint8_t* const skip_mex, const uint32_t skip_len)
+{
+    DEV_ASSERT(NULL != dev);
+    DEV_ASSERT(NULL != skip_mex);
+    if(skip_mex[0] != RESYNC_SKIP || skip_len < PHEMAP_KEY_MEX_SIZE)
+    {
+        PHEMAP_TRACE_EV(PHEMAP_EV_DEV_MALFORMED,dev->id,skip_mex[0],skip_len,0);
+        return CONN_WAIT;
+    }
+    phemap_id_t rcvd_id = U8_TO_PHEMAP_ID_BE(&skip_mex[1]);
+    if(rcvd_id != dev->as_id)
+    {
+        PHEMAP_TRACE_EV(PHEMAP_EV_DEV_WRONG_AS,dev->id,rcvd_id,0,0);
+        return CONN_WAIT;
+    }
+    if(dev->resync_pending == 0)
+        return CONN_WAIT;
+    //  Bound to the last request, an old or replayed one is dropped without using links
+    private_key_t   mac         = dev_keyed_sign(skip_mex,PHEMAP_KEY_MEX_SIGNED,dev->key_part^dev->secret_token^dev->resync_sign);
+    private_key_t   rcvd_mac    = U8_TO_PUF_BE(&skip_mex[PHEMAP_KEY_MEX_SIGNED]);
+    if(mac != rcvd_mac)
+    {
+        PHEMAP_TRACE_EV(PHEMAP_EV_DEV_AUTH_FAILED,dev->id,RESYNC_SKIP,rcvd_mac,mac);
+        return CONN_WAIT;
+    }
+    if(dev->is_pk_installed == 1 && U8_TO_PUF_BE(&skip_mex[PHEMAP_KEY_MEX_EPOCH]) == dev->epoch)
+    {
+        dev->resync_pending = 0;
+        return CONN_WAIT;
+    }
+    //  The linked request didn't match, the device is already past the links the AS counts
+    uint8_t hint = skip_mex[PHEMAP_KEY_MEX_ARG];
+    if(dev->resync_pending == 2 && hint < dev->resync_done)
+        return CONN_WAIT;
+    for(; dev->resync_done < hint; dev->resync_done++)
+        dev_get_next_puf_resp();
+    if(dev_send_resync_req(dev,1) == 1)
+        dev->resync_pending = 2;
+#if DEV_PC_DBG
+    printf("[GK-DEVICE %u] Resync or resume skipped to link %u \n",dev->id,dev->resync_done);
+#endif
+    return CONN_WAIT;
+}
+
+phemap_ret_t gk_dev_resync_cb(Device* const dev, const uint8_t* const delta_mex, const uint32_t delta_len)
+{
+    DEV_ASSERT(NULL != dev);
+    DEV_ASSERT(NULL != delta_mex);
+    if(delta_mex[0] != RESYNC_DELTA || delta_len < PHEMAP_KEY_MEX_SIZE)
+    {
+        PHEMAP_TRACE_EV(PHEMAP_EV_DEV_MALFORMED,dev->id,delta_mex[0],delta_len,0);
+        return CONN_WAIT;
+    }
+    phemap_id_t rcvd_id = U8_TO_PHEMAP_ID_BE(&delta_mex[1]);
+    if(rcvd_id != dev->as_id)
+    {
+        PHEMAP_TRACE_EV(PHEMAP_EV_DEV_WRONG_AS,dev->id,rcvd_id,0,0);
+        return CONN_WAIT;
+    }
+    //  Not the answer to the last linked request, its links are not the next ones of the chain
+    if(dev->resync_pending != 2 || delta_mex[PHEMAP_KEY_MEX_ARG] != dev->resync_tag)
+        return CONN_WAIT;
+    //  The links of the missed updates are already skipped, the noise and the MAC as in a linked update
+    puf_resp_t      noise       = dev_get_next_puf_resp();
+    private_key_t   mac         = dev_keyed_sign(delta_mex,PHEMAP_KEY_MEX_SIGNED,dev_get_next_puf_resp());
+    private_key_t   rcvd_mac    = U8_TO_PUF_BE(&delta_mex[PHEMAP_KEY_MEX_SIGNED]);
+    dev->resync_pending =   0;
+    if(mac != rcvd_mac)
+    {
+#if DEV_PC_DBG
+        printf("[GK-DEVICE %u] AS Authentication failed during resync, rcvd mac %#x exp mac %#x\n",dev->id,rcvd_mac,mac);
+#endif
+        PHEMAP_TRACE_EV(PHEMAP_EV_DEV_AUTH_FAILED,dev->id,RESYNC_DELTA,rcvd_mac,mac);
+        dev->dev_state = GK_DEV_WAIT_START_PK;
+        return REINIT;
+    }
+    dev->pk             ^=  U8_TO_PUF_BE(&delta_mex[1+sizeof(phemap_id_t)]) ^ noise;
+    dev->secret_token   =   U8_TO_PUF_BE(&delta_mex[1+sizeof(phemap_id_t)+sizeof(puf_resp_t)]) ^ noise;
+    dev->epoch          =   U8_TO_PUF_BE(&delta_mex[PHEMAP_KEY_MEX_EPOCH]);
+#if DEV_PC_DBG
+    printf("[GK-DEVICE %u] Resynced to epoch %u, new pk %#x \n",dev->id,dev->epoch,dev->pk);
+#endif
+    return OK;
+}
+
+static phemap_ret_t dev_start_pk_repeated(Device* const dev, const uint8_t* const resp_mex, const uint32_t resp_len)
+{
+    if(resp_len < PHEMAP_KEY_MEX_SIZE || U8_TO_PHEMAP_ID_BE(&resp_mex[1]) != dev->as_id)
+        return REINIT;
+    uint32_t epoch = U8_TO_PUF_BE(&resp_mex[PHEMAP_KEY_MEX_EPOCH]);
+    //  A later epoch is a new session of the AS
+    if(epoch > dev->epoch)
+        return REINIT;
+    //  The links are already used, the same PK_CONF is sent again and nothing else changes
+    dev_outbox_entry_t* slot = (epoch == dev->epoch) ? dev_outbox_reserve(dev) : NULL;
+    if(slot != NULL)
+    {
+        slot->type      = PK_CONF;
+        slot->len       = DEV_SIMPLE_MEX_SIZE;
+        slot->mex[0]    = PK_CONF;
+        PHEMAP_ID_TO_U8_BE(dev->id,&slot->mex[1]);
+        PUF_TO_U8_BE(dev->conf_link,&slot->mex[1+sizeof(phemap_id_t)]);
+        dev->outbox.count++;
+    }
+    return CONN_WAIT;
+}
+
+uint8_t gk_dev_save_ticket(const Device* const dev, gk_dev_ticket_t* const ticket)
+{
+    DEV_ASSERT(NULL != dev);
+    DEV_ASSERT(NULL != ticket);
+    //  While a resync is pending the AS may have used links the device hasn't
+    if(dev->is_pk_installed == 0 || dev->dev_state != GK_DEV_WAIT_FOR_UPDATE || dev->resync_pending != 0)
+        return 0;
+    ticket->as_id           = dev->as_id;
+    ticket->epoch           = dev->epoch;
+    ticket->key_part        = dev->key_part;
+    ticket->secret_token    = dev->secret_token;
+    ticket->cursor          = dev_chain_cursor();
+    return 1;
+}
+
+uint8_t gk_dev_resume_session(Device* const dev, const gk_dev_ticket_t* const ticket)
+{
+    DEV_ASSERT(NULL != dev);
+    DEV_ASSERT(NULL != ticket);
+    //  Nothing changes if the request can't be queued
+    if(dev->outbox.count == DEV_OUTBOX_DEPTH)
+    {
+        dev->outbox.dropped++;
+        return 0;
+    }
+    //  The key is lost until the RESUME_PK, what signs the request comes from the ticket
+    dev->as_id              = ticket->as_id;
+    dev->epoch              = ticket->epoch;
+    dev->key_part           = ticket->key_part;
+    dev->secret_token       = ticket->secret_token;
+    dev->is_pk_installed    = 0;
+#if DEV_INTER_GROUP
+    dev->inter_epoch        = 0;
+#endif
+    dev_set_chain_cursor(ticket->cursor);
+    dev->resync_done        = 0;
+    dev_send_resync_req(dev,0);
+    dev->resync_pending = 1;
+    dev->dev_state      = GK_DEV_WAIT_START_PK;
+#if DEV_PC_DBG
+    printf("[GK-DEVICE %u] Resuming from epoch %u cursor %u \n",dev->id,ticket->epoch,ticket->cursor);
+#endif
+    return 1;
+}
+
+phemap_ret_t gk_dev_resume_cb(Device* const dev, const uint8_t* const resume_mex, const uint32_t resume_len)
+{
+    DEV_ASSERT(NULL != dev);
+    DEV_ASSERT(NULL != resume_mex);
+    if(resume_mex[0] != RESUME_PK || resume_len < PHEMAP_KEY_MEX_SIZE)
+    {
+        PHEMAP_TRACE_EV(PHEMAP_EV_DEV_MALFORMED,dev->id,resume_mex[0],resume_len,0);
+        return CONN_WAIT;
+    }
+    phemap_id_t rcvd_id = U8_TO_PHEMAP_ID_BE(&resume_mex[1]);
+    if(rcvd_id != dev->as_id)
+    {
+        PHEMAP_TRACE_EV(PHEMAP_EV_DEV_WRONG_AS,dev->id,rcvd_id,0,0);
+        return CONN_WAIT;
+    }
+    //  Not the answer to the last linked RESUME_SESS, a START_SESS may be waiting on the chain instead
+    if(dev->resync_pending != 2 || dev->is_pk_installed == 1 || resume_mex[PHEMAP_KEY_MEX_ARG] != dev->resync_tag)
+        return CONN_WAIT;
+    //  The links the AS used after the ticket are already skipped, the noise and the MAC as in a RESYNC_DELTA
+    puf_resp_t      noise       = dev_get_next_puf_resp();
+    private_key_t   mac         = dev_keyed_sign(resume_mex,PHEMAP_KEY_MEX_SIGNED,dev_get_next_puf_resp());
+    private_key_t   rcvd_mac    = U8_TO_PUF_BE(&resume_mex[PHEMAP_KEY_MEX_SIGNED]);
+    if(mac != rcvd_mac)
+    {
+#if DEV_PC_DBG
+        printf("[GK-DEVICE %u] AS Authentication failed during resume, rcvd mac %#x exp mac %#x\n",dev->id,rcvd_mac,mac);
+#endif
+        PHEMAP_TRACE_EV(PHEMAP_EV_DEV_AUTH_FAILED,dev->id,RESUME_PK,rcvd_mac,mac);
+        dev->resync_pending = 0;
+        dev->dev_state      = GK_DEV_WAIT_START_PK;
+        return REINIT;
+    }
+    dev->pk                 =   U8_TO_PUF_BE(&resume_mex[1+sizeof(phemap_id_t)]) ^ noise;
+    dev->secret_token       =   U8_TO_PUF_BE(&resume_mex[1+sizeof(phemap_id_t)+sizeof(puf_resp_t)]) ^ noise;
+    dev->epoch              =   U8_TO_PUF_BE(&resume_mex[PHEMAP_KEY_MEX_EPOCH]);
+    dev->resync_pending     =   0;
+    dev->is_pk_installed    =   1;
+    dev->dev_state          =   GK_DEV_WAIT_FOR_UPDATE;
+#if DEV_PC_DBG
+    printf("[GK-DEVICE %u] Resumed at epoch %u, pk %#x \n",dev->id,dev->epoch,dev->pk);
+#endif
+    return INSTALL_OK;
+}
+
 phemap_ret_t gk_dev_automa(Device* const dev, uint8_t * const pPkt,const uint32_t pktLen)
 {
-    assert(NULL != dev);
-    assert(NULL != pPkt);
+    DEV_ASSERT(NULL != dev);
+    DEV_ASSERT(NULL != pPkt);
+    PHEMAP_CAPTURE_ENTER(PHEMAP_CAP_DEV,dev->id,pPkt,pktLen);
     phemap_ret_t toRet =OK;
     //  In case the pkt size is ok
     if(pktLen > 0)
@@ -190,6 +526,13 @@ phemap_ret_t gk_dev_automa(Device* const dev, uint8_t * const pPkt,const uint32_
             case GK_DEV_WAIT_START_PK:
                 if(pPkt[0] == START_PK)
                     toRet = gk_dev_startPK_cb(dev,pPkt,pktLen);
+                else if(pPkt[0] == RESUME_PK)
+                    toRet = gk_dev_resume_cb(dev,pPkt,pktLen);
+                else if(pPkt[0] == RESYNC_SKIP)
+                    toRet = gk_dev_resync_skip_cb(dev,pPkt,pktLen);
+                //  Sent before the RESUME_PK, which already covers it
+                else if(pPkt[0] == UPDATE_KEY && dev->resync_pending != 0)
+                    toRet = CONN_WAIT;
                 else
                 {
 #if DEV_PC_DBG
@@ -200,6 +543,7 @@ phemap_ret_t gk_dev_automa(Device* const dev, uint8_t * const pPkt,const uint32_
                     }
                     printf("\n");
 #endif
+                    PHEMAP_TRACE_EV(PHEMAP_EV_DEV_UNEXPECTED_MEX,dev->id,dev->dev_state,pPkt[0],0);
                     toRet = REINIT;
                 }
             break;
@@ -207,13 +551,24 @@ phemap_ret_t gk_dev_automa(Device* const dev, uint8_t * const pPkt,const uint32_
             case GK_DEV_WAIT_FOR_UPDATE:
                 if( pPkt[0] == UPDATE_KEY)
                     toRet = gk_dev_update_pk_cb(dev,pPkt,pktLen);  
+                else if(pPkt[0] == RESYNC_DELTA)
+                    toRet = gk_dev_resync_cb(dev,pPkt,pktLen);
+                else if(pPkt[0] == RESYNC_SKIP)
+                    toRet = gk_dev_resync_skip_cb(dev,pPkt,pktLen);
+                else if(pPkt[0] == START_PK)
+                    toRet = dev_start_pk_repeated(dev,pPkt,pktLen);
+                else if(pPkt[0] == RESUME_PK)
+                    toRet = gk_dev_resume_cb(dev,pPkt,pktLen);
+#if DEV_INTER_GROUP
                 else if (pPkt[0] == LV_SUP_KEY_INSTALL)
                     toRet = gk_dev_sup_inst(dev,pPkt,pktLen);
+#endif
                 else
                 {
 #if DEV_PC_DBG
                     printf("[GK DEV %u ] Invalid message in wait for update  %u \n ",dev->id,pPkt[0]);
 #endif
+                    PHEMAP_TRACE_EV(PHEMAP_EV_DEV_UNEXPECTED_MEX,dev->id,dev->dev_state,pPkt[0],0);
                     toRet = REINIT;
                 }
             break;
@@ -221,16 +576,56 @@ phemap_ret_t gk_dev_automa(Device* const dev, uint8_t * const pPkt,const uint32_
 #if DEV_PC_DBG
                 printf("[GK DEV] Invalid state \n ");
 #endif  
+                PHEMAP_TRACE_EV(PHEMAP_EV_DEV_UNEXPECTED_MEX,dev->id,dev->dev_state,pPkt[0],0);
                 toRet = REINIT;
             break;
         }
     }
     if(toRet == REINIT)
         dev->dev_state = GK_DEV_WAIT_START_PK;
+    PHEMAP_STATS_RECORD(dev->stats,pPkt,pktLen,toRet,dev->dev_state == GK_DEV_WAIT_START_PK,0,dev->outbox.count);
+    PHEMAP_CAPTURE_EXIT();
     return toRet;
 }
+uint8_t gk_dev_outbox_enqueue(Device* const dev, const phemap_mex_t type, const uint8_t* const mex)
+{
+    DEV_ASSERT(NULL != dev);
+    DEV_ASSERT(NULL != mex);
+    dev_outbox_entry_t* slot = dev_outbox_reserve(dev);
+    if(slot == NULL)
+        return 0;
+    slot->type = type;
+    slot->len  = (type == RESYNC_REQ) ? PHEMAP_RESYNC_REQ_SIZE : (type == RESUME_SESS) ? PHEMAP_RESUME_SESS_SIZE : DEV_SIMPLE_MEX_SIZE;
+    memcpy(slot->mex,mex,slot->len);
+    dev->outbox.count++;
+    return 1;
+}
+
+const dev_outbox_entry_t* gk_dev_outbox_peek(const Device* const dev)
+{
+    DEV_ASSERT(NULL != dev);
+    if(dev->outbox.count == 0)
+        return NULL;
+    return &dev->outbox.entries[dev->outbox.head];
+}
+
+void gk_dev_outbox_pop(Device* const dev)
+{
+    DEV_ASSERT(NULL != dev);
+    if(dev->outbox.count == 0)
+        return;
+    dev->outbox.head = (dev->outbox.head + 1) % DEV_OUTBOX_DEPTH;
+    dev->outbox.count--;
+}
+
+uint8_t gk_dev_outbox_count(const Device* const dev)
+{
+    DEV_ASSERT(NULL != dev);
+    return dev->outbox.count;
+}
+
 // Get the next chain link as an array of u8
-void dev_get_next_puf_resp_u8 (uint8_t* const  puf)
+void __attribute__((weak)) dev_get_next_puf_resp_u8 (uint8_t* const  puf)
 {
     puf[0] = 0xef;
     puf[1] = 0x00;
@@ -239,7 +634,7 @@ void dev_get_next_puf_resp_u8 (uint8_t* const  puf)
 }
 
 // get the next chain link
-puf_resp_t dev_get_next_puf_resp ()
+puf_resp_t __attribute__((weak)) dev_get_next_puf_resp ()
 {
     uint32_t puf_resp;
     uint8_t p_r[4];
@@ -251,51 +646,58 @@ puf_resp_t dev_get_next_puf_resp ()
 
 void  __attribute__((weak)) dev_start_timer(const phemap_id_t id){
     (void)id;
-    printf(" I'm weak :(  \n");
+    PHEMAP_TRACE_EV(PHEMAP_EV_DEV_WEAK_TIMER,id,0,0,0);
 }
 uint8_t   __attribute__((weak)) dev_is_timer_expired(const phemap_id_t id){
     (void)id;
     return 1;
 }
 
+uint32_t  __attribute__((weak)) dev_chain_cursor(){
+    return 0;
+}
+void  __attribute__((weak)) dev_set_chain_cursor(const uint32_t cursor){
+    (void)cursor;
+}
+
+#if DEV_INTER_GROUP
 phemap_ret_t gk_dev_sup_inst(Device* const dev, const uint8_t* const rcvd_pkt,const uint8_t pkt_len)
 {
+    if(pkt_len < PHEMAP_KEY_MEX_SIZE)
+    {
+        PHEMAP_TRACE_EV(PHEMAP_EV_DEV_MALFORMED,dev->id,rcvd_pkt[0],pkt_len,0);
+        return REINIT;
+    }
     //printf(" token utilizzato %u \n ", dev->secret_token);
     //  Calculate the sign using 
-    puf_resp_t calc_sign = dev_keyed_sign(rcvd_pkt,1+sizeof(phemap_id_t)+2*sizeof(puf_resp_t),dev->secret_token);
+    puf_resp_t calc_sign = dev_keyed_sign(rcvd_pkt,PHEMAP_KEY_MEX_SIGNED,dev->secret_token);
     //  Check if the calc sign is eq to the rcvd sign
-    if((U8_TO_PUF_BE(&rcvd_pkt[1+sizeof(phemap_id_t)+2*sizeof(puf_resp_t)]))!=calc_sign)
+    if((U8_TO_PUF_BE(&rcvd_pkt[PHEMAP_KEY_MEX_SIGNED]))!=calc_sign)
     {
 #if DEV_PC_DBG
         printf("DEV %u \n",dev->id);
-        printf("RCvd Sign %#x EXP %#x \n",(U8_TO_PUF_BE(&rcvd_pkt[1+sizeof(phemap_id_t)+2*sizeof(puf_resp_t)])),dev_keyed_sign(rcvd_pkt,1+sizeof(phemap_id_t)+2*sizeof(puf_resp_t),dev->secret_token));
+        printf("RCvd Sign %#x EXP %#x \n",(U8_TO_PUF_BE(&rcvd_pkt[PHEMAP_KEY_MEX_SIGNED])),calc_sign);
 #endif
+        PHEMAP_TRACE_EV(PHEMAP_EV_DEV_AUTH_FAILED,dev->id,LV_SUP_KEY_INSTALL,U8_TO_PUF_BE(&rcvd_pkt[PHEMAP_KEY_MEX_SIGNED]),calc_sign);
         return REINIT;
     }
+    //  A key older than the installed one, delivered late
+    uint32_t epoch = U8_TO_PUF_BE(&rcvd_pkt[PHEMAP_KEY_MEX_EPOCH]);
+    if(epoch <= dev->inter_epoch)
+        return CONN_WAIT;
+    dev->inter_epoch = epoch;
     //  Extract and decode the secret token 
     dev->inter_group_tok = U8_TO_PUF_BE(&rcvd_pkt[1+sizeof(phemap_id_t)+sizeof(puf_resp_t)])^dev->pk;
     //  Extract and decode the key 
     dev->inter_group_key = U8_TO_PUF_BE(&rcvd_pkt[1+sizeof(phemap_id_t)])^dev->pk;
 #if DEV_PC_DBG
-    printf("[GK-DEVICE %u] Inter GK: %u ST %u",dev->id, dev->inter_group_key, dev->inter_group_tok);
+    printf("[GK-DEVICE %u] Inter GK: %u ST %u epoch %u",dev->id, dev->inter_group_key, dev->inter_group_tok, dev->inter_epoch);
 #endif
     return OK;
 }
+#endif
 
 private_key_t dev_keyed_sign(const uint8_t *const buff, const uint32_t buff_size, const private_key_t sign_key )
 {
-    uint32_t new_buff_size = ceil(buff_size/sizeof(private_key_t));
-    uint32_t idx;
-    private_key_t helper,sign = 0;
-    
-    for(idx = 0;idx < new_buff_size-1; idx++)
-    {
-        helper  = U8_TO_PUF_BE(&buff[idx*sizeof(private_key_t)]);
-        sign    ^= (helper^sign_key);
-    }
-    // append the last one
-    helper  =   (U8_TO_PUF_BE(&buff[(new_buff_size-1)*sizeof(private_key_t)])<<8*(new_buff_size-buff_size));
-    sign    ^=  (helper^sign_key);
-    return sign;
+    return phemap_keyed_sign(buff,buff_size,sign_key);
 }
-
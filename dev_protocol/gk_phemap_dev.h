@@ -28,11 +28,62 @@
 #ifndef GK_PHEMAP_DEV_H
 #define GK_PHEMAP_DEV_H
 
-#define DEV_PC_DBG 0
+/*
+ *  Build profile for constrained nodes: defining GK_DEV_MINIMAL drops stdio, assert, the pkt capture, the stats, the event trace and the 
+ *  inter group support and shrinks the outbox. Each option can still be overridden one by one.
+ */
+#ifdef GK_DEV_MINIMAL
+#ifndef DEV_USE_STDIO
+#define DEV_USE_STDIO       0
+#endif
+#ifndef DEV_USE_ASSERT
+#define DEV_USE_ASSERT      0
+#endif
+#ifndef DEV_INTER_GROUP
+#define DEV_INTER_GROUP     0
+#endif
+#ifndef DEV_OUTBOX_DEPTH
+#define DEV_OUTBOX_DEPTH    2
+#endif
+#ifndef PHEMAP_CAPTURE
+#define PHEMAP_CAPTURE      0
+#endif
+#ifndef PHEMAP_STATS
+#define PHEMAP_STATS        0
+#endif
+#ifndef PHEMAP_TRACE
+#define PHEMAP_TRACE        0
+#endif
+#endif
+
+#ifndef DEV_USE_STDIO
+#define DEV_USE_STDIO       1   /*!< Weak hooks and debug paths are allowed to print */
+#endif
+#ifndef DEV_USE_ASSERT
+#define DEV_USE_ASSERT      1   /*!< Check pointers with assert */
+#endif
+#ifndef DEV_INTER_GROUP
+#define DEV_INTER_GROUP     1   /*!< Support the inter group key distributed from the LV */
+#endif
+#ifndef DEV_PC_DBG
+#define DEV_PC_DBG          0
+#endif
+#if DEV_PC_DBG && !DEV_USE_STDIO
+#error "DEV_PC_DBG requires DEV_USE_STDIO"
+#endif
 #if DEV_PC_DBG
 #include "string.h"
 #endif
 #include "dev_common.h"
+#include "../common/phemap_stats.h"
+#include "../common/phemap_trace.h"
+#include "../common/phemap_capture.h"
+
+#ifndef DEV_OUTBOX_DEPTH
+#define DEV_OUTBOX_DEPTH    4   /*!< Number of mexs the device can hold before the radio layer drains them */
+#endif
+#define DEV_SIMPLE_MEX_SIZE (1 + sizeof(phemap_id_t) + sizeof(puf_resp_t))    /*!< TYPE|DEV_ID|LINK*/
+#define DEV_MEX_SIZE        PHEMAP_RESUME_SESS_SIZE /*!< Largest mex sent by the device*/
 
 /**
  * @typedef State of the gkPheamap Device Authoma representing the next mex for the protocol
@@ -43,6 +94,25 @@ typedef enum{
     GK_DEV_WAIT_FOR_UPDATE,     /*!< The device has a key installed and is waiting for an update*/
 }GK_Dev_State;
 
+/**
+ * @typedef Mex waiting in the device outbox
+ */
+typedef struct{
+    uint8_t     type;                   /*!< Type of the mex (phemap_mex_t), tagged so the radio layer can prioritize*/
+    uint8_t     len;                    /*!< Bytes of mex to send*/
+    uint8_t     mex[DEV_MEX_SIZE];      /*!< Mex ready to be sent to the AS*/
+}dev_outbox_entry_t;
+
+/**
+ * @typedef Fixed capacity ring of mexs produced by the device and not yet sent
+ */
+typedef struct{
+    dev_outbox_entry_t  entries[DEV_OUTBOX_DEPTH];  /*!< Ring slots*/
+    uint8_t             head;                       /*!< Slot of the oldest mex*/
+    uint8_t             count;                      /*!< Number of mexs in the ring*/
+    uint16_t            dropped;                    /*!< Mexs lost because the ring was full*/
+}dev_outbox_t;
+
 /**
  * @typedef Device control struct
  */
@@ -53,14 +123,38 @@ typedef struct{
     GK_Dev_State dev_state;     /*!< Current state of the gkPhemap Device protocol*/
     private_key_t secret_token; /*!< Secret key shared from all devices*/
     uint8_t is_pk_installed;    /*!< Checks if the intra group key is installed*/ 
+    uint8_t resync_pending;     /*!< 1 after a RESYNC_REQ or a RESUME_SESS without link, 2 after a linked one, until the AS answers*/
+    uint8_t resync_done;        /*!< Links used by the pending resync or resume, from the position of the device at its epoch*/
+    uint8_t resync_tag;         /*!< Low byte of the link of the last linked request, ARG of the RESYNC_DELTA or RESUME_PK answering it*/
+    puf_resp_t resync_sign;     /*!< Sign of the last RESYNC_REQ or RESUME_SESS, binds the RESYNC_SKIP answering it*/
+    uint32_t epoch;             /*!< Epoch of the installed key*/
+    private_key_t key_part;     /*!< Own part of the key, known only to the AS, signs the RESYNC_REQ*/
+    puf_resp_t conf_link;       /*!< Link of the last PK_CONF, sent again if the START_PK is retransmitted*/
+#if DEV_INTER_GROUP
     puf_resp_t inter_group_key; /*!< Inter group Pk*/
     puf_resp_t inter_group_tok; /*!< Intergroup secret token */
-    uint8_t    unicast_tsmt_buff[7];
-    uint8_t    unicast_is_present;
+    uint32_t inter_epoch;       /*!< Epoch of the inter group key, older LV_SUP_KEY_INSTALL are dropped*/
+#endif
+    dev_outbox_t outbox;        /*!< Mexs the device has to send to the AS, oldest first*/
+#if PHEMAP_STATS
+    phemap_stats_slot_t* stats; /*!< Counters published by the device, NULL if not published*/
+#endif
     /*void (*write_data_to_as)(const phemap_id_t, 
                             const uint8_t* const,
                             const uint32_t);*/
 }Device;
+/**
+ * @typedef Resumption ticket, what a member needs to get the key back without a new session
+ * @details Saved by the application in non volatile memory while the key is installed, e.g. after each 
+ *          update. It is bound to the epoch of the key and to the position of the device in its chain.
+ */
+typedef struct{
+    phemap_id_t     as_id;          /*!< Id of the AS of the group*/
+    uint32_t        epoch;          /*!< Epoch of the key when the ticket was saved*/
+    private_key_t   key_part;       /*!< Own part of the key*/
+    private_key_t   secret_token;   /*!< Secret token of the epoch*/
+    uint32_t        cursor;         /*!< Position in the chain, dev_chain_cursor*/
+}gk_dev_ticket_t;
 /**
  * @brief Function used from a device in order to start a session
  * @param dev Pointer to the device gkPhemap control structure
@@ -91,6 +185,62 @@ void gk_dev_end_session(Device *const  dev);
  * @return phemap_ret_t Operation status.
  */
 phemap_ret_t gk_dev_update_pk_cb( Device *const  dev,const uint8_t * const update_mex,const uint32_t update_len);
+/**
+ * @brief Ask the AS for the updates missed since the epoch of the installed key.
+ * @details The device does it by itself when an update skips some epochs, the application calls it 
+ *          when it suspects a lost update or when the RESYNC_DELTA doesn't come. The RESYNC_REQ carries no
+ *          link, the AS answers with a RESYNC_SKIP and gk_dev_resync_skip_cb sends the linked one. Updates 
+ *          are dropped once the device used a link for the resync, until the RESYNC_DELTA arrives.
+ * @param dev Pointer to the device manager.
+ * @return uint8_t 1 if the RESYNC_REQ was queued.
+ */
+uint8_t gk_dev_resync(Device* const dev);
+/**
+ * @brief Function called when the AS tells how many links the updates missed by the device used.
+ * @details The device skips them and queues the request again with its next link. A RESYNC_SKIP at the epoch
+ *          of an installed key means nothing was missed, e.g. the gap came from a forged update, and ends the resync.
+ * @param dev Pointer to the device manager.
+ * @param skip_mex RESYNC_SKIP rcvd.
+ * @param skip_len Rcvd size.
+ * @return phemap_ret_t CONN_WAIT, the mex never changes the key.
+ */
+phemap_ret_t gk_dev_resync_skip_cb(Device* const dev, const uint8_t* const skip_mex, const uint32_t skip_len);
+/**
+ * @brief Function called when receiving the updates missed by the device.
+ * 
+ * @param dev Pointer to the device manager.
+ * @param delta_mex RESYNC_DELTA rcvd.
+ * @param delta_len Rcvd size.
+ * @return phemap_ret_t OK, CONN_WAIT if it doesn't answer the last linked RESYNC_REQ, REINIT if the chain is lost.
+ */
+phemap_ret_t gk_dev_resync_cb(Device* const dev, const uint8_t* const delta_mex, const uint32_t delta_len);
+/**
+ * @brief Save the resumption ticket of the installed key.
+ * 
+ * @param dev Pointer to the device manager.
+ * @param ticket Filled with the ticket.
+ * @return uint8_t 1 if the ticket was saved, 0 if no key is installed or a resync is in progress.
+ */
+uint8_t gk_dev_save_ticket(const Device* const dev, gk_dev_ticket_t* const ticket);
+/**
+ * @brief Rejoin the group with a ticket instead of a new session, e.g. after a reboot.
+ * @details The chain is moved back to the cursor of the ticket and a RESUME_SESS without link is queued, the AS
+ *          answers with a RESYNC_SKIP, then the linked one with a RESUME_PK. The rest of the group is not rekeyed. If the AS refuses the ticket, because the
+ *          device was removed or the ticket is too old, the device has to call gk_dev_start_session.
+ * @param dev Pointer to the device manager, id set.
+ * @param ticket Ticket saved by gk_dev_save_ticket.
+ * @return uint8_t 1 if the RESUME_SESS was queued.
+ */
+uint8_t gk_dev_resume_session(Device* const dev, const gk_dev_ticket_t* const ticket);
+/**
+ * @brief Function called when the AS reinstates the key of a resumed session.
+ * 
+ * @param dev Pointer to the device manager.
+ * @param resume_mex RESUME_PK rcvd.
+ * @param resume_len Rcvd size.
+ * @return phemap_ret_t INSTALL_OK, CONN_WAIT if it doesn't answer the last linked RESUME_SESS, REINIT if the chain is lost.
+ */
+phemap_ret_t gk_dev_resume_cb(Device* const dev, const uint8_t* const resume_mex, const uint32_t resume_len);
 /**
  * @brief Automa function called when receiving a packet.
  * 
@@ -100,6 +250,7 @@ phemap_ret_t gk_dev_update_pk_cb( Device *const  dev,const uint8_t * const updat
  * @return phemap_ret_t Operation status.
  */
 phemap_ret_t gk_dev_automa(Device* const pDev, uint8_t * const pPkt,const uint32_t pktLen);
+#if DEV_INTER_GROUP
 /**
  * @brief Callback fn called in DGK when LV shares the key.
  * 
@@ -109,16 +260,46 @@ phemap_ret_t gk_dev_automa(Device* const pDev, uint8_t * const pPkt,const uint32
  * @return phemap_ret_t Operation status.
  */
 phemap_ret_t gk_dev_sup_inst(Device* const dev, const uint8_t* const rcvd_pkt,const uint8_t pkt_len);
+#endif
 /**
- * @brief Obtain the next response of the PUF using the sentinel counter of PHEMAP.
+ * @brief Append a mex to the device outbox.
  * 
+ * @param dev Pointer to device manager.
+ * @param type Type of the mex.
+ * @param mex Mex of DEV_MEX_SIZE bytes, only the bytes of a mex of its type are sent.
+ * @return uint8_t 1 if the mex was queued, 0 if the outbox is full and the mex was dropped.
+ */
+uint8_t gk_dev_outbox_enqueue(Device* const dev, const phemap_mex_t type, const uint8_t* const mex);
+/**
+ * @brief Get the oldest mex in the outbox without removing it.
+ * 
+ * @param dev Pointer to device manager.
+ * @return const dev_outbox_entry_t* Oldest mex, NULL if the outbox is empty.
+ */
+const dev_outbox_entry_t* gk_dev_outbox_peek(const Device* const dev);
+/**
+ * @brief Remove the oldest mex from the outbox, once the radio layer has sent it.
+ * 
+ * @param dev Pointer to device manager.
+ */
+void gk_dev_outbox_pop(Device* const dev);
+/**
+ * @brief Number of mexs waiting in the outbox.
+ * 
+ * @param dev Pointer to device manager.
+ * @return uint8_t Number of queued mexs.
+ */
+uint8_t gk_dev_outbox_count(const Device* const dev);
+/**
+ * @brief Obtain the next response of the PUF using the sentinel counter of PHEMAP.
+ * @details Weak, the stock one returns a constant link, the platform replaces it with its PUF.
  * @param puf Pointer to the response. 
  */
 void dev_get_next_puf_resp_u8 (uint8_t* const puf);
 /**
  * @brief Return the next response of the PUF according to the value in the Q register and on 
  *        the sentinel counter.
- * 
+ * @details Weak, the stock one reads dev_get_next_puf_resp_u8.
  * @return puf_resp_t Next link of the chain. 
  */
 puf_resp_t dev_get_next_puf_resp();
@@ -28,7 +28,6 @@
 #include "stdio.h"
 #include "stdlib.h"
 #include "assert.h"
-#include "math.h"
 #include "stdlib.h"
 #include "string.h"
 
@@ -66,6 +65,72 @@ static puf_resp_t LvGetNextCarnetLink (const phemap_id_t reqId);
  */
 static void LvSendGroupToDevs(local_verifier_t*const lv);
 
+/**
+ * @brief Forge the LV_SUP_KEY_INSTALL of the installed Inter Group key at the current inter epoch.
+ * 
+ * @param lv Local Verifier sending the key.
+ * @param mex Buffer of PHEMAP_KEY_MEX_SIZE bytes.
+ */
+static void LvForgeGroupMex(const local_verifier_t*const lv, uint8_t*const mex);
+
+/**
+ * @brief Callback function used from the LV when it receives the combined key from its parent in the tree.
+ * 
+ * @param lv            Struct managing the LV. 
+ * @param RcvdBuff      Pointer to the rcvd pkt. 
+ * @param size          Size of the rcvd pkt.
+ * @return phemap_ret_t Op status. 
+ */
+static phemap_ret_t LvCombinedCB(local_verifier_t* const lv, uint8_t * const RcvdBuff, const uint32_t size);
+
+/**
+ * @brief Forge a mex for other LVs carrying a key and a token encrypted with the LV private key.
+ * @details The EPOCH of the mex is the next one of its type, the receivers apply only the next epoch of each sender.
+ * 
+ * @param lv        Local Verifier sending the mex.
+ * @param type      INTER_KEY_INSTALL or INTER_KEY_COMBINED.
+ * @param key       Key, or key part, in clear.
+ * @param tok       Secret token, or token part, in clear.
+ * @param mex       Buffer of LV_MEX_SIZE bytes.
+ */
+static void LvForgeLvMex(local_verifier_t*const lv, const phemap_mex_t type, const private_key_t key, const private_key_t tok, uint8_t*const mex);
+
+/**
+ * @brief Check that a mex of another LV is the next one of its sender, a replayed or a duplicated one moves
+ *        the inter key away from the other LVs.
+ * 
+ * @param lv        Local Verifier receiving the mex.
+ * @param mex       Mex already authenticated.
+ * @param seen      EPOCH of the last mex applied from the sender, advanced if the mex is the next one.
+ * @return uint8_t  1 if the mex can be applied.
+ */
+static uint8_t LvNextEpoch(local_verifier_t*const lv, const uint8_t*const mex, uint32_t*const seen);
+
+/**
+ * @brief Account a part of the subtree in the aggregation tree, own or from a child, in clear.
+ * 
+ * @param lv        Local Verifier.
+ * @param key       Key part.
+ * @param tok       Secret token part.
+ */
+static void LvTreeAddPart(local_verifier_t*const lv, const private_key_t key, const private_key_t tok);
+
+/**
+ * @brief Send the installed inter group key to the children in the tree.
+ * 
+ * @param lv        Local Verifier.
+ */
+static void LvTreeSendDown(local_verifier_t*const lv);
+
+/**
+ * @brief Account the part of an update round received from a LV, closing the round when
+ *        all the LVs sent their part.
+ * 
+ * @param lv        Local Verifier receiving the part.
+ * @param lv_idx    Index in list_of_lv of the sender.
+ */
+static void LvAggregateUpdate(local_verifier_t*const lv, const uint16_t lv_idx);
+
 /**
  * @brief Callback function called when the device receives a packet.
  * 
@@ -85,6 +150,198 @@ static phemap_ret_t LvConfInterGKCB(local_verifier_t *const lv,uint8_t *const Rc
  */
 static private_key_t LvKeyedSign(const uint8_t *const buff, const uint32_t buffSize, const private_key_t signKey );
 
+/**
+ * @brief Automa called when the sender is not known to the LV, the pkt is dropped and counted.
+ * 
+ * @param lv            Struct managing the LV that received the pkt.
+ * @param RcvdBuff      Pointer to the rcvd pkt. 
+ * @param rcvd_size     Size of the rcvd pkt.
+ * @return phemap_ret_t CONN_WAIT, the LV state is untouched.
+ */
+static phemap_ret_t lv_unknown_sender_automa(local_verifier_t* const lv, uint8_t* const RcvdBuff, const uint32_t rcvd_size);
+
+/**
+ * @typedef Automa handling the pkts of a sender role
+ */
+typedef phemap_ret_t (*lv_sender_automa_t)(local_verifier_t* const, uint8_t* const, const uint32_t);
+
+/**
+ * @brief Jump table from the lv_route_role_t of the sender to its automa.
+ */
+static const lv_sender_automa_t lv_sender_automas[LV_ROUTE_NUM] = {
+    lv_unknown_sender_automa,   //  LV_ROUTE_NONE
+    lv_as_sender_automa,        //  LV_ROUTE_AS
+    lv_device_sender_automa,    //  LV_ROUTE_DEV
+    lv_otherLv_sender_automa,   //  LV_ROUTE_LV
+};
+
+/**
+ * @brief Index of the first entry to probe for id, the hashed id is scaled to the table size.
+ */
+static inline uint32_t lv_route_hash(const local_verifier_t* const lv, const phemap_id_t id)
+{
+    return (uint32_t)(((uint64_t)((uint32_t)id * 0x9E3779B1u) * lv->num_routes) >> 32);
+}
+
+/**
+ * @brief Find the entry of id or the empty entry where id should be placed.
+ * 
+ * @param lv            Struct managing the LV.
+ * @param id            Phemap id to look for.
+ * @return lv_route_t*  Entry of id, or an entry with role LV_ROUTE_NONE if id is not present.
+ */
+static inline lv_route_t* lv_route_find(const local_verifier_t* const lv, const phemap_id_t id)
+{
+    //  The table is never more than half full, so there is always an empty entry ending the probes
+    uint32_t idx = lv_route_hash(lv,id);
+    while(lv->routes[idx].role != LV_ROUTE_NONE && lv->routes[idx].id != id)
+        idx = (idx + 1 == lv->num_routes) ? 0 : idx + 1;
+    return &lv->routes[idx];
+}
+
+/**
+ * @brief Insert a sender in the table, the first role inserted for an id wins.
+ */
+static inline void lv_route_insert(local_verifier_t* const lv, const phemap_id_t id, const lv_route_role_t role, const uint16_t slot)
+{
+    lv_route_t* entry = lv_route_find(lv,id);
+    if(entry->role != LV_ROUTE_NONE)
+        return;
+    entry->id   = id;
+    entry->role = role;
+    entry->slot = slot;
+}
+
+/**
+ * @brief Role of the sender of a pkt, the AS is checked first as it is not in the table.
+ */
+static inline lv_route_role_t lv_route_role(const local_verifier_t* const lv, const phemap_id_t id)
+{
+    if(lv->lv_dev_role.as_id == id)
+        return LV_ROUTE_AS;
+    return (lv_route_role_t)lv_route_find(lv,id)->role;
+}
+
+void lv_bind(local_verifier_t* const lv, void* const storage, const uint16_t max_devs, const uint16_t max_lv)
+{
+    assert(NULL != lv);
+    assert(NULL != storage);
+    memset(lv,0,sizeof(local_verifier_t));
+    //  The AS arrays first, their size keeps the alignment for the list of LVs
+    gk_as_bind(&lv->lv_as_role,storage,max_devs);
+    lv->part_epoch_seen = (uint32_t*)((uint8_t*)storage + GK_AS_STORAGE_SIZE(max_devs));
+    memset(lv->part_epoch_seen,0,max_lv*sizeof(uint32_t));
+    lv->list_of_lv  = (phemap_id_t*)(lv->part_epoch_seen + max_lv);
+    lv->max_lv      = max_lv;
+    lv->routes      = (lv_route_t*)(lv->list_of_lv + max_lv);
+    lv->num_routes  = LV_ROUTE_SIZE(max_devs,max_lv);
+    memset(lv->routes,0,lv->num_routes*sizeof(lv_route_t));
+    lv->update_part_seen = (uint8_t*)(lv->routes + lv->num_routes);
+    //  Devices only need the latest inter key, parts sent to LVs must all be delivered
+    lv->devs_queue.coalesce_types = (uint16_t)(1u << LV_SUP_KEY_INSTALL);
+}
+
+uint8_t lv_broad_push(lv_broad_queue_t* const q, const uint8_t* const mex)
+{
+    return lv_broad_push_to(q,LV_BROAD_ALL,mex);
+}
+
+uint8_t lv_broad_push_to(lv_broad_queue_t* const q, const phemap_id_t dest, const uint8_t* const mex)
+{
+    assert(NULL != q);
+    assert(NULL != mex);
+    uint8_t i;
+    if(mex[0] < 16 && (q->coalesce_types & (1u << mex[0])) != 0)
+    {
+        //  Drop the queued mex of the same type closing the gap, the new one goes at the tail
+        for(i = 0; i < q->count; i++)
+        {
+            const lv_broad_entry_t* queued = &q->entries[(q->head + i) % LV_BROAD_QUEUE_DEPTH];
+            if(queued->mex[0] == mex[0] && queued->dest == dest)
+            {
+                for(; i + 1 < q->count; i++)
+                    q->entries[(q->head + i) % LV_BROAD_QUEUE_DEPTH] = q->entries[(q->head + i + 1) % LV_BROAD_QUEUE_DEPTH];
+                q->count--;
+                q->coalesced++;
+                break;
+            }
+        }
+    }
+    if(q->count == LV_BROAD_QUEUE_DEPTH)
+    {
+        q->overflows++;
+        return 0;
+    }
+    lv_broad_entry_t* entry = &q->entries[(q->head + q->count) % LV_BROAD_QUEUE_DEPTH];
+    entry->seq  = q->next_seq++;
+    entry->dest = dest;
+    memcpy(entry->mex,mex,LV_MEX_SIZE);
+    q->count++;
+    return 1;
+}
+
+const lv_broad_entry_t* lv_broad_peek(const lv_broad_queue_t* const q)
+{
+    assert(NULL != q);
+    if(q->count == 0)
+        return NULL;
+    return &q->entries[q->head];
+}
+
+void lv_broad_pop(lv_broad_queue_t* const q)
+{
+    assert(NULL != q);
+    if(q->count == 0)
+        return;
+    q->head = (q->head + 1) % LV_BROAD_QUEUE_DEPTH;
+    q->count--;
+}
+
+uint8_t lv_broad_drain(lv_broad_queue_t* const q, const lv_broad_send_t send, void* const ctx)
+{
+    assert(NULL != q);
+    assert(NULL != send);
+    uint8_t sent = 0;
+    while(q->count > 0)
+    {
+        send(ctx,&q->entries[q->head]);
+        lv_broad_pop(q);
+        sent++;
+    }
+    return sent;
+}
+
+phemap_ret_t lv_register_dev(local_verifier_t* const lv, const phemap_id_t id)
+{
+    assert(NULL != lv);
+    phemap_ret_t to_ret = gk_as_register_dev(&lv->lv_as_role,id);
+    if(to_ret == OK)
+        lv_route_insert(lv,id,LV_ROUTE_DEV,lv->lv_as_role.num_auth_devs - 1);
+    return to_ret;
+}
+
+void lv_rebuild_routes(local_verifier_t* const lv)
+{
+    assert(NULL != lv);
+    memset(lv->routes,0,lv->num_routes*sizeof(lv_route_t));
+    //  Devices first, as lv_automa always checked them before the LVs
+    for(uint16_t i = 0; i < lv->lv_as_role.num_auth_devs; i++)
+        lv_route_insert(lv,lv->lv_as_role.auth_devs[i],LV_ROUTE_DEV,i);
+    for(uint16_t i = 0; i < lv->num_lv; i++)
+        lv_route_insert(lv,lv->list_of_lv[i],LV_ROUTE_LV,i);
+}
+
+phemap_ret_t lv_register_lv(local_verifier_t* const lv, const phemap_id_t id)
+{
+    assert(NULL != lv);
+    if(lv->num_lv == lv->max_lv || IsLV(lv,id))
+        return ENROLL_FAILED;
+    lv->list_of_lv[lv->num_lv] = id;
+    lv_route_insert(lv,id,LV_ROUTE_LV,lv->num_lv);
+    lv->num_lv++;
+    return OK;
+}
+
 phemap_ret_t lv_as_sender_automa(local_verifier_t* const lv, uint8_t* const RcvdBuff, const uint32_t rcvd_size)
 {
     //  Check the inputs
@@ -125,10 +382,17 @@ phemap_ret_t lv_otherLv_sender_automa(local_verifier_t* const lv, uint8_t* const
             //  Proceed installing the key 
         to_ret = LvGKPartCB(lv,RcvdBuff,rcvd_size);
     }
+    //  The key combined at the root of the tree
+    else if(RcvdBuff[0] == INTER_KEY_COMBINED)
+    {
+        to_ret = LvCombinedCB(lv,RcvdBuff,rcvd_size);
+    }
     else
     {
-        printf(" INcorrect \n");
-        assert(1 == 0);
+        PHEMAP_TRACE_EV(PHEMAP_EV_LV_UNEXPECTED_MEX,lv->lv_as_role.as_id,RcvdBuff[0],U8_TO_PHEMAP_ID_BE(&RcvdBuff[1]),0);
+        //  A bad pkt of a peer is dropped, it doesn't stop the LV
+        lv->dropped_pkts++;
+        to_ret = CONN_WAIT;
     }
     return to_ret;
 }
@@ -155,71 +419,37 @@ phemap_ret_t lv_device_sender_automa(local_verifier_t*const lv, uint8_t* const R
 #endif
         LvInstallInterGK(lv);
     }
-    /*
-    // If the message was an update request, update the key.
-    if( RcvdBuff[0] == END_SESS )
+    //  A join changes the intra key at START_SESS but it is completed by the PK_CONF of the new member,
+    //  keep the old key until then
+    if(RcvdBuff[0] == START_SESS && to_ret == OK && lv->rekey_pending == 0)
+    {
+        lv->rekey_old_key = old_key;
+        lv->rekey_pending = 1;
+    }
+    else if(RcvdBuff[0] == PK_CONF && to_ret == UPDATE_OK && lv->rekey_pending == 1)
+    {
+        lv->rekey_pending = 0;
+        if(lv->is_inter_installed == 1)
+            lv_forge_new_inter(lv,lv->rekey_old_key);
+    }
+    //  A leave is completed by the END_SESS itself
+    else if(RcvdBuff[0] == END_SESS && to_ret == OK && lv->is_inter_installed == 1)
     {
-        // If the intra key was updated
 #if LV_PC_DBG
         printf("LV %u update completed \n", lv->lv_as_role.as_id);
-#endif          
-        //  Calculate the update as new_intra_pk - old_intra_pk
-        private_key_t update = lv->lv_as_role.private_key ^ old_key;
-        //  Remove the old inter session nonce 
-        update = update ^ lv->inter_sess_nonce;
-        //  Generate the new sess nonce 
-        lv->inter_sess_nonce = as_rng_gen();
-        //  Add the nonce to the update mex 
-        update = update ^ lv->inter_sess_nonce;
-        //  Generate the new secret token 
-        //  It's just a new value to be xored with the already existing st 
-        private_key_t update_st = as_rng_gen();
-        lv->group_secret_token  = lv->group_secret_token ^ update_st;
-        //  Generate update mex and append them
-        uint8_t mex[1+sizeof(phemap_id_t)+3*sizeof(puf_resp_t)];
-        
-        //  Now generate the pkt for Lvs+
-        //  Encrypt the update and st with the intra key of LVS
-        private_key_t update_enc    = (update ^ lv->lv_dev_role.pk);
-        private_key_t st_enc        = (update_st ^ lv->lv_dev_role.pk);     
-        mex[0] = INTER_KEY_INSTALL;
-        PHEMAP_ID_TO_U8_BE(lv->lv_as_role.as_id,&mex[1]);
-        PUF_TO_U8_BE(update_enc,&mex[1+sizeof(phemap_id_t)]);
-        PUF_TO_U8_BE(st_enc,&mex[1+sizeof(phemap_id_t)+sizeof(puf_resp_t)]);
-        private_key_t sign = LvKeyedSign(   mex,
-                                            1+sizeof(phemap_id_t)+2*sizeof(puf_resp_t),
-                                            lv->lv_dev_role.secret_token
-                                        );
-        PUF_TO_U8_BE(sign,&mex[1+sizeof(phemap_id_t)+2*sizeof(puf_resp_t)]);*/
-        /*lv->lv_write_to_others(lv->lv_as_role.as_id,
-                                mex,
-                                1 + sizeof(phemap_id_t) + 3*sizeof(puf_resp_t));*/
-        /*
-        //  Now generate the pkt for devices 
-        memset(mex,0,1+sizeof(phemap_id_t)+3*sizeof(puf_resp_t));
-        //  Encrypt with the dev intra key 
-        update_enc  = (update ^ lv->lv_as_role.private_key);
-        st_enc      = (update_st ^ lv->lv_as_role.private_key);     
-        mex[0]      = LV_SUP_KEY_INSTALL;
-        PHEMAP_ID_TO_U8_BE(lv->lv_as_role.as_id,&mex[1]);
-        PUF_TO_U8_BE(update_enc,&mex[1+sizeof(phemap_id_t)]);
-        PUF_TO_U8_BE(st_enc,&mex[1+sizeof(phemap_id_t)+sizeof(puf_resp_t)]);
-        sign = LvKeyedSign  (   mex,
-                                1+sizeof(phemap_id_t)+2*sizeof(puf_resp_t),
-                                lv->lv_as_role.secret_token
-                            );      
-        PUF_TO_U8_BE(sign,&mex[1+sizeof(phemap_id_t)+2*sizeof(puf_resp_t)]);
-        //  Insert the pending_count as the number of group members
-        //  Setup the pending count 
-        lv->lv_as_role.pending_count=lv->lv_as_role.num_part;  */
-        /*
-        //  Broadcast the pkt 
-        lv->lv_broad_to_devs(   lv->lv_as_role.as_id,
-                                mex,
-                                1 + sizeof(phemap_id_t) + 3*sizeof(puf_resp_t)
-                            );            
-        
-    }*/
+#endif
+        lv_forge_new_inter(lv,old_key);
+    }
+    //  A resumed member got the intra key back but not the inter key, only it gets the current one
+    else if(RcvdBuff[0] == RESUME_SESS && to_ret == OK && lv->is_inter_installed == 1)
+    {
+        uint8_t mex[PHEMAP_KEY_MEX_SIZE];
+        LvForgeGroupMex(lv,mex);
+        lv_broad_push_to(&lv->devs_queue,U8_TO_PHEMAP_ID_BE(&RcvdBuff[1]),mex);
+    }
+    //  The AS role restarts from scratch, so does the inter key
+    if(to_ret == REINIT)
+        lv->rekey_pending = 0;
     return to_ret;
 }
 
@@ -229,100 +459,75 @@ void lv_forge_new_inter(
                 )
 {
     assert(NULL != lv);
-    // Evaluate the difference between the old Kl and the new Kl
-    // Update the session nonce.
-    private_key_t oldNonce = lv->inter_sess_nonce;
-    lv->inter_sess_nonce  = as_rng_gen();
-    // Update the secret token.
-    private_key_t oldSecretToken = lv->group_secret_token;
-    lv->group_secret_token ^= as_rng_gen();
-    // Generate the update message 
-    private_key_t updateMex = old_Kl ^ lv->lv_as_role.private_key ^oldNonce^lv->inter_sess_nonce;
-    private_key_t updateStKey = oldSecretToken ^ lv->group_secret_token;
-    // Update the key..
-    lv->inter_group_key ^= updateMex;
-    // Now generate the message for devices..
-    uint8_t mex[15];
-    mex[0] = LV_SUP_KEY_INSTALL;
-    PHEMAP_ID_TO_U8_BE(lv->lv_dev_role.id,&mex[1]);
-    private_key_t encKey = lv->lv_as_role.private_key ^ lv->inter_group_key;
-    private_key_t encSt = lv->lv_as_role.private_key ^ lv->group_secret_token;
-    PUF_TO_U8_BE(encKey,&mex[3]);
-    PUF_TO_U8_BE(encSt,&mex[3+sizeof(private_key_t)]);
-    //printf(" Token utilizzato %#x ",lv->lv_as_role.secret_token);
-    private_key_t sign = LvKeyedSign(mex,3+2*sizeof(puf_resp_t),lv->lv_as_role.secret_token);
-    //printf(" Firma calcolata %#x ",sign );
-    PUF_TO_U8_BE(sign,&mex[3+2*sizeof(private_key_t)]);
-    memcpy(lv->devices_broad_buffer,mex,15);
-    lv->device_buff_occupied = 1;
-    // Copy the pkt
-    mex[0] = INTER_KEY_INSTALL;
-    // Now generate the packet for local verifiers.
-    encKey = lv->lv_dev_role.pk ^ lv->inter_group_key;
-    encSt = lv->lv_dev_role.pk ^ lv->group_secret_token;
-    PUF_TO_U8_BE(encKey,&mex[3]);
-    PUF_TO_U8_BE(encSt,&mex[3+sizeof(private_key_t)]);
-    sign = LvKeyedSign(mex,3+2*sizeof(puf_resp_t),lv->lv_dev_role.secret_token);
-    PUF_TO_U8_BE(sign,&mex[3+2*sizeof(private_key_t)]);
-    // Copy the pkt
-    memcpy(lv->lvs_broad_buffer,mex,15);
-    lv->lvs_buff_occupied = 1;
-    
+    //  Refresh the session nonce, the delta is never the bare difference of the intra keys
+    private_key_t old_nonce     =   lv->inter_sess_nonce;
+    lv->inter_sess_nonce        =   as_rng_gen();
+    //  Difference between the old part of this LV and the new one
+    private_key_t key_delta     =   old_Kl ^ lv->lv_as_role.private_key ^ old_nonce ^ lv->inter_sess_nonce;
+    //  The new secret token is the old one xored with a fresh value
+    private_key_t tok_delta     =   as_rng_gen();
+    uint8_t mex[LV_MEX_SIZE];
+    LvForgeLvMex(lv,INTER_KEY_INSTALL,key_delta,tok_delta,mex);
+    //  In the tree only the root applies updates, the key comes back with the combined one
+    if(lv->topology == LV_TOPO_TREE && lv->tree_parent != lv->lv_dev_role.id)
+    {
+        lv_broad_push_to(&lv->lvs_queue,lv->tree_parent,mex);
+        return;
+    }
+    lv->inter_group_key         ^=  key_delta;
+    lv->group_secret_token      ^=  tok_delta;
+#if LV_PC_DBG
+    printf("[LV %u ] Intra key changed, InterGK: %#x InterST: %#x \n",lv->lv_as_role.as_id,lv->inter_group_key,lv->group_secret_token);
+#endif
+    if(lv->topology == LV_TOPO_TREE)
+        LvTreeSendDown(lv);
+    else
+        lv_broad_push(&lv->lvs_queue,mex);
+    //  Inside an open aggregation round the devices get the key when the round is closed
+    if(lv->update_mode == LV_UPDATE_AGGREGATE && lv->update_pending > 0)
+        lv->update_dirty = 1;
+    else
+        LvSendGroupToDevs(lv);
 }
 
 phemap_ret_t lv_automa(local_verifier_t*const lv, uint8_t* const RcvdBuff, const uint32_t rcvd_size)
 {
     assert(NULL != lv);             //  Check the pointer
-    phemap_ret_t to_ret = REINIT;   //  Initialize the return value
-    //  If the sender is the Authentication Server  
-    if(IsAS(lv,U8_TO_PHEMAP_ID_BE(&RcvdBuff[1]))) 
-    {
-        to_ret = lv_as_sender_automa(lv,RcvdBuff,rcvd_size);
-    }
-    //  If a device managed by the local verifier is the sender 
-    else if (IsDevice(lv,U8_TO_PHEMAP_ID_BE(&RcvdBuff[1])))
-    {
-        to_ret = lv_device_sender_automa(lv,RcvdBuff,rcvd_size);
-    }
-    //  If it is a message from another local verifier 
-    else if (IsLV(lv,U8_TO_PHEMAP_ID_BE(&RcvdBuff[1])))
-    {
-        to_ret = lv_otherLv_sender_automa(lv,RcvdBuff,rcvd_size);
-    }
+    assert(NULL != RcvdBuff);
+    PHEMAP_CAPTURE_ENTER(PHEMAP_CAP_LV,lv->lv_dev_role.id,RcvdBuff,rcvd_size);
+    phemap_ret_t to_ret = CONN_WAIT;
+    //  The pkt must at least carry the sender id
+    if(rcvd_size < 1 + sizeof(phemap_id_t))
+        lv->dropped_pkts++;
+    //  One lookup for the sender role, then jump to the automa of the role
     else
-    {
-        assert(1 == 0);
-    }
+        to_ret = lv_sender_automas[lv_route_role(lv,U8_TO_PHEMAP_ID_BE(&RcvdBuff[1]))](lv,RcvdBuff,rcvd_size);
+    PHEMAP_STATS_RECORD(lv->stats,RcvdBuff,rcvd_size,to_ret,lv->num_install_pending,lv->lv_as_role.num_part,
+                        lv->devs_queue.count + lv->lvs_queue.count + lv->lv_as_role.unicast_tsmt_count);
+    PHEMAP_CAPTURE_EXIT();
     return to_ret;
 }
 
+static phemap_ret_t lv_unknown_sender_automa(local_verifier_t* const lv, uint8_t* const RcvdBuff, const uint32_t rcvd_size)
+{
+    (void)rcvd_size;
+#if LV_PC_DBG
+    printf("[LV %u ] Dropping pkt %u from unknown sender %u \n",lv->lv_as_role.as_id,RcvdBuff[0],U8_TO_PHEMAP_ID_BE(&RcvdBuff[1]));
+#endif
+    PHEMAP_TRACE_EV(PHEMAP_EV_LV_UNKNOWN_SENDER,lv->lv_as_role.as_id,RcvdBuff[0],U8_TO_PHEMAP_ID_BE(&RcvdBuff[1]),0);
+    lv->dropped_pkts++;
+    return CONN_WAIT;
+}
+
 uint8_t IsDevice(const local_verifier_t*const lv,const phemap_id_t rcvdId)
 {
-    uint8_t to_ret = 0;
-    for(uint32_t i = 0; i< lv->lv_as_role.num_auth_devs; i++)
-    {
-        if(lv->lv_as_role.auth_devs[i] == rcvdId)
-        {
-            to_ret = 1;
-            break;
-        }
-    }
-    return to_ret;
+    return lv_route_find(lv,rcvdId)->role == LV_ROUTE_DEV;
 }
 
 
 uint8_t IsLV(const local_verifier_t*const lv,const phemap_id_t rcvdId)
 {
-    uint8_t to_ret=0;
-    for(uint32_t i=0;i<lv->num_lv;i++)
-    {
-        if(lv->list_of_lv[i]==rcvdId)
-        {
-            to_ret=1;
-            break;
-        }
-    }
-    return to_ret;
+    return lv_route_find(lv,rcvdId)->role == LV_ROUTE_LV;
 }
 
 uint8_t IsAS(const local_verifier_t*const lv,const phemap_id_t rcvdId)
@@ -341,31 +546,21 @@ static void LvInstallInterGK(local_verifier_t*const lv)
     private_key_t key_part      =   (secret_token               //  Add the secret token for back and for sec
                                     ^lv->lv_as_role.private_key);    
     lv->inter_sess_nonce        =   sess_nonce;                 //  Save the session nonce for this fn
+    //  In the tree the own part is combined with the children ones before leaving the LV
+    if(lv->topology == LV_TOPO_TREE)
+    {
+        LvTreeAddPart(lv,key_part,secret_token);
+        return;
+    }
     lv->inter_group_key         ^=  key_part;                   //  Add the newly generated key to the key 
     lv->group_secret_token      ^=  secret_token;               //  Add the newly generated secret token to the secret tokens list 
-    key_part                    ^=  lv->lv_dev_role.pk;         //  Encrypt the new key part with the LV private key
-    secret_token                ^=  lv->lv_dev_role.pk;         //  Encrypt the new token with the LV private key 
     
     // Generate the Local verifier install mex
     //  TYPE+ID+KEY_PART+SECRET_TOKEN+SIGN
-    uint8_t buff[1+sizeof(phemap_id_t)+3*sizeof(puf_resp_t)]; 
-    //  Set the type of the mex as INTER_KEY_INSTALL
-    buff[0] = INTER_KEY_INSTALL;                                                    
-    //  Set the ID of the sender as the ID of the current local verifier   
-    PHEMAP_ID_TO_U8_BE(lv->lv_dev_role.id,&buff[1]);                                
-    //  Add the part of the key given from the local verifier 
-    PUF_TO_U8_BE(key_part,&buff[1+sizeof(phemap_id_t)]);                           
-     //  Add the group secret token 
-    PUF_TO_U8_BE(lv->group_secret_token,                                           
-                &buff[1+sizeof(phemap_id_t)+sizeof(puf_resp_t)]);   
-    //  Generate the sign using the LV group secret token  
-    key_part=LvKeyedSign( buff, 1+sizeof(phemap_id_t)+2*sizeof(puf_resp_t),       
-                            lv->lv_dev_role.secret_token);
-    //  Append the sign to the mex
-    PUF_TO_U8_BE(key_part,&buff[1+sizeof(phemap_id_t)+2*sizeof(puf_resp_t)]);       
+    uint8_t buff[LV_MEX_SIZE]; 
+    LvForgeLvMex(lv,INTER_KEY_INSTALL,key_part,secret_token,buff);
     //  Write the mex to the other LV
-    memcpy(lv->lvs_broad_buffer,buff,15);
-    lv->lvs_buff_occupied = 1;
+    lv_broad_push(&lv->lvs_queue,buff);
     //  Decrease the number of pending operations, for each LV pending ops must be equal to the LV num
     lv->num_install_pending--;   
     //printf("[LV %u ]  Still pending for InterKey: %u \n",lv->lv_as_role.as_id,lv->num_install_pending);
@@ -386,25 +581,52 @@ static void LvInstallInterGK(local_verifier_t*const lv)
 static phemap_ret_t LvGKPartCB(local_verifier_t* const lv, uint8_t * const RcvdBuff, const uint32_t size)
 {
     //  Type and size checks
-    if(RcvdBuff[0] != INTER_KEY_INSTALL && size >= 1+sizeof(phemap_id_t)+3*sizeof(puf_resp_t)) 
+    if(RcvdBuff[0] != INTER_KEY_INSTALL || size < PHEMAP_KEY_MEX_SIZE) 
     {
-        printf("Parse error  !\n");
-
+        PHEMAP_TRACE_EV(PHEMAP_EV_LV_PARSE_ERROR,lv->lv_as_role.as_id,RcvdBuff[0],size,0);
         return CONN_WAIT;
     }
     // Extract the rcvd sign 
-    private_key_t rcvd_sign = U8_TO_PUF_BE(&RcvdBuff[1+sizeof(phemap_id_t)+2*sizeof(puf_resp_t)]);
+    private_key_t rcvd_sign = U8_TO_PUF_BE(&RcvdBuff[PHEMAP_KEY_MEX_SIGNED]);
     //  Check if the rcvd sign is equal to the calculated size
     
-    if (rcvd_sign != LvKeyedSign(RcvdBuff,1+sizeof(phemap_id_t)+2*sizeof(puf_resp_t),lv->lv_dev_role.secret_token))
+    if (rcvd_sign != LvKeyedSign(RcvdBuff,PHEMAP_KEY_MEX_SIGNED,lv->lv_dev_role.secret_token))
     {
-        printf("Error receiving the LV key part  !\n");
 #if LV_PC_DBG
-        printf("Error receiving the LV key part  !");
+        printf("Error receiving the LV key part  !\n");
 #endif
+        PHEMAP_TRACE_EV(PHEMAP_EV_LV_PART_AUTH_FAILED,lv->lv_as_role.as_id,U8_TO_PHEMAP_ID_BE(&RcvdBuff[1]),0,0);
         return AUTH_FAILED;
     }
+    //  Parts are xored into the key, each one must be applied exactly once
+    uint16_t lv_idx = lv_route_find(lv,U8_TO_PHEMAP_ID_BE(&RcvdBuff[1]))->slot;
+    if(LvNextEpoch(lv,RcvdBuff,&lv->part_epoch_seen[lv_idx]) == 0)
+        return CONN_WAIT;
     
+    if(lv->topology == LV_TOPO_TREE)
+    {
+        private_key_t key_part  =   (U8_TO_PUF_BE(&RcvdBuff[1+sizeof(phemap_id_t)]))^lv->lv_dev_role.pk;
+        private_key_t tok_part  =   (U8_TO_PUF_BE(&RcvdBuff[1+sizeof(phemap_id_t)+sizeof(puf_resp_t)]))^lv->lv_dev_role.pk;
+        //  During the install the part of a child is combined with the subtree one
+        if(lv->is_inter_installed == 0)
+            LvTreeAddPart(lv,key_part,tok_part);
+        //  Later on it is an update: the root applies it and sends the key down
+        else if(lv->tree_parent == lv->lv_dev_role.id)
+        {
+            lv->inter_group_key     ^=  key_part;
+            lv->group_secret_token  ^=  tok_part;
+            LvTreeSendDown(lv);
+            LvSendGroupToDevs(lv);
+        }
+        //  The other LVs forward it towards the root
+        else
+        {
+            uint8_t mex[LV_MEX_SIZE];
+            LvForgeLvMex(lv,INTER_KEY_INSTALL,key_part,tok_part,mex);
+            lv_broad_push_to(&lv->lvs_queue,lv->tree_parent,mex);
+        }
+        return OK;
+    }
     // Add the inter grup key rcvd part decoding the rcvd value with the pk
     lv->inter_group_key     ^=  (U8_TO_PUF_BE(&RcvdBuff[1+sizeof(phemap_id_t)]))^lv->lv_dev_role.pk;
     // Add the inter grup key rcvd part decoding the rcvd value with the pk
@@ -423,19 +645,233 @@ static phemap_ret_t LvGKPartCB(local_verifier_t* const lv, uint8_t * const RcvdB
             lv_reset_timer();
         }
     }
-    else
+    else if(lv->update_mode == LV_UPDATE_IMMEDIATE)
     {
         //  Otherwise just send the up to devs 
         LvSendGroupToDevs(lv);
-        //  Should start a tim here 
+    }
+    else
+    {
+        //  Only the key at the end of the round matters to devices
+        LvAggregateUpdate(lv,lv_idx);
     }
     return OK;
 }
 
+static phemap_ret_t LvCombinedCB(local_verifier_t* const lv, uint8_t * const RcvdBuff, const uint32_t size)
+{
+    //  Type and size checks, only the parent can send the combined key
+    if(RcvdBuff[0] != INTER_KEY_COMBINED || size < PHEMAP_KEY_MEX_SIZE ||
+        lv->topology != LV_TOPO_TREE || (U8_TO_PHEMAP_ID_BE(&RcvdBuff[1])) != lv->tree_parent)
+    {
+#if LV_PC_DBG
+        printf("[LV %u ] Unexpected combined key from %u \n",lv->lv_as_role.as_id,U8_TO_PHEMAP_ID_BE(&RcvdBuff[1]));
+#endif
+        PHEMAP_TRACE_EV(PHEMAP_EV_LV_UNEXPECTED_COMBINED,lv->lv_as_role.as_id,U8_TO_PHEMAP_ID_BE(&RcvdBuff[1]),0,0);
+        return CONN_WAIT;
+    }
+    private_key_t rcvd_sign = U8_TO_PUF_BE(&RcvdBuff[PHEMAP_KEY_MEX_SIGNED]);
+    if (rcvd_sign != LvKeyedSign(RcvdBuff,PHEMAP_KEY_MEX_SIGNED,lv->lv_dev_role.secret_token))
+    {
+        PHEMAP_TRACE_EV(PHEMAP_EV_LV_PART_AUTH_FAILED,lv->lv_as_role.as_id,U8_TO_PHEMAP_ID_BE(&RcvdBuff[1]),0,0);
+        return AUTH_FAILED;
+    }
+    //  A replayed combined key would roll the subtree back to an older key
+    if(LvNextEpoch(lv,RcvdBuff,&lv->combined_epoch_seen) == 0)
+        return CONN_WAIT;
+    //  The combined key replaces the local one
+    lv->inter_group_key     =   (U8_TO_PUF_BE(&RcvdBuff[1+sizeof(phemap_id_t)]))^lv->lv_dev_role.pk;
+    lv->group_secret_token  =   (U8_TO_PUF_BE(&RcvdBuff[1+sizeof(phemap_id_t)+sizeof(puf_resp_t)]))^lv->lv_dev_role.pk;
+#if LV_PC_DBG
+    printf("[LV %u ] Combined InterGK: %#x InterST: %#x \n",lv->lv_as_role.as_id,lv->inter_group_key,lv->group_secret_token);
+#endif
+    if(lv->is_inter_installed == 0)
+    {
+        lv->is_inter_installed = 1;
+        lv_reset_timer();
+    }
+    LvTreeSendDown(lv);
+    LvSendGroupToDevs(lv);
+    return OK;
+}
+
+static void LvForgeLvMex(local_verifier_t*const lv, const phemap_mex_t type, const private_key_t key, const private_key_t tok, uint8_t*const mex)
+{
+    //  TYPE+ID+ENC_KEY+ENC_TOKEN+EPOCH+ARG+SIGN
+    mex[0] = type;
+    PHEMAP_ID_TO_U8_BE(lv->lv_dev_role.id,&mex[1]);
+    //  Both encrypted with the LV private key
+    PUF_TO_U8_BE((key^lv->lv_dev_role.pk),&mex[1+sizeof(phemap_id_t)]);
+    PUF_TO_U8_BE((tok^lv->lv_dev_role.pk),&mex[1+sizeof(phemap_id_t)+sizeof(puf_resp_t)]);
+    //  Each receiver gets every mex of a type from this LV, a part upwards or a combined key downwards
+    uint32_t epoch = (type == INTER_KEY_COMBINED) ? ++lv->combined_epoch : ++lv->part_epoch;
+    PUF_TO_U8_BE(epoch,&mex[PHEMAP_KEY_MEX_EPOCH]);
+    mex[PHEMAP_KEY_MEX_ARG] = 0;
+    //  Generate the sign using the LV group secret token  
+    private_key_t sign = LvKeyedSign(mex,PHEMAP_KEY_MEX_SIGNED,lv->lv_dev_role.secret_token);
+    PUF_TO_U8_BE(sign,&mex[PHEMAP_KEY_MEX_SIGNED]);
+}
+
+static uint8_t LvNextEpoch(local_verifier_t*const lv, const uint8_t*const mex, uint32_t*const seen)
+{
+    uint32_t epoch = U8_TO_PUF_BE(&mex[PHEMAP_KEY_MEX_EPOCH]);
+    if(epoch != *seen + 1)
+    {
+#if LV_PC_DBG
+        printf("[LV %u ] Dropping type %u of %u at epoch %u, expected %u \n",lv->lv_as_role.as_id,mex[0],U8_TO_PHEMAP_ID_BE(&mex[1]),epoch,*seen + 1);
+#endif
+        PHEMAP_TRACE_EV(PHEMAP_EV_LV_PART_OUT_OF_ORDER,lv->lv_as_role.as_id,U8_TO_PHEMAP_ID_BE(&mex[1]),epoch,*seen + 1);
+        lv->dropped_pkts++;
+        return 0;
+    }
+    *seen = epoch;
+    return 1;
+}
+
+/**
+ * @brief Position of id among the LVs sorted by id.
+ */
+static uint16_t LvTreeRank(const local_verifier_t*const lv, const phemap_id_t id)
+{
+    uint16_t rank = (lv->lv_dev_role.id < id) ? 1 : 0;
+    for(uint16_t i = 0; i < lv->num_lv; i++)
+        if(lv->list_of_lv[i] < id)
+            rank++;
+    return rank;
+}
+
+/**
+ * @brief Id of the LV at the given position among the LVs sorted by id.
+ */
+static phemap_id_t LvTreeAtRank(const local_verifier_t*const lv, const uint16_t rank)
+{
+    if(LvTreeRank(lv,lv->lv_dev_role.id) == rank)
+        return lv->lv_dev_role.id;
+    for(uint16_t i = 0; i < lv->num_lv; i++)
+        if(LvTreeRank(lv,lv->list_of_lv[i]) == rank)
+            return lv->list_of_lv[i];
+    return lv->lv_dev_role.id;
+}
+
+void lv_build_tree(local_verifier_t* const lv)
+{
+    assert(NULL != lv);
+    uint16_t num_lvs    = lv->num_lv + 1;
+    uint16_t rank       = LvTreeRank(lv,lv->lv_dev_role.id);
+    //  Heap layout, the root is the LV with the lowest id
+    lv->tree_parent     = (rank == 0) ? lv->lv_dev_role.id : LvTreeAtRank(lv,(rank - 1)/LV_TREE_FANOUT);
+    lv->tree_num_children = 0;
+    for(uint32_t child = (uint32_t)rank*LV_TREE_FANOUT + 1; child <= (uint32_t)rank*LV_TREE_FANOUT + LV_TREE_FANOUT && child < num_lvs; child++)
+    {
+        lv->tree_children[lv->tree_num_children] = LvTreeAtRank(lv,child);
+        lv->tree_num_children++;
+    }
+    //  Own part plus one combined part for each child
+    lv->tree_pending    = lv->tree_num_children + 1;
+    lv->tree_acc_key    = 0;
+    lv->tree_acc_tok    = 0;
+}
+
+static void LvTreeAddPart(local_verifier_t*const lv, const private_key_t key, const private_key_t tok)
+{
+    lv->tree_acc_key ^= key;
+    lv->tree_acc_tok ^= tok;
+    lv->tree_pending--;
+    if(lv->tree_pending > 0)
+        return;
+    //  The subtree is complete, the root owns the whole key
+    if(lv->tree_parent == lv->lv_dev_role.id)
+    {
+        lv->inter_group_key     = lv->tree_acc_key;
+        lv->group_secret_token  = lv->tree_acc_tok;
+#if LV_PC_DBG 
+        printf("[LV %u ] Root InterGK: %#x InterST: %#x \n",lv->lv_as_role.as_id,lv->inter_group_key,lv->group_secret_token);
+#endif
+        lv->is_inter_installed  = 1;
+        LvTreeSendDown(lv);
+        LvSendGroupToDevs(lv);
+        lv_reset_timer();
+    }
+    else
+    {
+        uint8_t mex[LV_MEX_SIZE];
+        LvForgeLvMex(lv,INTER_KEY_INSTALL,lv->tree_acc_key,lv->tree_acc_tok,mex);
+        lv_broad_push_to(&lv->lvs_queue,lv->tree_parent,mex);
+    }
+}
+
+static void LvTreeSendDown(local_verifier_t*const lv)
+{
+    uint8_t mex[LV_MEX_SIZE];
+    LvForgeLvMex(lv,INTER_KEY_COMBINED,lv->inter_group_key,lv->group_secret_token,mex);
+    for(uint8_t i = 0; i < lv->tree_num_children; i++)
+        lv_broad_push_to(&lv->lvs_queue,lv->tree_children[i],mex);
+}
+
+static void LvAggregateUpdate(local_verifier_t*const lv, const uint16_t lv_idx)
+{
+    //  The first part opens the round
+    if(lv->update_pending == 0)
+    {
+        memset(lv->update_part_seen,0,lv->max_lv);
+        lv->update_pending = lv->num_lv;
+        lv_start_timer_ms(lv->update_window_ms);
+    }
+    lv->update_dirty = 1;
+    //  A LV sending more parts in the same round is counted once
+    if(lv->update_part_seen[lv_idx] == 0)
+    {
+        lv->update_part_seen[lv_idx] = 1;
+        lv->update_pending--;
+    }
+    if(lv->update_pending == 0)
+        lv_flush_inter_update(lv);
+}
+
+void lv_flush_inter_update(local_verifier_t* const lv)
+{
+    assert(NULL != lv);
+    if(lv->update_dirty == 1)
+    {
+#if LV_PC_DBG
+        printf("[LV %u ] Update round closed InterGK: %#x \n",lv->lv_as_role.as_id,lv->inter_group_key);
+#endif
+        LvSendGroupToDevs(lv);
+        lv->update_dirty = 0;
+    }
+    lv->update_pending = 0;
+    lv_reset_timer();
+}
+
+phemap_ret_t lv_retx_poll(local_verifier_t* const lv, const uint32_t now_ms)
+{
+    assert(NULL != lv);
+    phemap_ret_t to_ret = gk_as_retx_poll(&lv->lv_as_role,now_ms);
+    if(to_ret == INSTALL_OK && lv->lv_dev_role.is_pk_installed == 1)
+        LvInstallInterGK(lv);
+    //  The join changed the key, the eviction changed it again: one update from the key before the join
+    else if(to_ret == UPDATE_OK && lv->rekey_pending == 1)
+    {
+        lv->rekey_pending = 0;
+        if(lv->is_inter_installed == 1)
+            lv_forge_new_inter(lv,lv->rekey_old_key);
+    }
+    return to_ret;
+}
+
 static void LvSendGroupToDevs(local_verifier_t*const lv)
 {
-    //  TYPE+ID+NEW_KEY_ENC+NEW_SEC_TOK_END+SIGN
-    uint8_t mex[1+sizeof(phemap_id_t)+3*sizeof(puf_resp_t)]; 
+    uint8_t mex[PHEMAP_KEY_MEX_SIZE]; 
+    //  Each key sent to the devices is a new epoch, the devices drop the ones delivered late
+    lv->inter_epoch++;
+    LvForgeGroupMex(lv,mex);
+    //  Send the pkt in broad to devs 
+    lv_broad_push(&lv->devs_queue,mex);
+}
+
+static void LvForgeGroupMex(const local_verifier_t*const lv, uint8_t*const mex)
+{
+    //  TYPE+ID+NEW_KEY_ENC+NEW_SEC_TOK_END+EPOCH+ARG+SIGN
     //  Type used for downlink comm
     mex[0] = LV_SUP_KEY_INSTALL;
     //  Insert the id of the LV
@@ -448,14 +884,12 @@ static void LvSendGroupToDevs(local_verifier_t*const lv)
     //  Encrypted secret token
     PUF_TO_U8_BE(   (lv->group_secret_token^lv->lv_as_role.private_key),
                     &mex[1+sizeof(phemap_id_t)+sizeof(puf_resp_t)]); 
+    PUF_TO_U8_BE(lv->inter_epoch,&mex[PHEMAP_KEY_MEX_EPOCH]);
+    mex[PHEMAP_KEY_MEX_ARG] = 0;
     //  Sign the pkt
-    private_key_t sign = LvKeyedSign(mex,1+sizeof(phemap_id_t)+2*sizeof(puf_resp_t),lv->lv_as_role.secret_token);
+    private_key_t sign = LvKeyedSign(mex,PHEMAP_KEY_MEX_SIGNED,lv->lv_as_role.secret_token);
     //  Append the mex 
-    PUF_TO_U8_BE(sign,&mex[1+sizeof(phemap_id_t)+2*sizeof(puf_resp_t)]);
-    //  Send the pkt in broad to devs 
-    memcpy(lv->devices_broad_buffer,mex,15);
-    // Occupy the buffer 
-    lv->device_buff_occupied = 1;
+    PUF_TO_U8_BE(sign,&mex[PHEMAP_KEY_MEX_SIGNED]);
 }
 
 static puf_resp_t LvGetNextCarnetLink (const phemap_id_t reqId)
@@ -466,22 +900,15 @@ static puf_resp_t LvGetNextCarnetLink (const phemap_id_t reqId)
 
 static private_key_t LvKeyedSign(const uint8_t *const buff, const uint32_t buffSize, const private_key_t signKey )
 {
-
-    uint32_t newBuffSize = ceil(buffSize/sizeof(private_key_t));
-    uint32_t idx;
-    private_key_t helper,sign=0;
-    for(idx = 0; idx < newBuffSize-1;idx++)
-    {
-        helper  =   U8_TO_PUF_BE(&buff[idx*sizeof(private_key_t)]);
-        sign    ^=  (helper^signKey);
-    }
-    // append the last one
-    helper  =   (U8_TO_PUF_BE(&buff[(newBuffSize-1)*sizeof(private_key_t)])<<8*(newBuffSize-buffSize));
-    sign    ^=  (helper^signKey);
-    return sign;
+    return phemap_keyed_sign(buff,buffSize,signKey);
 }
 
 void lv_reset_timer()
 {
 
+}
+
+void lv_start_timer_ms(uint32_t ms_time)
+{
+    (void)ms_time;
 }
\ No newline at end of file
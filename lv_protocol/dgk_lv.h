@@ -28,6 +28,88 @@
 #include "../as_protocol/gk_phemap_as.h"
 #include "../dev_protocol/gk_phemap_dev.h"
 #define LV_PC_DBG 0
+#ifndef LV_BROAD_QUEUE_DEPTH
+#define LV_BROAD_QUEUE_DEPTH    8   /*!< Broadcast mexs each LV queue can hold before the sender drains them*/
+#endif
+#define LV_MEX_SIZE             GK_AS_MEX_SIZE
+#define LV_BROAD_ALL            0xFFFF  /*!< Destination of the mexs sent to every other LV*/
+#ifndef LV_TREE_FANOUT
+#define LV_TREE_FANOUT          2       /*!< Children of each LV in the aggregation tree*/
+#endif
+
+/**
+ * @typedef Broadcast mex waiting in a LV queue
+ */
+typedef struct{
+    uint32_t        seq;                    /*!< Sequence number, increasing in each queue*/
+    phemap_id_t     dest;                   /*!< Receiver of the mex, LV_BROAD_ALL for everyone*/
+    uint8_t         mex[LV_MEX_SIZE];       /*!< Mex to broadcast, its type is mex[0]*/
+}lv_broad_entry_t;
+
+/**
+ * @typedef Fixed capacity queue of broadcast mexs, oldest first
+ */
+typedef struct{
+    lv_broad_entry_t    entries[LV_BROAD_QUEUE_DEPTH];  /*!< Ring slots*/
+    uint8_t             head;                           /*!< Slot of the oldest mex*/
+    uint8_t             count;                          /*!< Number of queued mexs*/
+    uint16_t            coalesce_types;                 /*!< Bitmap of phemap_mex_t types whose newer mex supersedes the queued one*/
+    uint32_t            next_seq;                       /*!< Sequence number of the next pushed mex*/
+    uint32_t            overflows;                      /*!< Mexs rejected because the queue was full*/
+    uint32_t            coalesced;                      /*!< Queued mexs replaced by a newer one of the same type*/
+}lv_broad_queue_t;
+
+/**
+ * @typedef Function used to send a broadcast mex while draining a queue
+ */
+typedef void (*lv_broad_send_t)(void* const ctx, const lv_broad_entry_t* const entry);
+
+/**
+ * @brief Entries of the sender table, kept at most half full so that a lookup is about one probe.
+ */
+#define LV_ROUTE_SIZE(ndev,nlv)     (2*((uint32_t)(ndev) + (uint32_t)(nlv)) + 1)
+
+/**
+ * @typedef Role of the sender of a pkt received from a LV
+ */
+typedef enum{
+    LV_ROUTE_NONE,      /*!< Unknown sender, also marks an empty entry of the table*/
+    LV_ROUTE_AS,        /*!< The AS which manages the LVs*/
+    LV_ROUTE_DEV,       /*!< A device managed by the LV*/
+    LV_ROUTE_LV,        /*!< Another local verifier*/
+    LV_ROUTE_NUM
+}lv_route_role_t;
+
+/**
+ * @typedef Entry of the sender table
+ */
+typedef struct{
+    phemap_id_t     id;         /*!< Phemap id of the sender*/
+    uint16_t        slot;       /*!< Slot of the device in the AS role or index in list_of_lv*/
+    uint8_t         role;       /*!< lv_route_role_t of the sender*/
+}lv_route_t;
+
+/**
+ * @typedef How the inter group key parts travel among the LVs
+ */
+typedef enum{
+    LV_TOPO_FLAT,           /*!< Each LV sends its part to every other LV, O(L^2) mexs*/
+    LV_TOPO_TREE,           /*!< Parts are combined up an aggregation tree, the root sends the key down, O(L) mexs*/
+}lv_topology_t;
+
+/**
+ * @typedef How the inter group key updates received from other LVs reach the devices
+ */
+typedef enum{
+    LV_UPDATE_IMMEDIATE,    /*!< Each part received from a LV is broadcast to the devices at once*/
+    LV_UPDATE_AGGREGATE,    /*!< Parts are collected from all the LVs, or until the round deadline, then broadcast once*/
+}lv_update_mode_t;
+
+/**
+ * @brief Bytes of storage needed by a LV managing up to ndev devices and peering with up to nlv LVs.
+ */
+#define LV_STORAGE_SIZE(ndev,nlv)   (GK_AS_STORAGE_SIZE(ndev) + (uint32_t)(nlv)*(sizeof(uint32_t) + sizeof(phemap_id_t)) \
+                                    + LV_ROUTE_SIZE(ndev,nlv)*sizeof(lv_route_t) + (uint32_t)(nlv))
 
 /**
  * @typedef Struct utilized for managing a local verifier
@@ -36,20 +118,100 @@
 typedef struct{
     Device          lv_dev_role;                    /*!< The struct the local verifier uses in order to get the PK witht the AS.*/
     AuthServer      lv_as_role;                     /*!< The struct the local verifier uses in order to distribute the subgroup private key. */
-    phemap_id_t     list_of_lv[MAX_NUM_AUTH];       /*!< List of local verifiers connected.*/
+    phemap_id_t*    list_of_lv;                     /*!< List of local verifiers connected.*/
+    uint16_t        max_lv;                         /*!< Capacity of list_of_lv.*/
     uint16_t        num_lv;                         /*!< Number of local verifiers.*/
+    lv_route_t*     routes;                         /*!< Open addressing table mapping devices and LVs to their role.*/
+    uint32_t        num_routes;                     /*!< Number of entries of the routes table.*/
+    uint32_t        dropped_pkts;                   /*!< Pkts dropped: unknown sender, too short, unexpected or out of order from a LV.*/
     private_key_t   inter_group_key;                /*!< Inter-Group secret key.*/
+    uint32_t        inter_epoch;                    /*!< Epoch of the inter group key last sent to the devices.*/
+    uint32_t        part_epoch;                     /*!< INTER_KEY_INSTALL mexs forged by this LV, the EPOCH of the last one.*/
+    uint32_t*       part_epoch_seen;                /*!< Indexed as list_of_lv, EPOCH of the last INTER_KEY_INSTALL applied from each LV.*/
+    uint32_t        combined_epoch;                 /*!< INTER_KEY_COMBINED mexs forged by this LV, the EPOCH of the last one.*/
+    uint32_t        combined_epoch_seen;            /*!< EPOCH of the last INTER_KEY_COMBINED applied from the parent in the tree.*/
     private_key_t   inter_sess_nonce;               /*!< Session nonce for the backward and forward security used for this node.*/
     private_key_t   group_secret_token;             /*!< Secret token generated from the mex.*/
     uint16_t        num_install_pending;            /*!< Number of LV from which we're waiting a pkt.*/
     private_key_t   key_part;                       /*!< Part of the key generated from this LV.*/
     uint16_t        is_inter_installed;             /*!< Check if the inter pk is installed in all the nodes */
-    uint8_t         devices_broad_buffer[15];       /*!< Buffer used for sending the key and its updates to devices. */
-    uint8_t         device_buff_occupied;           /*!< Check if there is a broadcast pkt for devices.*/
-    uint8_t         lvs_broad_buffer[15];           /*!< Buffer used for sending the key parts to lvs. */
-    uint8_t         lvs_buff_occupied;              /*!< Check if there is a broadcast pkt for lvs.*/
+    uint8_t         update_mode;                    /*!< lv_update_mode_t used once the inter pk is installed.*/
+    uint8_t         update_dirty;                   /*!< 1 if the inter pk changed since the last broadcast to devices.*/
+    uint16_t        update_pending;                 /*!< LVs that haven't sent their part in the current update round, 0 if no round is open.*/
+    uint8_t*        update_part_seen;               /*!< Indexed as list_of_lv, 1 if the LV already sent its part in the current round.*/
+    uint32_t        update_window_ms;               /*!< Deadline of an update round, passed to lv_start_timer_ms.*/
+    uint8_t         topology;                       /*!< lv_topology_t of the inter group key install.*/
+    uint8_t         tree_num_children;              /*!< Number of children in the aggregation tree.*/
+    uint8_t         tree_pending;                   /*!< Parts, own and children ones, missing before the subtree part is complete.*/
+    phemap_id_t     tree_parent;                    /*!< Parent in the aggregation tree, the id of this LV at the root.*/
+    phemap_id_t     tree_children[LV_TREE_FANOUT];  /*!< Children in the aggregation tree.*/
+    private_key_t   tree_acc_key;                   /*!< Xor of the key parts of the subtree received so far.*/
+    private_key_t   tree_acc_tok;                   /*!< Xor of the secret token parts of the subtree received so far.*/
+    private_key_t   rekey_old_key;                  /*!< Intra key before the join waiting for the PK_CONF of the new member.*/
+    uint8_t         rekey_pending;                  /*!< 1 if a join changed the intra key and the inter key update is deferred.*/
+    lv_broad_queue_t devs_queue;                    /*!< Mexs broadcast to devices, the key and its updates. */
+    lv_broad_queue_t lvs_queue;                     /*!< Mexs broadcast to lvs, the key parts. */
+    phemap_stats_slot_t* stats;                     /*!< Counters published by the LV, NULL if not published, see phemap_stats.h*/
 }local_verifier_t;
 
+/**
+ * @brief Reset the LV and bind the storage of its AS role and of its list of LVs.
+ * 
+ * @param lv            Struct managing the actual local verifier.
+ * @param storage       At least LV_STORAGE_SIZE(max_devs,max_lv) bytes aligned as a private_key_t.
+ * @param max_devs      Number of devices the LV can manage.
+ * @param max_lv        Number of other LVs the LV can peer with.
+ */
+void lv_bind(local_verifier_t* const lv, void* const storage, const uint16_t max_devs, const uint16_t max_lv);
+
+/**
+ * @brief Add a device to the ones managed by the LV.
+ * 
+ * @param lv            Struct managing the actual local verifier.
+ * @param id            Phemap id of the device.
+ * @return phemap_ret_t OK, ENROLL_FAILED if the AS role is full or the device is already present.
+ */
+phemap_ret_t lv_register_dev(local_verifier_t* const lv, const phemap_id_t id);
+
+/**
+ * @brief Rebuild the sender table from the AS role devices and list_of_lv.
+ * @details lv_register_dev and lv_register_lv keep the table updated, this function is needed only
+ *          when the lists are edited directly.
+ * 
+ * @param lv            Struct managing the actual local verifier.
+ */
+void lv_rebuild_routes(local_verifier_t* const lv);
+
+/**
+ * @brief Add a LV to the list of the connected ones.
+ * 
+ * @param lv            Struct managing the actual local verifier.
+ * @param id            Phemap id of the other LV.
+ * @return phemap_ret_t OK, ENROLL_FAILED if the list is full or the LV is already present.
+ */
+phemap_ret_t lv_register_lv(local_verifier_t* const lv, const phemap_id_t id);
+
+#ifdef __cplusplus
+/**
+ * @brief LV whose storage is sized at compile time.
+ * @details get() exposes the plain local_verifier_t used by the lv_* functions.
+ * @tparam NDev Number of devices managed by the LV
+ * @tparam NLv  Number of other LVs
+ */
+template<uint16_t NDev, uint16_t NLv>
+class GkLocalVerifier{
+public:
+    GkLocalVerifier()                                   { lv_bind(&lv,storage,NDev,NLv); }
+    GkLocalVerifier(const GkLocalVerifier&)             = delete;
+    GkLocalVerifier& operator=(const GkLocalVerifier&)  = delete;
+    local_verifier_t*       get()                       { return &lv; }
+    const local_verifier_t* get() const                 { return &lv; }
+private:
+    local_verifier_t    lv;
+    alignas(private_key_t) uint8_t storage[LV_STORAGE_SIZE(NDev,NLv)];
+};
+#endif
+
 /**
  * @brief Automa called when the AS is the sender.
  * 
@@ -80,6 +242,92 @@ phemap_ret_t lv_otherLv_sender_automa(local_verifier_t*const lv, uint8_t* const
  */
 phemap_ret_t lv_device_sender_automa(local_verifier_t*const lv, uint8_t* const rcvd_buff, const uint32_t rcvd_size);
 
+/**
+ * @brief Append a mex to a broadcast queue.
+ * @details If the type of the mex is in coalesce_types, a queued mex of the same type is dropped
+ *          and the new one is appended, so that the queue keeps only the latest state.
+ * 
+ * @param q             Queue.
+ * @param mex           Mex of LV_MEX_SIZE bytes.
+ * @return uint8_t      1 if the mex was queued, 0 if the queue is full.
+ */
+uint8_t lv_broad_push(lv_broad_queue_t* const q, const uint8_t* const mex);
+
+/**
+ * @brief Append a mex for a single receiver to a broadcast queue, coalescing works as in lv_broad_push
+ *        among the mexs having the same receiver.
+ * 
+ * @param q             Queue.
+ * @param dest          Receiver of the mex.
+ * @param mex           Mex of LV_MEX_SIZE bytes.
+ * @return uint8_t      1 if the mex was queued, 0 if the queue is full.
+ */
+uint8_t lv_broad_push_to(lv_broad_queue_t* const q, const phemap_id_t dest, const uint8_t* const mex);
+
+/**
+ * @brief Get the oldest mex of a broadcast queue without removing it.
+ * 
+ * @param q                         Queue.
+ * @return const lv_broad_entry_t*  Oldest mex, NULL if the queue is empty.
+ */
+const lv_broad_entry_t* lv_broad_peek(const lv_broad_queue_t* const q);
+
+/**
+ * @brief Remove the oldest mex of a broadcast queue.
+ * 
+ * @param q             Queue.
+ */
+void lv_broad_pop(lv_broad_queue_t* const q);
+
+/**
+ * @brief Send all the queued mexs, oldest first, and empty the queue.
+ * 
+ * @param q             Queue.
+ * @param send          Function called for each mex.
+ * @param ctx           Context passed to send.
+ * @return uint8_t      Number of mexs sent.
+ */
+uint8_t lv_broad_drain(lv_broad_queue_t* const q, const lv_broad_send_t send, void* const ctx);
+
+/**
+ * @brief Place the LV in the aggregation tree and get ready for a new inter group key install.
+ * @details The LVs, i.e. this one and list_of_lv, are ranked by id and laid out as a LV_TREE_FANOUT-ary heap,
+ *          so every LV derives the same tree from the same membership. Needed only in LV_TOPO_TREE.
+ * 
+ * @param lv            Struct managing the actual local verifier.
+ */
+void lv_build_tree(local_verifier_t* const lv);
+
+/**
+ * @brief Close the current update round broadcasting the inter group key to the devices.
+ * @details In LV_UPDATE_AGGREGATE mode this is called when the timer started with lv_start_timer_ms
+ *          expires, rounds where all the LVs sent their part are closed automatically.
+ * 
+ * @param lv            Struct managing the actual local verifier.
+ */
+void lv_flush_inter_update(local_verifier_t* const lv);
+
+/**
+ * @brief Retransmission engine of the AS role, see gk_as_retx_poll.
+ * @details When an eviction completes the install or a join, the inter group key follows as if the last
+ *          PK_CONF had arrived.
+ * 
+ * @param lv            Struct managing the actual local verifier.
+ * @param now_ms        Current time in ms.
+ * @return phemap_ret_t Result of gk_as_retx_poll.
+ */
+phemap_ret_t lv_retx_poll(local_verifier_t* const lv, const uint32_t now_ms);
+
+/**
+ * @brief Update the inter group key after a change of the intra group key of the LV.
+ * @details The part of the LV changes by old_Kl ^ new intra key, masked with a fresh session nonce.
+ *          Only the delta is sent to the other LVs, in a single INTER_KEY_INSTALL, and the devices get
+ *          the new key in a single LV_SUP_KEY_INSTALL. In LV_TOPO_TREE a LV other than the root sends
+ *          the delta to its parent and gets the key back from the root with the INTER_KEY_COMBINED.
+ * 
+ * @param lv            Struct managing the actual local verifier.
+ * @param old_Kl        Intra group key before the change.
+ */
 void lv_forge_new_inter( 
                 local_verifier_t* const lv,
                 private_key_t old_Kl
@@ -122,6 +370,45 @@ uint8_t IsDevice(const local_verifier_t*const lv, const phemap_id_t rcvdId);
  */
 uint8_t IsLV(const local_verifier_t*const lv, const phemap_id_t rcvdId);
 
+/*  Snapshots, implemented in dgk_lv_snapshot.cc with as_protocol/gk_as_snapshot.cc */
+/**
+ * @brief Bytes of the snapshot of the LV, header included.
+ */
+uint32_t lv_snapshot_size(const local_verifier_t* const lv);
+
+/**
+ * @brief Write the snapshot of the LV: its AS role, its device role, the LVs it peers with and the inter group key.
+ * @details The mexs queued and the state of an open update round are not part of the snapshot.
+ * 
+ * @param lv            Struct managing the actual local verifier.
+ * @param buff          Destination buffer.
+ * @param cap           Bytes of buff.
+ * @return uint32_t     Bytes written, 0 if buff is too small.
+ */
+uint32_t lv_snapshot(const local_verifier_t* const lv, uint8_t* const buff, const uint32_t cap);
+
+/**
+ * @brief Restore a snapshot into a LV already bound with lv_bind, the routes and the tree are rebuilt.
+ * 
+ * @param lv            Struct managing the actual local verifier.
+ * @param snap          The snapshot.
+ * @param size          Bytes of snap.
+ * @return phemap_ret_t OK, REINIT if the snapshot is invalid or the LV too small, in that case the LV is untouched.
+ */
+phemap_ret_t lv_restore(local_verifier_t* const lv, const uint8_t* const snap, const uint32_t size);
+
+/**
+ * @brief Save the snapshot of the LV replacing path atomically.
+ * @return uint8_t 1 on success.
+ */
+uint8_t lv_save(const local_verifier_t* const lv, const char* const path);
+
+/**
+ * @brief Restore the LV from the snapshot saved at path.
+ * @return phemap_ret_t OK, REINIT if the file is missing or invalid.
+ */
+phemap_ret_t lv_load(local_verifier_t* const lv, const char* const path);
+
 void lv_start_timer_ms(uint32_t ms_time) __attribute__((weak));
 
 void lv_reset_timer() __attribute__((weak));
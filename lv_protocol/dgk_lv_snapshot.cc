@@ -0,0 +1,208 @@
+/*
+    Group-Key-Phemap - Copyright (C) 2023-2024 Antonio Emmanuele
+
+    This file is part of Group-Key-Phemap.
+
+    Group-Key-Phemap is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Group-Key-Phemap is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file    dgk_lv_snapshot.cc
+ * @brief   Snapshot and warm restart of the Local Verifier
+ */
+#include "dgk_lv.h"
+#include "../common/phemap_snapshot.h"
+#include "stdlib.h"
+#include "string.h"
+#include "assert.h"
+
+//  ID|AS_ID|PK|STATE|ST|INSTALLED|INTER_KEY|INTER_TOK|EPOCH|KEY_PART
+#define LV_SNAP_DEV_SIZE    (2*sizeof(phemap_id_t) + 6*sizeof(private_key_t) + 2)
+//  NUM_LV|INTER_KEY|NONCE|INTER_ST|INSTALL_PENDING|KEY_PART|INSTALLED|UPDATE_MODE|WINDOW|TOPOLOGY|
+//  TREE_PENDING|TREE_KEY|TREE_TOK|REKEY_OLD|REKEY_PENDING|INTER_EPOCH|PART_EPOCH|COMBINED_EPOCH|COMBINED_SEEN
+#define LV_SNAP_FIXED_SIZE  (2*sizeof(uint16_t) + 12*sizeof(private_key_t) + 5)
+//  LV_ID|PART_SEEN
+#define LV_SNAP_LV_SIZE     (sizeof(phemap_id_t) + sizeof(uint32_t))
+
+uint32_t lv_snapshot_size(const local_verifier_t* const lv)
+{
+    assert(NULL != lv);
+    return gk_as_snapshot_size(&lv->lv_as_role) + LV_SNAP_DEV_SIZE + LV_SNAP_FIXED_SIZE + (uint32_t)lv->num_lv*LV_SNAP_LV_SIZE;
+}
+
+uint32_t lv_snapshot(const local_verifier_t* const lv, uint8_t* const buff, const uint32_t cap)
+{
+    assert(NULL != lv);
+    assert(NULL != buff);
+    if(cap < lv_snapshot_size(lv))
+        return 0;
+    //  The AS role first
+    uint8_t* p = &buff[PHEMAP_SNAP_HDR_SIZE];
+    p += gk_as_snapshot_payload(&lv->lv_as_role,p);
+    //  The device role
+    const Device* dev = &lv->lv_dev_role;
+    PHEMAP_ID_TO_U8_BE(dev->id,p);              p += 2;
+    PHEMAP_ID_TO_U8_BE(dev->as_id,p);           p += 2;
+    PUF_TO_U8_BE(dev->pk,p);                    p += 4;
+    *p++ = (uint8_t)dev->dev_state;
+    PUF_TO_U8_BE(dev->secret_token,p);          p += 4;
+    *p++ = dev->is_pk_installed;
+#if DEV_INTER_GROUP
+    PUF_TO_U8_BE(dev->inter_group_key,p);       p += 4;
+    PUF_TO_U8_BE(dev->inter_group_tok,p);       p += 4;
+#else
+    memset(p,0,8);                              p += 8;
+#endif
+    PUF_TO_U8_BE(dev->epoch,p);                 p += 4;
+    PUF_TO_U8_BE(dev->key_part,p);              p += 4;
+    //  The inter group state
+    PHEMAP_ID_TO_U8_BE(lv->num_lv,p);           p += 2;
+    PUF_TO_U8_BE(lv->inter_group_key,p);        p += 4;
+    PUF_TO_U8_BE(lv->inter_sess_nonce,p);       p += 4;
+    PUF_TO_U8_BE(lv->group_secret_token,p);     p += 4;
+    PHEMAP_ID_TO_U8_BE(lv->num_install_pending,p);  p += 2;
+    PUF_TO_U8_BE(lv->key_part,p);               p += 4;
+    *p++ = (uint8_t)lv->is_inter_installed;
+    *p++ = lv->update_mode;
+    PUF_TO_U8_BE(lv->update_window_ms,p);       p += 4;
+    *p++ = lv->topology;
+    *p++ = lv->tree_pending;
+    PUF_TO_U8_BE(lv->tree_acc_key,p);           p += 4;
+    PUF_TO_U8_BE(lv->tree_acc_tok,p);           p += 4;
+    PUF_TO_U8_BE(lv->rekey_old_key,p);          p += 4;
+    *p++ = lv->rekey_pending;
+    PUF_TO_U8_BE(lv->inter_epoch,p);            p += 4;
+    PUF_TO_U8_BE(lv->part_epoch,p);             p += 4;
+    PUF_TO_U8_BE(lv->combined_epoch,p);         p += 4;
+    PUF_TO_U8_BE(lv->combined_epoch_seen,p);    p += 4;
+    for(uint16_t i = 0; i < lv->num_lv; i++)
+    {
+        PHEMAP_ID_TO_U8_BE(lv->list_of_lv[i],p);
+        PUF_TO_U8_BE(lv->part_epoch_seen[i],&p[2]);
+        p += LV_SNAP_LV_SIZE;
+    }
+    uint32_t payload_len = (uint32_t)(p - &buff[PHEMAP_SNAP_HDR_SIZE]);
+    phemap_snap_seal(buff,PHEMAP_SNAP_LV,payload_len);
+    return PHEMAP_SNAP_HDR_SIZE + payload_len;
+}
+
+phemap_ret_t lv_restore(local_verifier_t* const lv, const uint8_t* const snap, const uint32_t size)
+{
+    assert(NULL != lv);
+    uint32_t payload_len = phemap_snap_open(snap,size,PHEMAP_SNAP_LV);
+    if(payload_len < GK_AS_SNAP_FIXED_SIZE)
+        return REINIT;
+    const uint8_t* payload = &snap[PHEMAP_SNAP_HDR_SIZE];
+    //  Check the LV part before the AS one is restored, so that a failure leaves everything untouched
+    uint32_t as_len = GK_AS_SNAP_FIXED_SIZE + (uint32_t)(U8_TO_PHEMAP_ID_BE(&payload[2]))*GK_AS_SNAP_SLOT_SIZE;
+    if(payload_len < as_len + LV_SNAP_DEV_SIZE + LV_SNAP_FIXED_SIZE)
+        return REINIT;
+    const uint8_t* p = payload + as_len;
+    uint16_t num_lv = U8_TO_PHEMAP_ID_BE(&p[LV_SNAP_DEV_SIZE]);
+    if(num_lv > lv->max_lv || payload_len != as_len + LV_SNAP_DEV_SIZE + LV_SNAP_FIXED_SIZE + (uint32_t)num_lv*LV_SNAP_LV_SIZE ||
+        p[2*sizeof(phemap_id_t) + sizeof(private_key_t)] > GK_DEV_WAIT_FOR_UPDATE)
+        return REINIT;
+    if(gk_as_restore_payload(&lv->lv_as_role,payload,as_len) != as_len)
+        return REINIT;
+    //  The device role
+    Device* dev = &lv->lv_dev_role;
+#if PHEMAP_STATS
+    phemap_stats_slot_t* dev_stats = dev->stats;
+#endif
+    memset(dev,0,sizeof(Device));
+#if PHEMAP_STATS
+    dev->stats          = dev_stats;
+#endif
+    dev->id             = U8_TO_PHEMAP_ID_BE(p);    p += 2;
+    dev->as_id          = U8_TO_PHEMAP_ID_BE(p);    p += 2;
+    dev->pk             = U8_TO_PUF_BE(p);          p += 4;
+    dev->dev_state      = (GK_Dev_State)*p++;
+    dev->secret_token   = U8_TO_PUF_BE(p);          p += 4;
+    dev->is_pk_installed = *p++;
+#if DEV_INTER_GROUP
+    dev->inter_group_key = U8_TO_PUF_BE(p);     p += 4;
+    dev->inter_group_tok = U8_TO_PUF_BE(p);     p += 4;
+#else
+    p += 8;
+#endif
+    dev->epoch          = U8_TO_PUF_BE(p);          p += 4;
+    dev->key_part       = U8_TO_PUF_BE(p);          p += 4;
+    //  The inter group state
+    lv->num_lv              = U8_TO_PHEMAP_ID_BE(p);    p += 2;
+    lv->inter_group_key     = U8_TO_PUF_BE(p);          p += 4;
+    lv->inter_sess_nonce    = U8_TO_PUF_BE(p);          p += 4;
+    lv->group_secret_token  = U8_TO_PUF_BE(p);          p += 4;
+    lv->num_install_pending = U8_TO_PHEMAP_ID_BE(p);    p += 2;
+    lv->key_part            = U8_TO_PUF_BE(p);          p += 4;
+    lv->is_inter_installed  = *p++;
+    lv->update_mode         = *p++;
+    lv->update_window_ms    = U8_TO_PUF_BE(p);          p += 4;
+    lv->topology            = *p++;
+    uint8_t tree_pending    = *p++;
+    private_key_t tree_key  = U8_TO_PUF_BE(p);          p += 4;
+    private_key_t tree_tok  = U8_TO_PUF_BE(p);          p += 4;
+    lv->rekey_old_key       = U8_TO_PUF_BE(p);          p += 4;
+    lv->rekey_pending       = *p++;
+    lv->inter_epoch         = U8_TO_PUF_BE(p);          p += 4;
+    lv->part_epoch          = U8_TO_PUF_BE(p);          p += 4;
+    lv->combined_epoch      = U8_TO_PUF_BE(p);          p += 4;
+    lv->combined_epoch_seen = U8_TO_PUF_BE(p);          p += 4;
+    memset(lv->part_epoch_seen,0,lv->max_lv*sizeof(uint32_t));
+    for(uint16_t i = 0; i < lv->num_lv; i++)
+    {
+        lv->list_of_lv[i]       = U8_TO_PHEMAP_ID_BE(p);
+        lv->part_epoch_seen[i]  = U8_TO_PUF_BE(&p[2]);
+        p += LV_SNAP_LV_SIZE;
+    }
+    //  Derived state
+    lv_rebuild_routes(lv);
+    if(lv->topology == LV_TOPO_TREE)
+        lv_build_tree(lv);
+    lv->tree_pending        = tree_pending;
+    lv->tree_acc_key        = tree_key;
+    lv->tree_acc_tok        = tree_tok;
+    //  Nothing queued survives the restart, an open update round is closed
+    uint16_t coalesce_types = lv->devs_queue.coalesce_types;
+    memset(&lv->devs_queue,0,sizeof(lv_broad_queue_t));
+    memset(&lv->lvs_queue,0,sizeof(lv_broad_queue_t));
+    lv->devs_queue.coalesce_types = coalesce_types;
+    lv->update_dirty        = 0;
+    lv->update_pending      = 0;
+    memset(lv->update_part_seen,0,lv->max_lv);
+    return OK;
+}
+
+uint8_t lv_save(const local_verifier_t* const lv, const char* const path)
+{
+    assert(NULL != lv);
+    uint32_t size = lv_snapshot_size(lv);
+    uint8_t* buff = (uint8_t*)malloc(size);
+    if(buff == NULL)
+        return 0;
+    uint8_t to_ret = phemap_snap_write_file(path,buff,lv_snapshot(lv,buff,size));
+    free(buff);
+    return to_ret;
+}
+
+phemap_ret_t lv_load(local_verifier_t* const lv, const char* const path)
+{
+    assert(NULL != lv);
+    uint32_t size = 0;
+    uint8_t* buff = phemap_snap_read_file(path,&size);
+    if(buff == NULL)
+        return REINIT;
+    phemap_ret_t to_ret = lv_restore(lv,buff,size);
+    free(buff);
+    return to_ret;
+}
@@ -0,0 +1,272 @@
+/*
+    Group-Key-Phemap - Copyright (C) 2023-2024 Antonio Emmanuele
+
+    This file is part of Group-Key-Phemap.
+
+    Group-Key-Phemap is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Group-Key-Phemap is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "lv_runtime.h"
+#include <assert.h>
+#include <string.h>
+#include <new>
+
+/**
+ * @brief Queue a LV that just became scheduled on its home worker.
+ */
+static void lv_rt_schedule(lv_runtime_t* const rt, const uint16_t lv_idx);
+
+/**
+ * @brief Take a ready LV, from the own ring first then stealing from the others.
+ * @return uint16_t LV_RT_NO_LV if there is nothing to run.
+ */
+static uint16_t lv_rt_take(lv_runtime_t* const rt, const uint16_t self);
+
+/**
+ * @brief Process a batch of pkts of a LV owned by the worker self.
+ */
+static void lv_rt_run(lv_runtime_t* const rt, const uint16_t self, const uint16_t lv_idx);
+
+static void lv_rt_worker(lv_runtime_t* const rt, const uint16_t self);
+
+lv_runtime_t* lv_rt_create(const uint16_t max_lv, uint16_t num_workers, const lv_rt_drain_t drain, void* const user)
+{
+    if(num_workers == 0)
+        num_workers = (uint16_t)std::thread::hardware_concurrency();
+    if(num_workers == 0)
+        num_workers = 1;
+    lv_runtime_t* rt = new (std::nothrow) lv_runtime_t();
+    if(rt == NULL)
+        return NULL;
+    rt->slots   = new (std::nothrow) lv_rt_slot_t[max_lv]();
+    rt->workers = new (std::nothrow) lv_rt_worker_t[num_workers]();
+    if(rt->slots == NULL || rt->workers == NULL)
+    {
+        lv_rt_destroy(rt);
+        return NULL;
+    }
+    rt->max_lv      = max_lv;
+    rt->num_workers = num_workers;
+    for(uint16_t w = 0; w < num_workers; w++)
+    {
+        //  A LV is queued at most once, the ring can't overflow
+        rt->workers[w].ready = new (std::nothrow) uint16_t[max_lv];
+        if(rt->workers[w].ready == NULL)
+        {
+            lv_rt_destroy(rt);
+            return NULL;
+        }
+    }
+    rt->drain   = drain;
+    rt->user    = user;
+    return rt;
+}
+
+void lv_rt_destroy(lv_runtime_t* const rt)
+{
+    if(rt == NULL)
+        return;
+    lv_rt_stop(rt);
+    if(rt->workers != NULL)
+    {
+        for(uint16_t w = 0; w < rt->num_workers; w++)
+            delete[] rt->workers[w].ready;
+        delete[] rt->workers;
+    }
+    delete[] rt->slots;
+    delete rt;
+}
+
+uint16_t lv_rt_add(lv_runtime_t* const rt, local_verifier_t* const lv)
+{
+    assert(NULL != rt);
+    assert(NULL != lv);
+    if(rt->num_lv == rt->max_lv)
+        return LV_RT_NO_LV;
+    uint16_t lv_idx = rt->num_lv;
+    rt->slots[lv_idx].lv = lv;
+    rt->slots[lv_idx].home.store((uint16_t)(lv_idx % rt->num_workers));
+    rt->num_lv++;
+    return lv_idx;
+}
+
+void lv_rt_start(lv_runtime_t* const rt)
+{
+    assert(NULL != rt);
+    rt->running.store(1);
+    for(uint16_t w = 0; w < rt->num_workers; w++)
+        rt->workers[w].thread = std::thread(lv_rt_worker,rt,w);
+}
+
+uint8_t lv_rt_post(lv_runtime_t* const rt, const uint16_t lv_idx, const uint8_t* const pkt, const uint32_t size)
+{
+    assert(NULL != rt);
+    assert(NULL != pkt);
+    assert(lv_idx < rt->num_lv);
+    lv_rt_slot_t* const slot = &rt->slots[lv_idx];
+    {
+        std::lock_guard<std::mutex> lock(slot->lock);
+        if(size > LV_RT_MAX_PKT || slot->count == LV_RT_MBOX_DEPTH)
+        {
+            slot->dropped++;
+            return 0;
+        }
+        lv_rt_pkt_t* const entry = &slot->mbox[(slot->head + slot->count) % LV_RT_MBOX_DEPTH];
+        entry->size = (uint8_t)size;
+        memcpy(entry->pkt,pkt,size);
+        slot->count++;
+    }
+    //  Only the first pkt queues the LV, the next ones are taken by the same run
+    if(slot->scheduled.exchange(1) == 0)
+        lv_rt_schedule(rt,lv_idx);
+    return 1;
+}
+
+void lv_rt_wait_idle(lv_runtime_t* const rt)
+{
+    assert(NULL != rt);
+    std::unique_lock<std::mutex> lock(rt->idle_lock);
+    rt->idle_cv.wait(lock,[rt]{ return rt->pending.load() == 0; });
+}
+
+void lv_rt_stop(lv_runtime_t* const rt)
+{
+    assert(NULL != rt);
+    {
+        std::lock_guard<std::mutex> lock(rt->idle_lock);
+        rt->running.store(0);
+    }
+    rt->work_cv.notify_all();
+    if(rt->workers == NULL)
+        return;
+    for(uint16_t w = 0; w < rt->num_workers; w++)
+        if(rt->workers[w].thread.joinable())
+            rt->workers[w].thread.join();
+}
+
+static void lv_rt_schedule(lv_runtime_t* const rt, const uint16_t lv_idx)
+{
+    //  Counted before it is visible to the workers, so pending can't drop to 0 meanwhile
+    rt->pending.fetch_add(1);
+    lv_rt_worker_t* const worker = &rt->workers[rt->slots[lv_idx].home.load()];
+    {
+        std::lock_guard<std::mutex> lock(worker->lock);
+        worker->ready[(worker->head + worker->count) % rt->max_lv] = lv_idx;
+        worker->count++;
+    }
+    {
+        std::lock_guard<std::mutex> lock(rt->idle_lock);
+        rt->ready_total++;
+    }
+    rt->work_cv.notify_one();
+}
+
+static uint16_t lv_rt_take(lv_runtime_t* const rt, const uint16_t self)
+{
+    uint16_t lv_idx = LV_RT_NO_LV;
+    lv_rt_worker_t* worker = &rt->workers[self];
+    {
+        //  The own LVs in arrival order
+        std::lock_guard<std::mutex> lock(worker->lock);
+        if(worker->count > 0)
+        {
+            lv_idx = worker->ready[worker->head];
+            worker->head = (uint16_t)((worker->head + 1) % rt->max_lv);
+            worker->count--;
+        }
+    }
+    //  Steal the last queued LV of another worker, the LV moves here for good
+    for(uint16_t k = 1; k < rt->num_workers && lv_idx == LV_RT_NO_LV; k++)
+    {
+        worker = &rt->workers[(self + k) % rt->num_workers];
+        std::lock_guard<std::mutex> lock(worker->lock);
+        if(worker->count > 0)
+        {
+            worker->count--;
+            lv_idx = worker->ready[(worker->head + worker->count) % rt->max_lv];
+            rt->slots[lv_idx].home.store(self);
+            rt->workers[self].stolen.fetch_add(1,std::memory_order_relaxed);
+        }
+    }
+    if(lv_idx != LV_RT_NO_LV)
+    {
+        std::lock_guard<std::mutex> lock(rt->idle_lock);
+        rt->ready_total--;
+    }
+    return lv_idx;
+}
+
+static void lv_rt_run(lv_runtime_t* const rt, const uint16_t self, const uint16_t lv_idx)
+{
+    lv_rt_slot_t* const slot = &rt->slots[lv_idx];
+    lv_rt_pkt_t pkt;
+    uint16_t processed = 0;
+    uint8_t got = 1;
+    //  A LV with a burst of pkts gives the worker back after a batch
+    while(processed < LV_RT_BATCH && got == 1)
+    {
+        {
+            std::lock_guard<std::mutex> lock(slot->lock);
+            got = (slot->count > 0) ? 1 : 0;
+            if(got == 1)
+            {
+                pkt = slot->mbox[slot->head];
+                slot->head = (uint16_t)((slot->head + 1) % LV_RT_MBOX_DEPTH);
+                slot->count--;
+            }
+        }
+        if(got == 1)
+        {
+            lv_automa(slot->lv,pkt.pkt,pkt.size);
+            processed++;
+        }
+    }
+    rt->workers[self].processed.fetch_add(processed,std::memory_order_relaxed);
+    if(processed > 0 && rt->drain != NULL)
+        rt->drain(slot->lv,lv_idx,rt->user);
+    //  The LV has nothing left to do, its next join or leave is prepared before releasing it
+    if(LV_RT_PRECOMPUTE > 0 && got == 0)
+        gk_as_precompute(&slot->lv->lv_as_role,LV_RT_PRECOMPUTE);
+    //  Release the LV, then take it back if pkts arrived meanwhile and nobody else did
+    slot->scheduled.store(0);
+    uint8_t more;
+    {
+        std::lock_guard<std::mutex> lock(slot->lock);
+        more = (slot->count > 0) ? 1 : 0;
+    }
+    if(more == 1 && slot->scheduled.exchange(1) == 0)
+        lv_rt_schedule(rt,lv_idx);
+    if(rt->pending.fetch_sub(1) == 1)
+    {
+        std::lock_guard<std::mutex> lock(rt->idle_lock);
+        rt->idle_cv.notify_all();
+    }
+}
+
+static void lv_rt_worker(lv_runtime_t* const rt, const uint16_t self)
+{
+    for(;;)
+    {
+        uint16_t lv_idx = lv_rt_take(rt,self);
+        if(lv_idx != LV_RT_NO_LV)
+        {
+            lv_rt_run(rt,self,lv_idx);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(rt->idle_lock);
+        rt->work_cv.wait(lock,[rt]{ return rt->ready_total > 0 || rt->running.load() == 0; });
+        //  On stop the queued LVs are still run
+        if(rt->running.load() == 0 && rt->ready_total == 0)
+            break;
+    }
+}
@@ -0,0 +1,160 @@
+/*
+    Group-Key-Phemap - Copyright (C) 2023-2024 Antonio Emmanuele
+
+    This file is part of Group-Key-Phemap.
+
+    Group-Key-Phemap is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Group-Key-Phemap is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file    lv_runtime.h
+ * @brief   Runtime running many local verifiers of a gateway on a pool of worker threads.
+ * @details Each LV is owned by one worker at a time: pkts are posted to the mailbox of the LV and the LV is
+ *          queued on a worker when it has pkts to process. Idle workers steal whole LVs from the busy ones,
+ *          so the protocol code runs single threaded for each LV and needs no locks.
+ *          The platform hooks (as_get_next_link, as_rng_gen, timers ...) are called concurrently for
+ *          different LVs and must be thread safe, as the as_rng_gen of gk_as_rng.cc is.
+ */
+#ifndef LV_RUNTIME_H
+#define LV_RUNTIME_H
+#include "dgk_lv.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#ifndef LV_RT_MBOX_DEPTH
+#define LV_RT_MBOX_DEPTH    32      /*!< Pkts each LV mailbox can hold*/
+#endif
+#ifndef LV_RT_BATCH
+#define LV_RT_BATCH         16      /*!< Pkts a worker processes for a LV before moving to the next one*/
+#endif
+#ifndef LV_RT_PRECOMPUTE
+#define LV_RT_PRECOMPUTE    64      /*!< Budget of gk_as_precompute for a LV whose mailbox got empty, 0 disables it, links are pulled only with chain_rewind*/
+#endif
+#define LV_RT_MAX_PKT       LV_MEX_SIZE
+#define LV_RT_NO_LV         0xFFFF
+
+/**
+ * @brief Called by the worker owning the LV after it processed a batch of pkts.
+ * @details It should send the mexs of the LV, i.e. its broadcast queues, the unicast and broadcast buffers of
+ *          its AS role and the outbox of its device role. Pkts for other LVs of the gateway are delivered
+ *          with lv_rt_post, lv_automa must not be called on them directly.
+ */
+typedef void (*lv_rt_drain_t)(local_verifier_t* const lv, const uint16_t lv_idx, void* const user);
+
+/**
+ * @typedef Pkt waiting in a LV mailbox.
+ */
+typedef struct{
+    uint8_t         size;                   /*!< Bytes of pkt.*/
+    uint8_t         pkt[LV_RT_MAX_PKT];     /*!< The pkt as received.*/
+}lv_rt_pkt_t;
+
+/**
+ * @typedef A LV hosted by the runtime.
+ */
+typedef struct{
+    local_verifier_t*       lv;                         /*!< The LV, only the worker owning it touches it.*/
+    std::mutex              lock;                       /*!< Protects the mailbox.*/
+    lv_rt_pkt_t             mbox[LV_RT_MBOX_DEPTH];     /*!< Pkts posted and not yet processed.*/
+    uint16_t                head;                       /*!< Oldest pkt of mbox.*/
+    uint16_t                count;                      /*!< Pkts in mbox.*/
+    uint32_t                dropped;                    /*!< Pkts refused because the mailbox was full or too big.*/
+    std::atomic<uint8_t>    scheduled;                  /*!< 1 while the LV is queued on a worker or being run.*/
+    std::atomic<uint16_t>   home;                       /*!< Worker the LV is queued on when it gets new pkts.*/
+}lv_rt_slot_t;
+
+/**
+ * @typedef A worker thread and its queue of ready LVs.
+ */
+typedef struct{
+    std::mutex              lock;                       /*!< Protects the ready ring.*/
+    uint16_t*               ready;                      /*!< Ring of ready LVs, max_lv entries since a LV is queued once.*/
+    uint16_t                head;                       /*!< First ready LV.*/
+    uint16_t                count;                      /*!< Ready LVs.*/
+    std::thread             thread;                     /*!< The worker thread.*/
+    std::atomic<uint64_t>   processed;                  /*!< Pkts processed by this worker.*/
+    std::atomic<uint64_t>   stolen;                     /*!< LVs this worker took from the others.*/
+}lv_rt_worker_t;
+
+/**
+ * @typedef Struct managing the runtime.
+ */
+typedef struct{
+    lv_rt_slot_t*           slots;                      /*!< Hosted LVs, indexed as returned by lv_rt_add.*/
+    uint16_t                max_lv;                     /*!< Capacity of slots.*/
+    uint16_t                num_lv;                     /*!< Hosted LVs.*/
+    lv_rt_worker_t*         workers;                    /*!< Worker threads.*/
+    uint16_t                num_workers;                /*!< Number of workers.*/
+    lv_rt_drain_t           drain;                      /*!< Called after each batch.*/
+    void*                   user;                       /*!< Passed to drain.*/
+    std::atomic<uint8_t>    running;                    /*!< 0 once lv_rt_stop is called.*/
+    std::atomic<uint32_t>   pending;                    /*!< LVs scheduled, 0 when the runtime is idle.*/
+    std::mutex              idle_lock;                  /*!< Protects the sleeping of the workers and of lv_rt_wait_idle.*/
+    std::condition_variable work_cv;                    /*!< Signalled when a LV gets ready.*/
+    std::condition_variable idle_cv;                    /*!< Signalled when pending drops to 0.*/
+    uint32_t                ready_total;                /*!< Ready LVs in all the rings, under idle_lock.*/
+}lv_runtime_t;
+
+/**
+ * @brief Allocate a runtime, the workers are started with lv_rt_start.
+ *
+ * @param max_lv        Number of LVs the runtime can host.
+ * @param num_workers   Worker threads, 0 for one for each core.
+ * @param drain         Called by the owning worker after each batch.
+ * @param user          Passed to drain.
+ * @return lv_runtime_t* The runtime, NULL if it can't be allocated.
+ */
+lv_runtime_t* lv_rt_create(const uint16_t max_lv, uint16_t num_workers, const lv_rt_drain_t drain, void* const user);
+
+/**
+ * @brief Stop the runtime if still running and free it, the LVs are not touched.
+ */
+void lv_rt_destroy(lv_runtime_t* const rt);
+
+/**
+ * @brief Host a LV, to be called before lv_rt_start.
+ *
+ * @param rt            The runtime.
+ * @param lv            LV already bound and configured.
+ * @return uint16_t     Index of the LV for lv_rt_post, LV_RT_NO_LV if the runtime is full.
+ */
+uint16_t lv_rt_add(lv_runtime_t* const rt, local_verifier_t* const lv);
+
+/**
+ * @brief Start the worker threads, the LVs are spread round robin among them.
+ */
+void lv_rt_start(lv_runtime_t* const rt);
+
+/**
+ * @brief Post a pkt to a LV, it can be called from any thread, the drain callback included.
+ *
+ * @param rt            The runtime.
+ * @param lv_idx        Index returned by lv_rt_add.
+ * @param pkt           The pkt, copied in the mailbox.
+ * @param size          Bytes of pkt, at most LV_RT_MAX_PKT.
+ * @return uint8_t      1 if queued, 0 if the mailbox is full or the pkt is too big.
+ */
+uint8_t lv_rt_post(lv_runtime_t* const rt, const uint16_t lv_idx, const uint8_t* const pkt, const uint32_t size);
+
+/**
+ * @brief Wait until every posted pkt has been processed, pkts posted by drain included.
+ */
+void lv_rt_wait_idle(lv_runtime_t* const rt);
+
+/**
+ * @brief Process the pkts still queued then join the workers.
+ */
+void lv_rt_stop(lv_runtime_t* const rt);
+#endif
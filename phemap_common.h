@@ -48,9 +48,22 @@ typedef enum{
     UPDATE_CONF,    /*!< Mex sent from the Dev to AS in order to confirm its update of the pk*/
     INSTALL_SEC,    /*!< Special mex used for install secrets*/
     SEC_CONF,       /*!< Confirmation mex for secrets*/
-    INTER_KEY_INSTALL,  /*!< Inter Key install mex */  
-    LV_SUP_KEY_INSTALL
+    INTER_KEY_INSTALL,  /*!< Inter Key install mex, a key mex whose EPOCH counts the parts sent by the LV */  
+    LV_SUP_KEY_INSTALL,
+    INTER_KEY_COMBINED, /*!< Inter Key combined at the root of the LV tree and sent down to the children, a key mex whose EPOCH counts the combined keys sent by the LV*/
+    RESYNC_REQ,         /*!< Mex sent from a lagging Dev to AS asking for the updates it missed RESYNC_REQ|DEV_ID|EPOCH|LINKED|LINK|SIGN*/
+    RESYNC_DELTA,       /*!< Mex sent from the AS to Dev carrying the missed updates at once, a key mex whose ARG is the low byte of the LINK it answers*/
+    RESUME_SESS,        /*!< Mex sent from a Dev that lost its key but is still a member, built from its ticket RESUME_SESS|DEV_ID|EPOCH|CURSOR|LINKED|LINK|SIGN*/
+    RESUME_PK,          /*!< Mex sent from the AS to Dev reinstating the current key, a key mex whose ARG is the low byte of the LINK it answers*/
+    RESYNC_SKIP,        /*!< Mex sent from the AS to Dev answering a RESYNC_REQ or a RESUME_SESS without a link, a key mex whose ARG is the number of links to skip*/
 }phemap_mex_t;
+/**
+ * @typedef ARG of an UPDATE_KEY, i.e. how the update is encrypted
+ */
+typedef enum{
+    PHEMAP_UPDATE_LINKED,   /*!< Unicast, encrypted and signed with the next links of the receiver chain*/
+    PHEMAP_UPDATE_GROUP,    /*!< Broadcast, encrypted with the old key and signed with the old secret token*/
+}phemap_update_kind_t;
 /**
  * @brief Return values of gk and phemap functions
  */
@@ -72,7 +85,24 @@ typedef enum{
 
 typedef uint16_t phemap_id_t;
 
-#define U8_TO_PUF_BE(buff) ((uint32_t)(*buff)<<24)|((uint32_t)*(buff+1)<<16)|((uint32_t)*(buff+2)<<8)|(uint32_t)*(buff+3)
+#ifndef PHEMAP_CAPTURE
+#define PHEMAP_CAPTURE  1   /*!< Capture points on the automas, see common/phemap_capture.h*/
+#endif
+/**
+ * @typedef Entry point a captured pkt was passed to
+ */
+typedef enum{
+    PHEMAP_CAP_AS,          /*!< gk_as_automa*/
+    PHEMAP_CAP_AS_START,    /*!< gk_as_start_session_cb*/
+    PHEMAP_CAP_DEV,         /*!< gk_dev_automa*/
+    PHEMAP_CAP_LV,          /*!< lv_automa*/
+}phemap_cap_point_t;
+/**
+ * @typedef Called with each inbound pkt, self is the id of the receiving role
+ */
+typedef void (*phemap_capture_fn_t)(const uint8_t point, const phemap_id_t self, const uint8_t* const pkt, const uint32_t len);
+
+#define U8_TO_PUF_BE(buff) (((uint32_t)(*(buff))<<24)|((uint32_t)*(buff+1)<<16)|((uint32_t)*(buff+2)<<8)|(uint32_t)*(buff+3))
 
 #define PUF_TO_U8_BE(puf,buff){ \
     *(buff)=puf>>24;            \
@@ -84,7 +114,62 @@ typedef uint16_t phemap_id_t;
     *(buff)=id>>8;  \
     *(buff+1)=id;   \
 }
-#define U8_TO_PHEMAP_ID_BE(buff) ((phemap_id_t)(*(buff))<<8)|(phemap_id_t)*(buff+1)
+#define U8_TO_PHEMAP_ID_BE(buff) ((phemap_id_t)(((phemap_id_t)(*(buff))<<8)|(phemap_id_t)*(buff+1)))
+/**
+ * @brief Bijective mixing of a word, the finalizer of the keyed sign
+ */
+static inline uint32_t phemap_sign_mix(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7FEB352Du;
+    x ^= x >> 15;
+    x *= 0x846CA68Bu;
+    x ^= x >> 16;
+    return x;
+}
+/**
+ * @brief Keyed sign of the mexs, shared by the AS, the devices and the LVs.
+ * @details Each big endian word, the last one zero padded, is mixed into a state seeded with the key and the
+ *          length, and the key is added back after every word: unlike a xor of (word ^ key) it can't cancel out
+ *          on an even number of words.
+ * @param buff Bytes to sign
+ * @param buff_size Number of bytes
+ * @param sign_key Key of the sign
+ * @return uint32_t The sign
+ */
+static inline uint32_t phemap_keyed_sign(const uint8_t* const buff, const uint32_t buff_size, const uint32_t sign_key)
+{
+    uint32_t sign = sign_key ^ buff_size;
+    for(uint32_t idx = 0; idx < buff_size; idx += sizeof(uint32_t))
+    {
+        uint32_t word = 0;
+        for(uint32_t b = 0; b < sizeof(uint32_t); b++)
+            word = (word << 8) | ((idx + b < buff_size) ? buff[idx + b] : 0);
+        sign = phemap_sign_mix(sign ^ word) + sign_key;
+    }
+    return phemap_sign_mix(sign ^ sign_key);
+}
+/*
+ *  Key mexs (START_PK, UPDATE_KEY, RESYNC_DELTA, RESUME_PK, RESYNC_SKIP, LV_SUP_KEY_INSTALL, INTER_KEY_INSTALL, INTER_KEY_COMBINED):
+ *  TYPE|SENDER_ID|ENC_KEY|ENC_ST|EPOCH|ARG|SIGN, the sign covers everything before it.
+ *  A RESYNC_SKIP carries no key, it is signed with the key part of the device, the secret token of its epoch
+ *  and the sign of the request it answers.
+ */
+#define PHEMAP_KEY_MEX_EPOCH    (1 + sizeof(phemap_id_t) + 2*sizeof(puf_resp_t))   /*!< Offset of the epoch of the key*/
+#define PHEMAP_KEY_MEX_ARG      (PHEMAP_KEY_MEX_EPOCH + sizeof(uint32_t))           /*!< Offset of the type dependent argument*/
+#define PHEMAP_KEY_MEX_SIGNED   (PHEMAP_KEY_MEX_ARG + 1)                            /*!< Bytes covered by the sign*/
+#define PHEMAP_KEY_MEX_SIZE     (PHEMAP_KEY_MEX_SIGNED + sizeof(puf_resp_t))
+//  RESYNC_REQ|DEV_ID|EPOCH|LINKED|LINK|SIGN, LINKED is 1 if LINK is the next link of the device
+#define PHEMAP_RESYNC_REQ_LINKED    (1 + sizeof(phemap_id_t) + sizeof(uint32_t))
+#define PHEMAP_RESYNC_REQ_LINK      (PHEMAP_RESYNC_REQ_LINKED + 1)
+#define PHEMAP_RESYNC_REQ_SIGNED    (PHEMAP_RESYNC_REQ_LINK + sizeof(puf_resp_t))
+#define PHEMAP_RESYNC_REQ_SIZE      (PHEMAP_RESYNC_REQ_SIGNED + sizeof(puf_resp_t))
+//  RESUME_SESS|DEV_ID|EPOCH|CURSOR|LINKED|LINK|SIGN, the LINKED|LINK of a RESYNC_REQ after the cursor of the ticket
+#define PHEMAP_RESUME_SESS_CURSOR   (1 + sizeof(phemap_id_t) + sizeof(uint32_t))
+#define PHEMAP_RESUME_SESS_LINKED   (PHEMAP_RESUME_SESS_CURSOR + sizeof(uint32_t))
+#define PHEMAP_RESUME_SESS_LINK     (PHEMAP_RESUME_SESS_LINKED + 1)
+#define PHEMAP_RESUME_SESS_SIGNED   (PHEMAP_RESUME_SESS_LINK + sizeof(puf_resp_t))
+#define PHEMAP_RESUME_SESS_SIZE     (PHEMAP_RESUME_SESS_SIGNED + sizeof(puf_resp_t))
 // some mex size..
 // ENROLL
 #define start_size  1 + sizeof(phemap_id_t) * 2
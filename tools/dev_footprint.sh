@@ -0,0 +1,73 @@
+#!/bin/sh
+#
+#   Group-Key-Phemap - Copyright (C) 2023-2024 Antonio Emmanuele
+#
+#   This file is part of Group-Key-Phemap, released under the GNU GPL v3 or later.
+#
+#   Builds the device library with the constrained profile and prints a per symbol
+#   text/data/bss report plus the RAM taken by one Device instance.
+#
+#   Usage: tools/dev_footprint.sh [extra compiler flags]
+#   Environment:
+#       CXX         Compiler, default arm-none-eabi-g++ (host g++ if not installed)
+#       CPU_FLAGS   Target flags, default -mcpu=cortex-m4 -mthumb for the arm compiler
+#       PROFILE     Profile defines, default -DGK_DEV_MINIMAL
+#
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+OUT=${OUT:-$ROOT/_footprint}
+PROFILE=${PROFILE--DGK_DEV_MINIMAL}
+
+if [ -z "$CXX" ]; then
+    if command -v arm-none-eabi-g++ >/dev/null 2>&1; then
+        CXX=arm-none-eabi-g++
+    else
+        CXX=g++
+    fi
+fi
+case "$CXX" in
+    *arm-none-eabi-*)
+        CPU_FLAGS=${CPU_FLAGS:--mcpu=cortex-m4 -mthumb}
+        TOOL_PREFIX=arm-none-eabi-
+        ;;
+    *)
+        CPU_FLAGS=${CPU_FLAGS:-}
+        TOOL_PREFIX=
+        ;;
+esac
+NM=${NM:-${TOOL_PREFIX}nm}
+SIZE=${SIZE:-${TOOL_PREFIX}size}
+
+CXXFLAGS="-Os -ffunction-sections -fdata-sections -fno-exceptions -fno-rtti $CPU_FLAGS $PROFILE $*"
+
+mkdir -p "$OUT"
+$CXX $CXXFLAGS -c "$ROOT/dev_protocol/gk_phemap_dev.cc" -o "$OUT/gk_phemap_dev.o"
+# One Device instance in .bss, its symbol size is sizeof(Device)
+printf '#include "%s"\nDevice gk_footprint_device;\n' "$ROOT/dev_protocol/gk_phemap_dev.h" \
+    | $CXX $CXXFLAGS -x c++ -c - -o "$OUT/device_probe.o"
+
+echo "# compiler: $CXX $CXXFLAGS"
+echo "# per symbol footprint (bytes)"
+printf '%-8s %8s  %s\n' "section" "size" "symbol"
+$NM -S -C -t d --size-sort "$OUT/gk_phemap_dev.o" | awk '
+    NF >= 4 {
+        t = $3
+        if (t ~ /[tTwW]/)       sec = "text"
+        else if (t ~ /[rR]/)    sec = "rodata"
+        else if (t ~ /[dDgG]/)  sec = "data"
+        else if (t ~ /[bBsS]/)  sec = "bss"
+        else                    sec = t
+        name = $4
+        for (i = 5; i <= NF; i++) name = name " " $i
+        printf "%-8s %8d  %s\n", sec, $2 + 0, name
+    }'
+echo
+echo "# section totals"
+$SIZE "$OUT/gk_phemap_dev.o"
+echo
+echo "# RAM per Device instance"
+$NM -S -t d "$OUT/device_probe.o" | awk '$4 == "gk_footprint_device" { printf "sizeof(Device) = %d\n", $2 + 0 }'
+echo
+echo "# undefined references (libm/stdio must not appear in the minimal profile)"
+$NM -u "$OUT/gk_phemap_dev.o" | awk '{ print $2 }'
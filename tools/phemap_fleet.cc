@@ -0,0 +1,518 @@
+/*
+    Group-Key-Phemap - Copyright (C) 2023-2024 Antonio Emmanuele
+
+    This file is part of Group-Key-Phemap.
+
+    Group-Key-Phemap is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Group-Key-Phemap is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file    phemap_fleet.cc
+ * @brief   Simulates a fleet of devices on one thread, each device session is a coroutine of gk_dev_coro.h.
+ * @details g groups of n devices, each group with its AS. At time 0 the first device of each group joins, its 
+ *          START_SESS starts the install and the others co_await their START_PK. Then, by default, c devices
+ *          of each group leave, one every slot ms, and join again slot/2 ms later, while the other members
+ *          co_await the updates. With -j every device of every group instead reboots at a random time of the
+ *          window after slot ms and joins again, retrying after a random backoff until it gets the key: the
+ *          join storm after a power restore. -a puts the admission stage of gk_as_admit.h in front of each AS.
+ *          The mexs take -l ms each way, the virtual clock only moves to the next timer. Each device has its
+ *          own chain, the AS hooks find it through the group being processed and the device hooks through
+ *          gk_dev_co_current, so a device out of step with its AS can't decrypt its key. At the end every 
+ *          device must hold the key of its AS.
+ *
+ *          g++ -std=c++20 -O2 -o phemap_fleet tools/phemap_fleet.cc dev_protocol/gk_dev_coro.cc \
+ *              dev_protocol/gk_phemap_dev.cc as_protocol/gk_phemap_as.cc as_protocol/gk_as_admit.cc
+ *
+ *          Usage: phemap_fleet [-g groups] [-n devices] [-c churn] [-s slot] [-j window] [-l latency] [-a ms] [-r rate]
+ *              -g  groups, default 200
+ *              -n  devices of each group, default 1000
+ *              -c  devices of each group leaving and joining again, default 10
+ *              -s  virtual ms between two churn ops of a group, default 100
+ *              -j  join storm over window ms instead of the churn, default 0 (off)
+ *              -l  one way latency of the mexs in ms, default 0
+ *              -a  admission stage with this max join latency in ms, default off
+ *              -r  rekeys per second of each admission stage, default 0 (no limit)
+ */
+#include "../as_protocol/gk_as_admit.h"
+#include "../dev_protocol/gk_dev_coro.h"
+#include <array>
+#include <assert.h>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <vector>
+
+#define FLEET_AS_ID         1
+#define FLEET_DEV_BASE      1000
+#define FLEET_ALL           0xFFFF
+#define FLEET_TIMEOUT_MS    5000        /*!< Time a device waits for its key*/
+#define FLEET_BACKOFF_MS    1000        /*!< A storm device without key joins again within this time*/
+#define FLEET_POLL_MS       10          /*!< Period of gk_as_admit_poll*/
+
+/**
+ * @typedef An AS and its devices
+ */
+typedef struct{
+    AuthServer*             as;         /*!< The AS of the group.*/
+    void*                   storage;    /*!< Storage bound to as.*/
+    gk_as_admit_t*          adm;        /*!< Admission stage of as, NULL without -a.*/
+    gk_dev_co_session_t*    sess;       /*!< Sessions, the slot of a device is its index.*/
+    uint32_t*               as_cursor;  /*!< Position of the AS in the chain of each device.*/
+    uint32_t*               dev_cursor; /*!< Position of each device in its own chain.*/
+    uint32_t                seed;       /*!< Chains of the group, different from the other groups.*/
+    uint16_t                ndev;       /*!< Number of devices.*/
+}fleet_group_t;
+
+/**
+ * @typedef Outcome of the run
+ */
+typedef struct{
+    uint64_t    installs;               /*!< Devices installed by the first session.*/
+    uint64_t    joins;                  /*!< Joins after a leave or a reboot that got the key.*/
+    uint64_t    failed;                 /*!< Installs and joins that got REINIT or timed out.*/
+    uint64_t    leaves;                 /*!< END_SESS sent.*/
+    uint64_t    updates;                /*!< gk_dev_co_update returning UPDATE_OK.*/
+    uint64_t    reinits;                /*!< Members that lost the key.*/
+    uint64_t    as_reinits;             /*!< REINIT returned by the ASes.*/
+}fleet_count_t;
+
+static gk_dev_co_sched_t    fleet_sched;
+static fleet_count_t        fleet_count;
+static uint64_t             fleet_end_ms;
+static uint64_t             fleet_slot_ms = 100;
+static uint64_t             fleet_latency_ms = 0;
+static uint32_t             fleet_seed = 0x9E3779B9u;
+static fleet_group_t*       fleet_as_on = NULL;     /*!< Group whose AS is processing, for the AS chain hooks*/
+
+static uint32_t fleet_rand()
+{
+    fleet_seed ^= fleet_seed << 13;
+    fleet_seed ^= fleet_seed >> 17;
+    fleet_seed ^= fleet_seed << 5;
+    return fleet_seed;
+}
+
+static fleet_group_t* fleet_group_of(const gk_dev_co_session_t* const s)
+{
+    return (fleet_group_t*)s->user;
+}
+
+/**
+ * @brief Link at of the chain of device id, a hash standing for its PUF.
+ */
+static puf_resp_t fleet_link(const fleet_group_t* const g, const phemap_id_t id, const uint32_t at)
+{
+    uint32_t x = g->seed ^ ((uint32_t)id*0x9E3779B1u) ^ (at*0x85EBCA77u);
+    x ^= x >> 16;
+    x *= 0x7FEB352Du;
+    x ^= x >> 15;
+    x *= 0x846CA68Bu;
+    x ^= x >> 16;
+    return x;
+}
+
+static uint32_t& fleet_as_cursor(const phemap_id_t id)
+{
+    assert(NULL != fleet_as_on);
+    return fleet_as_on->as_cursor[id - FLEET_DEV_BASE];
+}
+
+static uint32_t& fleet_dev_cursor()
+{
+    gk_dev_co_session_t* const s = gk_dev_co_current();
+    assert(NULL != s);
+    return fleet_group_of(s)->dev_cursor[s->dev.id - FLEET_DEV_BASE];
+}
+
+puf_resp_t as_get_next_link(const phemap_id_t id)
+{
+    return fleet_link(fleet_as_on,id,fleet_as_cursor(id)++);
+}
+
+uint32_t as_peek_links(const phemap_id_t id, puf_resp_t* const links, const uint32_t n)
+{
+    for(uint32_t i = 0; i < n; i++)
+        links[i] = fleet_link(fleet_as_on,id,fleet_as_cursor(id) + i);
+    return n;
+}
+
+void as_skip_links(const phemap_id_t id, const uint32_t n)
+{
+    fleet_as_cursor(id) += n;
+}
+
+uint32_t as_chain_cursor(const phemap_id_t id)
+{
+    return fleet_as_cursor(id);
+}
+
+void as_set_chain_cursor(const phemap_id_t id, const uint32_t cursor)
+{
+    fleet_as_cursor(id) = cursor;
+}
+
+void dev_get_next_puf_resp_u8(uint8_t* const puf)
+{
+    gk_dev_co_session_t* const s = gk_dev_co_current();
+    puf_resp_t link = fleet_link(fleet_group_of(s),s->dev.id,fleet_dev_cursor()++);
+    PUF_TO_U8_BE(link,puf);
+}
+
+puf_resp_t dev_get_next_puf_resp()
+{
+    uint8_t puf[4];
+    dev_get_next_puf_resp_u8(puf);
+    return U8_TO_PUF_BE(puf);
+}
+
+uint32_t dev_chain_cursor()
+{
+    return fleet_dev_cursor();
+}
+
+void dev_set_chain_cursor(const uint32_t cursor)
+{
+    fleet_dev_cursor() = cursor;
+}
+
+static void fleet_to_dev(fleet_group_t* const g, const uint16_t slot, const uint8_t* const mex)
+{
+    if(slot != FLEET_ALL)
+        gk_dev_co_deliver(&g->sess[slot],mex,GK_AS_MEX_SIZE);
+    else
+        for(uint16_t d = 0; d < g->ndev; d++)
+            gk_dev_co_deliver(&g->sess[d],mex,GK_AS_MEX_SIZE);
+}
+
+static GkDevTask<void> fleet_downlink(fleet_group_t* const g, const uint16_t slot, const std::array<uint8_t,GK_AS_MEX_SIZE> mex)
+{
+    co_await gk_dev_co_sleep(&fleet_sched,fleet_latency_ms);
+    fleet_to_dev(g,slot,mex.data());
+}
+
+/**
+ * @brief Move the unicast and broadcast mexs of the AS to its devices.
+ */
+static void fleet_as_out(fleet_group_t* const g)
+{
+    AuthServer* const as = g->as;
+    std::array<uint8_t,GK_AS_MEX_SIZE> mex;
+    for(uint32_t k = 0; k <= as->unicast_tsmt_count; k++)
+    {
+        uint16_t slot;
+        if(k < as->unicast_tsmt_count)
+        {
+            slot = as->unicast_tsmt_queue[k];
+            memcpy(mex.data(),as->unicast_tsmt_buff[slot],GK_AS_MEX_SIZE);
+        }
+        else if(as->broadcast_is_present)
+        {
+            slot = FLEET_ALL;
+            memcpy(mex.data(),as->broadcast_tsmt_buff,GK_AS_MEX_SIZE);
+        }
+        else
+            break;
+        if(fleet_latency_ms == 0)
+            fleet_to_dev(g,slot,mex.data());
+        else
+            gk_dev_co_spawn(&fleet_sched,fleet_downlink(g,slot,mex));
+    }
+    as->unicast_tsmt_count = 0;
+    as->broadcast_is_present = 0;
+}
+
+/**
+ * @brief The AS of the group receives a mex, through its admission stage if any.
+ */
+static void fleet_as_rx(fleet_group_t* const g, uint8_t* const pkt, const uint8_t len)
+{
+    const uint32_t now = (uint32_t)fleet_sched.now_ms;
+    phemap_ret_t ret;
+    fleet_as_on = g;
+    if(g->adm != NULL)
+        ret = gk_as_admit_automa(g->adm,pkt,len,now);
+    else if(g->as->as_state == GK_AS_WAIT_FOR_START_REQ && pkt[0] == START_SESS)
+        ret = gk_as_start_session_cb(g->as,pkt,len);
+    else
+        ret = gk_as_automa(g->as,pkt,len);
+    if(ret == REINIT)
+        fleet_count.as_reinits++;
+    fleet_as_out(g);
+    while(g->adm != NULL && gk_as_admit_poll(g->adm,now) > 0)
+        fleet_as_out(g);
+}
+
+static GkDevTask<void> fleet_uplink(fleet_group_t* const g, std::array<uint8_t,DEV_MEX_SIZE> mex, const uint8_t len)
+{
+    co_await gk_dev_co_sleep(&fleet_sched,fleet_latency_ms);
+    fleet_as_rx(g,mex.data(),len);
+}
+
+/**
+ * @brief Send callback: the mex reaches the AS at once, or after the latency.
+ */
+static void fleet_send(gk_dev_co_session_t* const s, const uint8_t* const mex, const uint8_t len, void* const user)
+{
+    (void)user;
+    std::array<uint8_t,DEV_MEX_SIZE> pkt;
+    memcpy(pkt.data(),mex,len);
+    if(fleet_latency_ms == 0)
+        fleet_as_rx(fleet_group_of(s),pkt.data(),len);
+    else
+        gk_dev_co_spawn(&fleet_sched,fleet_uplink(fleet_group_of(s),pkt,len));
+}
+
+/**
+ * @brief Releases the joins of the admission stage whose max latency expired.
+ */
+static GkDevTask<void> fleet_admit_poller(fleet_group_t* const g)
+{
+    while(fleet_sched.now_ms < fleet_end_ms)
+    {
+        co_await gk_dev_co_sleep(&fleet_sched,FLEET_POLL_MS);
+        fleet_as_on = g;
+        while(gk_as_admit_poll(g->adm,(uint32_t)fleet_sched.now_ms) > 0)
+            fleet_as_out(g);
+    }
+}
+
+static GkDevTask<phemap_ret_t> fleet_first_key(gk_dev_co_session_t* const s, const uint8_t first)
+{
+    phemap_ret_t ret = first ? co_await gk_dev_co_join(s,FLEET_TIMEOUT_MS) : co_await gk_dev_co_install(s,FLEET_TIMEOUT_MS);
+    if(ret == INSTALL_OK)
+        fleet_count.installs++;
+    else
+        fleet_count.failed++;
+    co_return ret;
+}
+
+/**
+ * @brief Life of a device: install, updates, possibly a leave and a join at leave_at, updates up to the end.
+ */
+static GkDevTask<void> fleet_device(gk_dev_co_session_t* const s, const uint8_t first, uint64_t leave_at)
+{
+    phemap_ret_t ret = co_await fleet_first_key(s,first);
+    while(s->sched->now_ms < fleet_end_ms)
+    {
+        uint64_t now = s->sched->now_ms;
+        uint64_t until = (leave_at < fleet_end_ms) ? leave_at : fleet_end_ms;
+        if(now < until)
+        {
+            ret = co_await gk_dev_co_update(s,until - now);
+            if(ret == UPDATE_OK)
+                fleet_count.updates++;
+            else if(ret == REINIT)
+            {
+                fleet_count.reinits++;
+                leave_at = now;
+            }
+            continue;
+        }
+        gk_dev_co_leave(s);
+        fleet_count.leaves++;
+        co_await gk_dev_co_sleep(s->sched,fleet_slot_ms/2);
+        ret = co_await gk_dev_co_join(s,FLEET_TIMEOUT_MS);
+        if(ret == INSTALL_OK)
+            fleet_count.joins++;
+        else
+            fleet_count.failed++;
+        leave_at = GK_DEV_CO_FOREVER;
+    }
+}
+
+/**
+ * @brief Life of a device in a storm: install, reboot at join_at losing the key, join until it gets one.
+ */
+static GkDevTask<void> fleet_storm_device(gk_dev_co_session_t* const s, const uint8_t first, const uint64_t join_at)
+{
+    uint8_t member = (co_await fleet_first_key(s,first) == INSTALL_OK) ? 1 : 0;
+    if(join_at > s->sched->now_ms)
+        co_await gk_dev_co_sleep(s->sched,join_at - s->sched->now_ms);
+    member = 0;
+    while(s->sched->now_ms < fleet_end_ms)
+    {
+        if(member == 0)
+        {
+            if(co_await gk_dev_co_join(s,FLEET_TIMEOUT_MS) == INSTALL_OK)
+            {
+                fleet_count.joins++;
+                member = 1;
+            }
+            else
+            {
+                fleet_count.failed++;
+                co_await gk_dev_co_sleep(s->sched,1 + fleet_rand() % FLEET_BACKOFF_MS);
+            }
+            continue;
+        }
+        phemap_ret_t ret = co_await gk_dev_co_update(s,fleet_end_ms - s->sched->now_ms);
+        if(ret == UPDATE_OK)
+            fleet_count.updates++;
+        else if(ret == REINIT)
+        {
+            fleet_count.reinits++;
+            member = 0;
+            co_await gk_dev_co_sleep(s->sched,1 + fleet_rand() % FLEET_BACKOFF_MS);
+        }
+    }
+}
+
+static uint8_t fleet_build(fleet_group_t& g, const uint16_t n, const uint8_t admit, const uint32_t admit_ms, const uint32_t rate)
+{
+    g.ndev      = n;
+    g.as        = (AuthServer*)calloc(1,sizeof(AuthServer));
+    g.storage   = aligned_alloc(sizeof(private_key_t),(GK_AS_STORAGE_SIZE(n) + sizeof(private_key_t) - 1) & ~(uint32_t)(sizeof(private_key_t) - 1));
+    g.sess      = (gk_dev_co_session_t*)calloc(n,sizeof(gk_dev_co_session_t));
+    g.as_cursor = (uint32_t*)calloc(n,sizeof(uint32_t));
+    g.dev_cursor= (uint32_t*)calloc(n,sizeof(uint32_t));
+    g.seed      = fleet_rand();
+    g.adm       = NULL;
+    if(g.as == NULL || g.storage == NULL || g.sess == NULL || g.as_cursor == NULL || g.dev_cursor == NULL)
+        return 0;
+    gk_as_bind(g.as,g.storage,n);
+    g.as->as_id = FLEET_AS_ID;
+    for(uint16_t d = 0; d < n; d++)
+    {
+        gk_as_register_dev(g.as,(phemap_id_t)(FLEET_DEV_BASE + d));
+        gk_dev_co_session_init(&fleet_sched,&g.sess[d],(phemap_id_t)(FLEET_DEV_BASE + d),FLEET_AS_ID);
+        g.sess[d].user = &g;
+    }
+    if(admit == 1 && (g.adm = gk_as_admit_open(g.as,admit_ms,rate)) == NULL)
+        return 0;
+    return 1;
+}
+
+int main(int argc, char** argv)
+{
+    uint32_t groups = 200, n = 1000, churn = 10, admit_ms = 0, rate = 0;
+    uint64_t storm_ms = 0;
+    uint8_t admit = 0;
+    for(int i = 1; i + 1 < argc; i += 2)
+    {
+        if(strcmp(argv[i],"-g") == 0)
+            groups = (uint32_t)strtoul(argv[i + 1],NULL,0);
+        else if(strcmp(argv[i],"-n") == 0)
+            n = (uint32_t)strtoul(argv[i + 1],NULL,0);
+        else if(strcmp(argv[i],"-c") == 0)
+            churn = (uint32_t)strtoul(argv[i + 1],NULL,0);
+        else if(strcmp(argv[i],"-s") == 0)
+            fleet_slot_ms = strtoull(argv[i + 1],NULL,0);
+        else if(strcmp(argv[i],"-j") == 0)
+            storm_ms = strtoull(argv[i + 1],NULL,0);
+        else if(strcmp(argv[i],"-l") == 0)
+            fleet_latency_ms = strtoull(argv[i + 1],NULL,0);
+        else if(strcmp(argv[i],"-a") == 0)
+        {
+            admit = 1;
+            admit_ms = (uint32_t)strtoul(argv[i + 1],NULL,0);
+        }
+        else if(strcmp(argv[i],"-r") == 0)
+            rate = (uint32_t)strtoul(argv[i + 1],NULL,0);
+        else
+        {
+            fprintf(stderr,"usage: %s [-g groups] [-n devices] [-c churn] [-s slot] [-j window] [-l latency] [-a ms] [-r rate]\n",argv[0]);
+            return 2;
+        }
+    }
+    if(groups == 0 || n == 0 || n > 0xFFFF - FLEET_DEV_BASE || churn > n || fleet_slot_ms < 2)
+    {
+        fprintf(stderr,"invalid sizes\n");
+        return 2;
+    }
+    gk_dev_co_sched_init(&fleet_sched,fleet_send,NULL);
+    std::vector<fleet_group_t> fleet(groups);
+    for(fleet_group_t& g : fleet)
+        if(fleet_build(g,(uint16_t)n,admit,admit_ms,rate) == 0)
+        {
+            fprintf(stderr,"out of memory\n");
+            return 1;
+        }
+    //  Churn op i of a group at (i + 1)*slot, on devices spread over the slots
+    fleet_end_ms = (storm_ms > 0) ? fleet_slot_ms + storm_ms + 2*FLEET_TIMEOUT_MS : (churn + 2)*fleet_slot_ms;
+    for(fleet_group_t& g : fleet)
+    {
+        std::vector<uint64_t> leave_at(n,GK_DEV_CO_FOREVER);
+        for(uint32_t i = 0; i < churn; i++)
+            leave_at[(uint64_t)i*n/churn] = (i + 1)*fleet_slot_ms;
+        for(uint16_t d = 0; d < n; d++)
+            if(storm_ms > 0)
+                gk_dev_co_spawn(&fleet_sched,fleet_storm_device(&g.sess[d],d == 0,fleet_slot_ms + fleet_rand() % storm_ms));
+            else
+                gk_dev_co_spawn(&fleet_sched,fleet_device(&g.sess[d],d == 0,leave_at[d]));
+        if(g.adm != NULL)
+            gk_dev_co_spawn(&fleet_sched,fleet_admit_poller(&g));
+    }
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    uint32_t left = gk_dev_co_run_virtual(&fleet_sched,GK_DEV_CO_FOREVER);
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    uint64_t agree = 0, dropped = 0, epochs = 0;
+    gk_as_admit_stats_t adm;
+    uint32_t p50 = 0, p99 = 0;
+    memset(&adm,0,sizeof(adm));
+    for(fleet_group_t& g : fleet)
+    {
+        for(uint16_t d = 0; d < n; d++)
+        {
+            agree += (g.sess[d].dev.dev_state == GK_DEV_WAIT_FOR_UPDATE && g.sess[d].dev.pk == g.as->private_key);
+            dropped += g.sess[d].in_dropped;
+        }
+        epochs += g.as->epoch;
+        if(g.adm == NULL)
+            continue;
+        adm.depth_peak      = (g.adm->stats.depth_peak > adm.depth_peak) ? g.adm->stats.depth_peak : adm.depth_peak;
+        adm.admitted        += g.adm->stats.admitted;
+        adm.merged          += g.adm->stats.merged;
+        adm.absorbed        += g.adm->stats.absorbed;
+        adm.refused         += g.adm->stats.refused;
+        adm.expired         += g.adm->stats.expired;
+        adm.rekeys          += g.adm->stats.rekeys;
+        adm.throttled       += g.adm->stats.throttled;
+        adm.latency_sum_ms  += g.adm->stats.latency_sum_ms;
+        adm.latency_max_ms  = (g.adm->stats.latency_max_ms > adm.latency_max_ms) ? g.adm->stats.latency_max_ms : adm.latency_max_ms;
+        uint32_t q = gk_as_admit_latency_ms(g.adm,0.5);
+        p50 = (q > p50) ? q : p50;
+        q = gk_as_admit_latency_ms(g.adm,0.99);
+        p99 = (q > p99) ? q : p99;
+    }
+    struct rusage ru;
+    getrusage(RUSAGE_SELF,&ru);
+    printf("sessions   %llu, %u groups of %u, %zu bytes each\n",(unsigned long long)groups*n,groups,n,sizeof(gk_dev_co_session_t));
+    printf("installs   %llu joins %llu leaves %llu failed %llu\n",(unsigned long long)fleet_count.installs,
+        (unsigned long long)fleet_count.joins,(unsigned long long)fleet_count.leaves,(unsigned long long)fleet_count.failed);
+    printf("updates    %llu reinits %llu timeouts %llu inbox drops %llu flows left %u\n",(unsigned long long)fleet_count.updates,
+        (unsigned long long)fleet_count.reinits,(unsigned long long)fleet_sched.timeouts,(unsigned long long)dropped,left);
+    printf("as         %llu epochs, %llu reinits\n",(unsigned long long)epochs,(unsigned long long)fleet_count.as_reinits);
+    if(admit == 1)
+        printf("admission  %llu rekeys for %llu joins, peak depth %u, merged %llu absorbed %llu refused %llu expired %llu throttled %llu,"
+            " latency mean %.1f ms worst group p50 <%u p99 <%u max %u ms\n",(unsigned long long)adm.rekeys,(unsigned long long)adm.admitted,
+            adm.depth_peak,(unsigned long long)adm.merged,(unsigned long long)adm.absorbed,(unsigned long long)adm.refused,
+            (unsigned long long)adm.expired,(unsigned long long)adm.throttled,adm.admitted ? (double)adm.latency_sum_ms/adm.admitted : 0.0,
+            p50,p99,adm.latency_max_ms);
+    printf("keys agree %llu/%llu\n",(unsigned long long)agree,(unsigned long long)groups*n);
+    printf("virtual    %llu ms, wall %.3f s, %llu resumes, %.0f resumes/s, max rss %ld MB\n",(unsigned long long)fleet_sched.now_ms,
+        wall,(unsigned long long)fleet_sched.resumed,fleet_sched.resumed/wall,ru.ru_maxrss/1024);
+    gk_dev_co_sched_free(&fleet_sched);
+    for(fleet_group_t& g : fleet)
+    {
+        gk_as_admit_close(g.adm);
+        free(g.as);
+        free(g.storage);
+        free(g.sess);
+        free(g.as_cursor);
+        free(g.dev_cursor);
+    }
+    return agree == (uint64_t)groups*n ? 0 : 1;
+}
@@ -0,0 +1,374 @@
+/*
+    Group-Key-Phemap - Copyright (C) 2023-2024 Antonio Emmanuele
+
+    This file is part of Group-Key-Phemap.
+
+    Group-Key-Phemap is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Group-Key-Phemap is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file    phemap_replay.cc
+ * @brief   Feeds a pkt trace written by phemap_capture_open back into fresh AS, device and LV instances.
+ * @details One instance is built for each role seen in the trace, its peers are registered from the senders
+ *          of its pkts: an LV takes the sender of START_PK/UPDATE_KEY as its AS, the senders of the inter key
+ *          mexs as LVs and the other senders as devices. The pkts are loaded in memory and replayed back to
+ *          back, the mexs produced by the instances are discarded. The calls made by the application, like
+ *          gk_as_start_session or gk_dev_start_session, are not in the trace: with -s the ASes and the AS
+ *          roles of the LVs start their session before the first pkt.
+ *          Fresh instances have no keys, so most pkts take the failure and REINIT paths. With -r the ASes and
+ *          the LVs are restored from the snapshots saved with gk_as_save and lv_save when the capture was
+ *          opened, as as_<id>.snap and lv_<id>.snap in dir. The devices have no snapshot and start fresh, and
+ *          the links come from the chain hooks linked into phemap_replay: the link checks pass only if they
+ *          are the hooks of the captured run.
+ *
+ *          g++ -std=c++17 -O2 -pthread -o phemap_replay tools/phemap_replay.cc common/phemap_capture.cc \
+ *              common/phemap_snapshot.cc as_protocol/gk_phemap_as.cc as_protocol/gk_as_snapshot.cc \
+ *              dev_protocol/gk_phemap_dev.cc lv_protocol/dgk_lv.cc lv_protocol/dgk_lv_snapshot.cc ...
+ *
+ *          Usage: phemap_replay [-s] [-r dir] [-t] [-v] [-n loops] trace
+ *              -s  start the sessions of the ASes before replaying
+ *              -r  restore the ASes and the LVs from the snapshots in dir
+ *              -t  LVs use the aggregation tree for the inter group key
+ *              -v  print each record and its return code
+ *              -n  replay the trace loops times, each time on fresh instances
+ */
+#include "../common/phemap_capture.h"
+#include "../common/phemap_snapshot.h"
+#include "../lv_protocol/dgk_lv.h"
+#include <chrono>
+#include <map>
+#include <set>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#define REPLAY_RET_CODES    32
+
+/**
+ * @typedef A role of the trace and the peers it received pkts from
+ */
+typedef struct{
+    uint8_t                 point;          /*!< PHEMAP_CAP_AS, PHEMAP_CAP_DEV or PHEMAP_CAP_LV.*/
+    phemap_id_t             self;           /*!< Id of the role.*/
+    phemap_id_t             as_id;          /*!< AS of a device or LV, 0 if unknown.*/
+    std::set<phemap_id_t>   devs;           /*!< Devices of an AS or LV.*/
+    std::set<phemap_id_t>   lvs;            /*!< LVs peering with a LV.*/
+    void*                   inst;           /*!< AuthServer, Device or local_verifier_t.*/
+    void*                   storage;        /*!< Storage bound to inst.*/
+    uint64_t                pkts;           /*!< Pkts replayed on this role.*/
+}replay_role_t;
+
+typedef std::map<uint32_t,replay_role_t> replay_roles_t;
+
+static const char* const point_names[] = {"AS","AS_START","DEV","LV"};
+
+static uint32_t replay_key(const uint8_t point, const phemap_id_t self)
+{
+    //  gk_as_start_session_cb and gk_as_automa run on the same AS
+    uint8_t role = (point == PHEMAP_CAP_AS_START) ? (uint8_t)PHEMAP_CAP_AS : point;
+    return ((uint32_t)role << 16) | self;
+}
+
+/**
+ * @brief Note the peer of a record in its role.
+ */
+static void replay_scan(replay_roles_t& roles, const phemap_trace_rec_t& rec)
+{
+    replay_role_t& role = roles[replay_key(rec.point,rec.self)];
+    role.point  = (rec.point == PHEMAP_CAP_AS_START) ? (uint8_t)PHEMAP_CAP_AS : rec.point;
+    role.self   = rec.self;
+    if(rec.len == 0)
+        return;
+    switch(rec.point)
+    {
+        case PHEMAP_CAP_AS:
+        case PHEMAP_CAP_AS_START:
+            role.devs.insert(rec.peer);
+            break;
+        case PHEMAP_CAP_DEV:
+            if(role.as_id == 0)
+                role.as_id = rec.peer;
+            break;
+        default:
+            if(rec.pkt[0] == START_PK || rec.pkt[0] == UPDATE_KEY || rec.pkt[0] == RESYNC_DELTA || rec.pkt[0] == RESUME_PK ||
+                rec.pkt[0] == RESYNC_SKIP)
+                role.as_id = rec.peer;
+            else if(rec.pkt[0] == INTER_KEY_INSTALL || rec.pkt[0] == INTER_KEY_COMBINED)
+                role.lvs.insert(rec.peer);
+            else
+                role.devs.insert(rec.peer);
+            break;
+    }
+}
+
+static void replay_snap_path(const replay_role_t& role, const char* const dir, char* const path, const size_t cap)
+{
+    snprintf(path,cap,"%s/%s_%u.snap",dir,role.point == PHEMAP_CAP_AS ? "as" : "lv",role.self);
+}
+
+/**
+ * @brief Devices registered in the snapshot of an AS or LV, 0 if there is none.
+ */
+static uint16_t replay_snap_devs(const replay_role_t& role, const char* const dir)
+{
+    char path[512];
+    uint32_t size = 0;
+    if(dir == NULL)
+        return 0;
+    replay_snap_path(role,dir,path,sizeof(path));
+    uint8_t* snap = phemap_snap_read_file(path,&size);
+    if(snap == NULL)
+        return 0;
+    //  Both payloads start with the one of the AS, AS_ID|NUM_AUTH|...
+    phemap_snap_kind_t kind = (role.point == PHEMAP_CAP_AS) ? PHEMAP_SNAP_AS : PHEMAP_SNAP_LV;
+    uint16_t devs = (phemap_snap_open(snap,size,kind) >= 2*sizeof(phemap_id_t)) ? U8_TO_PHEMAP_ID_BE(&snap[PHEMAP_SNAP_HDR_SIZE + 2]) : 0;
+    free(snap);
+    return devs;
+}
+
+/**
+ * @brief Restore an AS or LV from its snapshot in dir, if any.
+ * @return uint8_t 1 if restored.
+ */
+static uint8_t replay_restore(replay_role_t& role, const char* const dir)
+{
+    char path[512];
+    if(replay_snap_devs(role,dir) == 0)
+        return 0;
+    replay_snap_path(role,dir,path,sizeof(path));
+    phemap_ret_t ret = (role.point == PHEMAP_CAP_AS) ? gk_as_load((AuthServer*)role.inst,path) : lv_load((local_verifier_t*)role.inst,path);
+    if(ret != OK)
+        fprintf(stderr,"%s: doesn't fit the roles of the trace, fresh instance\n",path);
+    return ret == OK ? 1 : 0;
+}
+
+/**
+ * @brief Build an instance for a role, restored from dir when its snapshot is there.
+ */
+static uint8_t replay_build(replay_role_t& role, const uint8_t tree, const uint8_t start, const char* const dir)
+{
+    uint16_t ndev = (uint16_t)(role.devs.size() > 0 ? role.devs.size() : 1);
+    uint16_t nsnap = (role.point == PHEMAP_CAP_DEV) ? 0 : replay_snap_devs(role,dir);
+    if(nsnap > ndev)
+        ndev = nsnap;
+    uint16_t nlv = (uint16_t)(role.lvs.size() > 0 ? role.lvs.size() : 1);
+    role.pkts = 0;
+    if(role.point == PHEMAP_CAP_DEV)
+    {
+        Device* dev = (Device*)calloc(1,sizeof(Device));
+        if(dev == NULL)
+            return 0;
+        dev->id     = role.self;
+        dev->as_id  = role.as_id;
+        role.inst   = dev;
+        role.storage= NULL;
+        return 1;
+    }
+    if(role.point == PHEMAP_CAP_AS)
+    {
+        AuthServer* as = (AuthServer*)calloc(1,sizeof(AuthServer));
+        role.storage = aligned_alloc(sizeof(private_key_t),GK_AS_STORAGE_SIZE(ndev));
+        if(as == NULL || role.storage == NULL)
+            return 0;
+        gk_as_bind(as,role.storage,ndev);
+        as->as_id = role.self;
+        for(phemap_id_t id : role.devs)
+            gk_as_register_dev(as,id);
+        role.inst = as;
+        if(replay_restore(role,dir) == 0 && start)
+        {
+            gk_as_start_session(as);
+            as->unicast_tsmt_count = 0;
+            as->broadcast_is_present = 0;
+        }
+        return 1;
+    }
+    local_verifier_t* lv = (local_verifier_t*)calloc(1,sizeof(local_verifier_t));
+    role.storage = aligned_alloc(sizeof(private_key_t),(LV_STORAGE_SIZE(ndev,nlv) + sizeof(private_key_t) - 1) & ~(sizeof(private_key_t) - 1));
+    if(lv == NULL || role.storage == NULL)
+        return 0;
+    lv_bind(lv,role.storage,ndev,nlv);
+    lv->lv_dev_role.id      = role.self;
+    lv->lv_dev_role.as_id   = role.as_id;
+    lv->lv_as_role.as_id    = role.self;
+    for(phemap_id_t id : role.devs)
+        lv_register_dev(lv,id);
+    for(phemap_id_t id : role.lvs)
+        lv_register_lv(lv,id);
+    lv->num_install_pending = (uint16_t)(lv->num_lv + 1);
+    lv->topology = tree ? LV_TOPO_TREE : LV_TOPO_FLAT;
+    lv_build_tree(lv);
+    role.inst = lv;
+    if(replay_restore(role,dir) == 0 && start)
+    {
+        gk_as_start_session(&lv->lv_as_role);
+        lv->lv_as_role.unicast_tsmt_count = 0;
+        lv->lv_as_role.broadcast_is_present = 0;
+    }
+    return 1;
+}
+
+static void replay_free(replay_role_t& role)
+{
+    free(role.inst);
+    free(role.storage);
+    role.inst = NULL;
+    role.storage = NULL;
+}
+
+/**
+ * @brief Drop the mexs an instance produced, the replay only drives the inbound side.
+ */
+static void replay_discard(replay_role_t& role)
+{
+    if(role.point == PHEMAP_CAP_DEV)
+    {
+        Device* dev = (Device*)role.inst;
+        while(gk_dev_outbox_count(dev) > 0)
+            gk_dev_outbox_pop(dev);
+    }
+    else if(role.point == PHEMAP_CAP_AS)
+    {
+        AuthServer* as = (AuthServer*)role.inst;
+        as->unicast_tsmt_count = 0;
+        as->broadcast_is_present = 0;
+    }
+    else
+    {
+        local_verifier_t* lv = (local_verifier_t*)role.inst;
+        while(gk_dev_outbox_count(&lv->lv_dev_role) > 0)
+            gk_dev_outbox_pop(&lv->lv_dev_role);
+        lv->lv_as_role.unicast_tsmt_count = 0;
+        lv->lv_as_role.broadcast_is_present = 0;
+        while(lv_broad_peek(&lv->devs_queue) != NULL)
+            lv_broad_pop(&lv->devs_queue);
+        while(lv_broad_peek(&lv->lvs_queue) != NULL)
+            lv_broad_pop(&lv->lvs_queue);
+    }
+}
+
+static phemap_ret_t replay_pkt(replay_role_t& role, const phemap_trace_rec_t& rec)
+{
+    uint8_t pkt[PHEMAP_TRACE_MAX_PKT];
+    phemap_ret_t ret;
+    //  The automas may write on the pkt, the trace is replayed many times
+    memcpy(pkt,rec.pkt,rec.len);
+    switch(rec.point)
+    {
+        case PHEMAP_CAP_AS:
+            ret = gk_as_automa((AuthServer*)role.inst,pkt,rec.len);
+            break;
+        case PHEMAP_CAP_AS_START:
+            ret = gk_as_start_session_cb((AuthServer*)role.inst,pkt,rec.len);
+            break;
+        case PHEMAP_CAP_DEV:
+            ret = gk_dev_automa((Device*)role.inst,pkt,rec.len);
+            break;
+        default:
+            ret = lv_automa((local_verifier_t*)role.inst,pkt,rec.len);
+            break;
+    }
+    role.pkts++;
+    replay_discard(role);
+    return ret;
+}
+
+int main(int argc, char** argv)
+{
+    uint8_t start = 0, tree = 0, verbose = 0;
+    uint32_t loops = 1;
+    const char* path = NULL;
+    const char* dir = NULL;
+    for(int i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i],"-s") == 0)
+            start = 1;
+        else if(strcmp(argv[i],"-r") == 0 && i + 1 < argc)
+            dir = argv[++i];
+        else if(strcmp(argv[i],"-t") == 0)
+            tree = 1;
+        else if(strcmp(argv[i],"-v") == 0)
+            verbose = 1;
+        else if(strcmp(argv[i],"-n") == 0 && i + 1 < argc)
+            loops = (uint32_t)strtoul(argv[++i],NULL,0);
+        else
+            path = argv[i];
+    }
+    if(path == NULL || loops == 0)
+    {
+        fprintf(stderr,"usage: %s [-s] [-r dir] [-t] [-v] [-n loops] trace\n",argv[0]);
+        return 2;
+    }
+    phemap_trace_reader_t reader;
+    if(phemap_trace_open(&reader,path) == 0)
+    {
+        fprintf(stderr,"%s: not a pkt trace\n",path);
+        return 1;
+    }
+    std::vector<phemap_trace_rec_t> recs;
+    replay_roles_t roles;
+    phemap_trace_rec_t rec;
+    while(phemap_trace_next(&reader,&rec))
+    {
+        if(rec.point > PHEMAP_CAP_LV)
+            continue;
+        recs.push_back(rec);
+        replay_scan(roles,rec);
+    }
+    phemap_trace_close(&reader);
+
+    uint64_t rets[REPLAY_RET_CODES] = {0};
+    uint64_t points[PHEMAP_CAP_LV + 1] = {0};
+    double secs = 0;
+    for(uint32_t loop = 0; loop < loops; loop++)
+    {
+        for(auto& it : roles)
+        {
+            if(replay_build(it.second,tree,start,dir) == 0)
+            {
+                fprintf(stderr,"out of memory\n");
+                return 1;
+            }
+        }
+        auto t0 = std::chrono::steady_clock::now();
+        for(const phemap_trace_rec_t& r : recs)
+        {
+            phemap_ret_t ret = replay_pkt(roles[replay_key(r.point,r.self)],r);
+            if(loop == 0)
+            {
+                rets[(uint32_t)ret < REPLAY_RET_CODES ? (uint32_t)ret : REPLAY_RET_CODES - 1]++;
+                points[r.point]++;
+                if(verbose)
+                    printf("%10llu us %-8s self %5u peer %5u type %2u len %3u ret %d\n",(unsigned long long)r.ts_us,
+                        point_names[r.point],r.self,r.peer,r.len > 0 ? r.pkt[0] : 0,r.len,(int)ret);
+            }
+        }
+        secs += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        for(auto& it : roles)
+            replay_free(it.second);
+    }
+
+    uint64_t total = (uint64_t)recs.size()*loops;
+    printf("%zu pkts, %zu roles, %llu us captured\n",recs.size(),roles.size(),
+        recs.empty() ? 0ULL : (unsigned long long)recs.back().ts_us);
+    for(uint8_t p = 0; p <= PHEMAP_CAP_LV; p++)
+        if(points[p] > 0)
+            printf("  %-8s %llu pkts\n",point_names[p],(unsigned long long)points[p]);
+    printf("replayed %llu pkts in %.6f s, %.0f pkts/s\n",(unsigned long long)total,secs,secs > 0 ? total/secs : 0.0);
+    printf("return codes:\n");
+    for(uint32_t k = 0; k < REPLAY_RET_CODES; k++)
+        if(rets[k] > 0)
+            printf("  %2u  %llu\n",k,(unsigned long long)rets[k]);
+    return 0;
+}
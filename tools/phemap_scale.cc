@@ -0,0 +1,593 @@
+/*
+    Group-Key-Phemap - Copyright (C) 2023-2024 Antonio Emmanuele
+
+    This file is part of Group-Key-Phemap.
+
+    Group-Key-Phemap is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Group-Key-Phemap is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file    phemap_scale.cc
+ * @brief   Sweeps the group size, the number of LVs and the churn rate over full protocol runs.
+ * @details Each configuration is built with malloc'd storage bound with gk_as_bind/lv_bind and driven end to
+ *          end by an in process network delivering every mex in order:
+ *              install     gk_as_start_session on a group of n devices, up to the last PK_CONF
+ *              remove      churn*n members leave one at a time, END_SESS and the key update
+ *              add         the same devices join again, START_SESS, START_PK, the key update and PK_CONF
+ *              lv_flat     n devices spread on l LVs, install from the AS down to the inter group key
+ *              lv_tree     the same with the LV aggregation tree
+ *          The AS and LV time is the time spent in the AS and LV functions only, the devices are excluded.
+ *          A broadcast counts as one mex. The summary gives, for each path, the growth exponent of the
+ *          AS/LV time per op between consecutive sizes.
+ *
+ *          g++ -std=c++17 -O2 -o phemap_scale tools/phemap_scale.cc as_protocol/gk_phemap_as.cc \
+ *              dev_protocol/gk_phemap_dev.cc lv_protocol/dgk_lv.cc
+ *
+ *          Usage: phemap_scale [-n sizes] [-l lvs] [-c churns] [-p links] [-o csv]
+ *              -n  group sizes, default 10,30,100,300,1000,3000
+ *              -l  LV counts, default 4,16
+ *              -c  churn rates, fraction of the group leaving and joining, default 0.01,0.1
+ *              -p  links gk_as_precompute pulls before each churn op, not counted as AS time, default 0
+ *              -o  CSV file, default stdout before the summary
+ */
+#include "../lv_protocol/dgk_lv.h"
+#include <chrono>
+#include <deque>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#define SCALE_TOP_ID        1
+#define SCALE_LV_BASE       100
+#define SCALE_DEV_BASE      1000
+#define SCALE_TO_AS         0
+#define SCALE_TO_LV         1
+#define SCALE_TO_DEV        2
+#define SCALE_ALL           0xFFFF
+#define SCALE_MIN_RUN_US    20000.0     /*!< Installs are repeated on fresh groups until this time is reached*/
+
+static uint32_t scale_precompute = 0;   /*!< Budget of gk_as_precompute between churn ops, 0 to not call it*/
+
+/**
+ * @typedef Traffic and time of a run
+ */
+typedef struct{
+    uint64_t    mexs;                   /*!< Mexs sent, a broadcast counts once.*/
+    uint64_t    bytes;                  /*!< Bytes sent.*/
+    double      server_us;              /*!< Time in the AS and LV functions.*/
+}scale_cost_t;
+
+/**
+ * @typedef A LV, or the top AS for a group without LVs, and its devices
+ */
+typedef struct{
+    local_verifier_t*   lv;             /*!< NULL if the devices talk to the top AS.*/
+    void*               storage;        /*!< Storage bound to lv.*/
+    Device*             devs;           /*!< Devices, the slot of a device is its index.*/
+    uint16_t            ndev;           /*!< Number of devices.*/
+}scale_node_t;
+
+/**
+ * @typedef A mex in flight
+ */
+typedef struct{
+    uint8_t     to;                     /*!< SCALE_TO_AS, SCALE_TO_LV or SCALE_TO_DEV.*/
+    uint16_t    node;                   /*!< Receiving node.*/
+    uint16_t    dev;                    /*!< Receiving device of the node.*/
+    uint8_t     len;                    /*!< Bytes of mex.*/
+    uint8_t     mex[GK_AS_MEX_SIZE];    /*!< The mex.*/
+}scale_mex_t;
+
+/**
+ * @typedef The whole system under test
+ */
+typedef struct{
+    AuthServer*                 top;            /*!< The AS of the devices or of the LVs.*/
+    void*                       top_storage;    /*!< Storage bound to top.*/
+    std::vector<scale_node_t>   nodes;          /*!< LVs, or a single node holding the devices of top.*/
+    std::deque<scale_mex_t>     net;            /*!< Mexs in flight, in order.*/
+    scale_cost_t                cost;           /*!< Accumulated cost.*/
+}scale_sys_t;
+
+typedef std::chrono::steady_clock scale_clock_t;
+
+static double scale_us(const scale_clock_t::time_point t0)
+{
+    return std::chrono::duration<double,std::micro>(scale_clock_t::now() - t0).count();
+}
+
+static void scale_send(scale_sys_t& sys, const uint8_t to, const uint16_t node, const uint16_t dev, const uint8_t* const mex, const uint8_t len)
+{
+    scale_mex_t m;
+    m.to    = to;
+    m.node  = node;
+    m.dev   = dev;
+    m.len   = len;
+    memcpy(m.mex,mex,len);
+    sys.net.push_back(m);
+}
+
+static void scale_account(scale_sys_t& sys, const uint8_t len)
+{
+    sys.cost.mexs++;
+    sys.cost.bytes += len;
+}
+
+/**
+ * @brief Move the unicast and broadcast mexs of an AS to the network, to the devices or the LVs of node.
+ */
+static void scale_collect_as(scale_sys_t& sys, AuthServer* const as, const uint8_t to, const uint16_t node)
+{
+    for(uint32_t k = 0; k < as->unicast_tsmt_count; k++)
+    {
+        uint16_t slot = as->unicast_tsmt_queue[k];
+        scale_account(sys,GK_AS_MEX_SIZE);
+        if(to == SCALE_TO_LV)
+            scale_send(sys,SCALE_TO_LV,slot,0,as->unicast_tsmt_buff[slot],GK_AS_MEX_SIZE);
+        else
+            scale_send(sys,SCALE_TO_DEV,node,slot,as->unicast_tsmt_buff[slot],GK_AS_MEX_SIZE);
+    }
+    as->unicast_tsmt_count = 0;
+    if(as->broadcast_is_present)
+    {
+        scale_account(sys,GK_AS_MEX_SIZE);
+        scale_send(sys,to,to == SCALE_TO_LV ? SCALE_ALL : node,SCALE_ALL,as->broadcast_tsmt_buff,GK_AS_MEX_SIZE);
+        as->broadcast_is_present = 0;
+    }
+}
+
+static void scale_collect_dev(scale_sys_t& sys, Device* const dev, const uint8_t to, const uint16_t node)
+{
+    const dev_outbox_entry_t* e;
+    while((e = gk_dev_outbox_peek(dev)) != NULL)
+    {
+        scale_account(sys,e->len);
+        scale_send(sys,to,node,0,e->mex,e->len);
+        gk_dev_outbox_pop(dev);
+    }
+}
+
+static void scale_collect_lv(scale_sys_t& sys, const uint16_t node)
+{
+    local_verifier_t* lv = sys.nodes[node].lv;
+    const lv_broad_entry_t* e;
+    scale_collect_dev(sys,&lv->lv_dev_role,SCALE_TO_AS,0);
+    scale_collect_as(sys,&lv->lv_as_role,SCALE_TO_DEV,node);
+    while((e = lv_broad_peek(&lv->lvs_queue)) != NULL)
+    {
+        scale_account(sys,LV_MEX_SIZE);
+        uint16_t dest = (e->dest == LV_BROAD_ALL) ? (uint16_t)SCALE_ALL : (uint16_t)(e->dest - SCALE_LV_BASE);
+        scale_send(sys,SCALE_TO_LV,dest,node,e->mex,LV_MEX_SIZE);
+        lv_broad_pop(&lv->lvs_queue);
+    }
+    while((e = lv_broad_peek(&lv->devs_queue)) != NULL)
+    {
+        scale_account(sys,LV_MEX_SIZE);
+        scale_send(sys,SCALE_TO_DEV,node,SCALE_ALL,e->mex,LV_MEX_SIZE);
+        lv_broad_pop(&lv->devs_queue);
+    }
+}
+
+static void scale_deliver_dev(scale_sys_t& sys, const uint16_t node, const uint16_t idx, scale_mex_t& m)
+{
+    scale_node_t& n = sys.nodes[node];
+    gk_dev_automa(&n.devs[idx],m.mex,m.len);
+    if(n.lv != NULL)
+        scale_collect_dev(sys,&n.devs[idx],SCALE_TO_LV,node);
+    else
+        scale_collect_dev(sys,&n.devs[idx],SCALE_TO_AS,0);
+}
+
+/**
+ * @brief Deliver the mexs in flight until the network is quiet.
+ */
+static void scale_pump(scale_sys_t& sys)
+{
+    while(!sys.net.empty())
+    {
+        scale_mex_t m = sys.net.front();
+        sys.net.pop_front();
+        if(m.to == SCALE_TO_AS)
+        {
+            scale_clock_t::time_point t0 = scale_clock_t::now();
+            gk_as_automa(sys.top,m.mex,m.len);
+            sys.cost.server_us += scale_us(t0);
+            scale_collect_as(sys,sys.top,sys.nodes[0].lv != NULL ? SCALE_TO_LV : SCALE_TO_DEV,0);
+        }
+        else if(m.to == SCALE_TO_LV)
+        {
+            for(uint16_t k = 0; k < sys.nodes.size(); k++)
+            {
+                //  m.dev is the sending LV for the mexs between LVs
+                if((m.node != SCALE_ALL && m.node != k) || (m.node == SCALE_ALL && m.dev == k && m.mex[0] != START_PK && m.mex[0] != UPDATE_KEY))
+                    continue;
+                uint8_t pkt[GK_AS_MEX_SIZE];
+                memcpy(pkt,m.mex,m.len);
+                scale_clock_t::time_point t0 = scale_clock_t::now();
+                lv_automa(sys.nodes[k].lv,pkt,m.len);
+                sys.cost.server_us += scale_us(t0);
+                scale_collect_lv(sys,k);
+            }
+        }
+        else if(m.dev == SCALE_ALL)
+        {
+            for(uint16_t d = 0; d < sys.nodes[m.node].ndev; d++)
+            {
+                scale_mex_t copy = m;
+                scale_deliver_dev(sys,m.node,d,copy);
+            }
+        }
+        else
+            scale_deliver_dev(sys,m.node,m.dev,m);
+    }
+}
+
+static void scale_free(scale_sys_t& sys)
+{
+    for(scale_node_t& n : sys.nodes)
+    {
+        free(n.lv);
+        free(n.storage);
+        free(n.devs);
+    }
+    sys.nodes.clear();
+    free(sys.top);
+    free(sys.top_storage);
+    sys.top = NULL;
+    sys.top_storage = NULL;
+    sys.net.clear();
+}
+
+static void* scale_alloc_storage(const uint32_t size)
+{
+    return aligned_alloc(sizeof(private_key_t),(size + sizeof(private_key_t) - 1) & ~(uint32_t)(sizeof(private_key_t) - 1));
+}
+
+static uint8_t scale_alloc_devs(scale_node_t& node, const uint16_t ndev, const phemap_id_t first_id, const phemap_id_t as_id)
+{
+    node.ndev = ndev;
+    node.devs = (Device*)calloc(ndev,sizeof(Device));
+    if(node.devs == NULL)
+        return 0;
+    for(uint16_t d = 0; d < ndev; d++)
+    {
+        node.devs[d].id     = (phemap_id_t)(first_id + d);
+        node.devs[d].as_id  = as_id;
+    }
+    return 1;
+}
+
+/**
+ * @brief A group of n devices around the top AS, installed if install is 1.
+ */
+static uint8_t scale_build_group(scale_sys_t& sys, const uint16_t n)
+{
+    memset(&sys.cost,0,sizeof(sys.cost));
+    sys.top = (AuthServer*)calloc(1,sizeof(AuthServer));
+    sys.top_storage = scale_alloc_storage(GK_AS_STORAGE_SIZE(n));
+    sys.nodes.resize(1);
+    memset(&sys.nodes[0],0,sizeof(scale_node_t));
+    if(sys.top == NULL || sys.top_storage == NULL || scale_alloc_devs(sys.nodes[0],n,SCALE_DEV_BASE,SCALE_TOP_ID) == 0)
+        return 0;
+    gk_as_bind(sys.top,sys.top_storage,n);
+    sys.top->as_id = SCALE_TOP_ID;
+    for(uint16_t d = 0; d < n; d++)
+        gk_as_register_dev(sys.top,(phemap_id_t)(SCALE_DEV_BASE + d));
+    return 1;
+}
+
+/**
+ * @brief l LVs sharing n devices around the top AS.
+ */
+static uint8_t scale_build_lvs(scale_sys_t& sys, const uint16_t n, const uint16_t l, const uint8_t topology)
+{
+    memset(&sys.cost,0,sizeof(sys.cost));
+    sys.top = (AuthServer*)calloc(1,sizeof(AuthServer));
+    sys.top_storage = scale_alloc_storage(GK_AS_STORAGE_SIZE(l));
+    if(sys.top == NULL || sys.top_storage == NULL)
+        return 0;
+    gk_as_bind(sys.top,sys.top_storage,l);
+    sys.top->as_id = SCALE_TOP_ID;
+    sys.nodes.resize(l);
+    uint16_t first = 0;
+    for(uint16_t i = 0; i < l; i++)
+    {
+        scale_node_t& node = sys.nodes[i];
+        memset(&node,0,sizeof(scale_node_t));
+        uint16_t ndev = (uint16_t)(n/l + (i < n % l ? 1 : 0));
+        uint16_t nlv = (uint16_t)(l > 1 ? l - 1 : 1);
+        node.lv = (local_verifier_t*)calloc(1,sizeof(local_verifier_t));
+        node.storage = scale_alloc_storage(LV_STORAGE_SIZE(ndev > 0 ? ndev : 1,nlv));
+        if(node.lv == NULL || node.storage == NULL || scale_alloc_devs(node,ndev,(phemap_id_t)(SCALE_DEV_BASE + first),(phemap_id_t)(SCALE_LV_BASE + i)) == 0)
+            return 0;
+        local_verifier_t* lv = node.lv;
+        lv_bind(lv,node.storage,ndev > 0 ? ndev : 1,nlv);
+        lv->lv_dev_role.id      = (phemap_id_t)(SCALE_LV_BASE + i);
+        lv->lv_dev_role.as_id   = SCALE_TOP_ID;
+        lv->lv_as_role.as_id    = (phemap_id_t)(SCALE_LV_BASE + i);
+        gk_as_register_dev(sys.top,(phemap_id_t)(SCALE_LV_BASE + i));
+        for(uint16_t j = 0; j < l; j++)
+            if(j != i)
+                lv_register_lv(lv,(phemap_id_t)(SCALE_LV_BASE + j));
+        for(uint16_t d = 0; d < ndev; d++)
+            lv_register_dev(lv,(phemap_id_t)(SCALE_DEV_BASE + first + d));
+        lv->num_install_pending = l;
+        lv->topology = topology;
+        lv_build_tree(lv);
+        first = (uint16_t)(first + ndev);
+    }
+    return 1;
+}
+
+static void scale_start_top(scale_sys_t& sys)
+{
+    scale_clock_t::time_point t0 = scale_clock_t::now();
+    gk_as_start_session(sys.top);
+    sys.cost.server_us += scale_us(t0);
+    scale_collect_as(sys,sys.top,sys.nodes[0].lv != NULL ? SCALE_TO_LV : SCALE_TO_DEV,0);
+    scale_pump(sys);
+}
+
+/**
+ * @typedef A row of the report
+ */
+typedef struct{
+    std::string path;
+    uint32_t    n;
+    uint32_t    lvs;
+    double      churn;
+    uint64_t    ops;
+    double      server_us;
+    double      total_us;
+    uint64_t    mexs;
+    uint64_t    bytes;
+}scale_row_t;
+
+static void scale_row(std::vector<scale_row_t>& rows, const char* const path, const uint32_t n, const uint32_t lvs,
+                        const double churn, const uint64_t ops, const scale_cost_t& cost, const double total_us)
+{
+    scale_row_t r = {path,n,lvs,churn,ops,cost.server_us,total_us,cost.mexs,cost.bytes};
+    rows.push_back(r);
+}
+
+/**
+ * @brief Install, then churn*n members leave and join again one at a time.
+ */
+static uint8_t scale_run_group(std::vector<scale_row_t>& rows, const uint16_t n, const std::vector<double>& churns)
+{
+    scale_sys_t sys;
+    scale_cost_t acc = {0,0,0};
+    double total = 0;
+    uint64_t runs = 0;
+    //  Small groups install in microseconds, repeat them on fresh groups
+    while(runs == 0 || total < SCALE_MIN_RUN_US)
+    {
+        if(scale_build_group(sys,n) == 0)
+            return 0;
+        scale_clock_t::time_point t0 = scale_clock_t::now();
+        scale_start_top(sys);
+        total += scale_us(t0);
+        acc.mexs += sys.cost.mexs;
+        acc.bytes += sys.cost.bytes;
+        acc.server_us += sys.cost.server_us;
+        runs++;
+        scale_free(sys);
+    }
+    scale_row(rows,"install",n,0,0,runs,acc,total);
+    for(double churn : churns)
+    {
+        uint16_t k = (uint16_t)ceil(churn*n);
+        k = (k == 0) ? 1 : (k > n ? n : k);
+        if(scale_build_group(sys,n) == 0)
+            return 0;
+        scale_start_top(sys);
+        //  The stock chain has no cursor to rewind, but all its links are the same and a lost cache costs nothing
+        sys.top->chain_rewind = (scale_precompute > 0) ? 1 : 0;
+        //  Spread the churning devices over the slots
+        std::vector<uint16_t> who(k);
+        for(uint16_t i = 0; i < k; i++)
+            who[i] = (uint16_t)((uint32_t)i*n/k);
+        const char* const paths[2] = {"remove","add"};
+        for(uint8_t phase = 0; phase < 2; phase++)
+        {
+            memset(&sys.cost,0,sizeof(sys.cost));
+            scale_clock_t::time_point t0 = scale_clock_t::now();
+            for(uint16_t i = 0; i < k; i++)
+            {
+                //  The AS is idle between two ops
+                if(scale_precompute > 0)
+                    gk_as_precompute(sys.top,scale_precompute);
+                Device* dev = &sys.nodes[0].devs[who[i]];
+                if(phase == 0)
+                    gk_dev_end_session(dev);
+                else
+                    gk_dev_start_session(dev);
+                scale_collect_dev(sys,dev,SCALE_TO_AS,0);
+                scale_pump(sys);
+            }
+            scale_row(rows,paths[phase],n,0,churn,k,sys.cost,scale_us(t0));
+        }
+        scale_free(sys);
+    }
+    return 1;
+}
+
+/**
+ * @brief Install the LVs from the top AS, then their devices, up to the inter group key.
+ */
+static uint8_t scale_run_lvs(std::vector<scale_row_t>& rows, const uint16_t n, const uint16_t l, const uint8_t topology)
+{
+    scale_sys_t sys;
+    scale_cost_t acc = {0,0,0};
+    double total = 0;
+    uint64_t runs = 0;
+    while(runs == 0 || total < SCALE_MIN_RUN_US)
+    {
+        if(scale_build_lvs(sys,n,l,topology) == 0)
+            return 0;
+        scale_clock_t::time_point t0 = scale_clock_t::now();
+        scale_start_top(sys);
+        for(uint16_t i = 0; i < l; i++)
+        {
+            scale_clock_t::time_point t1 = scale_clock_t::now();
+            gk_as_start_session(&sys.nodes[i].lv->lv_as_role);
+            sys.cost.server_us += scale_us(t1);
+            scale_collect_lv(sys,i);
+            scale_pump(sys);
+        }
+        total += scale_us(t0);
+        for(uint16_t i = 0; i < l; i++)
+            if(sys.nodes[i].lv->is_inter_installed == 0)
+                fprintf(stderr,"warning: n %u l %u LV %u has no inter group key\n",n,l,i);
+        acc.mexs += sys.cost.mexs;
+        acc.bytes += sys.cost.bytes;
+        acc.server_us += sys.cost.server_us;
+        runs++;
+        scale_free(sys);
+    }
+    scale_row(rows,topology == LV_TOPO_TREE ? "lv_tree" : "lv_flat",n,l,0,runs,acc,total);
+    return 1;
+}
+
+template<typename T>
+static std::vector<T> scale_list(const char* const arg)
+{
+    std::vector<T> out;
+    std::string s(arg);
+    size_t pos = 0;
+    while(pos <= s.size())
+    {
+        size_t end = s.find(',',pos);
+        if(end == std::string::npos)
+            end = s.size();
+        if(end > pos)
+            out.push_back((T)strtod(s.substr(pos,end - pos).c_str(),NULL));
+        pos = end + 1;
+    }
+    return out;
+}
+
+static const char* scale_shape(const double slope)
+{
+    if(slope < 0.2)
+        return "constant";
+    if(slope < 1.2)
+        return "linear";
+    return "SUPER-LINEAR";
+}
+
+/**
+ * @brief Per path, the AS/LV time per op against n and the growth exponent between consecutive sizes.
+ */
+static void scale_summary(const std::vector<scale_row_t>& rows)
+{
+    std::vector<const scale_row_t*> done;
+    printf("\n%-8s %5s %6s %8s %14s %12s %12s %8s\n","path","lvs","churn","n","as/lv us/op","mexs/op","bytes/op","exp");
+    for(size_t i = 0; i < rows.size(); i++)
+    {
+        const scale_row_t& key = rows[i];
+        uint8_t seen = 0;
+        for(const scale_row_t* d : done)
+            if(d->path == key.path && d->lvs == key.lvs && d->churn == key.churn)
+                seen = 1;
+        if(seen)
+            continue;
+        done.push_back(&key);
+        const scale_row_t* prev = NULL;
+        double worst = 0;
+        for(size_t j = i; j < rows.size(); j++)
+        {
+            const scale_row_t& r = rows[j];
+            if(r.path != key.path || r.lvs != key.lvs || r.churn != key.churn)
+                continue;
+            double per_op = r.server_us/r.ops;
+            printf("%-8s %5u %6.3f %8u %14.3f %12.1f %12.1f",r.path.c_str(),r.lvs,r.churn,r.n,per_op,
+                (double)r.mexs/r.ops,(double)r.bytes/r.ops);
+            if(prev != NULL && r.n > prev->n && prev->server_us > 0 && r.server_us > 0)
+            {
+                double slope = log(per_op/(prev->server_us/prev->ops))/log((double)r.n/prev->n);
+                worst = (slope > worst) ? slope : worst;
+                printf(" %8.2f",slope);
+            }
+            printf("\n");
+            prev = &r;
+        }
+        printf("%-8s -> AS/LV time per op grows at most as n^%.2f, %s\n",key.path.c_str(),worst,scale_shape(worst));
+    }
+}
+
+int main(int argc, char** argv)
+{
+    std::vector<uint32_t> sizes = {10,30,100,300,1000,3000};
+    std::vector<uint32_t> lvs = {4,16};
+    std::vector<double> churns = {0.01,0.1};
+    const char* csv_path = NULL;
+    for(int i = 1; i + 1 < argc; i += 2)
+    {
+        if(strcmp(argv[i],"-n") == 0)
+            sizes = scale_list<uint32_t>(argv[i + 1]);
+        else if(strcmp(argv[i],"-l") == 0)
+            lvs = scale_list<uint32_t>(argv[i + 1]);
+        else if(strcmp(argv[i],"-c") == 0)
+            churns = scale_list<double>(argv[i + 1]);
+        else if(strcmp(argv[i],"-p") == 0)
+            scale_precompute = (uint32_t)strtoul(argv[i + 1],NULL,0);
+        else if(strcmp(argv[i],"-o") == 0)
+            csv_path = argv[i + 1];
+        else
+        {
+            fprintf(stderr,"usage: %s [-n sizes] [-l lvs] [-c churns] [-p links] [-o csv]\n",argv[0]);
+            return 2;
+        }
+    }
+    std::vector<scale_row_t> rows;
+    for(uint32_t n : sizes)
+    {
+        if(n == 0 || n > 0xFFFF - SCALE_DEV_BASE)
+        {
+            fprintf(stderr,"skipping n %u, above the id space\n",n);
+            continue;
+        }
+        if(scale_run_group(rows,(uint16_t)n,churns) == 0)
+        {
+            fprintf(stderr,"out of memory at n %u\n",n);
+            return 1;
+        }
+    }
+    for(uint32_t l : lvs)
+        for(uint8_t topology = LV_TOPO_FLAT; topology <= LV_TOPO_TREE; topology++)
+            for(uint32_t n : sizes)
+                if(l > 0 && l <= n && l < SCALE_DEV_BASE - SCALE_LV_BASE && n <= 0xFFFF - SCALE_DEV_BASE &&
+                    scale_run_lvs(rows,(uint16_t)n,(uint16_t)l,topology) == 0)
+                {
+                    fprintf(stderr,"out of memory at n %u l %u\n",n,l);
+                    return 1;
+                }
+    FILE* csv = (csv_path != NULL) ? fopen(csv_path,"w") : stdout;
+    if(csv == NULL)
+    {
+        fprintf(stderr,"%s: can't write\n",csv_path);
+        return 1;
+    }
+    fprintf(csv,"path,n,lvs,churn,ops,as_lv_us,total_us,as_lv_us_per_op,mexs_per_op,bytes_per_op\n");
+    for(const scale_row_t& r : rows)
+        fprintf(csv,"%s,%u,%u,%g,%llu,%.3f,%.3f,%.4f,%.2f,%.2f\n",r.path.c_str(),r.n,r.lvs,r.churn,(unsigned long long)r.ops,
+            r.server_us,r.total_us,r.server_us/r.ops,(double)r.mexs/r.ops,(double)r.bytes/r.ops);
+    if(csv != stdout)
+        fclose(csv);
+    scale_summary(rows);
+    return 0;
+}
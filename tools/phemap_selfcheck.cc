@@ -0,0 +1,262 @@
+/*
+    Group-Key-Phemap - Copyright (C) 2023-2024 Antonio Emmanuele
+
+    This file is part of Group-Key-Phemap.
+
+    Group-Key-Phemap is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Group-Key-Phemap is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file    phemap_selfcheck.cc
+ * @brief   Negative checks of the protocol: forged, replayed and repeated mexs must be refused.
+ * @details Each check builds the smallest AS and devices it needs, with the stock chain hooks, and prints one
+ *          line. The exit code is the number of failed checks.
+ *
+ *          g++ -std=c++11 -O2 -o phemap_selfcheck tools/phemap_selfcheck.cc as_protocol/gk_phemap_as.cc \
+ *              dev_protocol/gk_phemap_dev.cc
+ *
+ *          Usage: phemap_selfcheck
+ */
+#include "../as_protocol/gk_phemap_as.h"
+#include "../dev_protocol/gk_phemap_dev.h"
+#include <stdio.h>
+#include <string.h>
+
+#define CHECK_AS_ID     1
+#define CHECK_DEV_BASE  100
+#define CHECK_DEVS      4
+
+static uint32_t check_failed = 0;
+
+static void check(const char* const what, const uint8_t ok)
+{
+    printf("%-60s %s\n",what,ok ? "ok" : "FAILED");
+    check_failed += ok ? 0 : 1;
+}
+
+/**
+ * @brief Move the mexs of the devices to the AS and back until nothing is left to send.
+ */
+static void check_pump(AuthServer* const as, Device* const devs, const uint16_t n)
+{
+    for(uint32_t round = 0; round < 8; round++)
+    {
+        for(uint16_t d = 0; d < n; d++)
+            while(const dev_outbox_entry_t* e = gk_dev_outbox_peek(&devs[d]))
+            {
+                uint8_t pkt[DEV_MEX_SIZE];
+                uint8_t len = e->len;
+                memcpy(pkt,e->mex,len);
+                gk_dev_outbox_pop(&devs[d]);
+                if(as->as_state == GK_AS_WAIT_FOR_START_REQ)
+                    gk_as_start_session_cb(as,pkt,len);
+                else
+                    gk_as_automa(as,pkt,len);
+            }
+        for(uint32_t k = 0; k < as->unicast_tsmt_count; k++)
+        {
+            uint16_t slot = as->unicast_tsmt_queue[k];
+            gk_dev_automa(&devs[as->auth_devs[slot] - CHECK_DEV_BASE],as->unicast_tsmt_buff[slot],GK_AS_MEX_SIZE);
+        }
+        as->unicast_tsmt_count = 0;
+        if(as->broadcast_is_present)
+            for(uint16_t d = 0; d < n; d++)
+                if(devs[d].dev_state == GK_DEV_WAIT_FOR_UPDATE)
+                    gk_dev_automa(&devs[d],as->broadcast_tsmt_buff,GK_AS_MEX_SIZE);
+        as->broadcast_is_present = 0;
+    }
+}
+
+/**
+ * @brief A group of n devices installed by the first one.
+ */
+static void check_group(AuthServer* const as, Device* const devs, const uint16_t n)
+{
+    as->as_id = CHECK_AS_ID;
+    for(uint16_t d = 0; d < n; d++)
+    {
+        memset(&devs[d],0,sizeof(Device));
+        gk_as_register_dev(as,(phemap_id_t)(CHECK_DEV_BASE + d));
+        devs[d].id          = (phemap_id_t)(CHECK_DEV_BASE + d);
+        devs[d].as_id       = CHECK_AS_ID;
+        devs[d].dev_state   = GK_DEV_WAIT_START_PK;
+    }
+    gk_dev_start_session(&devs[0]);
+    check_pump(as,devs,n);
+}
+
+/**
+ * @brief Every device holds the key of the AS, which is the session nonce and the key parts of its members.
+ */
+static uint8_t check_agree(const AuthServer* const as, const Device* const devs, const uint16_t n)
+{
+    private_key_t parts = as->session_nonce;
+    uint16_t members = 0;
+    for(uint16_t slot = 0; slot < as->num_auth_devs; slot++)
+        if(as->group_members[slot] == 1)
+        {
+            parts ^= as->sr_key[slot];
+            members++;
+        }
+    uint8_t ok = (parts == as->private_key && members == as->num_part) ? 1 : 0;
+    for(uint16_t d = 0; d < n; d++)
+        ok &= (devs[d].dev_state == GK_DEV_WAIT_FOR_UPDATE && devs[d].pk == as->private_key) ? 1 : 0;
+    return ok;
+}
+
+/**
+ * @brief The sign depends on its key for every signed length, an even number of words included.
+ */
+static void check_sign_keyed()
+{
+    const uint32_t sizes[] = {PHEMAP_KEY_MEX_SIGNED,PHEMAP_RESYNC_REQ_SIGNED,PHEMAP_RESUME_SESS_SIGNED,8,16};
+    uint8_t mex[PHEMAP_RESUME_SESS_SIZE];
+    for(uint32_t i = 0; i < sizeof(mex); i++)
+        mex[i] = (uint8_t)(0x5A + 7*i);
+    uint8_t ok = 1;
+    for(uint32_t s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++)
+    {
+        uint32_t a = phemap_keyed_sign(mex,sizes[s],0);
+        uint32_t b = phemap_keyed_sign(mex,sizes[s],0xdeadbeef);
+        uint32_t c = phemap_keyed_sign(mex,sizes[s],0x12345678);
+        ok &= (a != b && b != c && a != c) ? 1 : 0;
+    }
+    check("one mex signed with different keys gives different signs",ok);
+}
+
+/**
+ * @brief A group UPDATE_KEY signed with a key other than the secret token is refused by the device.
+ */
+static void check_update_wrong_key()
+{
+    Device dev;
+    memset(&dev,0,sizeof(dev));
+    dev.id              = CHECK_DEV_BASE;
+    dev.as_id           = CHECK_AS_ID;
+    dev.dev_state       = GK_DEV_WAIT_FOR_UPDATE;
+    dev.pk              = 0x11111111;
+    dev.secret_token    = 0x22222222;
+    dev.epoch           = 1;
+    uint8_t mex[GK_AS_MEX_SIZE];
+    memset(mex,0,sizeof(mex));
+    mex[0] = UPDATE_KEY;
+    const phemap_id_t as_id = CHECK_AS_ID;
+    PHEMAP_ID_TO_U8_BE(as_id,&mex[1]);
+    uint32_t update = 0xabcdef01, token = 0x10fedcba, epoch = 2;
+    PUF_TO_U8_BE(update,&mex[1 + sizeof(phemap_id_t)]);
+    PUF_TO_U8_BE(token,&mex[1 + sizeof(phemap_id_t) + sizeof(puf_resp_t)]);
+    PUF_TO_U8_BE(epoch,&mex[PHEMAP_KEY_MEX_EPOCH]);
+    mex[PHEMAP_KEY_MEX_ARG] = PHEMAP_UPDATE_GROUP;
+    uint32_t sign = phemap_keyed_sign(mex,PHEMAP_KEY_MEX_SIGNED,0x33333333);
+    PUF_TO_U8_BE(sign,&mex[PHEMAP_KEY_MEX_SIGNED]);
+    Device forged = dev;
+    phemap_ret_t ret = gk_dev_automa(&forged,mex,GK_AS_MEX_SIZE);
+    check("group UPDATE_KEY signed with the wrong token is refused",ret != OK && forged.pk == dev.pk && forged.epoch == dev.epoch);
+    sign = phemap_keyed_sign(mex,PHEMAP_KEY_MEX_SIGNED,dev.secret_token);
+    PUF_TO_U8_BE(sign,&mex[PHEMAP_KEY_MEX_SIGNED]);
+    ret = gk_dev_automa(&dev,mex,GK_AS_MEX_SIZE);
+    check("group UPDATE_KEY signed with the secret token is applied",ret == OK && dev.pk == (0x11111111u ^ update) && dev.epoch == epoch);
+}
+
+/**
+ * @brief A RESUME_SESS signed with a key other than the one of the ticket gets no answer.
+ */
+static void check_resume_wrong_key()
+{
+    GkAuthServer<CHECK_DEVS> srv;
+    AuthServer* const as = srv.get();
+    Device devs[CHECK_DEVS];
+    check_group(as,devs,CHECK_DEVS);
+    uint16_t slot = gk_as_get_slot(as,devs[1].id);
+    uint8_t mex[PHEMAP_RESUME_SESS_SIZE];
+    memset(mex,0,sizeof(mex));
+    mex[0] = RESUME_SESS;
+    PHEMAP_ID_TO_U8_BE(devs[1].id,&mex[1]);
+    PUF_TO_U8_BE(as->epoch,&mex[1 + sizeof(phemap_id_t)]);
+    PUF_TO_U8_BE(gk_as_slot_cursor(as,slot),&mex[PHEMAP_RESUME_SESS_CURSOR]);
+    mex[PHEMAP_RESUME_SESS_LINKED] = 0;
+    uint32_t sign = phemap_keyed_sign(mex,PHEMAP_RESUME_SESS_SIGNED,as->sr_key[slot] ^ as->secret_token ^ 0x5555aaaa);
+    PUF_TO_U8_BE(sign,&mex[PHEMAP_RESUME_SESS_SIGNED]);
+    as->unicast_tsmt_count = 0;
+    phemap_ret_t ret = gk_as_automa(as,mex,sizeof(mex));
+    check("RESUME_SESS signed with the wrong ticket key is refused",ret == AUTH_FAILED && as->unicast_tsmt_count == 0);
+    sign = phemap_keyed_sign(mex,PHEMAP_RESUME_SESS_SIGNED,as->sr_key[slot] ^ as->secret_token);
+    PUF_TO_U8_BE(sign,&mex[PHEMAP_RESUME_SESS_SIGNED]);
+    ret = gk_as_automa(as,mex,sizeof(mex));
+    check("RESUME_SESS signed with the ticket key gets a RESYNC_SKIP",ret == CONN_WAIT && as->unicast_tsmt_count == 1 &&
+        as->unicast_tsmt_buff[slot][0] == RESYNC_SKIP);
+    as->unicast_tsmt_count = 0;
+}
+
+/**
+ * @brief A member joining again through gk_as_add_batch leaves and joins in one rekey, it is counted once.
+ */
+static void check_rejoin_batch()
+{
+    GkAuthServer<CHECK_DEVS> srv;
+    AuthServer* const as = srv.get();
+    Device devs[CHECK_DEVS];
+    check_group(as,devs,CHECK_DEVS);
+    check("group installed",check_agree(as,devs,CHECK_DEVS) && as->num_part == CHECK_DEVS);
+    //  The device lost its key and its ticket
+    devs[1].dev_state = GK_DEV_WAIT_START_PK;
+    gk_dev_start_session(&devs[1]);
+    const dev_outbox_entry_t* e = gk_dev_outbox_peek(&devs[1]);
+    uint8_t pkt[DEV_MEX_SIZE];
+    uint8_t len = e->len;
+    memcpy(pkt,e->mex,len);
+    gk_dev_outbox_pop(&devs[1]);
+    const uint8_t* pkts[1] = {pkt};
+    uint16_t slots[1];
+    phemap_ret_t ret = gk_as_add_batch(as,pkts,&len,1,slots);
+    check_pump(as,devs,CHECK_DEVS);
+    check("member rejoining through the batch is counted once",ret == OK && as->num_part == CHECK_DEVS &&
+        as->pending_count == 0);
+    check("member rejoining through the batch drops its old key part",check_agree(as,devs,CHECK_DEVS));
+}
+
+/**
+ * @brief The PK_CONF a member sends again for a retransmitted START_PK is dropped, with the stock policy too.
+ */
+static void check_conf_repeated()
+{
+    GkAuthServer<CHECK_DEVS> srv;
+    AuthServer* const as = srv.get();
+    Device devs[CHECK_DEVS];
+    check_group(as,devs,CHECK_DEVS);
+    private_key_t key = as->private_key;
+    uint8_t start_pk[GK_AS_MEX_SIZE];
+    memcpy(start_pk,as->unicast_tsmt_buff[gk_as_get_slot(as,devs[2].id)],GK_AS_MEX_SIZE);
+    gk_dev_automa(&devs[2],start_pk,GK_AS_MEX_SIZE);
+    const dev_outbox_entry_t* e = gk_dev_outbox_peek(&devs[2]);
+    uint8_t pkt[DEV_MEX_SIZE] = {0};
+    uint8_t len = (e != NULL) ? e->len : 0;
+    if(e != NULL)
+        memcpy(pkt,e->mex,len);
+    gk_dev_outbox_pop(&devs[2]);
+    phemap_ret_t ret = (len > 0) ? gk_as_automa(as,pkt,len) : REINIT;
+    check("PK_CONF sent again for a repeated START_PK is dropped",pkt[0] == PK_CONF && ret == CONN_WAIT &&
+        as->as_state == GK_AS_WAIT_FOR_UPDATES && as->private_key == key && check_agree(as,devs,CHECK_DEVS));
+}
+
+int main()
+{
+    check_sign_keyed();
+    check_update_wrong_key();
+    check_resume_wrong_key();
+    check_rejoin_batch();
+    check_conf_repeated();
+    printf("%u failed\n",check_failed);
+    return (int)check_failed;
+}
@@ -0,0 +1,134 @@
+/*
+    Group-Key-Phemap - Copyright (C) 2023-2024 Antonio Emmanuele
+
+    This file is part of Group-Key-Phemap.
+
+    Group-Key-Phemap is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Group-Key-Phemap is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file    phemap_stats.cc
+ * @brief   Attaches the stats segment of a running process and prints its counters.
+ * @details g++ -std=c++17 -O2 -o phemap_stats tools/phemap_stats.cc common/phemap_stats.cc
+ *
+ *          Usage: phemap_stats [-i ms] [-n count] name
+ *              -i  refresh period, default 1000 ms, the rates are per second over the period
+ *              -n  refreshes before exiting, 0 (default) runs until killed, 1 prints once
+ */
+#include "../common/phemap_stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+static const char* const mex_names[] = {"START_SESS","START_PK","PK_CONF","END_SESS","UPDATE_KEY","UPDATE_CONF",
+    "INSTALL_SEC","SEC_CONF","INTER_KEY_INSTALL","LV_SUP_KEY_INSTALL","INTER_KEY_COMBINED","RESYNC_REQ","RESYNC_DELTA",
+    "RESUME_SESS","RESUME_PK","RESYNC_SKIP"};
+static const char* const ret_names[] = {"OK","REINIT","CHAIN_EXHAUSTED","SYNC_AUTH_FAILED","TIMEOUT_SYNCB",
+    "TIMEOUT_SYNC_C","AUTH_FAILED","TIMEOUT_AUTH_B","CONN_WAIT","ENROLL_FAILED","UPDATE_OK","INSTALL_OK"};
+static const char* const role_names[] = {"AS","DEV","LV"};
+
+static void print_code(const char* const* names, const uint32_t num_names, const uint32_t code)
+{
+    if(code < num_names)
+        printf("%s",names[code]);
+    else
+        printf("#%u",code);
+}
+
+static uint64_t slot_total(const phemap_stats_slot_t* const slot)
+{
+    uint64_t total = 0;
+    for(uint32_t k = 0; k < PHEMAP_STATS_MEX_TYPES; k++)
+        total += slot->pkts[k].load(std::memory_order_relaxed);
+    return total;
+}
+
+static void print_slot(const phemap_stats_slot_t* const slot, const uint64_t prev, const double period_s)
+{
+    uint64_t total = slot_total(slot);
+    printf("%-3s %5u pid %-7u pkts %-10llu %9.0f/s  pending %-5u group %-5u tsmt %u\n",
+        slot->role < 3 ? role_names[slot->role] : "?",slot->id,slot->pid,(unsigned long long)total,
+        period_s > 0 ? (double)(total - prev)/period_s : 0.0,
+        slot->pending.load(std::memory_order_relaxed),slot->group_size.load(std::memory_order_relaxed),
+        slot->tsmt_depth.load(std::memory_order_relaxed));
+    printf("    rcvd");
+    for(uint32_t k = 0; k < PHEMAP_STATS_MEX_TYPES; k++)
+    {
+        uint64_t n = slot->pkts[k].load(std::memory_order_relaxed);
+        if(n == 0)
+            continue;
+        printf(" ");
+        print_code(mex_names,sizeof(mex_names)/sizeof(mex_names[0]),k);
+        printf("=%llu",(unsigned long long)n);
+    }
+    printf("\n    ret ");
+    for(uint32_t k = 0; k < PHEMAP_STATS_RET_CODES; k++)
+    {
+        uint64_t n = slot->rets[k].load(std::memory_order_relaxed);
+        if(n == 0)
+            continue;
+        printf(" ");
+        print_code(ret_names,sizeof(ret_names)/sizeof(ret_names[0]),k);
+        printf("=%llu",(unsigned long long)n);
+    }
+    printf("\n");
+}
+
+int main(int argc, char** argv)
+{
+    uint32_t period_ms = 1000, count = 0;
+    const char* name = NULL;
+    for(int i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i],"-i") == 0 && i + 1 < argc)
+            period_ms = (uint32_t)strtoul(argv[++i],NULL,0);
+        else if(strcmp(argv[i],"-n") == 0 && i + 1 < argc)
+            count = (uint32_t)strtoul(argv[++i],NULL,0);
+        else
+            name = argv[i];
+    }
+    if(name == NULL)
+    {
+        fprintf(stderr,"usage: %s [-i ms] [-n count] name\n",argv[0]);
+        return 2;
+    }
+    const phemap_stats_seg_t* seg = phemap_stats_attach(name);
+    if(seg == NULL)
+    {
+        fprintf(stderr,"%s: no stats segment\n",name);
+        return 1;
+    }
+    std::vector<uint64_t> prev(seg->max_slots,0);
+    const phemap_stats_slot_t* slots = phemap_stats_slots(seg);
+    for(uint32_t round = 0; count == 0 || round < count; round++)
+    {
+        if(round > 0)
+            usleep(period_ms*1000u);
+        uint32_t used = seg->num_slots.load(std::memory_order_relaxed);
+        used = used < seg->max_slots ? used : seg->max_slots;
+        printf("--- %s: %u/%u slots\n",name,used,seg->max_slots);
+        for(uint32_t k = 0; k < used; k++)
+        {
+            if(slots[k].ready.load(std::memory_order_acquire) == 0)
+                continue;
+            print_slot(&slots[k],prev[k],round > 0 ? period_ms/1000.0 : 0.0);
+            prev[k] = slot_total(&slots[k]);
+        }
+        fflush(stdout);
+    }
+    phemap_stats_detach(seg);
+    return 0;
+}
@@ -0,0 +1,106 @@
+/*
+    Group-Key-Phemap - Copyright (C) 2023-2024 Antonio Emmanuele
+
+    This file is part of Group-Key-Phemap.
+
+    Group-Key-Phemap is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Group-Key-Phemap is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file    phemap_trace_dec.cc
+ * @brief   Formats a dump written by phemap_trace_dump, the events of all the threads merged by time.
+ * @details g++ -std=c++17 -O2 -o phemap_trace_dec tools/phemap_trace_dec.cc
+ *
+ *          Usage: phemap_trace_dec dump
+ */
+#include "../common/phemap_trace.h"
+#include <algorithm>
+#include <stdio.h>
+#include <vector>
+
+#define PHEMAP_TRACE_EV_NAME(id,fmt)    {#id,fmt},
+static const struct{
+    const char* name;
+    const char* fmt;
+}ev_table[] = { PHEMAP_TRACE_EVENTS(PHEMAP_TRACE_EV_NAME) };
+
+/**
+ * @typedef A decoded event
+ */
+typedef struct{
+    uint64_t    ts_ns;
+    uint32_t    thread;
+    uint16_t    event;
+    phemap_id_t self;
+    uint32_t    arg[3];
+}dec_event_t;
+
+int main(int argc, char** argv)
+{
+    uint8_t hdr[PHEMAP_TRACE_DUMP_RING_SIZE];
+    uint8_t rec[PHEMAP_TRACE_DUMP_EV_SIZE];
+    if(argc != 2)
+    {
+        fprintf(stderr,"usage: %s dump\n",argv[0]);
+        return 2;
+    }
+    FILE* file = fopen(argv[1],"rb");
+    if(file == NULL || fread(hdr,1,PHEMAP_TRACE_DUMP_HDR_SIZE,file) != PHEMAP_TRACE_DUMP_HDR_SIZE ||
+        U8_TO_PUF_BE(hdr) != PHEMAP_TRACE_DUMP_MAGIC || U8_TO_PHEMAP_ID_BE(&hdr[4]) != PHEMAP_TRACE_DUMP_VERSION)
+    {
+        fprintf(stderr,"%s: not an event dump\n",argv[1]);
+        return 1;
+    }
+    std::vector<dec_event_t> events;
+    while(fread(hdr,1,PHEMAP_TRACE_DUMP_RING_SIZE,file) == PHEMAP_TRACE_DUMP_RING_SIZE)
+    {
+        uint32_t thread = U8_TO_PUF_BE(hdr);
+        uint64_t head   = ((uint64_t)U8_TO_PUF_BE(&hdr[4]) << 32) | U8_TO_PUF_BE(&hdr[8]);
+        uint32_t count  = U8_TO_PUF_BE(&hdr[12]);
+        printf("thread %u: %llu events, %u kept\n",thread,(unsigned long long)head,count);
+        for(uint32_t k = 0; k < count; k++)
+        {
+            if(fread(rec,1,sizeof(rec),file) != sizeof(rec))
+            {
+                fprintf(stderr,"%s: truncated\n",argv[1]);
+                break;
+            }
+            dec_event_t ev;
+            ev.ts_ns    = ((uint64_t)U8_TO_PUF_BE(rec) << 32) | U8_TO_PUF_BE(&rec[4]);
+            ev.thread   = thread;
+            ev.event    = U8_TO_PHEMAP_ID_BE(&rec[8]);
+            ev.self     = U8_TO_PHEMAP_ID_BE(&rec[10]);
+            ev.arg[0]   = U8_TO_PUF_BE(&rec[12]);
+            ev.arg[1]   = U8_TO_PUF_BE(&rec[16]);
+            ev.arg[2]   = U8_TO_PUF_BE(&rec[20]);
+            events.push_back(ev);
+        }
+    }
+    fclose(file);
+    std::stable_sort(events.begin(),events.end(),[](const dec_event_t& a, const dec_event_t& b){ return a.ts_ns < b.ts_ns; });
+    uint64_t start = events.empty() ? 0 : events[0].ts_ns;
+    for(const dec_event_t& ev : events)
+    {
+        printf("%12.6f ms  t%-3u ",(ev.ts_ns - start)/1e6,ev.thread);
+        if(ev.event < PHEMAP_EV_NUM)
+        {
+            printf("%-32s ",ev_table[ev.event].name);
+            printf(ev_table[ev.event].fmt,ev.self,ev.arg[0],ev.arg[1],ev.arg[2]);
+        }
+        else
+            printf("event #%u self %u args %#x %#x %#x",ev.event,ev.self,ev.arg[0],ev.arg[1],ev.arg[2]);
+        printf("\n");
+    }
+    return 0;
+}